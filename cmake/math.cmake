@@ -9,6 +9,7 @@ set(MATH_DIR
   ${CMAKE_SOURCE_DIR}/math/matrix.hpp
   ${CMAKE_SOURCE_DIR}/math/quaternion.hpp
   ${CMAKE_SOURCE_DIR}/math/ray.hpp
+  ${CMAKE_SOURCE_DIR}/math/simd.hpp
   ${CMAKE_SOURCE_DIR}/math/vector.hpp
   ${CMAKE_SOURCE_DIR}/math/impl/matrix.inl
   ${CMAKE_SOURCE_DIR}/math/impl/vector.inl
@@ -0,0 +1,147 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+namespace pbr {
+
+
+namespace detail {
+
+
+// The inverse kernels work on the raw rows, so the scalar template and the float
+// specialization share them. Each leaves sol alone and returns false if mat is singular.
+template<typename _Type>
+bool GeneralInverse(const _Type (&mat)[4][4], _Type (&sol)[4][4])
+{
+  // Laplace expansion over the top two and bottom two rows. Every cofactor is
+  // built from the same twelve 2x2 determinants, so none of them get recomputed.
+  _Type s0 = mat[0][0] * mat[1][1] - mat[1][0] * mat[0][1];
+  _Type s1 = mat[0][0] * mat[1][2] - mat[1][0] * mat[0][2];
+  _Type s2 = mat[0][0] * mat[1][3] - mat[1][0] * mat[0][3];
+  _Type s3 = mat[0][1] * mat[1][2] - mat[1][1] * mat[0][2];
+  _Type s4 = mat[0][1] * mat[1][3] - mat[1][1] * mat[0][3];
+  _Type s5 = mat[0][2] * mat[1][3] - mat[1][2] * mat[0][3];
+
+  _Type c5 = mat[2][2] * mat[3][3] - mat[3][2] * mat[2][3];
+  _Type c4 = mat[2][1] * mat[3][3] - mat[3][1] * mat[2][3];
+  _Type c3 = mat[2][1] * mat[3][2] - mat[3][1] * mat[2][2];
+  _Type c2 = mat[2][0] * mat[3][3] - mat[3][0] * mat[2][3];
+  _Type c1 = mat[2][0] * mat[3][2] - mat[3][0] * mat[2][2];
+  _Type c0 = mat[2][0] * mat[3][1] - mat[3][0] * mat[2][1];
+
+  _Type det = s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+  if (det == 0) {
+    return false;
+  }
+  _Type inv = static_cast<_Type>(1) / det;
+
+  sol[0][0] = ( mat[1][1] * c5 - mat[1][2] * c4 + mat[1][3] * c3) * inv;
+  sol[0][1] = (-mat[0][1] * c5 + mat[0][2] * c4 - mat[0][3] * c3) * inv;
+  sol[0][2] = ( mat[3][1] * s5 - mat[3][2] * s4 + mat[3][3] * s3) * inv;
+  sol[0][3] = (-mat[2][1] * s5 + mat[2][2] * s4 - mat[2][3] * s3) * inv;
+
+  sol[1][0] = (-mat[1][0] * c5 + mat[1][2] * c2 - mat[1][3] * c1) * inv;
+  sol[1][1] = ( mat[0][0] * c5 - mat[0][2] * c2 + mat[0][3] * c1) * inv;
+  sol[1][2] = (-mat[3][0] * s5 + mat[3][2] * s2 - mat[3][3] * s1) * inv;
+  sol[1][3] = ( mat[2][0] * s5 - mat[2][2] * s2 + mat[2][3] * s1) * inv;
+
+  sol[2][0] = ( mat[1][0] * c4 - mat[1][1] * c2 + mat[1][3] * c0) * inv;
+  sol[2][1] = (-mat[0][0] * c4 + mat[0][1] * c2 - mat[0][3] * c0) * inv;
+  sol[2][2] = ( mat[3][0] * s4 - mat[3][1] * s2 + mat[3][3] * s0) * inv;
+  sol[2][3] = (-mat[2][0] * s4 + mat[2][1] * s2 - mat[2][3] * s0) * inv;
+
+  sol[3][0] = (-mat[1][0] * c3 + mat[1][1] * c1 - mat[1][2] * c0) * inv;
+  sol[3][1] = ( mat[0][0] * c3 - mat[0][1] * c1 + mat[0][2] * c0) * inv;
+  sol[3][2] = (-mat[3][0] * s3 + mat[3][1] * s1 - mat[3][2] * s0) * inv;
+  sol[3][3] = ( mat[2][0] * s3 - mat[2][1] * s1 + mat[2][2] * s0) * inv;
+  return true;
+}
+
+
+template<typename _Type>
+bool AffineInverse(const _Type (&mat)[4][4], _Type (&sol)[4][4])
+{
+  // Inverse of the upper 3x3 from its cofactors.
+  _Type c00 = mat[1][1] * mat[2][2] - mat[1][2] * mat[2][1];
+  _Type c01 = mat[1][2] * mat[2][0] - mat[1][0] * mat[2][2];
+  _Type c02 = mat[1][0] * mat[2][1] - mat[1][1] * mat[2][0];
+  _Type det = mat[0][0] * c00 + mat[0][1] * c01 + mat[0][2] * c02;
+  if (det == 0) {
+    return false;
+  }
+  _Type inv = static_cast<_Type>(1) / det;
+
+  _Type r00 = c00 * inv;
+  _Type r01 = (mat[0][2] * mat[2][1] - mat[0][1] * mat[2][2]) * inv;
+  _Type r02 = (mat[0][1] * mat[1][2] - mat[0][2] * mat[1][1]) * inv;
+  _Type r10 = c01 * inv;
+  _Type r11 = (mat[0][0] * mat[2][2] - mat[0][2] * mat[2][0]) * inv;
+  _Type r12 = (mat[0][2] * mat[1][0] - mat[0][0] * mat[1][2]) * inv;
+  _Type r20 = c02 * inv;
+  _Type r21 = (mat[0][1] * mat[2][0] - mat[0][0] * mat[2][1]) * inv;
+  _Type r22 = (mat[0][0] * mat[1][1] - mat[0][1] * mat[1][0]) * inv;
+
+  // The translation undone by the inverted 3x3.
+  _Type tx = mat[3][0];
+  _Type ty = mat[3][1];
+  _Type tz = mat[3][2];
+
+  sol[0][0] = r00; sol[0][1] = r01; sol[0][2] = r02; sol[0][3] = 0;
+  sol[1][0] = r10; sol[1][1] = r11; sol[1][2] = r12; sol[1][3] = 0;
+  sol[2][0] = r20; sol[2][1] = r21; sol[2][2] = r22; sol[2][3] = 0;
+  sol[3][0] = -(tx * r00 + ty * r10 + tz * r20);
+  sol[3][1] = -(tx * r01 + ty * r11 + tz * r21);
+  sol[3][2] = -(tx * r02 + ty * r12 + tz * r22);
+  sol[3][3] = 1;
+  return true;
+}
+} // detail
+
+
+template<typename _Type>
+Matrix4<_Type> Matrix4<_Type>::Inverse() const
+{
+  return IsAffine() ? AffineInverse() : GeneralInverse();
+}
+
+
+template<typename _Type>
+Matrix4<_Type> Matrix4<_Type>::GeneralInverse() const
+{
+  Matrix4 sol;
+  detail::GeneralInverse(mat, sol.mat);
+  return sol;
+}
+
+
+template<typename _Type>
+Matrix4<_Type> Matrix4<_Type>::AffineInverse() const
+{
+  Matrix4 sol;
+  detail::AffineInverse(mat, sol.mat);
+  return sol;
+}
+
+
+#if PBR_SIMD_SSE
+inline Matrix4<float> Matrix4<float>::Inverse() const
+{
+  return IsAffine() ? AffineInverse() : GeneralInverse();
+}
+
+
+inline Matrix4<float> Matrix4<float>::GeneralInverse() const
+{
+  Matrix4 sol;
+  detail::GeneralInverse(mat, sol.mat);
+  return sol;
+}
+
+
+inline Matrix4<float> Matrix4<float>::AffineInverse() const
+{
+  Matrix4 sol;
+  detail::AffineInverse(mat, sol.mat);
+  return sol;
+}
+#endif // PBR_SIMD_SSE
+} // pbr
@@ -0,0 +1,243 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+namespace pbr {
+
+
+namespace detail {
+
+
+// Same results as minps/maxps, second operand if either is NaN. The slab test leans
+// on it, a ray lying in a slab plane gives 0 * inf = NaN, which then drops out.
+template<typename _Type>
+inline _Type SlabMin(_Type a, _Type b) { return a < b ? a : b; }
+
+template<typename _Type>
+inline _Type SlabMax(_Type a, _Type b) { return a > b ? a : b; }
+} // detail
+
+
+template<typename _Type>
+bool IntersectTriangle(Ray<_Type> &ray, const Vector3<_Type> &v0, const Vector3<_Type> &v1,
+  const Vector3<_Type> &v2, TriangleHit<_Type> &hit)
+{
+  Vector3<_Type> e1 = v1 - v0;
+  Vector3<_Type> e2 = v2 - v0;
+  Vector3<_Type> p = Cross(ray.direction, e2);
+  _Type det = Dot(e1, p);
+  if (det == 0) {
+    return false;
+  }
+  _Type invDet = static_cast<_Type>(1) / det;
+  _Type eps = RayEpsilon<_Type>::Barycentric();
+
+  // Written so that NaNs, from a nearly parallel ray, fail every test.
+  Vector3<_Type> s = ray.origin - v0;
+  _Type u = Dot(s, p) * invDet;
+  if (!(u >= -eps && u <= 1 + eps)) {
+    return false;
+  }
+  Vector3<_Type> q = Cross(s, e1);
+  _Type v = Dot(ray.direction, q) * invDet;
+  if (!(v >= -eps && u + v <= 1 + eps)) {
+    return false;
+  }
+  _Type t = Dot(e2, q) * invDet;
+  if (!(t >= ray.tMin && t <= ray.tMax)) {
+    return false;
+  }
+  hit.t = t;
+  hit.u = u;
+  hit.v = v;
+  ray.tMax = t;
+  return true;
+}
+
+
+template<typename _Type>
+bool IntersectBox(const Ray<_Type> &ray, const Vector3<_Type> &boxMin, const Vector3<_Type> &boxMax,
+  _Type &tNear)
+{
+  _Type t0x = (boxMin.x - ray.origin.x) * ray.invDirection.x;
+  _Type t1x = (boxMax.x - ray.origin.x) * ray.invDirection.x;
+  _Type t0y = (boxMin.y - ray.origin.y) * ray.invDirection.y;
+  _Type t1y = (boxMax.y - ray.origin.y) * ray.invDirection.y;
+  _Type t0z = (boxMin.z - ray.origin.z) * ray.invDirection.z;
+  _Type t1z = (boxMax.z - ray.origin.z) * ray.invDirection.z;
+  // The ray's own range goes in last, so a NaN slab never wins.
+  _Type tEnter = detail::SlabMax(detail::SlabMin(t0x, t1x), ray.tMin);
+  tEnter = detail::SlabMax(detail::SlabMin(t0y, t1y), tEnter);
+  tEnter = detail::SlabMax(detail::SlabMin(t0z, t1z), tEnter);
+  _Type tExit = detail::SlabMin(detail::SlabMax(t0x, t1x), ray.tMax);
+  tExit = detail::SlabMin(detail::SlabMax(t0y, t1y), tExit);
+  tExit = detail::SlabMin(detail::SlabMax(t0z, t1z), tExit);
+  tNear = tEnter;
+  return tEnter <= tExit;
+}
+
+
+template<int _Width>
+int IntersectTriangle(RayPacket<_Width> &rays, const Vector3<float> &v0, const Vector3<float> &v1,
+  const Vector3<float> &v2, PacketHit<_Width> &hit)
+{
+  int mask = 0;
+  for (int lane = 0; lane < _Width; ++lane) {
+    Ray<float> ray = rays.Get(lane);
+    TriangleHit<float> laneHit;
+    if (IntersectTriangle(ray, v0, v1, v2, laneHit)) {
+      rays.tMax[lane] = ray.tMax;
+      hit.t[lane] = laneHit.t;
+      hit.u[lane] = laneHit.u;
+      hit.v[lane] = laneHit.v;
+      mask |= 1 << lane;
+    }
+  }
+  return mask;
+}
+
+
+template<int _Width>
+int IntersectBox(const RayPacket<_Width> &rays, const Vector3<float> &boxMin,
+  const Vector3<float> &boxMax, float (&tNear)[_Width])
+{
+  int mask = 0;
+  for (int lane = 0; lane < _Width; ++lane) {
+    if (IntersectBox(rays.Get(lane), boxMin, boxMax, tNear[lane])) {
+      mask |= 1 << lane;
+    }
+  }
+  return mask;
+}
+
+
+#if PBR_SIMD_SSE
+namespace detail {
+
+
+// The single ray kernels again, one lane per ray, in the same order of operations so
+// every lane gives the scalar result bit for bit (unless the compiler contracts one of
+// them into FMAs). Covers lanes [first, first + register width) of the packet.
+template<typename _Reg, int _Width>
+int IntersectTriangleLanes(RayPacket<_Width> &rays, int first, const Vector3<float> &v0,
+  const Vector3<float> &v1, const Vector3<float> &v2, PacketHit<_Width> &hit)
+{
+  using namespace simd;
+  _Reg e1x = Set1<_Reg>(v1.x - v0.x);
+  _Reg e1y = Set1<_Reg>(v1.y - v0.y);
+  _Reg e1z = Set1<_Reg>(v1.z - v0.z);
+  _Reg e2x = Set1<_Reg>(v2.x - v0.x);
+  _Reg e2y = Set1<_Reg>(v2.y - v0.y);
+  _Reg e2z = Set1<_Reg>(v2.z - v0.z);
+  _Reg dx = Load<_Reg>(rays.dx + first);
+  _Reg dy = Load<_Reg>(rays.dy + first);
+  _Reg dz = Load<_Reg>(rays.dz + first);
+
+  // p = d x e2, det = e1 . p
+  _Reg px = Sub(Mul(dy, e2z), Mul(dz, e2y));
+  _Reg py = Sub(Mul(dz, e2x), Mul(dx, e2z));
+  _Reg pz = Sub(Mul(dx, e2y), Mul(dy, e2x));
+  _Reg det = Add(Add(Mul(e1x, px), Mul(e1y, py)), Mul(e1z, pz));
+  _Reg invDet = Div(Set1<_Reg>(1.0f), det);
+
+  _Reg sx = Sub(Load<_Reg>(rays.ox + first), Set1<_Reg>(v0.x));
+  _Reg sy = Sub(Load<_Reg>(rays.oy + first), Set1<_Reg>(v0.y));
+  _Reg sz = Sub(Load<_Reg>(rays.oz + first), Set1<_Reg>(v0.z));
+  _Reg u = Mul(Add(Add(Mul(sx, px), Mul(sy, py)), Mul(sz, pz)), invDet);
+
+  // q = s x e1
+  _Reg qx = Sub(Mul(sy, e1z), Mul(sz, e1y));
+  _Reg qy = Sub(Mul(sz, e1x), Mul(sx, e1z));
+  _Reg qz = Sub(Mul(sx, e1y), Mul(sy, e1x));
+  _Reg v = Mul(Add(Add(Mul(dx, qx), Mul(dy, qy)), Mul(dz, qz)), invDet);
+  _Reg t = Mul(Add(Add(Mul(e2x, qx), Mul(e2y, qy)), Mul(e2z, qz)), invDet);
+
+  // Ordered compares, NaN lanes fail them all like the scalar kernel.
+  _Reg lo = Set1<_Reg>(-RayEpsilon<float>::Barycentric());
+  _Reg hi = Set1<_Reg>(1.0f + RayEpsilon<float>::Barycentric());
+  _Reg tMax = Load<_Reg>(rays.tMax + first);
+  _Reg mask = And(CmpNeq(det, Set1<_Reg>(0.0f)), And(CmpGe(u, lo), CmpLe(u, hi)));
+  mask = And(mask, And(CmpGe(v, lo), CmpLe(Add(u, v), hi)));
+  mask = And(mask, And(CmpGe(t, Load<_Reg>(rays.tMin + first)), CmpLe(t, tMax)));
+  int bits = MoveMask(mask);
+  if (bits) {
+    Store(hit.t + first, Select(mask, t, Load<_Reg>(hit.t + first)));
+    Store(hit.u + first, Select(mask, u, Load<_Reg>(hit.u + first)));
+    Store(hit.v + first, Select(mask, v, Load<_Reg>(hit.v + first)));
+    Store(rays.tMax + first, Select(mask, t, tMax));
+  }
+  return bits;
+}
+
+
+template<typename _Reg, int _Width>
+int IntersectBoxLanes(const RayPacket<_Width> &rays, int first, const Vector3<float> &boxMin,
+  const Vector3<float> &boxMax, float *tNear)
+{
+  using namespace simd;
+  _Reg ox = Load<_Reg>(rays.ox + first);
+  _Reg oy = Load<_Reg>(rays.oy + first);
+  _Reg oz = Load<_Reg>(rays.oz + first);
+  _Reg idx = Load<_Reg>(rays.idx + first);
+  _Reg idy = Load<_Reg>(rays.idy + first);
+  _Reg idz = Load<_Reg>(rays.idz + first);
+  _Reg t0x = Mul(Sub(Set1<_Reg>(boxMin.x), ox), idx);
+  _Reg t1x = Mul(Sub(Set1<_Reg>(boxMax.x), ox), idx);
+  _Reg t0y = Mul(Sub(Set1<_Reg>(boxMin.y), oy), idy);
+  _Reg t1y = Mul(Sub(Set1<_Reg>(boxMax.y), oy), idy);
+  _Reg t0z = Mul(Sub(Set1<_Reg>(boxMin.z), oz), idz);
+  _Reg t1z = Mul(Sub(Set1<_Reg>(boxMax.z), oz), idz);
+  _Reg tEnter = Max(Min(t0x, t1x), Load<_Reg>(rays.tMin + first));
+  tEnter = Max(Min(t0y, t1y), tEnter);
+  tEnter = Max(Min(t0z, t1z), tEnter);
+  _Reg tExit = Min(Max(t0x, t1x), Load<_Reg>(rays.tMax + first));
+  tExit = Min(Max(t0y, t1y), tExit);
+  tExit = Min(Max(t0z, t1z), tExit);
+  Store(tNear + first, tEnter);
+  return MoveMask(CmpLe(tEnter, tExit));
+}
+} // detail
+
+
+template<>
+inline int IntersectTriangle<4>(RayPacket<4> &rays, const Vector3<float> &v0,
+  const Vector3<float> &v1, const Vector3<float> &v2, PacketHit<4> &hit)
+{
+  return detail::IntersectTriangleLanes<__m128>(rays, 0, v0, v1, v2, hit);
+}
+
+
+template<>
+inline int IntersectBox<4>(const RayPacket<4> &rays, const Vector3<float> &boxMin,
+  const Vector3<float> &boxMax, float (&tNear)[4])
+{
+  return detail::IntersectBoxLanes<__m128>(rays, 0, boxMin, boxMax, tNear);
+}
+
+
+// Without AVX, 8 wide packets run as two SSE halves.
+template<>
+inline int IntersectTriangle<8>(RayPacket<8> &rays, const Vector3<float> &v0,
+  const Vector3<float> &v1, const Vector3<float> &v2, PacketHit<8> &hit)
+{
+#if PBR_SIMD_AVX
+  return detail::IntersectTriangleLanes<__m256>(rays, 0, v0, v1, v2, hit);
+#else
+  return detail::IntersectTriangleLanes<__m128>(rays, 0, v0, v1, v2, hit) |
+    (detail::IntersectTriangleLanes<__m128>(rays, 4, v0, v1, v2, hit) << 4);
+#endif
+}
+
+
+template<>
+inline int IntersectBox<8>(const RayPacket<8> &rays, const Vector3<float> &boxMin,
+  const Vector3<float> &boxMax, float (&tNear)[8])
+{
+#if PBR_SIMD_AVX
+  return detail::IntersectBoxLanes<__m256>(rays, 0, boxMin, boxMax, tNear);
+#else
+  return detail::IntersectBoxLanes<__m128>(rays, 0, boxMin, boxMax, tNear) |
+    (detail::IntersectBoxLanes<__m128>(rays, 4, boxMin, boxMax, tNear) << 4);
+#endif
+}
+#endif // PBR_SIMD_SSE
+} // pbr
@@ -31,10 +31,10 @@ class Matrix4 {
 public:
 
   Matrix4(
-    Vector4<_Type> &row1,
-    Vector4<_Type> &row2,
-    Vector4<_Type> &row3,
-    Vector4<_Type> &row4)
+    const Vector4<_Type> &row1,
+    const Vector4<_Type> &row2,
+    const Vector4<_Type> &row3,
+    const Vector4<_Type> &row4)
   {
     mat[0][0] = row1.x; mat[0][1] = row1.y; mat[0][2] = row1.z; mat[0][3] = row1.w;
     mat[1][0] = row2.x; mat[1][1] = row2.y; mat[1][2] = row2.z; mat[1][3] = row2.w;
@@ -58,7 +58,7 @@ public:
     mat[3][0] = a30; mat[3][1] = a31; mat[3][2] = a32; mat[3][3] = a33;
   }
 
-  Matrix4(Matrix3<_Type> &mat1) {
+  Matrix4(const Matrix3<_Type> &mat1) {
     mat[0][0] = mat1[0][0]; mat[0][1] = mat1[0][1]; mat[0][2] = mat1[0][2]; mat[0][3] = 0;
     mat[1][0] = mat1[1][0]; mat[1][1] = mat1[1][1]; mat[1][2] = mat1[1][2]; mat[1][3] = 0;
     mat[2][0] = mat1[2][0]; mat[2][1] = mat1[2][1]; mat[2][2] = mat1[2][2]; mat[2][3] = 0;
@@ -69,7 +69,7 @@ public:
     return Matrix4();
   }
 
-  Matrix4 operator+(Matrix4 &mat1) {
+  Matrix4 operator+(const Matrix4 &mat1) const {
     // Matrix Addition without the need of loop sequence.
     return Matrix4(
       mat[0][0] + mat1.mat[0][0], mat[0][1] + mat1.mat[0][1], mat[0][2] + mat1.mat[0][2], mat[0][3] + mat1.mat[0][3],
@@ -80,7 +80,7 @@ public:
   }
 
 
-  Matrix4 operator-(Matrix4 &mat1) {
+  Matrix4 operator-(const Matrix4 &mat1) const {
     return Matrix4(
       mat[0][0] - mat1.mat[0][0], mat[0][1] - mat1.mat[0][1], mat[0][2] - mat1.mat[0][2], mat[0][3] - mat1.mat[0][3],
       mat[1][0] - mat1.mat[1][0], mat[1][1] - mat1.mat[1][1], mat[1][2] - mat1.mat[1][2], mat[1][3] - mat1.mat[1][3],
@@ -90,7 +90,7 @@ public:
   }
 
 
-  Matrix4 operator*(Matrix4 &mat1) {
+  Matrix4 operator*(const Matrix4 &mat1) const {
     return Matrix4(
       mat[0][0] * mat1.mat[0][0] + mat[0][1] * mat1.mat[1][0] + mat[0][2] * mat1.mat[2][0] + mat[0][3] * mat1.mat[3][0],
       mat[0][0] * mat1.mat[0][1] + mat[0][1] * mat1.mat[1][1] + mat[0][2] * mat1.mat[2][1] + mat[0][3] * mat1.mat[3][1],
@@ -114,28 +114,39 @@ public:
     );
   }
 
+  /**
+  M * v, v as a column vector.
+  */
+  Vector4<_Type> operator*(const Vector4<_Type> &vec) const {
+    return Vector4<_Type>(
+      mat[0][0] * vec.x + mat[0][1] * vec.y + mat[0][2] * vec.z + mat[0][3] * vec.w,
+      mat[1][0] * vec.x + mat[1][1] * vec.y + mat[1][2] * vec.z + mat[1][3] * vec.w,
+      mat[2][0] * vec.x + mat[2][1] * vec.y + mat[2][2] * vec.z + mat[2][3] * vec.w,
+      mat[3][0] * vec.x + mat[3][1] * vec.y + mat[3][2] * vec.z + mat[3][3] * vec.w
+    );
+  }
+
   _Type *operator[](unsigned int row) {
     return mat[row];
   }
 
+  const _Type *operator[](unsigned int row) const {
+    return mat[row];
+  }
+
   _Type *GetData() {
     return mat[0];
   }
 
-  _Type *operator*() {
+  const _Type *GetData() const {
     return mat[0];
   }
 
-  bool operator!=(Matrix4 &mat1) {
-    return (
-      mat[0][0] != mat1.mat[0][0] && mat[0][1] != mat1.mat[0][1] && mat[0][2] != mat1.mat[0][2] && mat[0][3] != mat1.mat[0][3] &&
-      mat[1][0] != mat1.mat[1][0] && mat[1][1] != mat1.mat[1][1] && mat[1][2] != mat1.mat[1][2] && mat[1][3] != mat1.mat[1][3] &&
-      mat[2][0] != mat1.mat[2][0] && mat[2][1] != mat1.mat[2][1] && mat[2][2] != mat1.mat[2][2] && mat[2][3] != mat1.mat[2][3] &&
-      mat[3][0] != mat1.mat[3][0] && mat[3][1] != mat1.mat[3][1] && mat[3][2] != mat1.mat[3][2] && mat[3][3] != mat1.mat[3][3]
-      );
+  _Type *operator*() {
+    return mat[0];
   }
 
-  bool operator==(Matrix4 &mat1) {
+  bool operator==(const Matrix4 &mat1) const {
     return (
       mat[0][0] == mat1.mat[0][0] && mat[0][1] == mat1.mat[0][1] && mat[0][2] == mat1.mat[0][2] && mat[0][3] == mat1.mat[0][3] &&
       mat[1][0] == mat1.mat[1][0] && mat[1][1] == mat1.mat[1][1] && mat[1][2] == mat1.mat[1][2] && mat[1][3] == mat1.mat[1][3] &&
@@ -144,10 +155,14 @@ public:
       );
   }
 
+  bool operator!=(const Matrix4 &mat1) const {
+    return !(*this == mat1);
+  }
+
   /**
   A^T transpose of this matrix.
   */
-  Matrix4 Transpose() {
+  Matrix4 Transpose() const {
     return Matrix4(
       mat[0][0], mat[1][0], mat[2][0], mat[3][0],
       mat[0][1], mat[1][1], mat[2][1], mat[3][1],
@@ -159,7 +174,7 @@ public:
   /**
   Determinant of this Matrix4 ADT
   */
-  _Type Determinant() {
+  _Type Determinant() const {
     return  mat[0][0] * (mat[1][1] * (mat[2][2] * mat[3][3] - mat[2][3] * mat[3][2]) -
                          mat[2][1] * (mat[1][2] * mat[3][3] - mat[1][3] * mat[3][2]) +
                          mat[3][1] * (mat[1][2] * mat[2][3] - mat[1][3] * mat[2][2])
@@ -178,9 +193,31 @@ public:
                    );
   }
 
-  Matrix4 Inverse() {
-    Matrix4 sol;
-    return sol;
+  /**
+  A^-1 inverse of this matrix. Takes AffineInverse() when IsAffine(), 
+  GeneralInverse() otherwise. A singular matrix gives back the identity.
+  */
+  Matrix4 Inverse() const;
+
+  /**
+  Inverse of any invertible Matrix4, from its 2x2 sub determinants.
+  */
+  Matrix4 GeneralInverse() const;
+
+  /**
+  Inverse of an affine transform, only the upper 3x3 gets inverted and the 
+  translation is carried back through it. The result is wrong if the matrix
+  is not affine, check with IsAffine() first.
+  */
+  Matrix4 AffineInverse() const;
+
+  /**
+  True if this matrix is a transform with no projective part. In the OpenGL 
+  layout that is mat[0][3] = mat[1][3] = mat[2][3] = 0 and mat[3][3] = 1, 
+  with the translation in mat[3][0..2].
+  */
+  bool IsAffine() const {
+    return mat[0][3] == 0 && mat[1][3] == 0 && mat[2][3] == 0 && mat[3][3] == 1;
   }
 
 private:
@@ -225,6 +262,10 @@ public:
   _Type *operator[](unsigned int i) {
     return mat[i];
   }
+
+  const _Type *operator[](unsigned int i) const {
+    return mat[i];
+  }
 private:
   _Type mat[3][3];
 };
@@ -251,6 +292,228 @@ private:
 };
 
 
+#if PBR_SIMD_SSE
+/// Matrix4<float> with every row in an SSE register, same interface and layout as 
+/// the scalar template. Products run a row at a time, as a sum of the other matrix's 
+/// rows scaled by splatted elements, two rows at a time with AVX.
+template<>
+class Matrix4<float> {
+public:
+  Matrix4(
+    const Vector4<float> &row1,
+    const Vector4<float> &row2,
+    const Vector4<float> &row3,
+    const Vector4<float> &row4)
+  {
+    rows[0] = row1.v; rows[1] = row2.v; rows[2] = row3.v; rows[3] = row4.v;
+  }
+
+  Matrix4(__m128 row1, __m128 row2, __m128 row3, __m128 row4) {
+    rows[0] = row1; rows[1] = row2; rows[2] = row3; rows[3] = row4;
+  }
+
+  /**
+  Initialize Column-Major format.
+  */
+  Matrix4(
+    float a00 = 1, float a01 = 0, float a02 = 0, float a03 = 0,
+    float a10 = 0, float a11 = 1, float a12 = 0, float a13 = 0,
+    float a20 = 0, float a21 = 0, float a22 = 1, float a23 = 0,
+    float a30 = 0, float a31 = 0, float a32 = 0, float a33 = 1)
+  {
+    rows[0] = _mm_setr_ps(a00, a01, a02, a03);
+    rows[1] = _mm_setr_ps(a10, a11, a12, a13);
+    rows[2] = _mm_setr_ps(a20, a21, a22, a23);
+    rows[3] = _mm_setr_ps(a30, a31, a32, a33);
+  }
+
+  Matrix4(const Matrix3<float> &mat1) {
+    rows[0] = _mm_setr_ps(mat1[0][0], mat1[0][1], mat1[0][2], 0);
+    rows[1] = _mm_setr_ps(mat1[1][0], mat1[1][1], mat1[1][2], 0);
+    rows[2] = _mm_setr_ps(mat1[2][0], mat1[2][1], mat1[2][2], 0);
+    rows[3] = _mm_setr_ps(0, 0, 0, 1);
+  }
+
+  static Matrix4 Identity() {
+    return Matrix4();
+  }
+
+  Matrix4 operator+(const Matrix4 &mat1) const {
+    return Matrix4(
+      _mm_add_ps(rows[0], mat1.rows[0]), _mm_add_ps(rows[1], mat1.rows[1]),
+      _mm_add_ps(rows[2], mat1.rows[2]), _mm_add_ps(rows[3], mat1.rows[3]));
+  }
+
+  Matrix4 operator-(const Matrix4 &mat1) const {
+    return Matrix4(
+      _mm_sub_ps(rows[0], mat1.rows[0]), _mm_sub_ps(rows[1], mat1.rows[1]),
+      _mm_sub_ps(rows[2], mat1.rows[2]), _mm_sub_ps(rows[3], mat1.rows[3]));
+  }
+
+  Matrix4 operator*(const Matrix4 &mat1) const {
+    Matrix4 sol;
+#if PBR_SIMD_AVX
+    // Rows 0 and 1, then 2 and 3, in the two halves of one register. permute splats
+    // within each half, so both rows pick up their own element.
+    __m256 b0 = _mm256_broadcast_ps(&mat1.rows[0]);
+    __m256 b1 = _mm256_broadcast_ps(&mat1.rows[1]);
+    __m256 b2 = _mm256_broadcast_ps(&mat1.rows[2]);
+    __m256 b3 = _mm256_broadcast_ps(&mat1.rows[3]);
+    for (int i = 0; i < 4; i += 2) {
+      __m256 a = _mm256_loadu_ps(mat[i]);
+      __m256 c = _mm256_mul_ps(_mm256_permute_ps(a, 0x00), b0);
+      c = simd::MulAdd(_mm256_permute_ps(a, 0x55), b1, c);
+      c = simd::MulAdd(_mm256_permute_ps(a, 0xaa), b2, c);
+      c = simd::MulAdd(_mm256_permute_ps(a, 0xff), b3, c);
+      _mm256_storeu_ps(sol.mat[i], c);
+    }
+#else
+    for (int i = 0; i < 4; ++i) {
+      sol.rows[i] = mat1.MulRow(rows[i]);
+    }
+#endif
+    return sol;
+  }
+
+  /**
+  M * v, v as a column vector.
+  */
+  Vector4<float> operator*(const Vector4<float> &vec) const {
+    __m128 x = _mm_mul_ps(rows[0], vec.v);
+    __m128 y = _mm_mul_ps(rows[1], vec.v);
+    __m128 z = _mm_mul_ps(rows[2], vec.v);
+    __m128 w = _mm_mul_ps(rows[3], vec.v);
+    // Four dot products at once, summing columns instead of across each register.
+    _MM_TRANSPOSE4_PS(x, y, z, w);
+    return Vector4<float>(_mm_add_ps(_mm_add_ps(x, y), _mm_add_ps(z, w)));
+  }
+
+  /**
+  row * M, a row vector times this matrix.
+  */
+  __m128 MulRow(__m128 row) const {
+    __m128 sol = _mm_mul_ps(simd::Splat<0>(row), rows[0]);
+    sol = simd::MulAdd(simd::Splat<1>(row), rows[1], sol);
+    sol = simd::MulAdd(simd::Splat<2>(row), rows[2], sol);
+    return simd::MulAdd(simd::Splat<3>(row), rows[3], sol);
+  }
+
+  float *operator[](unsigned int row) {
+    return mat[row];
+  }
+
+  const float *operator[](unsigned int row) const {
+    return mat[row];
+  }
+
+  float *GetData() {
+    return mat[0];
+  }
+
+  const float *GetData() const {
+    return mat[0];
+  }
+
+  float *operator*() {
+    return mat[0];
+  }
+
+  bool operator==(const Matrix4 &mat1) const {
+    __m128 eq = _mm_and_ps(
+      _mm_and_ps(_mm_cmpeq_ps(rows[0], mat1.rows[0]), _mm_cmpeq_ps(rows[1], mat1.rows[1])),
+      _mm_and_ps(_mm_cmpeq_ps(rows[2], mat1.rows[2]), _mm_cmpeq_ps(rows[3], mat1.rows[3])));
+    return _mm_movemask_ps(eq) == 0xf;
+  }
+
+  bool operator!=(const Matrix4 &mat1) const {
+    return !(*this == mat1);
+  }
+
+  /**
+  A^T transpose of this matrix.
+  */
+  Matrix4 Transpose() const {
+    Matrix4 sol(rows[0], rows[1], rows[2], rows[3]);
+    _MM_TRANSPOSE4_PS(sol.rows[0], sol.rows[1], sol.rows[2], sol.rows[3]);
+    return sol;
+  }
+
+  /**
+  Determinant of this Matrix4 ADT, from the 2x2 sub determinants of the top two 
+  and bottom two rows, the same expansion as GeneralInverse().
+  */
+  float Determinant() const {
+    // s = (01 02 03 12) and (13 23) sub determinants of rows 0 and 1, c the same for 
+    // rows 2 and 3. det = s01 c23 - s02 c13 + s03 c12 + s12 c03 - s13 c02 + s23 c01.
+    __m128 s = SubDeterminants(rows[0], rows[1]);
+    __m128 t = SubDeterminantsHigh(rows[0], rows[1]);
+    __m128 c = SubDeterminants(rows[2], rows[3]);
+    __m128 d = SubDeterminantsHigh(rows[2], rows[3]);
+    // (c23 c13 c12 c03) against s, (c02 c01) against t.
+    __m128 cs = _mm_shuffle_ps(d, c, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 ct = _mm_shuffle_ps(c, c, _MM_SHUFFLE(0, 0, 0, 1));
+    __m128 sum = _mm_mul_ps(_mm_mul_ps(s, cs), _mm_setr_ps(1.0f, -1.0f, 1.0f, 1.0f));
+    sum = simd::MulAdd(_mm_mul_ps(t, ct), _mm_setr_ps(-1.0f, 1.0f, 0.0f, 0.0f), sum);
+    return simd::HorizontalSum(sum);
+  }
+
+  Matrix4 Inverse() const;
+  Matrix4 GeneralInverse() const;
+  Matrix4 AffineInverse() const;
+
+  bool IsAffine() const {
+    return mat[0][3] == 0 && mat[1][3] == 0 && mat[2][3] == 0 && mat[3][3] == 1;
+  }
+
+private:
+  // (a0 b1 - b0 a1, a0 b2 - b0 a2, a0 b3 - b0 a3, a1 b2 - b1 a2)
+  static __m128 SubDeterminants(__m128 a, __m128 b) {
+    __m128 al = _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 0, 0));
+    __m128 ar = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 2, 1));
+    __m128 bl = _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 0, 0, 0));
+    __m128 br = _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 3, 2, 1));
+    return _mm_sub_ps(_mm_mul_ps(al, br), _mm_mul_ps(bl, ar));
+  }
+
+  // (a1 b3 - b1 a3, a2 b3 - b2 a3, 0, 0)
+  static __m128 SubDeterminantsHigh(__m128 a, __m128 b) {
+    __m128 al = _mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 0, 2, 1));
+    __m128 ar = _mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 0, 3, 3));
+    __m128 bl = _mm_shuffle_ps(b, b, _MM_SHUFFLE(0, 0, 2, 1));
+    __m128 br = _mm_shuffle_ps(b, b, _MM_SHUFFLE(0, 0, 3, 3));
+    return _mm_sub_ps(_mm_mul_ps(al, br), _mm_mul_ps(bl, ar));
+  }
+
+  // Same row major mat[row][col] as the scalar template, rows[i] aliases mat[i].
+  union {
+    __m128 rows[4];
+    float mat[4][4];
+  };
+};
+#endif // PBR_SIMD_SSE
+
+
+/// v * M, v as a row vector. With OpenGL laid out transforms, this is what glm
+/// computes for M * v.
+template<typename _Type>
+Vector4<_Type> operator*(const Vector4<_Type> &vec, const Matrix4<_Type> &mat)
+{
+  return Vector4<_Type>(
+    vec.x * mat[0][0] + vec.y * mat[1][0] + vec.z * mat[2][0] + vec.w * mat[3][0],
+    vec.x * mat[0][1] + vec.y * mat[1][1] + vec.z * mat[2][1] + vec.w * mat[3][1],
+    vec.x * mat[0][2] + vec.y * mat[1][2] + vec.z * mat[2][2] + vec.w * mat[3][2],
+    vec.x * mat[0][3] + vec.y * mat[1][3] + vec.z * mat[2][3] + vec.w * mat[3][3]
+  );
+}
+
+#if PBR_SIMD_SSE
+inline Vector4<float> operator*(const Vector4<float> &vec, const Matrix4<float> &mat)
+{
+  return Vector4<float>(mat.MulRow(vec.v));
+}
+#endif // PBR_SIMD_SSE
+
+
 //template<typename _Type>
 //Matrix4<_Type> ToMatrix4(Quaternion<_Type> &quat);
 
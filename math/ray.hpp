@@ -0,0 +1,141 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __RAY_HPP
+#define __RAY_HPP
+
+#include "vector.hpp"
+#include <limits>
+
+
+namespace pbr {
+
+
+/// Ray over the parametric range [tMin, tMax], origin + t * direction.
+/// The direction does not need to be normalized, t is then in units of its length.
+/// The intersection kernels shrink tMax to the closest hit they find, so a ray
+/// tested against many triangles ends up with the nearest one.
+template<typename _Type = float>
+class Ray {
+public:
+  Ray(const Vector3<_Type> &origin = Vector3<_Type>(0, 0, 0),
+      const Vector3<_Type> &direction = Vector3<_Type>(0, 0, 1),
+      _Type tMin = 0,
+      _Type tMax = std::numeric_limits<_Type>::infinity())
+    : origin(origin)
+    , direction(direction)
+    , invDirection(1 / direction.x, 1 / direction.y, 1 / direction.z)
+    , tMin(tMin)
+    , tMax(tMax) { }
+
+  Vector3<_Type> At(_Type t) const {
+    return Vector3<_Type>(
+      origin.x + direction.x * t,
+      origin.y + direction.y * t,
+      origin.z + direction.z * t
+    );
+  }
+
+  Vector3<_Type> origin;
+  Vector3<_Type> direction;
+  /// 1 / direction for the slab test. Zero components give infinities, which the
+  /// slab test handles.
+  Vector3<_Type> invDirection;
+  _Type tMin;
+  _Type tMax;
+};
+
+
+/// Where a ray hit a triangle, the hit point is (1 - u - v) v0 + u v1 + v v2.
+template<typename _Type = float>
+struct TriangleHit {
+  _Type t;
+  _Type u;
+  _Type v;
+};
+
+
+/// Barycentric slack in the triangle kernels. Neighbouring triangles overlap by this
+/// much along their shared edges, so a ray can't slip between them through rounding.
+/// It may hit both instead, and the closer one wins. 1e-6 still leaked through the
+/// slivers around the poles of Geometry::CreateSphere, see --bench ray.
+template<typename _Type>
+struct RayEpsilon {
+  static _Type Barycentric() { return static_cast<_Type>(1e-5); }
+};
+
+
+/// Moller-Trumbore ray/triangle test, double sided. On a hit inside [ray.tMin, ray.tMax]
+/// fills hit, shrinks ray.tMax to the hit and returns true, leaves both alone otherwise.
+template<typename _Type>
+bool IntersectTriangle(Ray<_Type> &ray, const Vector3<_Type> &v0, const Vector3<_Type> &v1,
+  const Vector3<_Type> &v2, TriangleHit<_Type> &hit);
+
+/// Slab ray/box test. Returns true if the ray's [tMin, tMax] overlaps the box, with
+/// tNear the distance it enters it at, clamped to tMin.
+template<typename _Type>
+bool IntersectBox(const Ray<_Type> &ray, const Vector3<_Type> &boxMin, const Vector3<_Type> &boxMax,
+  _Type &tNear);
+
+
+/// _Width rays in structure of arrays form, for testing them all against the same
+/// triangle or box at once. 4 wide runs on SSE, 8 wide on AVX. Without them, or at
+/// other widths, the packet kernels loop over the single ray ones.
+template<int _Width>
+struct RayPacket {
+  static const int kWidth = _Width;
+
+  void Set(int lane, const Ray<float> &ray) {
+    ox[lane] = ray.origin.x; oy[lane] = ray.origin.y; oz[lane] = ray.origin.z;
+    dx[lane] = ray.direction.x; dy[lane] = ray.direction.y; dz[lane] = ray.direction.z;
+    idx[lane] = ray.invDirection.x; idy[lane] = ray.invDirection.y; idz[lane] = ray.invDirection.z;
+    tMin[lane] = ray.tMin; tMax[lane] = ray.tMax;
+  }
+
+  Ray<float> Get(int lane) const {
+    return Ray<float>(Vector3<float>(ox[lane], oy[lane], oz[lane]),
+      Vector3<float>(dx[lane], dy[lane], dz[lane]), tMin[lane], tMax[lane]);
+  }
+
+  alignas(32) float ox[_Width];
+  alignas(32) float oy[_Width];
+  alignas(32) float oz[_Width];
+  alignas(32) float dx[_Width];
+  alignas(32) float dy[_Width];
+  alignas(32) float dz[_Width];
+  alignas(32) float idx[_Width];
+  alignas(32) float idy[_Width];
+  alignas(32) float idz[_Width];
+  alignas(32) float tMin[_Width];
+  alignas(32) float tMax[_Width];
+};
+
+
+template<int _Width>
+struct PacketHit {
+  alignas(32) float t[_Width];
+  alignas(32) float u[_Width];
+  alignas(32) float v[_Width];
+};
+
+
+/// IntersectTriangle() for every lane of the packet. Returns a bit per lane that hit,
+/// and only those lanes of hit and rays.tMax are written.
+template<int _Width>
+int IntersectTriangle(RayPacket<_Width> &rays, const Vector3<float> &v0, const Vector3<float> &v1,
+  const Vector3<float> &v2, PacketHit<_Width> &hit);
+
+/// IntersectBox() for every lane of the packet. Returns a bit per lane that hit, with
+/// tNear written for every lane.
+template<int _Width>
+int IntersectBox(const RayPacket<_Width> &rays, const Vector3<float> &boxMin,
+  const Vector3<float> &boxMax, float (&tNear)[_Width]);
+
+
+typedef Ray<float> Rayf;
+typedef RayPacket<4> RayPacket4;
+typedef RayPacket<8> RayPacket8;
+} // pbr
+
+#include <ray.inl>
+#endif // __RAY_HPP
@@ -0,0 +1,122 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __SIMD_HPP
+#define __SIMD_HPP
+
+// Which instruction sets the float specializations of Vector4 and Matrix4 are built
+// with. SSE2 is always there on x86-64, AVX and FMA only if the compiler was told it
+// can use them (-mavx2 -mfma, /arch:AVX2, see the PBR_AVX cmake option). Define
+// PBR_NO_SIMD to fall back to the scalar templates everywhere.
+#if !defined(PBR_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+  (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+ #define PBR_SIMD_SSE 1
+ #include <emmintrin.h>
+#else
+ #define PBR_SIMD_SSE 0
+#endif
+
+#if PBR_SIMD_SSE && defined(__AVX__)
+ #define PBR_SIMD_AVX 1
+ #include <immintrin.h>
+#else
+ #define PBR_SIMD_AVX 0
+#endif
+
+// msvc never defines __FMA__, but every AVX2 part has FMA3.
+#if PBR_SIMD_AVX && (defined(__FMA__) || defined(__AVX2__))
+ #define PBR_SIMD_FMA 1
+#else
+ #define PBR_SIMD_FMA 0
+#endif
+
+
+#if PBR_SIMD_SSE
+namespace pbr {
+namespace simd {
+
+
+/// a * b + c, in one rounding if the target has FMA.
+inline __m128 MulAdd(__m128 a, __m128 b, __m128 c)
+{
+#if PBR_SIMD_FMA
+  return _mm_fmadd_ps(a, b, c);
+#else
+  return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
+}
+
+
+/// Copy one lane into all four.
+template<int _Lane>
+inline __m128 Splat(__m128 v)
+{
+  return _mm_shuffle_ps(v, v, _MM_SHUFFLE(_Lane, _Lane, _Lane, _Lane));
+}
+
+
+/// v.x + v.y + v.z + v.w
+inline float HorizontalSum(__m128 v)
+{
+  __m128 shuffled = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+  __m128 sums = _mm_add_ps(v, shuffled);
+  shuffled = _mm_movehl_ps(shuffled, sums);
+  sums = _mm_add_ss(sums, shuffled);
+  return _mm_cvtss_f32(sums);
+}
+
+
+// Overloads over __m128 and __m256, so a kernel written once as a template over the
+// register type runs 4 or 8 wide. Comparisons give all bits set lanes, MoveMask packs
+// their sign bits into an int.
+template<typename _Reg> _Reg Set1(float value);
+template<typename _Reg> _Reg Load(const float *aligned);
+
+template<> inline __m128 Set1<__m128>(float value) { return _mm_set1_ps(value); }
+template<> inline __m128 Load<__m128>(const float *aligned) { return _mm_load_ps(aligned); }
+inline void Store(float *aligned, __m128 v) { _mm_store_ps(aligned, v); }
+inline __m128 Add(__m128 a, __m128 b) { return _mm_add_ps(a, b); }
+inline __m128 Sub(__m128 a, __m128 b) { return _mm_sub_ps(a, b); }
+inline __m128 Mul(__m128 a, __m128 b) { return _mm_mul_ps(a, b); }
+inline __m128 Div(__m128 a, __m128 b) { return _mm_div_ps(a, b); }
+inline __m128 Min(__m128 a, __m128 b) { return _mm_min_ps(a, b); }
+inline __m128 Max(__m128 a, __m128 b) { return _mm_max_ps(a, b); }
+inline __m128 CmpLe(__m128 a, __m128 b) { return _mm_cmple_ps(a, b); }
+inline __m128 CmpGe(__m128 a, __m128 b) { return _mm_cmpge_ps(a, b); }
+inline __m128 CmpNeq(__m128 a, __m128 b) { return _mm_cmpneq_ps(a, b); }
+inline __m128 And(__m128 a, __m128 b) { return _mm_and_ps(a, b); }
+inline __m128 Select(__m128 mask, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+inline int MoveMask(__m128 mask) { return _mm_movemask_ps(mask); }
+
+
+#if PBR_SIMD_AVX
+inline __m256 MulAdd(__m256 a, __m256 b, __m256 c)
+{
+#if PBR_SIMD_FMA
+  return _mm256_fmadd_ps(a, b, c);
+#else
+  return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+
+template<> inline __m256 Set1<__m256>(float value) { return _mm256_set1_ps(value); }
+template<> inline __m256 Load<__m256>(const float *aligned) { return _mm256_load_ps(aligned); }
+inline void Store(float *aligned, __m256 v) { _mm256_store_ps(aligned, v); }
+inline __m256 Add(__m256 a, __m256 b) { return _mm256_add_ps(a, b); }
+inline __m256 Sub(__m256 a, __m256 b) { return _mm256_sub_ps(a, b); }
+inline __m256 Mul(__m256 a, __m256 b) { return _mm256_mul_ps(a, b); }
+inline __m256 Div(__m256 a, __m256 b) { return _mm256_div_ps(a, b); }
+inline __m256 Min(__m256 a, __m256 b) { return _mm256_min_ps(a, b); }
+inline __m256 Max(__m256 a, __m256 b) { return _mm256_max_ps(a, b); }
+inline __m256 CmpLe(__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+inline __m256 CmpGe(__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+inline __m256 CmpNeq(__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+inline __m256 And(__m256 a, __m256 b) { return _mm256_and_ps(a, b); }
+inline __m256 Select(__m256 mask, __m256 a, __m256 b) { return _mm256_blendv_ps(b, a, mask); }
+inline int MoveMask(__m256 mask) { return _mm256_movemask_ps(mask); }
+#endif
+} // simd
+} // pbr
+#endif // PBR_SIMD_SSE
+#endif // __SIMD_HPP
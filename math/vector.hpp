@@ -4,6 +4,7 @@
 #ifndef __VECTOR_HPP
 #define __VECTOR_HPP
 
+#include "simd.hpp"
 #include <cmath>
 
 
@@ -24,13 +25,13 @@ public:
           _Value w = 1.0f)
     : x(x), y(y), z(z), w(w) { }
 
-  Vector4(Vector3 &v)
+  Vector4(const Vector3<_Value> &v)
     : x(v.x), y(v.y), z(v.z), w(1.0f) { }
 
-  Vector4(Vector2 &v)
+  Vector4(const Vector2<_Value> &v)
     : x(v.x), y(v.y), z(0.0f), w(0.0f) { }
 
-  Vector4 operator+(Vector4 &vec) {
+  Vector4 operator+(const Vector4 &vec) const {
     return Vector4(
       x + vec.x,
       y + vec.y,
@@ -39,7 +40,7 @@ public:
     );
   }
 
-  Vector4 operator-(Vector4 &vec) {
+  Vector4 operator-(const Vector4 &vec) const {
     return Vector4(
       x - vec.x,
       y - vec.y,
@@ -48,7 +49,7 @@ public:
     );
   }
 
-  Vector4 operator*(Vector4 &vec) {
+  Vector4 operator*(const Vector4 &vec) const {
     return Vector4(
       x * vec.x,
       y * vec.y,
@@ -57,12 +58,7 @@ public:
     );
   }
 
-  Vector4 operator/(Vector4 &vec) {
-    static_assert(
-      (vec.x != 0 || vec.y != 0 || vec.z != 0 || vec.w != 0),
-      "Divide by zero!"
-      );
-
+  Vector4 operator/(const Vector4 &vec) const {
     return Vector4(
       x / vec.x,
       y / vec.y,
@@ -71,11 +67,15 @@ public:
     );
   }
 
-  bool operator!=(Vector4 &vec) {
-    return (x != vec.x) && (y != vec.y) && (z != vec.z) && (w != vec.w);
+  bool operator==(const Vector4 &vec) const {
+    return (x == vec.x) && (y == vec.y) && (z == vec.z) && (w == vec.w);
+  }
+
+  bool operator!=(const Vector4 &vec) const {
+    return !(*this == vec);
   }
 
-  Vector4 Copy() {
+  Vector4 Copy() const {
     return Vector4(x, y, z, w);
   }
 
@@ -83,7 +83,7 @@ public:
   union {
     struct { _Value x, y, z, w; };
     struct { _Value r, g, b, a; };
-    struct { _Value s, t, r, q; };
+    struct { _Value s, t, p, q; };
   };
 };
 
@@ -98,7 +98,7 @@ public:
     : x(x), y(y), z(z) { }
 
 
-  Vector3 operator+(Vector3 &vec) {
+  Vector3 operator+(const Vector3 &vec) const {
     return Vector3(
       x + vec.x,
       y + vec.y,
@@ -106,7 +106,7 @@ public:
     );
   }
 
-  Vector3 operator-(Vector3 &vec) {
+  Vector3 operator-(const Vector3 &vec) const {
     return Vector3(
       x - vec.x,
       y - vec.y,
@@ -114,7 +114,7 @@ public:
     );
   }
 
-  Vector3 operator*(Vector3 &vec) {
+  Vector3 operator*(const Vector3 &vec) const {
     return Vector3(
       x * vec.x,
       y * vec.y,
@@ -125,7 +125,7 @@ public:
   union {
     struct { _Value x, y, z; };
     struct { _Value r, g, b; };
-    struct { _Value s, t, r; };
+    struct { _Value s, t, p; };
   };
 };
 
@@ -137,21 +137,21 @@ public:
           _Value y = 1.0f)
     : x(x), y(y) { }
 
-  Vector2 operator+(Vector2 &vec) {
+  Vector2 operator+(const Vector2 &vec) const {
     return Vector2(
       x + vec.x,
       y + vec.y
     );
   }
 
-  Vector2 operator-(Vector2 &vec) {
+  Vector2 operator-(const Vector2 &vec) const {
     return Vector2(
       x - vec.x,
       y - vec.y
     );
   }
 
-  Vector2 operator*(Vector2 &vec) {
+  Vector2 operator*(const Vector2 &vec) const {
     return Vector2(
       x * vec.x,
       y * vec.y
@@ -165,11 +165,107 @@ public:
   };
 };
 
+#if PBR_SIMD_SSE
+/// Vector4<float> kept in one SSE register. Same interface as the scalar template,
+/// plus the register itself in v. The __m128 member keeps it 16 byte aligned.
+template<>
+class Vector4<float> {
+public:
+  Vector4(float x = 0.0f,
+          float y = 0.0f,
+          float z = 0.0f,
+          float w = 1.0f)
+    : v(_mm_setr_ps(x, y, z, w)) { }
+
+  explicit Vector4(__m128 v)
+    : v(v) { }
+
+  Vector4(const Vector3<float> &vec)
+    : v(_mm_setr_ps(vec.x, vec.y, vec.z, 1.0f)) { }
+
+  Vector4(const Vector2<float> &vec)
+    : v(_mm_setr_ps(vec.x, vec.y, 0.0f, 0.0f)) { }
+
+  Vector4 operator+(const Vector4 &vec) const {
+    return Vector4(_mm_add_ps(v, vec.v));
+  }
+
+  Vector4 operator-(const Vector4 &vec) const {
+    return Vector4(_mm_sub_ps(v, vec.v));
+  }
+
+  Vector4 operator*(const Vector4 &vec) const {
+    return Vector4(_mm_mul_ps(v, vec.v));
+  }
+
+  Vector4 operator/(const Vector4 &vec) const {
+    return Vector4(_mm_div_ps(v, vec.v));
+  }
+
+  bool operator==(const Vector4 &vec) const {
+    return _mm_movemask_ps(_mm_cmpeq_ps(v, vec.v)) == 0xf;
+  }
+
+  bool operator!=(const Vector4 &vec) const {
+    return !(*this == vec);
+  }
+
+  Vector4 Copy() const {
+    return *this;
+  }
+
+
+  union {
+    __m128 v;
+    struct { float x, y, z, w; };
+    struct { float r, g, b, a; };
+    struct { float s, t, p, q; };
+  };
+};
+#endif // PBR_SIMD_SSE
+
+
+/// Dot product of 2 4D vectors.
+template<typename _Type>
+_Type Dot(Vector4<_Type> const &a, Vector4<_Type> const &b)
+{
+  return (a.x * b.x) + (a.y * b.y) + (a.z * b.z) + (a.w * b.w);
+}
+
+/// a * b + c component wise. Fused into one rounding where the target supports it,
+/// so the last bit may differ from writing out a * b + c.
+template<typename _Type>
+Vector4<_Type> MulAdd(Vector4<_Type> const &a, Vector4<_Type> const &b, Vector4<_Type> const &c)
+{
+  return Vector4<_Type>(
+    a.x * b.x + c.x,
+    a.y * b.y + c.y,
+    a.z * b.z + c.z,
+    a.w * b.w + c.w
+  );
+}
+
+#if PBR_SIMD_SSE
+inline float Dot(Vector4<float> const &a, Vector4<float> const &b)
+{
+  return simd::HorizontalSum(_mm_mul_ps(a.v, b.v));
+}
+
+inline Vector4<float> MulAdd(Vector4<float> const &a, Vector4<float> const &b, Vector4<float> const &c)
+{
+  return Vector4<float>(simd::MulAdd(a.v, b.v, c.v));
+}
+#endif // PBR_SIMD_SSE
+
 /// Cross product of 2 3D vectors.
 template<typename _Type = float>
 Vector3<_Type> Cross(Vector3<_Type> const &a, Vector3<_Type> const &b)
 {
-  
+  return Vector3<_Type>(
+    a.y * b.z - a.z * b.y,
+    a.z * b.x - a.x * b.z,
+    a.x * b.y - a.y * b.x
+  );
 }
 
 /// Dot product of 2 3D vectors.
@@ -197,15 +293,16 @@ _Type Length(Vector3<_Type> const &a) {
 /// Normalize the vector to it's base unit.
 /// This is probably not the best solution, but it is will suffice in this case.
 template<typename _Type = float>
-Vector3<_Type> Normalize(Vector3<_Type> &vec) {
+Vector3<_Type> Normalize(Vector3<_Type> const &vec) {
   _Type mag = Length(vec);
   return Vector3<_Type>(vec.x / mag, vec.y / mag, vec.z / mag);
 }
 
 
+typedef Vector4<float> Vec4;
 typedef Vector3<float> Vec3;
 typedef Vector2<float> Vec2;
+} // pbr
 
 #include <vector.inl>
-} // pbr
-#endif // __VECTOR_HPP
\ No newline at end of file
+#endif // __VECTOR_HPP
@@ -0,0 +1,24 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#version 430
+#extension GL_ARB_separate_shader_objects : enable
+
+layout (location = 0) in vec3 position;
+
+layout (binding = 0) uniform UniformBufferObject {
+  mat4 model;
+  mat4 view;
+  mat4 projection;
+  mat4 normalMatrix;
+  vec3 camPosition;
+} ubo;
+
+// The PBR pass tests against this depth with EQUAL, both shaders have to compute
+// gl_Position the exact same way.
+invariant gl_Position;
+
+void main() {
+  vec4 worldPosition = ubo.model * vec4(position, 1.0);
+  gl_Position = ubo.projection * ubo.view * worldPosition;
+}
@@ -3,19 +3,25 @@
 //
 #version 430 
 #extension GL_ARB_separate_shader_objects : enable
-layout (location = 0) in vec3 inPosition;
-layout (location = 2) in vec2 inUV;
-layout (location = 0) out vec3 outPosition;
+layout (location = 0) out vec3 outUVW;
 
+// The sky slice of the uniform ring. model holds the inverse of the projection times the
+// rotation part of the view, so clip space maps straight back to a world direction.
 layout (binding = 0) uniform UniformBufferObject {
   mat4 model;
   mat4 view;
   mat4 projection;
+  mat4 normalMatrix;
   vec3 camPosition;
 } ubo;
 
 void main() 
 {
-  gl_Position =  ubo.projection * ubo.model * vec4(inPosition, 1.0);
-  outPosition = inPosition;
-}
\ No newline at end of file
+  // One triangle covering the screen, (-1,-1), (3,-1), (-1,3). No vertex buffers.
+  vec2 position = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2) * 2.0 - 1.0;
+  // On the far plane, so it only lands where the opaque pass left the depth clear value.
+  gl_Position = vec4(position, 1.0, 1.0);
+  // Affine in screen space, so interpolating before the divide is exact, and the divide
+  // itself only scales the direction.
+  outUVW = (ubo.model * vec4(position, 1.0, 1.0)).xyz;
+}
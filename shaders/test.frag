@@ -23,6 +23,7 @@ layout (binding = 0) uniform UniformBufferObject {
   mat4 model;
   mat4 view;
   mat4 projection;
+  mat4 normalMatrix;
   vec3 camPosition;
 } ubo;
 
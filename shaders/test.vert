@@ -17,14 +17,18 @@ layout (binding = 0) uniform UniformBufferObject {
   mat4 model;
   mat4 view;
   mat4 projection;
+  mat4 normalMatrix;
   vec3 camPosition;
 } ubo;
 
+// Must match depth.vert, the depth prepass relies on it.
+invariant gl_Position;
+
 
 void main() {
   vec4 worldPosition = ubo.model * vec4(position, 1.0);
   gl_Position = ubo.projection * ubo.view * worldPosition;
   fragPos = worldPosition.xyz;
-  fragNormal = mat3(transpose(inverse(ubo.model))) * normal;
+  fragNormal = mat3(ubo.normalMatrix) * normal;
   fragTexCoord = texcoord;
 }
\ No newline at end of file
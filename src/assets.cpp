@@ -0,0 +1,150 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "assets.hpp"
+#include "shader.hpp"
+#include "geometry.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include "stb_image.h"
+
+#include <cassert>
+#include <future>
+#include <mutex>
+
+#include <gli/load.hpp>
+
+
+// If you prefer to render the sphere, set this to 1 
+#define SPHERE 0
+
+
+namespace pbr {
+
+
+struct ShaderSource {
+  ShaderModule::ShaderStage stage;
+  const char *filepath;
+};
+
+
+const ShaderSource kShaderSources[Assets::siCount] = {
+  { ShaderModule::ssVertShader, PBR_STUDY_DIR"/shaders/test.vert" },
+  { ShaderModule::ssFragShader, PBR_STUDY_DIR"/shaders/test.frag" },
+  { ShaderModule::ssVertShader, PBR_STUDY_DIR"/shaders/skybox.vert" },
+  { ShaderModule::ssFragShader, PBR_STUDY_DIR"/shaders/skybox.frag" },
+  { ShaderModule::ssVertShader, PBR_STUDY_DIR"/shaders/depth.vert" }
+};
+
+
+// Futures of every asset. Lives in a function so that it is constructed before 
+// anything can call Start(), even from a static initializer.
+struct AssetFutures {
+  std::once_flag                                    started;
+  std::shared_future<Model>                         model;
+  std::shared_future<Assets::Image>                 texture;
+  std::shared_future<gli::texture_cube>             envMap;
+  std::shared_future<gli::texture_cube>             irradianceMap;
+  std::shared_future<std::vector<uint32_t>>         shaders[Assets::siCount];
+};
+
+
+static AssetFutures &GetFutures()
+{
+  static AssetFutures futures;
+  return futures;
+}
+
+
+void Assets::Start()
+{
+  AssetFutures &futures = GetFutures();
+  std::call_once(futures.started, [&futures] () {
+    ThreadPool &pool = ThreadPool::Global();
+    // Biggest job first, the model takes the longest by far.
+    futures.model = pool.Submit([] () {
+#if SPHERE
+      return Model("Sphere", Geometry::CreateSphere(1.0f, 60, 60));
+#else
+      return Model::Load("Happy buddha", PBR_STUDY_DIR"/dragon.obj");
+#endif
+    }).share();
+
+    for (uint32_t i = 0; i < siCount; ++i) {
+      futures.shaders[i] = pool.Submit([i] () {
+        return ShaderModule::CompileSpirv(kShaderSources[i].stage, kShaderSources[i].filepath);
+      }).share();
+    }
+
+    futures.envMap = pool.Submit([] () {
+      PBR_TRACE_SCOPE("LoadEnvMap");
+      return gli::texture_cube(gli::load(PBR_STUDY_DIR"/maps/subway_skybox.ktx"));
+    }).share();
+
+    futures.irradianceMap = pool.Submit([] () {
+      PBR_TRACE_SCOPE("LoadIrradianceMap");
+      return gli::texture_cube(gli::load(PBR_STUDY_DIR"/maps/subway_irradiance.ktx"));
+    }).share();
+
+    futures.texture = pool.Submit([] () {
+      PBR_TRACE_SCOPE("LoadTexture");
+      Image image = { };
+      int32_t channels;
+      stbi_uc *pixels = stbi_load(PBR_STUDY_DIR"/statue.jpg", &image.width, &image.height, 
+        &channels, STBI_rgb_alpha);
+      assert(pixels && "Failed to load image");
+      image.pixels = std::shared_ptr<uint8_t>(pixels, [] (uint8_t *p) { stbi_image_free(p); });
+      return image;
+    }).share();
+  });
+}
+
+
+const Model &Assets::GetModel()
+{
+  Start();
+  PBR_TRACE_SCOPE("WaitForModel");
+  return GetFutures().model.get();
+}
+
+
+Assets::Image Assets::GetTexture()
+{
+  Start();
+  PBR_TRACE_SCOPE("WaitForTexture");
+  return GetFutures().texture.get();
+}
+
+
+gli::texture_cube Assets::GetEnvMap()
+{
+  Start();
+  PBR_TRACE_SCOPE("WaitForEnvMap");
+  return GetFutures().envMap.get();
+}
+
+
+gli::texture_cube Assets::GetIrradianceMap()
+{
+  Start();
+  PBR_TRACE_SCOPE("WaitForIrradianceMap");
+  return GetFutures().irradianceMap.get();
+}
+
+
+const std::vector<uint32_t> &Assets::GetShader(ShaderId id)
+{
+  Start();
+  PBR_TRACE_SCOPE("WaitForShader");
+  return GetFutures().shaders[id].get();
+}
+
+
+void Assets::ReleaseTextures()
+{
+  AssetFutures &futures = GetFutures();
+  futures.texture = std::shared_future<Image>();
+  futures.envMap = std::shared_future<gli::texture_cube>();
+  futures.irradianceMap = std::shared_future<gli::texture_cube>();
+}
+} // pbr
@@ -0,0 +1,58 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __ASSETS_HPP
+#define __ASSETS_HPP
+
+
+#include "platform.hpp"
+#include "model.hpp"
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include <gli/texture_cube.hpp>
+
+
+namespace pbr {
+
+
+/// Everything the renderer reads from disk at startup: the model, the texture, the 
+/// KTX cubemaps and the compiled shaders. Start() kicks off every load on the global
+/// ThreadPool, so parsing, decoding and shader compiles run while the vulkan instance,
+/// device and swapchain are being created. Each getter only blocks on the asset it returns.
+class Assets {
+public:
+  /// Shaders compiled at startup.
+  enum ShaderId {
+    siPbrVert,
+    siPbrFrag,
+    siSkyboxVert,
+    siSkyboxFrag,
+    siDepthVert,
+    siCount
+  };
+
+  /// Decoded 8 bit RGBA image.
+  struct Image {
+    int32_t width;
+    int32_t height;
+    std::shared_ptr<uint8_t> pixels;
+  };
+
+  /// Start loading everything in the background. Safe to call more than once, the getters
+  /// call it as well in case nobody did.
+  static void Start();
+
+  static const Model &GetModel();
+  static Image GetTexture();
+  static gli::texture_cube GetEnvMap();
+  static gli::texture_cube GetIrradianceMap();
+  static const std::vector<uint32_t> &GetShader(ShaderId id);
+
+  /// Drop the decoded images and cubemaps once they have been uploaded to the gpu.
+  /// GetTexture(), GetEnvMap() and GetIrradianceMap() must not be called afterwards.
+  static void ReleaseTextures();
+};
+} // pbr
+#endif // __ASSETS_HPP
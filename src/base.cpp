@@ -6,6 +6,11 @@
 #include "vertex.hpp"
 #include "model.hpp"
 #include "geometry.hpp"
+#include "assets.hpp"
+#include "image_writer.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include <matrix.hpp>
 #include <GLFW/glfw3.h>
 #define STB_IMAGE_IMPLEMENTTION
 #include "stb_image.h"
@@ -18,6 +23,16 @@
 #include <iostream>
 #include <array>
 #include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+ #include <direct.h>
+#endif
 
 #include <gli/gli.hpp>
 
@@ -38,15 +53,16 @@
 #endif
 #define APPEND_AB(a, b) a##b
 
-// If you prefer to render the sphere, set this to 1 
-#define SPHERE 0
-
 #if BASE_DEBUG
  #define BASE_ASSERT(expr) assert(expr)
 #else
  #define BASE_ASSERT(expr)
 #endif  
 
+// Nobody is around to press Enter in headless mode.
+static bool pauseOnValidation = true;
+
+
 // Vulkan Validation Layer Callback.
 static VKAPI_ATTR VkBool32 VKAPI_CALL DebugCallback(
   VkDebugReportFlagsEXT flags,
@@ -59,8 +75,10 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL DebugCallback(
   void *usrData)
 {
   std::printf("Validation => %s\n", msg);
-  std::printf("Pressing Enter will continue with the program...\n");
-  std::cin.ignore();
+  if (pauseOnValidation) {
+    std::printf("Pressing Enter will continue with the program...\n");
+    std::cin.ignore();
+  }
   return VK_FALSE;
 }
 
@@ -104,19 +122,24 @@ const bool enableValidationLayers = true;
 #else
 const bool enableValidationLayers = false;
 #endif
+// Cleared if the layers are missing in headless mode.
+bool useValidationLayers = enableValidationLayers;
 
 
-std::vector<const char *> GetRequiredExtensions()
+std::vector<const char *> GetRequiredExtensions(bool headless)
 {
   std::vector<const char *> extensions;
-  uint32_t glfwExtensionsCount = 0;
-  const char **glfwExtensions;
-  glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionsCount);
-  for (uint32_t i = 0; i < glfwExtensionsCount; ++i) {
-    extensions.push_back(glfwExtensions[i]);
+  // Surface extensions are only needed to present.
+  if (!headless) {
+    uint32_t glfwExtensionsCount = 0;
+    const char **glfwExtensions;
+    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionsCount);
+    for (uint32_t i = 0; i < glfwExtensionsCount; ++i) {
+      extensions.push_back(glfwExtensions[i]);
+    }
   }
 
-  if (enableValidationLayers) {
+  if (useValidationLayers) {
     extensions.push_back(VK_EXT_DEBUG_REPORT_EXTENSION_NAME);
   }
   
@@ -148,11 +171,16 @@ bool CheckValidationLayerSupport()
 }
 
 
-VkInstance CreateInstance()
+VkInstance CreateInstance(bool headless)
 {
   glfwInit();
   if (enableValidationLayers && !CheckValidationLayerSupport()) {
     std::printf("this shit don't work mate...\n");
+    // Render farm nodes and software drivers usually come without the layers, and
+    // asking for missing layers fails instance creation.
+    if (headless) {
+      useValidationLayers = false;
+    }
   }
 
   VkApplicationInfo appInfo = { };
@@ -167,10 +195,10 @@ VkInstance CreateInstance()
   instanceCreateInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
   instanceCreateInfo.pApplicationInfo = &appInfo;
   
-  auto extensions = GetRequiredExtensions();
+  auto extensions = GetRequiredExtensions(headless);
   instanceCreateInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
   instanceCreateInfo.ppEnabledExtensionNames = extensions.data();
-  if (enableValidationLayers) {
+  if (useValidationLayers) {
     instanceCreateInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
     instanceCreateInfo.ppEnabledLayerNames = validationLayers.data();
   } else {
@@ -182,7 +210,8 @@ VkInstance CreateInstance()
   return inst;
 }
 
-VkInstance instance = CreateInstance();
+// Created in Base::Initialize(), after the asset loads have been kicked off.
+VkInstance instance = VK_NULL_HANDLE;
 
 
 VkInstance GetInstance()
@@ -273,21 +302,31 @@ const std::vector<uint32_t> indices = {
   0, 1, 2, 2, 3, 0 
 }; 
 
-#if SPHERE
-const GeometryData model = Geometry::CreateSphere(1.0f, 60, 60);
-#else
-const GeometryData model = Model::LoadModel("Happy buddha", PBR_STUDY_DIR"/dragon.obj");
-#endif
-
-const GeometryData skybox = Geometry::CreateCube();
+const char *pipelineCachePath = PBR_STUDY_DIR"/pipeline.cache";
+const char pipelineCacheMagic[8] = { 'P', 'B', 'R', 'P', 'S', 'O', '\0', '\0' };
 } // global
 
 
+// Header of the pipeline cache file. The blob vulkan hands us already starts with the 
+// vendor, device and cache UUID, but not the driver version, so we keep our own copy 
+// of all of it and check it before the driver ever sees the data.
+struct PipelineCacheHeader {
+  char      magic[8];
+  uint32_t  vendorID;
+  uint32_t  deviceID;
+  uint32_t  driverVersion;
+  uint8_t   pipelineCacheUUID[VK_UUID_SIZE];
+  uint64_t  dataSize;
+};
+
+
 // Global Uniform Buffer Object
 struct UBO {
   glm::mat4 Model;
   glm::mat4 View;
   glm::mat4 Projection;
+  // mat3 in the upper left, a mat4 keeps the std140 layout the same as on the host.
+  glm::mat4 Normal;
   glm::vec3 CamPosition;
 } ubo;
 
@@ -311,8 +350,25 @@ struct PointLightUBO {
 
 
 Base::Base()
-  : mSwapchain(VK_NULL_HANDLE)
-{
+  : mPhysicalDevice(VK_NULL_HANDLE)
+  , mSurface(VK_NULL_HANDLE)
+  , mSwapchain(VK_NULL_HANDLE)
+  , mPipelineCache(VK_NULL_HANDLE)
+  , mPipelineCacheWarm(false)
+  , mMaxDrawSlices(0)
+  , mDepthPrepass(false)
+  , mFramesInFlight(2)
+  , mFrameIndex(0)
+  , mFrameNumber(0)
+  , mWindow(nullptr)
+  , mTime(0.0)
+{
+  mHeadless.enabled = false;
+  mHeadless.frameCount = 0;
+  mBenchmark.enabled = false;
+  mBenchmark.frameCount = 0;
+  mBenchmark.sweepFramesInFlight = false;
+  mRecording.enabled = false;
   glfwInit();
 }
 
@@ -321,33 +377,37 @@ Base::~Base()
 {
   CloseWindow();
   Cleanup();
-  vkDestroySemaphore(mLogicalDevice, mSemaphores.presentation, nullptr);
-  vkDestroySemaphore(mLogicalDevice, mSemaphores.rendering, nullptr);
+  for (Frame &frame : mFrames) {
+    vkDestroySemaphore(mLogicalDevice, frame.imageAvailable, nullptr);
+    vkDestroySemaphore(mLogicalDevice, frame.renderFinished, nullptr);
+    vkDestroyFence(mLogicalDevice, frame.fence, nullptr);
+    vkFreeCommandBuffers(mLogicalDevice, mCommandPool, 1, &frame.commandBuffer);
+  }
+  // Takes the secondaries with them.
+  for (SliceRecorder &recorder : mSliceRecorders) {
+    vkDestroyCommandPool(mLogicalDevice, recorder.pool, nullptr);
+  }
   // Destroy swapchain image views
   for (size_t i = 0; i < mSwapchainImageViews.size(); ++i) {
     vkDestroyImageView(mLogicalDevice, mSwapchainImageViews[i], nullptr);
     vkDestroyFramebuffer(mLogicalDevice, mSwapchainFramebuffers[i], nullptr);
   }
+  // Headless, the "swapchain" images are ours.
+  if (mHeadless.enabled) {
+    for (size_t i = 0; i < mSwapchainImages.size(); ++i) {
+      vkDestroyImage(mLogicalDevice, mSwapchainImages[i], nullptr);
+      mAllocator.Free(mHeadless.colorMemory[i]);
+    }
+    for (Readback &readback : mHeadless.readbacks) {
+      vkDestroyBuffer(mLogicalDevice, readback.buffer, nullptr);
+      mAllocator.Free(readback.memory);
+    }
+  }
 
-  vkFreeCommandBuffers(mLogicalDevice, mCommandPool, 
-    static_cast<uint32_t>(mCommandBuffers.size()), mCommandBuffers.data());
-
-  vkFreeMemory(mLogicalDevice, mEnvMap.memory, nullptr);
-  vkFreeMemory(mLogicalDevice, mDepth.memory, nullptr);
-  vkFreeMemory(mLogicalDevice, mMaterial.memory, nullptr);
-  vkFreeMemory(mLogicalDevice, mMaterial.stagingMemory, nullptr);
-  vkFreeMemory(mLogicalDevice, mPointLight.stagingMemory, nullptr);
-  vkFreeMemory(mLogicalDevice, mPointLight.memory, nullptr);
-  vkFreeMemory(mLogicalDevice, mSkybox.memory, nullptr);
-  vkFreeMemory(mLogicalDevice, mIrradianceMap.memory, nullptr);
-  vkFreeMemory(mLogicalDevice, mSkyboxUBO.memory, nullptr);
-  vkFreeMemory(mLogicalDevice, mSkyboxUBO.stagingMemory, nullptr);
-  vkDestroyBuffer(mLogicalDevice, mMaterial.stagingBuffer, nullptr);
-  vkDestroyBuffer(mLogicalDevice, mMaterial.buffer, nullptr);
-  vkDestroyBuffer(mLogicalDevice, mPointLight.stagingBuffer, nullptr);
-  vkDestroyBuffer(mLogicalDevice, mPointLight.buffer, nullptr);
-  vkDestroyBuffer(mLogicalDevice, mSkyboxUBO.buffer, nullptr);
-  vkDestroyBuffer(mLogicalDevice, mSkyboxUBO.stagingBuffer, nullptr);
+  mAllocator.Free(mEnvMap.memory);
+  mAllocator.Free(mDepth.memory);
+  mAllocator.Free(mSkybox.memory);
+  mAllocator.Free(mIrradianceMap.memory);
   vkDestroyImage(mLogicalDevice, mEnvMap.image, nullptr);
   vkDestroyImage(mLogicalDevice, texture.image, nullptr);
   vkDestroyImage(mLogicalDevice, mDepth.image, nullptr);
@@ -362,24 +422,36 @@ Base::~Base()
   vkDestroySampler(mLogicalDevice, texture.sampler, nullptr);
   vkDestroySampler(mLogicalDevice, mSkybox.sampler, nullptr);
   vkDestroySampler(mLogicalDevice, mIrradianceMap.sampler, nullptr);
-  vkFreeMemory(mLogicalDevice, texture.memory, nullptr);
-  vkFreeMemory(mLogicalDevice, mUbo.stagingMemory, nullptr);
-  vkFreeMemory(mLogicalDevice, mUbo.memory, nullptr);
-  vkDestroyBuffer(mLogicalDevice, mUbo.buffer, nullptr);
-  vkDestroyBuffer(mLogicalDevice, mUbo.stagingBuffer, nullptr);
+  mAllocator.Free(texture.memory);
+  mAllocator.Free(mUniformRing.memory);
+  vkDestroyBuffer(mLogicalDevice, mUniformRing.buffer, nullptr);
   vkDestroyDescriptorSetLayout(mLogicalDevice, mDescriptorSetLayout, nullptr);
   vkDestroyDescriptorPool(mLogicalDevice, mDescriptorPool, nullptr);
-  vkFreeMemory(mLogicalDevice, mesh.vertexMemory, nullptr);
-  vkFreeMemory(mLogicalDevice, mesh.indicesMemory, nullptr);
+  mAllocator.Free(mesh.vertexMemory);
+  mAllocator.Free(mesh.indicesMemory);
+  mAllocator.Free(mesh.positionMemory);
   vkDestroyBuffer(mLogicalDevice, mesh.indicesBuffer, nullptr);
   vkDestroyBuffer(mLogicalDevice, mesh.vertexBuffer, nullptr);
+  vkDestroyBuffer(mLogicalDevice, mesh.positionBuffer, nullptr);
   vkDestroyCommandPool(mLogicalDevice, mCommandPool, nullptr);
+  mProfiler.Shutdown();
   vkDestroyPipeline(mLogicalDevice, mPipelines.pbr, nullptr);
+  vkDestroyPipeline(mLogicalDevice, mPipelines.pbrDepthEqual, nullptr);
+  vkDestroyPipeline(mLogicalDevice, mPipelines.depth, nullptr);
   vkDestroyPipeline(mLogicalDevice, mPipelines.skybox, nullptr);
   vkDestroyRenderPass(mLogicalDevice, mDefaultRenderPass, nullptr);
   vkDestroyPipelineLayout(mLogicalDevice, mPipelineLayout, nullptr);
-  vkDestroySwapchainKHR(mLogicalDevice, mSwapchain, nullptr);
-  vkDestroySurfaceKHR(global::GetInstance(), mSurface, nullptr);
+  SavePipelineCache();
+  vkDestroyPipelineCache(mLogicalDevice, mPipelineCache, nullptr);
+  // Neither extension is enabled in headless mode.
+  if (mSwapchain != VK_NULL_HANDLE) {
+    vkDestroySwapchainKHR(mLogicalDevice, mSwapchain, nullptr);
+  }
+  if (mSurface != VK_NULL_HANDLE) {
+    vkDestroySurfaceKHR(global::GetInstance(), mSurface, nullptr);
+  }
+  mUploader.Shutdown();
+  mAllocator.Shutdown();
   vkDestroyDevice(mLogicalDevice, nullptr);
   DestroyDebugReportCallbackEXT(global::GetInstance(), mCallback, nullptr);
   vkDestroyInstance(global::GetInstance(), nullptr);
@@ -394,6 +466,27 @@ void Base::OnWindowResized(global::Window window, int width, int height)
 }
 
 
+const uint32_t Base::kMaxFramesInFlight;
+
+
+void Base::SetFramesInFlight(uint32_t count)
+{
+  mFramesInFlight = (std::max)(1u, (std::min)(count, kMaxFramesInFlight));
+}
+
+
+void Base::SetupFramesInFlightSweep()
+{
+  mBenchmark.sweepFramesInFlight = true;
+}
+
+
+uint32_t Base::GetFrameSlotCount() const
+{
+  return mBenchmark.sweepFramesInFlight ? kMaxFramesInFlight : mFramesInFlight;
+}
+
+
 void Base::SetupWindow(uint32_t width, uint32_t height)
 {
   glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
@@ -413,6 +506,44 @@ void Base::SetupWindow(uint32_t width, uint32_t height)
 }
 
 
+void Base::SetupHeadless(uint32_t width, uint32_t height, uint32_t frameCount,
+  const std::string &outputDir)
+{
+  mHeadless.enabled = true;
+  mHeadless.frameCount = frameCount;
+  mHeadless.outputDir = outputDir;
+  windowWidth = width;
+  windowHeight = height;
+  pauseOnValidation = false;
+}
+
+
+const double Base::kBenchmarkTimestep = 1.0 / 60.0;
+const uint32_t Base::kWarmupFrames = 16;
+
+
+void Base::SetupBenchmark(uint32_t frameCount, const std::string &scriptPath,
+  const std::string &jsonPath)
+{
+  mBenchmark.enabled = true;
+  mBenchmark.frameCount = frameCount;
+  mBenchmark.jsonPath = jsonPath;
+  if (scriptPath.empty() || !mBenchmark.script.Load(scriptPath.c_str())) {
+    if (!scriptPath.empty()) {
+      std::printf("Falling back to the built-in orbit.\n");
+    }
+    mBenchmark.script = CameraScript::CreateOrbit(4.0f, 2.0f, frameCount * kBenchmarkTimestep);
+  }
+}
+
+
+void Base::SetupRecording(const std::string &scriptPath)
+{
+  mRecording.enabled = true;
+  mRecording.scriptPath = scriptPath;
+}
+
+
 Base::SwapChainSupportDetails Base::QuerySwapChainSupport(VkPhysicalDevice device)
 {
   SwapChainSupportDetails details;
@@ -480,6 +611,10 @@ bool Base::IsDeviceSuitable(VkPhysicalDevice device)
   vkGetPhysicalDeviceProperties(device, &deviceProperties);
   VkPhysicalDeviceFeatures deviceFeatures;
   vkGetPhysicalDeviceFeatures(device, &deviceFeatures);
+  if (mHeadless.enabled) {
+    // Nothing to present to, so anything that can draw will do, software rasterizers included.
+    return FindQueueFamilies(device).graphicsFamily >= 0;
+  }
 
   bool extensionsSupported = CheckDeviceExensionSupport(device);
   bool swapChainAdequate = false;
@@ -496,6 +631,7 @@ bool Base::IsDeviceSuitable(VkPhysicalDevice device)
 
 void Base::FindPhyiscalDevice()
 {
+  PBR_TRACE_FUNCTION();
   uint32_t count = 0;
   vkEnumeratePhysicalDevices(global::GetInstance(),
     &count, nullptr);
@@ -510,6 +646,11 @@ void Base::FindPhyiscalDevice()
     }
   }
   BASE_ASSERT(mPhysicalDevice != VK_NULL_HANDLE && "Base member m_phyDev is still NULL!!"); 
+  if (mHeadless.enabled) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
+    std::printf("Rendering headless on %s\n", properties.deviceName);
+  }
 }
 
 
@@ -578,9 +719,15 @@ Base::QueueFamilyIndices Base::FindQueueFamilies(VkPhysicalDevice device)
   uint32_t i = 0;
   for (const auto &queueFamily : queueFamilies) {
     VkBool32 presentSupport = false;
-    vkGetPhysicalDeviceSurfaceSupportKHR(device, i, mSurface, &presentSupport);
+    if (!mHeadless.enabled) {
+      vkGetPhysicalDeviceSurfaceSupportKHR(device, i, mSurface, &presentSupport);
+    }
     if (queueFamily.queueCount > 0 && queueFamily.queueFlags  & VK_QUEUE_GRAPHICS_BIT) {
       indices.graphicsFamily = i;
+      // Headless never presents, let the graphics queue stand in.
+      if (mHeadless.enabled) {
+        indices.presentFamily = i;
+      }
     }
     if (queueFamily.queueCount > 0 && presentSupport) {
       indices.presentFamily = i;
@@ -591,16 +738,34 @@ Base::QueueFamilyIndices Base::FindQueueFamilies(VkPhysicalDevice device)
     ++i;
   }
 
+  // A family that can only transfer is usually the copy engine, which can stream 
+  // uploads while the graphics queue is busy. Only take it if it copies whole texels,
+  // so that image uploads need no special casing.
+  for (uint32_t family = 0; family < queueFamilyCount; ++family) {
+    const VkQueueFamilyProperties &props = queueFamilies[family];
+    VkExtent3D granularity = props.minImageTransferGranularity;
+    if (props.queueCount > 0 && (props.queueFlags & VK_QUEUE_TRANSFER_BIT) &&
+        !(props.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) &&
+        granularity.width <= 1 && granularity.height <= 1 && granularity.depth <= 1) {
+      indices.transferFamily = family;
+      break;
+    }
+  }
+
   return indices;
 }
 
 
 void Base::CreateLogicalDevice()
 {
+  PBR_TRACE_FUNCTION();
   QueueFamilyIndices indices = FindQueueFamilies(mPhysicalDevice);
   float queuePriority = 1.0f;
   std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
   std::set<int32_t> uniqueQueueFamilies = { indices.graphicsFamily, indices.presentFamily };
+  if (indices.transferFamily >= 0) {
+    uniqueQueueFamilies.insert(indices.transferFamily);
+  }
   for(int32_t queueFamily : uniqueQueueFamilies) {
     VkDeviceQueueCreateInfo queueCreateInfo = { };
     queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
@@ -610,15 +775,22 @@ void Base::CreateLogicalDevice()
     queueCreateInfos.push_back(queueCreateInfo);
   }
   
+  VkPhysicalDeviceFeatures supportedFeatures;
+  vkGetPhysicalDeviceFeatures(mPhysicalDevice, &supportedFeatures);
   VkPhysicalDeviceFeatures phyDevFeatures = { };
+  // Only used by the profiler, which does without when it's missing.
+  phyDevFeatures.pipelineStatisticsQuery = supportedFeatures.pipelineStatisticsQuery;
   VkDeviceCreateInfo deviceCreateInfo = { };
   deviceCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
   deviceCreateInfo.queueCreateInfoCount = (uint32_t )queueCreateInfos.size();
   deviceCreateInfo.pQueueCreateInfos = queueCreateInfos.data();
   deviceCreateInfo.pEnabledFeatures = &phyDevFeatures;
-  deviceCreateInfo.enabledExtensionCount = static_cast<uint32_t>(global::deviceExensions.size());
-  deviceCreateInfo.ppEnabledExtensionNames = global::deviceExensions.data();
-  if (global::enableValidationLayers) {
+  // No swapchain headless.
+  if (!mHeadless.enabled) {
+    deviceCreateInfo.enabledExtensionCount = static_cast<uint32_t>(global::deviceExensions.size());
+    deviceCreateInfo.ppEnabledExtensionNames = global::deviceExensions.data();
+  }
+  if (global::useValidationLayers) {
     deviceCreateInfo.enabledLayerCount = static_cast<uint32_t>(global::validationLayers.size());
     deviceCreateInfo.ppEnabledLayerNames = global::validationLayers.data();
   }
@@ -628,11 +800,21 @@ void Base::CreateLogicalDevice()
   // Get the device queue.
   vkGetDeviceQueue(mLogicalDevice, indices.graphicsFamily, 0, &mQueues.rendering);
   vkGetDeviceQueue(mLogicalDevice, indices.presentFamily, 0, &mQueues.presentation);
+  mQueues.transfer = mQueues.rendering;
+  if (indices.transferFamily >= 0) {
+    vkGetDeviceQueue(mLogicalDevice, indices.transferFamily, 0, &mQueues.transfer);
+  }
+
+  mAllocator.Initialize(mPhysicalDevice, mLogicalDevice);
+  mUploader.Initialize(mLogicalDevice, &mAllocator, indices.graphicsFamily, mQueues.rendering,
+    indices.transferFamily, mQueues.transfer);
+  CreatePipelineCache();
 }
 
 
 void Base::CreateSurface()
 {
+  PBR_TRACE_FUNCTION();
   VkResult result = glfwCreateWindowSurface(global::GetInstance(),
     mWindow, nullptr, &mSurface);
   BASE_ASSERT(result == VK_SUCCESS && "Failed to Create a KHR surface!");
@@ -641,6 +823,7 @@ void Base::CreateSurface()
 
 void Base::CreateSwapChain()
 {
+  PBR_TRACE_FUNCTION();
   SwapChainSupportDetails swapChainSupport = QuerySwapChainSupport(mPhysicalDevice);
   VkSurfaceFormatKHR surfaceFormat = ChooseSwapSurfaceFormat(swapChainSupport.formats);
   VkPresentModeKHR presentMode = ChooseSwapPresentMode(swapChainSupport.presentModes);
@@ -701,6 +884,7 @@ void Base::CreateSwapChain()
 
 void Base::CreateImageViews()
 {
+  PBR_TRACE_FUNCTION();
   mSwapchainImageViews.resize(mSwapchainImages.size());
   for (uint32_t i = 0; i < mSwapchainImages.size(); ++i) {
     CreateImageView(mSwapchainImages[i], mSwapchainFormat, VK_IMAGE_ASPECT_COLOR_BIT, mSwapchainImageViews[i]);
@@ -708,38 +892,43 @@ void Base::CreateImageViews()
 }
 
 
-void Base::CreateCubemap(gli::texture_cube &cubeMap, Cubemap &cubemap)
+void Base::CreateOffscreenTargets()
 {
-  VkBuffer stagingBuffer;
-  VkDeviceMemory stagingMemory;
+  PBR_TRACE_FUNCTION();
+  // RGBA, so readback rows go straight into the png writer.
+  mSwapchainFormat = VK_FORMAT_R8G8B8A8_UNORM;
+  mSwapchainExtent = { windowWidth, windowHeight };
+  uint32_t slotCount = GetFrameSlotCount();
+  mSwapchainImages.resize(slotCount);
+  mSwapchainImageViews.resize(slotCount);
+  mHeadless.colorMemory.resize(slotCount);
+  mHeadless.readbacks.resize(slotCount);
 
-  VkBufferCreateInfo createInfo = { };
-  createInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-  createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  createInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-  createInfo.size = cubeMap.size();
-  VkResult result = vkCreateBuffer(mLogicalDevice, &createInfo, nullptr, &stagingBuffer);
-  BASE_ASSERT(result == VK_SUCCESS && "Failed to create staging buffer");
-  
-  VkMemoryRequirements memReqs = { };
-  vkGetBufferMemoryRequirements(mLogicalDevice, stagingBuffer, &memReqs);
-  
-  VkMemoryAllocateInfo allocInfo = { };
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.memoryTypeIndex = FindMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
-    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-  allocInfo.allocationSize = memReqs.size;
-  
-  result = vkAllocateMemory(mLogicalDevice, &allocInfo, nullptr, &stagingMemory);
-  BASE_ASSERT(result == VK_SUCCESS && "Failed to allocate staging buffer memory!");
+  // Prefer cached memory, the CPU reads every byte of it back.
+  VkMemoryPropertyFlags readbackProperties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | 
+    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+  if (FindMemoryType(UINT32_MAX, readbackProperties) == UINT32_MAX) {
+    readbackProperties &= ~VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+  }
+  VkDeviceSize readbackSize = (VkDeviceSize )windowWidth * windowHeight * 4;
+  for (uint32_t i = 0; i < slotCount; ++i) {
+    CreateImage(windowWidth, windowHeight, mSwapchainFormat, VK_IMAGE_TILING_OPTIMAL, 
+      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, 
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mSwapchainImages[i], mHeadless.colorMemory[i]);
+    CreateImageView(mSwapchainImages[i], mSwapchainFormat, VK_IMAGE_ASPECT_COLOR_BIT, 
+      mSwapchainImageViews[i]);
+
+    Readback &readback = mHeadless.readbacks[i];
+    CreateBuffer(readbackSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, readbackProperties,
+      readback.buffer, readback.memory);
+    readback.frameNumber = -1;
+  }
+}
 
-  vkBindBufferMemory(mLogicalDevice, stagingBuffer, stagingMemory, 0);
-  
-  void *data;
-  vkMapMemory(mLogicalDevice, stagingMemory, 0, memReqs.size, 0, &data);
-    memcpy(data, cubeMap.data(), (size_t )cubeMap.size());
-  vkUnmapMemory(mLogicalDevice, stagingMemory);
 
+void Base::CreateCubemap(gli::texture_cube &cubeMap, Cubemap &cubemap)
+{
+  PBR_TRACE_FUNCTION();
   std::vector<VkBufferImageCopy> bufferCopyRegions;
   size_t offset = 0;
   for (uint32_t face = 0; face < 6; ++face) {
@@ -777,57 +966,27 @@ void Base::CreateCubemap(gli::texture_cube &cubeMap, Cubemap &cubemap)
   imageInfo.extent = { width, height, 1 };
   imageInfo.arrayLayers = 6;
   
-  result = vkCreateImage(mLogicalDevice, &imageInfo, nullptr, &cubemap.image);
+  VkResult result = vkCreateImage(mLogicalDevice, &imageInfo, nullptr, &cubemap.image);
   BASE_ASSERT(result == VK_SUCCESS && "Failed to create Enviroment map image!");
 
+  VkMemoryRequirements memReqs = { };
   vkGetImageMemoryRequirements(mLogicalDevice, cubemap.image, &memReqs);
-  allocInfo.allocationSize = memReqs.size;
-  allocInfo.memoryTypeIndex = FindMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  bool allocated = mAllocator.Allocate(memReqs, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 
+    DeviceAllocator::rkOptimal, cubemap.memory);
+  BASE_ASSERT(allocated && "Failed to allocate Enviroment map memory!");
+  vkBindImageMemory(mLogicalDevice, cubemap.image, cubemap.memory.memory, cubemap.memory.offset);
   
-  result = vkAllocateMemory(mLogicalDevice, &allocInfo, nullptr, &cubemap.memory);
-  BASE_ASSERT(result == VK_SUCCESS && "Failed to allocate Enviroment map memory!");
-  vkBindImageMemory(mLogicalDevice, cubemap.image, cubemap.memory, 0);
-  
-  // One time commandbuffer setting.
-  VkCommandBuffer commandbuffer = BeginSingleTimeCommands();
   VkImageSubresourceRange subresourceRange = { };
   subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
   subresourceRange.baseMipLevel = 0;
   subresourceRange.layerCount = 6;
   subresourceRange.levelCount = cubeMap.levels();
   
-  VkImageMemoryBarrier barrier = { };
-  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-  barrier.srcAccessMask = 0;
-  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.subresourceRange = subresourceRange;
-  barrier.image = cubemap.image;
-  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-  vkCmdPipelineBarrier(commandbuffer, 
-    VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-    0, 0, VK_NULL_HANDLE, 0, VK_NULL_HANDLE, 1, &barrier);
-  
-  vkCmdCopyBufferToImage(commandbuffer, stagingBuffer, cubemap.image, 
-    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, bufferCopyRegions.size(), bufferCopyRegions.data());
-
-  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-  barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-  vkCmdPipelineBarrier(commandbuffer,
-    VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-    0, 0, VK_NULL_HANDLE, 0, VK_NULL_HANDLE, 1, &barrier);
-
-  // end and flush the commandbuffer.
-  EndSingleTimeCommands(commandbuffer);
-  
-  vkFreeMemory(mLogicalDevice, stagingMemory, nullptr);
-  vkDestroyBuffer(mLogicalDevice, stagingBuffer, nullptr);
+  // Goes out with the rest of the uploads at the end of Initialize().
+  mUploader.UploadImage(cubemap.image, subresourceRange, cubeMap.data(), cubeMap.size(),
+    bufferCopyRegions.data(), static_cast<uint32_t>(bufferCopyRegions.size()), 
+    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 
+    VK_ACCESS_SHADER_READ_BIT);
 
   VkSamplerCreateInfo samplerInfo = { };
   samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
@@ -867,26 +1026,31 @@ void Base::CreateCubemap(gli::texture_cube &cubeMap, Cubemap &cubemap)
 
 void Base::CreateCubemaps()
 {
-  gli::texture_cube cubeMap(gli::load(PBR_STUDY_DIR"/maps/subway_skybox.ktx"));
-  gli::texture_cube irradianceMap(gli::load(PBR_STUDY_DIR"/maps/subway_irradiance.ktx"));
-  gli::texture_cube skyBox(gli::load(PBR_STUDY_DIR"/maps/subway_skybox.ktx"));
+  PBR_TRACE_FUNCTION();
+  // The skybox and the environment map come from the same file, it is only loaded once.
+  gli::texture_cube cubeMap = Assets::GetEnvMap();
+  gli::texture_cube irradianceMap = Assets::GetIrradianceMap();
 
   CreateCubemap(cubeMap, mEnvMap);
   CreateCubemap(irradianceMap, mIrradianceMap);
-  CreateCubemap(skyBox, mSkybox);
+  CreateCubemap(cubeMap, mSkybox);
 }
 
 
 void Base::CreateGraphicsPipeline()
 {
-  VkShaderModule vert = ShaderModule::GenerateShaderModule(mLogicalDevice, 
-    ShaderModule::ssVertShader, PBR_STUDY_DIR"/shaders/test.vert");
-  VkShaderModule frag = ShaderModule::GenerateShaderModule(mLogicalDevice,
-    ShaderModule::ssFragShader, PBR_STUDY_DIR"/shaders/test.frag");
-  VkShaderModule skyVert = ShaderModule::GenerateShaderModule(mLogicalDevice,
-    ShaderModule::ssVertShader, PBR_STUDY_DIR"/shaders/skybox.vert");
-  VkShaderModule skyFrag = ShaderModule::GenerateShaderModule(mLogicalDevice,
-    ShaderModule::ssFragShader, PBR_STUDY_DIR"/shaders/skybox.frag");
+  PBR_TRACE_FUNCTION();
+  // SPIR-V is compiled in the background by Assets, this only waits if it isn't done yet.
+  VkShaderModule vert = ShaderModule::CreateShaderModule(mLogicalDevice, 
+    Assets::GetShader(Assets::siPbrVert));
+  VkShaderModule frag = ShaderModule::CreateShaderModule(mLogicalDevice,
+    Assets::GetShader(Assets::siPbrFrag));
+  VkShaderModule skyVert = ShaderModule::CreateShaderModule(mLogicalDevice,
+    Assets::GetShader(Assets::siSkyboxVert));
+  VkShaderModule skyFrag = ShaderModule::CreateShaderModule(mLogicalDevice,
+    Assets::GetShader(Assets::siSkyboxFrag));
+  VkShaderModule depthVert = ShaderModule::CreateShaderModule(mLogicalDevice,
+    Assets::GetShader(Assets::siDepthVert));
 
   VkPipelineShaderStageCreateInfo vertShaderStageInfo = { };
   vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -923,25 +1087,14 @@ void Base::CreateGraphicsPipeline()
   tesseCreateInfo.pNext = nullptr;
   tesseCreateInfo.flags = 0;
 
-  VkViewport viewport = { };
-  viewport.x = viewport.y = 0.0f;
-  viewport.width = static_cast<float>(mSwapchainExtent.width);
-  viewport.height = static_cast<float>(mSwapchainExtent.height);
-  viewport.minDepth = 0.0f;
-  viewport.maxDepth = 1.0f;  
-  
-  VkRect2D scissor = { };
-  scissor.offset.x = scissor.offset.y = 0;
-  scissor.extent = mSwapchainExtent;
-
-  // This can be a dynamic state as well, but we don't need to manually
-  // define the viewport state unless we are doing other things besides pbr.
+  // Viewport and scissor are dynamic, they are set when recording the commandbuffers.
+  // That way the pipelines don't depend on the swapchain extent, and survive a resize.
   VkPipelineViewportStateCreateInfo viewportStateCreateInfo = { };
   viewportStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;  
-  viewportStateCreateInfo.pViewports = &viewport;
+  viewportStateCreateInfo.pViewports = nullptr;
   viewportStateCreateInfo.viewportCount = 1;
   viewportStateCreateInfo.scissorCount = 1;
-  viewportStateCreateInfo.pScissors = &scissor; 
+  viewportStateCreateInfo.pScissors = nullptr; 
  
   VkPipelineRasterizationStateCreateInfo rasterStateCreateInfo = { };
   rasterStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
@@ -1003,7 +1156,7 @@ void Base::CreateGraphicsPipeline()
 
   VkDynamicState dynamicStates[] = {
     VK_DYNAMIC_STATE_VIEWPORT,
-    VK_DYNAMIC_STATE_LINE_WIDTH
+    VK_DYNAMIC_STATE_SCISSOR
   };
 
   VkPipelineDynamicStateCreateInfo dynamicStateCreateInfo = { };
@@ -1034,7 +1187,7 @@ void Base::CreateGraphicsPipeline()
   gPipelineCreateInfo.pMultisampleState = &multisampleCreateInfo;
   gPipelineCreateInfo.pDepthStencilState = &depthStencilCreateInfo;
   gPipelineCreateInfo.pColorBlendState = &colorBlendStateCreateInfo;
-  gPipelineCreateInfo.pDynamicState = nullptr;
+  gPipelineCreateInfo.pDynamicState = &dynamicStateCreateInfo;
   gPipelineCreateInfo.layout = mPipelineLayout;
   gPipelineCreateInfo.renderPass = mDefaultRenderPass;
   // For deriving from a base pipeline (parent). This is a single pipeline, so
@@ -1044,31 +1197,179 @@ void Base::CreateGraphicsPipeline()
   gPipelineCreateInfo.basePipelineIndex = -1;
   
 
-  result = vkCreateGraphicsPipelines(mLogicalDevice, VK_NULL_HANDLE, 1, 
+  auto pipelineStart = std::chrono::high_resolution_clock::now();
+  result = vkCreateGraphicsPipelines(mLogicalDevice, mPipelineCache, 1, 
     &gPipelineCreateInfo, nullptr, &mPipelines.pbr);
   BASE_ASSERT(result == VK_SUCCESS && "Failed to create PBR graphics pipeline!");
 
+  // Same shading, for after the depth prepass. Depth is already final, so only the
+  // fragments that match it get shaded.
+  gPipelineCreateInfo.flags = VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+  gPipelineCreateInfo.basePipelineHandle = mPipelines.pbr;
+  depthStencilCreateInfo.depthWriteEnable = VK_FALSE;
+  depthStencilCreateInfo.depthCompareOp = VK_COMPARE_OP_EQUAL;
+  result = vkCreateGraphicsPipelines(mLogicalDevice, mPipelineCache, 1, 
+    &gPipelineCreateInfo, nullptr, &mPipelines.pbrDepthEqual);
+  BASE_ASSERT(result == VK_SUCCESS && "Failed to create PBR depth equal pipeline!");
+
+  // Depth prepass, vertex shader only, reading the position stream.
+  VkVertexInputBindingDescription positionBinding = { };
+  positionBinding.binding = 0;
+  positionBinding.stride = sizeof(glm::vec3);
+  positionBinding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+  VkVertexInputAttributeDescription positionAttribute = attribute_descriptions[0];
+  VkPipelineVertexInputStateCreateInfo depthVertexInputStateInfo = vertexInputStateinfo;
+  depthVertexInputStateInfo.pVertexBindingDescriptions = &positionBinding;
+  depthVertexInputStateInfo.pVertexAttributeDescriptions = &positionAttribute;
+  depthVertexInputStateInfo.vertexAttributeDescriptionCount = 1;
+  VkPipelineColorBlendAttachmentState depthBlendAttachment = colorBlendAttachment;
+  depthBlendAttachment.colorWriteMask = 0;
+  VkPipelineColorBlendStateCreateInfo depthBlendStateCreateInfo = colorBlendStateCreateInfo;
+  depthBlendStateCreateInfo.pAttachments = &depthBlendAttachment;
+  VkPipelineDepthStencilStateCreateInfo depthOnlyStencilCreateInfo = depthStencilCreateInfo;
+  depthOnlyStencilCreateInfo.depthWriteEnable = VK_TRUE;
+  depthOnlyStencilCreateInfo.depthCompareOp = VK_COMPARE_OP_LESS;
+  VkPipelineShaderStageCreateInfo depthStageInfo = vertShaderStageInfo;
+  depthStageInfo.module = depthVert;
+  VkGraphicsPipelineCreateInfo depthPipelineCreateInfo = gPipelineCreateInfo;
+  depthPipelineCreateInfo.stageCount = 1;
+  depthPipelineCreateInfo.pStages = &depthStageInfo;
+  depthPipelineCreateInfo.pVertexInputState = &depthVertexInputStateInfo;
+  depthPipelineCreateInfo.pColorBlendState = &depthBlendStateCreateInfo;
+  depthPipelineCreateInfo.pDepthStencilState = &depthOnlyStencilCreateInfo;
+  result = vkCreateGraphicsPipelines(mLogicalDevice, mPipelineCache, 1, 
+    &depthPipelineCreateInfo, nullptr, &mPipelines.depth);
+  BASE_ASSERT(result == VK_SUCCESS && "Failed to create depth prepass pipeline!");
+
+  vkDestroyShaderModule(mLogicalDevice, depthVert, nullptr);
   vkDestroyShaderModule(mLogicalDevice, vert, nullptr);
   vkDestroyShaderModule(mLogicalDevice, frag, nullptr);
 
-  rasterStateCreateInfo.cullMode = VK_CULL_MODE_BACK_BIT;
+  // The sky is a fullscreen triangle made up in the vertex shader, drawn after the opaque
+  // geometry. It sits on the far plane, and only passes where the depth is still cleared,
+  // so every pixel is shaded by either the PBR pass or the sky, never both.
+  VkPipelineVertexInputStateCreateInfo skyVertexInputStateInfo = { };
+  skyVertexInputStateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+  rasterStateCreateInfo.cullMode = VK_CULL_MODE_NONE;
   rasterStateCreateInfo.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+  depthStencilCreateInfo.depthWriteEnable = VK_FALSE;
+  depthStencilCreateInfo.depthCompareOp = VK_COMPARE_OP_EQUAL;
+  gPipelineCreateInfo.pVertexInputState = &skyVertexInputStateInfo;
   shaderInfos[0].module = skyVert;
   shaderInfos[1].module = skyFrag;
   gPipelineCreateInfo.flags = VK_PIPELINE_CREATE_DERIVATIVE_BIT;
   gPipelineCreateInfo.basePipelineHandle = mPipelines.pbr;
   
-  result = vkCreateGraphicsPipelines(mLogicalDevice, VK_NULL_HANDLE, 1,
+  result = vkCreateGraphicsPipelines(mLogicalDevice, mPipelineCache, 1,
     &gPipelineCreateInfo, nullptr, &mPipelines.skybox);
   BASE_ASSERT(result == VK_SUCCESS && "Failed to create skybox pipeline!");
+  auto pipelineEnd = std::chrono::high_resolution_clock::now();
+  std::printf("Graphics pipelines created in %.3f ms (%s pipeline cache)\n",
+    std::chrono::duration<double, std::milli>(pipelineEnd - pipelineStart).count(),
+    mPipelineCacheWarm ? "warm" : "cold");
+  // Whatever happens next (a resize), the cache holds these now.
+  mPipelineCacheWarm = true;
 
   vkDestroyShaderModule(mLogicalDevice, skyVert, nullptr);
   vkDestroyShaderModule(mLogicalDevice, skyFrag, nullptr);  
 }
 
 
+void Base::CreatePipelineCache()
+{
+  PBR_TRACE_FUNCTION();
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
+
+  std::vector<char> initialData;
+  std::ifstream file(global::pipelineCachePath, std::ios::binary | std::ios::ate);
+  uint64_t fileSize = file.is_open() ? static_cast<uint64_t>(file.tellg()) : 0;
+  file.seekg(0);
+  PipelineCacheHeader header;
+  if (file.is_open() && file.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+    bool valid = std::memcmp(header.magic, global::pipelineCacheMagic, 
+        sizeof(global::pipelineCacheMagic)) == 0 &&
+      header.vendorID == properties.vendorID &&
+      header.deviceID == properties.deviceID &&
+      header.driverVersion == properties.driverVersion &&
+      std::memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+    // The header doesn't get to decide how much we allocate, the file has to back it.
+    bool complete = header.dataSize > 0 && header.dataSize == fileSize - sizeof(header);
+    if (valid && !complete) {
+      std::printf("Pipeline cache is truncated or corrupt, starting cold.\n");
+    } else if (valid) {
+      initialData.resize(static_cast<size_t>(header.dataSize));
+      if (!file.read(initialData.data(), initialData.size())) {
+        initialData.clear();
+      }
+    } else {
+      std::printf("Pipeline cache was written by another device or driver, starting cold.\n");
+    }
+  }
+
+  VkPipelineCacheCreateInfo cacheCreateInfo = { };
+  cacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  cacheCreateInfo.initialDataSize = initialData.size();
+  cacheCreateInfo.pInitialData = initialData.empty() ? nullptr : initialData.data();
+  VkResult result = vkCreatePipelineCache(mLogicalDevice, &cacheCreateInfo, nullptr, &mPipelineCache);
+  if (result != VK_SUCCESS && !initialData.empty()) {
+    // Driver didn't like the data after all, just start with an empty one.
+    cacheCreateInfo.initialDataSize = 0;
+    cacheCreateInfo.pInitialData = nullptr;
+    initialData.clear();
+    result = vkCreatePipelineCache(mLogicalDevice, &cacheCreateInfo, nullptr, &mPipelineCache);
+  }
+  BASE_ASSERT(result == VK_SUCCESS && "Failed to create pipeline cache!");
+  mPipelineCacheWarm = !initialData.empty();
+}
+
+
+void Base::SavePipelineCache()
+{
+  PBR_TRACE_FUNCTION();
+  if (mPipelineCache == VK_NULL_HANDLE) return;
+  size_t dataSize = 0;
+  VkResult result = vkGetPipelineCacheData(mLogicalDevice, mPipelineCache, &dataSize, nullptr);
+  if (result != VK_SUCCESS || dataSize == 0) return;
+  std::vector<char> data(dataSize);
+  result = vkGetPipelineCacheData(mLogicalDevice, mPipelineCache, &dataSize, data.data());
+  if (result != VK_SUCCESS) return;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
+  PipelineCacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, global::pipelineCacheMagic, sizeof(global::pipelineCacheMagic));
+  header.vendorID = properties.vendorID;
+  header.deviceID = properties.deviceID;
+  header.driverVersion = properties.driverVersion;
+  std::memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+  header.dataSize = dataSize;
+
+  // Same as the mesh and spirv caches, never leave a torn file behind.
+  std::string tempPath = std::string(global::pipelineCachePath) + ".tmp";
+  {
+    std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+      std::printf("Failed to write pipeline cache %s\n", global::pipelineCachePath);
+      return;
+    }
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(data.data(), dataSize);
+    if (!file.good()) {
+      file.close();
+      std::remove(tempPath.c_str());
+      return;
+    }
+  }
+  std::remove(global::pipelineCachePath);
+  std::rename(tempPath.c_str(), global::pipelineCachePath);
+}
+
+
 void Base::CreateRenderPasses()
 {
+  PBR_TRACE_FUNCTION();
   // NOTE():
   // These are the actual attachments to be bound to 
   // the renderpass.
@@ -1087,7 +1388,9 @@ void Base::CreateRenderPasses()
   colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
   colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  // Headless, the image is copied into a readback buffer right after the renderpass.
+  colorAttachment.finalLayout = mHeadless.enabled ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : 
+    VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
   VkAttachmentDescription depthAttachment = { };
   depthAttachment.format = FindDepthFormat();
@@ -1129,8 +1432,17 @@ void Base::CreateRenderPasses()
   subpassDependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
   subpassDependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | 
     VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-  
 
+  // Make the color writes, and the transition to TRANSFER_SRC, visible to the readback copy.
+  VkSubpassDependency readbackDependency = { };
+  readbackDependency.srcSubpass = 0;
+  readbackDependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+  readbackDependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  readbackDependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  readbackDependency.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+  readbackDependency.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+  std::array<VkSubpassDependency, 2> dependencies = { subpassDependency, readbackDependency };
   std::array<VkAttachmentDescription, 2> attachments = { colorAttachment, depthAttachment };
   VkRenderPassCreateInfo renderpassCreateInfo = { };
   renderpassCreateInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
@@ -1138,8 +1450,8 @@ void Base::CreateRenderPasses()
   renderpassCreateInfo.pAttachments = attachments.data();
   renderpassCreateInfo.subpassCount = 1;
   renderpassCreateInfo.pSubpasses = &subpass;
-  renderpassCreateInfo.dependencyCount = 1;
-  renderpassCreateInfo.pDependencies = &subpassDependency;
+  renderpassCreateInfo.dependencyCount = mHeadless.enabled ? 2 : 1;
+  renderpassCreateInfo.pDependencies = dependencies.data();
   
   VkResult result = vkCreateRenderPass(mLogicalDevice, &renderpassCreateInfo,
     nullptr, &mDefaultRenderPass);
@@ -1149,6 +1461,7 @@ void Base::CreateRenderPasses()
 
 void Base::CreateFramebuffers()
 {
+  PBR_TRACE_FUNCTION();
   mSwapchainFramebuffers.resize(mSwapchainImageViews.size());
   for (size_t i = 0; i < mSwapchainImageViews.size(); ++i) {
     std::array<VkImageView, 2> attachments = {
@@ -1172,11 +1485,13 @@ void Base::CreateFramebuffers()
 
 void Base::CreateCommandPool()
 {
+  PBR_TRACE_FUNCTION();
   QueueFamilyIndices indices = FindQueueFamilies(mPhysicalDevice);
   VkCommandPoolCreateInfo commandPoolCreateInfo = { };
   commandPoolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
   commandPoolCreateInfo.queueFamilyIndex = indices.graphicsFamily;
-  commandPoolCreateInfo.flags = 0;
+  // Frame commandbuffers are reset and re-recorded every time their frame comes around.
+  commandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
   VkResult result = vkCreateCommandPool(mLogicalDevice, &commandPoolCreateInfo, nullptr, &mCommandPool);
   BASE_ASSERT(result == VK_SUCCESS && "Failed to create a command pool!");
 }
@@ -1184,93 +1499,364 @@ void Base::CreateCommandPool()
 
 void Base::CreateCommandBuffers()
 {
-  mCommandBuffers.resize(mSwapchainFramebuffers.size());
+  PBR_TRACE_FUNCTION();
+  std::vector<VkCommandBuffer> commandBuffers(mFrames.size());
+  VkCommandBufferAllocateInfo cmdAllocInfo = { };
+  cmdAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmdAllocInfo.commandPool = mCommandPool;
+  cmdAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmdAllocInfo.commandBufferCount = static_cast<uint32_t>(commandBuffers.size());
+  VkResult result = vkAllocateCommandBuffers(mLogicalDevice, &cmdAllocInfo, commandBuffers.data());
+  BASE_ASSERT(result == VK_SUCCESS && "Failed to allocated commandbuffers!");
+  for (size_t i = 0; i < mFrames.size(); ++i) {
+    mFrames[i].commandBuffer = commandBuffers[i];
+  }
 
-  {
+  // A slice per pool worker, plus the recording thread, to begin with. More get added
+  // once a draw list is cut into more slices than that.
+  mMaxDrawSlices = 0;
+  ReserveDrawSlices(ThreadPool::Global().GetThreadCount() + 1);
+}
+
+
+void Base::ReserveDrawSlices(uint32_t sliceCount)
+{
+  if (sliceCount <= mMaxDrawSlices) return;
+  QueueFamilyIndices indices = FindQueueFamilies(mPhysicalDevice);
+  // Slice major, so growing leaves the recorders of the slices before alone.
+  size_t first = mSliceRecorders.size();
+  mSliceRecorders.resize(sliceCount * mFrames.size());
+  for (size_t i = first; i < mSliceRecorders.size(); ++i) {
+    SliceRecorder &recorder = mSliceRecorders[i];
+    VkCommandPoolCreateInfo poolInfo = { };
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = indices.graphicsFamily;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    VkResult result = vkCreateCommandPool(mLogicalDevice, &poolInfo, nullptr, &recorder.pool);
+    BASE_ASSERT(result == VK_SUCCESS && "Failed to create a secondary command pool!");
     VkCommandBufferAllocateInfo cmdAllocInfo = { };
     cmdAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    cmdAllocInfo.commandPool = mCommandPool;
-    cmdAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    cmdAllocInfo.commandBufferCount = static_cast<uint32_t>(mCommandBuffers.size());
-    VkResult result = vkAllocateCommandBuffers(mLogicalDevice, &cmdAllocInfo, mCommandBuffers.data());
-    BASE_ASSERT(result == VK_SUCCESS && "Failed to allocated commandbuffers!");
-  }
-
-  for (size_t i = 0; i < mCommandBuffers.size(); ++i) {
-    VkCommandBufferBeginInfo cmdBeginInfo = { };
-    cmdBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    cmdBeginInfo.pInheritanceInfo = nullptr;
-    cmdBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-    cmdBeginInfo.pNext = nullptr;
-    vkBeginCommandBuffer(mCommandBuffers[i], &cmdBeginInfo);    
-    
-    VkRenderPassBeginInfo renderpassBegin = { };
-    renderpassBegin.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    renderpassBegin.renderPass = mDefaultRenderPass;
-    renderpassBegin.framebuffer = mSwapchainFramebuffers[i];
-    renderpassBegin.renderArea.offset = { 0, 0 };
-    renderpassBegin.renderArea.extent = mSwapchainExtent;
-    std::array<VkClearValue, 2> clearValues;
-    clearValues[0].color = { 0.0f, 0.0f, 0.0f, 1.0f };
-    clearValues[1].depthStencil = { 1.0f, 0 };
-    renderpassBegin.clearValueCount = (uint32_t )clearValues.size();
-    renderpassBegin.pClearValues = clearValues.data();
-    vkCmdBeginRenderPass(mCommandBuffers[i], &renderpassBegin, VK_SUBPASS_CONTENTS_INLINE);
-    VkDeviceSize offsets[] = { 0 };
-
-    vkCmdBindPipeline(mCommandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, mPipelines.skybox);
-    vkCmdBindDescriptorSets(mCommandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, mPipelineLayout, 
-      0, 1, &mDescriptorSetSkybox, 0, nullptr);
-    vkCmdBindVertexBuffers(mCommandBuffers[i], 0, 1, &mesh.vertexBuffer, offsets);
-    vkCmdBindIndexBuffer(mCommandBuffers[i], mesh.indicesBuffer, 0, VK_INDEX_TYPE_UINT32);
-    vkCmdDrawIndexed(mCommandBuffers[i], (uint32_t )global::model.indices.size(), 1, 0, 0, 0);
-
-    
-    vkCmdBindPipeline(mCommandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, mPipelines.pbr);
-    vkCmdBindDescriptorSets(mCommandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, mPipelineLayout, 0,
-      1, &mDescriptorSet, 0, nullptr);
-    vkCmdBindVertexBuffers(mCommandBuffers[i], 0, 1, &mesh.vertexBuffer, offsets);
-    vkCmdBindIndexBuffer(mCommandBuffers[i], mesh.indicesBuffer, 0, VK_INDEX_TYPE_UINT32);
-    // hardcoded values.
-    //vkCmdDraw(m_commandbuffers[i], (uint32_t )global::vertices.size(), 1, 0, 0);
-    vkCmdDrawIndexed(mCommandBuffers[i], (uint32_t )global::model.indices.size(), 1, 0, 0, 0);
-    vkCmdEndRenderPass(mCommandBuffers[i]);
-    VkResult result = vkEndCommandBuffer(mCommandBuffers[i]);
-    BASE_ASSERT(result == VK_SUCCESS && "A CommandBuffer failed recording!");
+    cmdAllocInfo.commandPool = recorder.pool;
+    cmdAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+    cmdAllocInfo.commandBufferCount = 1;
+    result = vkAllocateCommandBuffers(mLogicalDevice, &cmdAllocInfo, &recorder.commandBuffer);
+    BASE_ASSERT(result == VK_SUCCESS && "Failed to allocate a secondary commandbuffer!");
+  }
+  mMaxDrawSlices = sliceCount;
+}
+
+
+void Base::RecordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t frame)
+{
+  PBR_TRACE_FUNCTION();
+  BuildDrawList();
+  BuildDrawSlices();
+  // The frame's fence has signaled, so its secondaries are free to be reset and re-recorded.
+  uint32_t sliceCount = static_cast<uint32_t>(mDrawSlices.size());
+  ReserveDrawSlices(sliceCount);
+  mSliceCommandBuffers.resize(sliceCount);
+  // The secondaries write the pass scopes, before the primary gets to BeginFrame().
+  mProfiler.ResetFrame(frame);
+  ThreadPool::Global().ParallelFor(sliceCount, [&] (uint32_t i) {
+    PBR_TRACE_SCOPE("RecordDrawSlice");
+    SliceRecorder &recorder = mSliceRecorders[i * mFrames.size() + frame];
+    vkResetCommandPool(mLogicalDevice, recorder.pool, 0);
+    RecordDrawSlice(recorder.commandBuffer, imageIndex, frame, mDrawSlices[i]);
+    mSliceCommandBuffers[i] = recorder.commandBuffer;
+  });
+
+  VkCommandBufferBeginInfo cmdBeginInfo = { };
+  cmdBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  cmdBeginInfo.pInheritanceInfo = nullptr;
+  cmdBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  cmdBeginInfo.pNext = nullptr;
+  // Implicitly resets the commandbuffer, its fence guarantees the GPU is done with it.
+  vkBeginCommandBuffer(commandBuffer, &cmdBeginInfo);    
+  mProfiler.BeginFrame(commandBuffer, frame);
+  mProfiler.BeginScope(commandBuffer, frame, GpuProfiler::gsFrame);
+  
+  VkRenderPassBeginInfo renderpassBegin = { };
+  renderpassBegin.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  renderpassBegin.renderPass = mDefaultRenderPass;
+  renderpassBegin.framebuffer = mSwapchainFramebuffers[imageIndex];
+  renderpassBegin.renderArea.offset = { 0, 0 };
+  renderpassBegin.renderArea.extent = mSwapchainExtent;
+  std::array<VkClearValue, 2> clearValues;
+  clearValues[0].color = { 0.0f, 0.0f, 0.0f, 1.0f };
+  clearValues[1].depthStencil = { 1.0f, 0 };
+  renderpassBegin.clearValueCount = (uint32_t )clearValues.size();
+  renderpassBegin.pClearValues = clearValues.data();
+  // Nothing but vkCmdExecuteCommands() is allowed in here, the pass scopes are written
+  // by the secondaries themselves.
+  vkCmdBeginRenderPass(commandBuffer, &renderpassBegin, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+  if (sliceCount > 0) {
+    vkCmdExecuteCommands(commandBuffer, sliceCount, mSliceCommandBuffers.data());
+  }
+  vkCmdEndRenderPass(commandBuffer);
+  if (mHeadless.enabled) {
+    RecordReadback(commandBuffer, frame);
+  }
+  mProfiler.EndScope(commandBuffer, frame, GpuProfiler::gsFrame);
+  VkResult result = vkEndCommandBuffer(commandBuffer);
+  BASE_ASSERT(result == VK_SUCCESS && "A CommandBuffer failed recording!");
+}
+
+
+void Base::BuildDrawList()
+{
+  uint32_t indexCount = static_cast<uint32_t>(Assets::GetModel().GetIndexCount());
+  mDrawList.clear();
+  DrawCall draw = { };
+  draw.firstIndex = 0;
+  draw.indexCount = indexCount;
+  if (mDepthPrepass) {
+    draw.pass = GpuProfiler::gsDepth;
+    draw.pipeline = mPipelines.depth;
+    draw.descriptorSet = mDescriptorSet;
+    draw.vertexBuffer = mesh.positionBuffer;
+    mDrawList.push_back(draw);
+  }
+
+  draw.pass = GpuProfiler::gsPbr;
+  draw.pipeline = mDepthPrepass ? mPipelines.pbrDepthEqual : mPipelines.pbr;
+  draw.descriptorSet = mDescriptorSet;
+  draw.vertexBuffer = mesh.vertexBuffer;
+  mDrawList.push_back(draw);
+
+  // Sky goes last, it is depth tested against everything opaque.
+  draw.pass = GpuProfiler::gsSkybox;
+  draw.pipeline = mPipelines.skybox;
+  draw.descriptorSet = mDescriptorSetSkybox;
+  draw.vertexBuffer = VK_NULL_HANDLE;
+  draw.indexCount = 0;
+  draw.vertexCount = 3;
+  mDrawList.push_back(draw);
+}
+
+
+void Base::BuildDrawSlices()
+{
+  // Small passes stay in one slice, handing a few draws to a worker costs more than 
+  // recording them. Cutting lower would not help this scene anyway, every pass of it is
+  // a single draw.
+  const uint32_t minDrawsPerSlice = 128;
+  uint32_t maxSlicesPerPass = ThreadPool::Global().GetThreadCount() + 1;
+  mDrawSlices.clear();
+  uint32_t drawCount = static_cast<uint32_t>(mDrawList.size());
+  uint32_t passBegin = 0;
+  while (passBegin < drawCount) {
+    uint32_t passEnd = passBegin + 1;
+    while (passEnd < drawCount && mDrawList[passEnd].pass == mDrawList[passBegin].pass) {
+      ++passEnd;
+    }
+    uint32_t passDraws = passEnd - passBegin;
+    uint32_t slices = (passDraws + minDrawsPerSlice - 1) / minDrawsPerSlice;
+    slices = (std::min)(slices, maxSlicesPerPass);
+    for (uint32_t i = 0; i < slices; ++i) {
+      DrawSlice slice;
+      slice.first = passBegin + passDraws * i / slices;
+      slice.count = passBegin + passDraws * (i + 1) / slices - slice.first;
+      slice.beginsPass = (i == 0);
+      slice.endsPass = (i + 1 == slices);
+      mDrawSlices.push_back(slice);
+    }
+    passBegin = passEnd;
+  }
+}
+
+
+void Base::RecordDrawSlice(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t frame,
+  const DrawSlice &slice)
+{
+  VkCommandBufferInheritanceInfo inheritanceInfo = { };
+  inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+  inheritanceInfo.renderPass = mDefaultRenderPass;
+  inheritanceInfo.subpass = 0;
+  inheritanceInfo.framebuffer = mSwapchainFramebuffers[imageIndex];
+  VkCommandBufferBeginInfo cmdBeginInfo = { };
+  cmdBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  cmdBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT 
+    | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  cmdBeginInfo.pInheritanceInfo = &inheritanceInfo;
+  vkBeginCommandBuffer(commandBuffer, &cmdBeginInfo);
+
+  // Dynamic state doesn't carry over between commandbuffers.
+  VkViewport viewport = { };
+  viewport.x = viewport.y = 0.0f;
+  viewport.width = static_cast<float>(mSwapchainExtent.width);
+  viewport.height = static_cast<float>(mSwapchainExtent.height);
+  viewport.minDepth = 0.0f;
+  viewport.maxDepth = 1.0f;
+  VkRect2D scissor = { };
+  scissor.offset = { 0, 0 };
+  scissor.extent = mSwapchainExtent;
+  vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+  vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+  // A pipeline statistics query can't span commandbuffers, split passes only get timestamps.
+  GpuProfiler::Scope pass = mDrawList[slice.first].pass;
+  bool statistics = slice.beginsPass && slice.endsPass;
+  if (slice.beginsPass) {
+    mProfiler.BeginScope(commandBuffer, frame, pass, statistics);
+  }
+
+  // Bindings 0, 4 and 5 are dynamic, all of them live in this frame's uniform slice.
+  uint32_t sliceOffset = static_cast<uint32_t>(frame * mUniformRing.sliceSize);
+  std::array<uint32_t, 3> dynamicOffsets = { sliceOffset, sliceOffset, sliceOffset };
+  VkDeviceSize offsets[] = { 0 };
+  vkCmdBindIndexBuffer(commandBuffer, mesh.indicesBuffer, 0, VK_INDEX_TYPE_UINT32);
+  VkPipeline boundPipeline = VK_NULL_HANDLE;
+  VkDescriptorSet boundSet = VK_NULL_HANDLE;
+  VkBuffer boundVertexBuffer = VK_NULL_HANDLE;
+  for (uint32_t i = slice.first; i < slice.first + slice.count; ++i) {
+    const DrawCall &draw = mDrawList[i];
+    if (draw.pipeline != boundPipeline) {
+      vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, draw.pipeline);
+      boundPipeline = draw.pipeline;
+    }
+    if (draw.descriptorSet != boundSet) {
+      vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mPipelineLayout, 
+        0, 1, &draw.descriptorSet, (uint32_t )dynamicOffsets.size(), dynamicOffsets.data());
+      boundSet = draw.descriptorSet;
+    }
+    if (draw.vertexBuffer != VK_NULL_HANDLE && draw.vertexBuffer != boundVertexBuffer) {
+      vkCmdBindVertexBuffers(commandBuffer, 0, 1, &draw.vertexBuffer, offsets);
+      boundVertexBuffer = draw.vertexBuffer;
+    }
+    if (draw.indexCount > 0) {
+      vkCmdDrawIndexed(commandBuffer, draw.indexCount, 1, draw.firstIndex, 0, 0);
+    } else {
+      vkCmdDraw(commandBuffer, draw.vertexCount, 1, 0, 0);
+    }
   }
+
+  if (slice.endsPass) {
+    mProfiler.EndScope(commandBuffer, frame, pass, statistics);
+  }
+  VkResult result = vkEndCommandBuffer(commandBuffer);
+  BASE_ASSERT(result == VK_SUCCESS && "A secondary CommandBuffer failed recording!");
+}
+
+
+void Base::RecordReadback(VkCommandBuffer commandBuffer, uint32_t frame)
+{
+  // The renderpass left the image in TRANSFER_SRC_OPTIMAL.
+  VkBufferImageCopy region = { };
+  region.bufferOffset = 0;
+  region.bufferRowLength = 0;
+  region.bufferImageHeight = 0;
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.mipLevel = 0;
+  region.imageSubresource.baseArrayLayer = 0;
+  region.imageSubresource.layerCount = 1;
+  region.imageExtent = { mSwapchainExtent.width, mSwapchainExtent.height, 1 };
+  const Readback &readback = mHeadless.readbacks[frame];
+  vkCmdCopyImageToBuffer(commandBuffer, mSwapchainImages[frame], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+    readback.buffer, 1, &region);
+
+  VkBufferMemoryBarrier barrier = { };
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = readback.buffer;
+  barrier.offset = 0;
+  barrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+    0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+
+void Base::SaveReadback(uint32_t frame)
+{
+  PBR_TRACE_FUNCTION();
+  Readback &readback = mHeadless.readbacks[frame];
+  if (readback.frameNumber < 0) return;
+  if (!mHeadless.outputDir.empty()) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/frame_%04lld.png", (long long )readback.frameNumber);
+    std::string filepath = mHeadless.outputDir + name;
+    ImageWriter::WritePng(filepath.c_str(), mSwapchainExtent.width, mSwapchainExtent.height,
+      readback.memory.mapped, (size_t )mSwapchainExtent.width * 4);
+  }
+  readback.frameNumber = -1;
 }
 
 
 void Base::CreateSemaphores()
 {
+  PBR_TRACE_FUNCTION();
   VkSemaphoreCreateInfo semaphoreCreateInfo = { };
   semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-  VkResult result = vkCreateSemaphore(mLogicalDevice, &semaphoreCreateInfo, 
-    nullptr, &mSemaphores.presentation);
-  BASE_ASSERT(result == VK_SUCCESS && "Failed to create presentation semaphore!");
-  result = vkCreateSemaphore(mLogicalDevice, &semaphoreCreateInfo,
-    nullptr, &mSemaphores.rendering);
-  BASE_ASSERT(result == VK_SUCCESS && "Failed to create rendering semaphore!");
+  // Start signaled, no frame has been submitted yet.
+  VkFenceCreateInfo fenceCreateInfo = { };
+  fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+  mFrames.resize(GetFrameSlotCount());
+  for (Frame &frame : mFrames) {
+    VkResult result = vkCreateSemaphore(mLogicalDevice, &semaphoreCreateInfo, 
+      nullptr, &frame.imageAvailable);
+    BASE_ASSERT(result == VK_SUCCESS && "Failed to create presentation semaphore!");
+    result = vkCreateSemaphore(mLogicalDevice, &semaphoreCreateInfo,
+      nullptr, &frame.renderFinished);
+    BASE_ASSERT(result == VK_SUCCESS && "Failed to create rendering semaphore!");
+    result = vkCreateFence(mLogicalDevice, &fenceCreateInfo, nullptr, &frame.fence);
+    BASE_ASSERT(result == VK_SUCCESS && "Failed to create frame fence!");
+    frame.number = -1;
+  }
 }
 
 
-uint32_t Base::FindMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties)
+void Base::CreateQueryPools()
+{
+  PBR_TRACE_FUNCTION();
+  // CreateLogicalDevice() enabled pipeline statistics whenever they are supported.
+  VkPhysicalDeviceFeatures features;
+  vkGetPhysicalDeviceFeatures(mPhysicalDevice, &features);
+  QueueFamilyIndices indices = FindQueueFamilies(mPhysicalDevice);
+  mProfiler.Initialize(mPhysicalDevice, mLogicalDevice, static_cast<uint32_t>(indices.graphicsFamily),
+    GetFrameSlotCount(), features.pipelineStatisticsQuery == VK_TRUE);
+}
+
+
+// Stands in for frames whose GPU results never came back.
+static GpuProfiler::Result MakeUntimedResult()
 {
-  VkPhysicalDeviceMemoryProperties memProps = { };
-  vkGetPhysicalDeviceMemoryProperties(mPhysicalDevice, &memProps);
-  for (uint32_t i = 0; i < memProps.memoryTypeCount; ++i) {
-    if (typeFilter & (1 << i) && 
-        (memProps.memoryTypes[i].propertyFlags & properties) == properties) {
-      return i;
+  GpuProfiler::Result result = { };
+  for (uint32_t scope = 0; scope < GpuProfiler::gsCount; ++scope) {
+    result.time[scope] = -1.0;
+  }
+  return result;
+}
+
+
+void Base::CollectGpuResults(uint32_t frame)
+{
+  Frame &slot = mFrames[frame];
+  if (slot.number < 0) return;
+  GpuProfiler::Result result;
+  if (mProfiler.Collect(frame, result)) {
+    if (mGpuResults.size() <= static_cast<size_t>(slot.number)) {
+      mGpuResults.resize(static_cast<size_t>(slot.number) + 1, MakeUntimedResult());
     }
+    mGpuResults[slot.number] = result;
   }
-  return -1;
+  slot.number = -1;
+}
+
+
+uint32_t Base::FindMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties)
+{
+  return mAllocator.FindMemoryType(typeFilter, properties);
 }
 
 
 void Base::CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
-  VkBuffer &buffer, VkDeviceMemory &bufferMem)
+  VkBuffer &buffer, DeviceAllocation &bufferMem)
 {
+  PBR_TRACE_FUNCTION();
   VkBufferCreateInfo bufferInfo = {};
   bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
   bufferInfo.size = size;
@@ -1281,85 +1867,65 @@ void Base::CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPro
   BASE_ASSERT(result == VK_SUCCESS && "Failed to create vertex buffer!");
   VkMemoryRequirements memReqs = {};
   vkGetBufferMemoryRequirements(mLogicalDevice, buffer, &memReqs);
-  VkMemoryAllocateInfo allocInfo = {};
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.allocationSize = memReqs.size;
-  allocInfo.memoryTypeIndex = FindMemoryType(memReqs.memoryTypeBits, properties);
-  result = vkAllocateMemory(mLogicalDevice, &allocInfo, nullptr, &bufferMem);
-  BASE_ASSERT(result == VK_SUCCESS && "Failed to Create Vertex buffer memory");
-  vkBindBufferMemory(mLogicalDevice, buffer, bufferMem, 0);
-}
-
-
-void Base::CopyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size)
-{
-  VkCommandBuffer commandBuffer = BeginSingleTimeCommands();
-
-  VkBufferCopy copyRegion = { };
-  copyRegion.size = size;
-  vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
-
-  EndSingleTimeCommands(commandBuffer);
+  bool allocated = mAllocator.Allocate(memReqs, properties, DeviceAllocator::rkLinear, bufferMem);
+  BASE_ASSERT(allocated && "Failed to Create Vertex buffer memory");
+  vkBindBufferMemory(mLogicalDevice, buffer, bufferMem.memory, bufferMem.offset);
 }
 
 
 void Base::CreateVertexBuffers()
 {
-  VkDeviceSize bufferSize = sizeof(global::model.vertices[0]) * global::model.vertices.size();
-  VkBuffer stagingBuffer;
-  VkDeviceMemory stagingBufferMem;  
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMem);
-
-  // map memory to vertexbuffer.  
-  void *data;
-  vkMapMemory(mLogicalDevice, stagingBufferMem, 0, bufferSize, 0, &data);
-    memcpy(data, global::model.vertices.data(), (size_t )bufferSize);
-  vkUnmapMemory(mLogicalDevice, stagingBufferMem);
-
+  PBR_TRACE_FUNCTION();
+  const Model &model = Assets::GetModel();
+  // Zero sized buffers are not valid Vulkan, and there would be nothing to draw anyway.
+  // The first to touch the model, so the index buffer and draw list never see it empty.
+  if (model.GetIndexCount() == 0) {
+    std::cout << "No geometry to render, the model failed to load.\n";
+    std::exit(EXIT_FAILURE);
+  }
+  VkDeviceSize bufferSize = sizeof(Vertex) * model.GetVertexCount();
   CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 
     mesh.vertexBuffer, mesh.vertexMemory);
 
-  CopyBuffer(stagingBuffer, mesh.vertexBuffer, bufferSize);
+  // If the model came from the mesh cache, this copies straight out of the file mapping.
+  mUploader.UploadBuffer(mesh.vertexBuffer, 0, model.GetVertices(), bufferSize,
+    VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
 
-  vkFreeMemory(mLogicalDevice, stagingBufferMem, nullptr);
-  vkDestroyBuffer(mLogicalDevice, stagingBuffer, nullptr);
+  // The depth prepass only fetches positions, a third of the bytes of a full vertex.
+  // Gathered out of the vertices straight into staging memory.
+  VkDeviceSize positionSize = sizeof(glm::vec3) * model.GetVertexCount();
+  CreateBuffer(positionSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 
+    mesh.positionBuffer, mesh.positionMemory);
+  mUploader.UploadBufferStrided(mesh.positionBuffer, 0, &model.GetVertices()->position,
+    sizeof(glm::vec3), sizeof(Vertex), model.GetVertexCount(),
+    VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
 }
 
 
 void Base::CreateIndexBuffers()
 {
-  VkDeviceSize bufferSize = sizeof(global::model.indices[0]) * global::model.indices.size();
-  VkBuffer stagingBuffer;
-  VkDeviceMemory stagingMemory;
-  
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingMemory);
-
-  void *data;
-  vkMapMemory(mLogicalDevice, stagingMemory, 0, bufferSize, 0, &data);
-    memcpy(data, global::model.indices.data(), (size_t )bufferSize);
-  vkUnmapMemory(mLogicalDevice, stagingMemory);
-
+  PBR_TRACE_FUNCTION();
+  const Model &model = Assets::GetModel();
+  VkDeviceSize bufferSize = sizeof(uint32_t) * model.GetIndexCount();
   CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh.indicesBuffer,
     mesh.indicesMemory);
 
-  CopyBuffer(stagingBuffer, mesh.indicesBuffer, bufferSize);
-
-  vkFreeMemory(mLogicalDevice, stagingMemory, nullptr);
-  vkDestroyBuffer(mLogicalDevice, stagingBuffer, nullptr);
+  mUploader.UploadBuffer(mesh.indicesBuffer, 0, model.GetIndices(), bufferSize,
+    VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_INDEX_READ_BIT);
 }
 
 
 void Base::CreateDescriptorSetLayouts()
 {
+  PBR_TRACE_FUNCTION();
   std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings;
   VkDescriptorSetLayoutBinding uboLayoutBinding = { };
   uboLayoutBinding.binding = 0;
   uboLayoutBinding.descriptorCount = 1;
-  uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   // can be reference in all stages...
   uboLayoutBinding.stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS;
 
@@ -1392,7 +1958,7 @@ void Base::CreateDescriptorSetLayouts()
   VkDescriptorSetLayoutBinding materialLayoutBinding = { };
   materialLayoutBinding.binding = 4;
   materialLayoutBinding.descriptorCount = 1;
-  materialLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  materialLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   materialLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
   setLayoutBindings.push_back(materialLayoutBinding);
@@ -1400,7 +1966,7 @@ void Base::CreateDescriptorSetLayouts()
   VkDescriptorSetLayoutBinding lightLayoutBinding = { };
   lightLayoutBinding.binding = 5;
   lightLayoutBinding.descriptorCount = 1;
-  lightLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  lightLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   lightLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
   setLayoutBindings.push_back(lightLayoutBinding);
@@ -1415,48 +1981,44 @@ void Base::CreateDescriptorSetLayouts()
 }
 
 
+static VkDeviceSize AlignUniform(VkDeviceSize value, VkDeviceSize alignment)
+{
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+
 void Base::CreateUniformBuffers()
 {
-  VkDeviceSize bufferSize = sizeof(ubo);
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
-    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, mUbo.stagingBuffer,
-    mUbo.stagingMemory);
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mUbo.buffer, mUbo.memory);
-
-  bufferSize = sizeof(PointLightUBO);
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, mPointLight.stagingBuffer,
-    mPointLight.stagingMemory);
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mPointLight.buffer,
-    mPointLight.memory);
-
-  bufferSize = sizeof(MaterialUBO);
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, mMaterial.stagingBuffer,
-    mMaterial.stagingMemory);
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mMaterial.buffer,
-    mMaterial.memory);
-
-  bufferSize = sizeof(ubo);
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, mSkyboxUBO.stagingBuffer,
-    mSkyboxUBO.stagingMemory);
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mSkyboxUBO.buffer,
-    mSkyboxUBO.memory);
+  PBR_TRACE_FUNCTION();
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
+  // Every offset we hand out, static or dynamic, must respect this.
+  VkDeviceSize alignment = (std::max)(properties.limits.minUniformBufferOffsetAlignment, 
+    (VkDeviceSize )16);
+
+  mUniformRing.uboOffset = 0;
+  mUniformRing.skyboxOffset = AlignUniform(mUniformRing.uboOffset + sizeof(UBO), alignment);
+  mUniformRing.materialOffset = AlignUniform(mUniformRing.skyboxOffset + sizeof(UBO), alignment);
+  mUniformRing.lightOffset = AlignUniform(mUniformRing.materialOffset + sizeof(MaterialUBO), alignment);
+  mUniformRing.sliceSize = AlignUniform(mUniformRing.lightOffset + sizeof(PointLightUBO), alignment);
+  mUniformRing.sliceCount = GetFrameSlotCount();
+
+  CreateBuffer(mUniformRing.sliceSize * mUniformRing.sliceCount, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
+    mUniformRing.buffer, mUniformRing.memory);
+  // The allocator keeps host visible blocks mapped.
+  mUniformRing.mapped = mUniformRing.memory.mapped;
 }
 
 
 void Base::CreateDescriptorPools()
 {
+  PBR_TRACE_FUNCTION();
   std::vector<VkDescriptorPoolSize> poolSizes;
 
   VkDescriptorPoolSize poolSize = { };
   poolSize.descriptorCount = 6;
-  poolSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  poolSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 
   VkDescriptorPoolSize cubemapPool = { };
   cubemapPool.descriptorCount = 8;
@@ -1489,6 +2051,7 @@ void Base::CreateDescriptorPools()
 
 void Base::CreateDescriptorSets()
 {
+  PBR_TRACE_FUNCTION();
   std::array<VkDescriptorSetLayout, 1> layouts = { mDescriptorSetLayout };
   VkDescriptorSetAllocateInfo allocInfo = { };
   allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
@@ -1502,8 +2065,9 @@ void Base::CreateDescriptorSets()
   
   // Create the actual descriptor set.
   VkDescriptorBufferInfo bufferInfo = { };
-  bufferInfo.buffer = mUbo.buffer;
-  bufferInfo.offset = 0;
+  // Offsets are within a slice, the slice itself is picked with the dynamic offset.
+  bufferInfo.buffer = mUniformRing.buffer;
+  bufferInfo.offset = mUniformRing.uboOffset;
   bufferInfo.range = sizeof(ubo);
 
   VkDescriptorImageInfo imageInfo = { };
@@ -1522,13 +2086,13 @@ void Base::CreateDescriptorSets()
   skyboxInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
   VkDescriptorBufferInfo materialBufferInfo = { };
-  materialBufferInfo.buffer = mMaterial.buffer;
-  materialBufferInfo.offset = 0;
+  materialBufferInfo.buffer = mUniformRing.buffer;
+  materialBufferInfo.offset = mUniformRing.materialOffset;
   materialBufferInfo.range = sizeof(material);
 
   VkDescriptorBufferInfo lightBufferInfo = { };
-  lightBufferInfo.buffer = mPointLight.buffer;
-  lightBufferInfo.offset = 0;
+  lightBufferInfo.buffer = mUniformRing.buffer;
+  lightBufferInfo.offset = mUniformRing.lightOffset;
   lightBufferInfo.range = sizeof(pointLight);
 
   std::vector<VkWriteDescriptorSet> writeDescriptorSets;  
@@ -1536,7 +2100,7 @@ void Base::CreateDescriptorSets()
   VkWriteDescriptorSet descriptorWrite = { };
   descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
   descriptorWrite.dstSet = mDescriptorSet;
-  descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   descriptorWrite.dstBinding = 0;
   descriptorWrite.dstArrayElement = 0;
   descriptorWrite.descriptorCount = 1;
@@ -1580,7 +2144,7 @@ void Base::CreateDescriptorSets()
   VkWriteDescriptorSet materialWrite = { };
   materialWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
   materialWrite.dstSet = mDescriptorSet;
-  materialWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  materialWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   materialWrite.dstBinding = 4;
   materialWrite.dstArrayElement = 0;
   materialWrite.descriptorCount = 1;
@@ -1590,7 +2154,7 @@ void Base::CreateDescriptorSets()
   lightWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
   lightWrite.dstBinding = 5;
   lightWrite.descriptorCount = 1;
-  lightWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  lightWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   lightWrite.dstSet = mDescriptorSet;
   lightWrite.dstArrayElement = 0;
   lightWrite.pBufferInfo = &lightBufferInfo;
@@ -1605,24 +2169,26 @@ void Base::CreateDescriptorSets()
   vkUpdateDescriptorSets(mLogicalDevice, (uint32_t )writeDescriptorSets.size(), writeDescriptorSets.data(), 0, nullptr);
 
   VkDescriptorBufferInfo bufferInfoSky = {};
-  bufferInfoSky.buffer = mSkyboxUBO.buffer;
-  bufferInfoSky.offset = 0;
+  bufferInfoSky.buffer = mUniformRing.buffer;
+  bufferInfoSky.offset = mUniformRing.skyboxOffset;
   bufferInfoSky.range = sizeof(UBO);
 
   VkWriteDescriptorSet descriptorWriteSky = {};
   descriptorWriteSky.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
   descriptorWriteSky.dstSet = mDescriptorSetSkybox;
-  descriptorWriteSky.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  descriptorWriteSky.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   descriptorWriteSky.dstBinding = 0;
   descriptorWriteSky.dstArrayElement = 0;
   descriptorWriteSky.descriptorCount = 1;
   descriptorWriteSky.pBufferInfo = &bufferInfoSky;
   descriptorWriteSky.pImageInfo = nullptr;
   descriptorWriteSky.pTexelBufferView = nullptr;
-  writeDescriptorSets.push_back(descriptorWriteSky);
-
+  // Fill out every binding of the skybox set as well. Dynamic offsets are passed for 
+  // every dynamic binding in the layout, so none of them should be left dangling.
   writeDescriptorSets[0] = descriptorWriteSky;
-  writeDescriptorSets[3].dstSet = mDescriptorSetSkybox;
+  for (VkWriteDescriptorSet &write : writeDescriptorSets) {
+    write.dstSet = mDescriptorSetSkybox;
+  }
 
   vkUpdateDescriptorSets(mLogicalDevice, (uint32_t )writeDescriptorSets.size(), writeDescriptorSets.data(), 0, nullptr);
   writeDescriptorSets.clear();
@@ -1630,8 +2196,9 @@ void Base::CreateDescriptorSets()
 
 
 void Base::CreateImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling,
-  VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage &image, VkDeviceMemory &imageMemory)
+  VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage &image, DeviceAllocation &imageMemory)
 {
+  PBR_TRACE_FUNCTION();
   VkImageCreateInfo imageCreateInfo = {};
   imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
   imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1653,129 +2220,51 @@ void Base::CreateImage(uint32_t width, uint32_t height, VkFormat format, VkImage
 
   VkMemoryRequirements memReqs = {};
   vkGetImageMemoryRequirements(mLogicalDevice, image, &memReqs);
-  VkMemoryAllocateInfo allocInfo = {};
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.allocationSize = memReqs.size;
-  allocInfo.memoryTypeIndex = FindMemoryType(memReqs.memoryTypeBits, properties);
-
-  result = vkAllocateMemory(mLogicalDevice, &allocInfo, nullptr, &imageMemory);
-  BASE_ASSERT(result == VK_SUCCESS && "Failed to allocate stage image memory.");
-  vkBindImageMemory(mLogicalDevice, image, imageMemory, 0);
+  // Linear and optimal images never share a block, see DeviceAllocator.
+  DeviceAllocator::ResourceKind kind = (tiling == VK_IMAGE_TILING_OPTIMAL) ? 
+    DeviceAllocator::rkOptimal : DeviceAllocator::rkLinear;
+  bool allocated = mAllocator.Allocate(memReqs, properties, kind, imageMemory);
+  BASE_ASSERT(allocated && "Failed to allocate stage image memory.");
+  vkBindImageMemory(mLogicalDevice, image, imageMemory.memory, imageMemory.offset);
 }
 
 
 void Base::CreateTextureImages()
 {
-  int32_t width, height, channels;
-  stbi_uc *bytecode = stbi_load(PBR_STUDY_DIR"/statue.jpg", &width, &height, &channels, STBI_rgb_alpha);
+  PBR_TRACE_FUNCTION();
+  Assets::Image image = Assets::GetTexture();
+  int32_t width = image.width;
+  int32_t height = image.height;
+  const uint8_t *bytecode = image.pixels.get();
   VkDeviceSize imageSize = width * height * 4;
   
   BASE_ASSERT(bytecode && "Failed to load image");
-  VkImage stagingImage;
-  VkDeviceMemory stageMemory;
-
-  CreateImage(width, height, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_LINEAR,
-    VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-    stagingImage, stageMemory);
-
-  VkImageSubresource subresource = {};
-  subresource.arrayLayer = 0;
-  subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  subresource.mipLevel = 0;
-  VkSubresourceLayout stagingImageLayout;
-  vkGetImageSubresourceLayout(mLogicalDevice, stagingImage, &subresource, &stagingImageLayout);
-
-  void *data;
-  vkMapMemory(mLogicalDevice, stageMemory, 0, imageSize, 0, &data);
-    if (stagingImageLayout.rowPitch == width * 4) {
-      memcpy(data, bytecode, (size_t )imageSize);
-    } else {
-      uint8_t *bytes  = static_cast<uint8_t *>(data);
-      for (int32_t y = 0; y < height; ++y) {
-        memcpy(&bytes[y * stagingImageLayout.rowPitch],
-              &bytecode[y * width * 4],
-              width * 4);
-      }
-    }
-  vkUnmapMemory(mLogicalDevice, stageMemory);
 
-  CreateImage(width, height, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_LINEAR,
+  CreateImage(width, height, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_OPTIMAL,
     VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, texture.image, texture.memory);  
 
-  TransitionImageLayout(stagingImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_PREINITIALIZED,
-    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
-  TransitionImageLayout(texture.image, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_PREINITIALIZED,
-    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);  
-  CopyImage(stagingImage, texture.image, width, height);
-
-  TransitionImageLayout(texture.image, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-
-
-  vkFreeMemory(mLogicalDevice, stageMemory, nullptr);
-  vkDestroyImage(mLogicalDevice, stagingImage, nullptr);
-  stbi_image_free(bytecode);
-}
-
-
-VkCommandBuffer Base::BeginSingleTimeCommands()
-{
-  VkCommandBufferAllocateInfo allocInfo = { };
-  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;  
-  allocInfo.commandPool = mCommandPool;
-  allocInfo.commandBufferCount = 1;
-
-  VkCommandBuffer commandbuffer;
-  vkAllocateCommandBuffers(mLogicalDevice, &allocInfo, &commandbuffer);
-  
-  VkCommandBufferBeginInfo beginInfo = { };
-  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-  vkBeginCommandBuffer(commandbuffer, &beginInfo);
-
-  return commandbuffer;
-}
-
-
-void Base::EndSingleTimeCommands(VkCommandBuffer commandbuffer)
-{
-  vkEndCommandBuffer(commandbuffer);
-  
-  VkSubmitInfo submitInfo = { };
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &commandbuffer;
-  
-  vkQueueSubmit(mQueues.rendering, 1, &submitInfo, VK_NULL_HANDLE);
-  vkQueueWaitIdle(mQueues.rendering);
-
-  vkFreeCommandBuffers(mLogicalDevice, mCommandPool, 1, &commandbuffer);
-}
-
-
-void Base::CopyImage(VkImage srcImage, VkImage dstImage, uint32_t width, uint32_t height)
-{
-  VkCommandBuffer commandbuffer = BeginSingleTimeCommands();
-  VkImageSubresourceLayers subresource = { };
-  subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  subresource.baseArrayLayer = 0;
-  subresource.layerCount = 1;
-  subresource.mipLevel = 0;
-
-  VkImageCopy region = { };
-  region.dstSubresource = subresource;
-  region.srcSubresource = subresource;
-  region.srcOffset = { 0, 0, 0 };
-  region.dstOffset = { 0, 0, 0 };
-  region.extent.width = width;
-  region.extent.height = height;
-  region.extent.depth = 1;
-  vkCmdCopyImage(commandbuffer, srcImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-    dstImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-
-  EndSingleTimeCommands(commandbuffer);
+  VkImageSubresourceRange subresourceRange = { };
+  subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  subresourceRange.baseMipLevel = 0;
+  subresourceRange.levelCount = 1;
+  subresourceRange.baseArrayLayer = 0;
+  subresourceRange.layerCount = 1;
+
+  VkBufferImageCopy region = { };
+  region.bufferOffset = 0;
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.mipLevel = 0;
+  region.imageSubresource.baseArrayLayer = 0;
+  region.imageSubresource.layerCount = 1;
+  region.imageExtent.width = width;
+  region.imageExtent.height = height;
+  region.imageExtent.depth = 1;
+  // The pixels are copied into staging memory here, so the texture can be released 
+  // before the upload is even submitted.
+  mUploader.UploadImage(texture.image, subresourceRange, bytecode, imageSize, &region, 1,
+    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+    VK_ACCESS_SHADER_READ_BIT);
 }
 
 
@@ -1785,60 +2274,10 @@ bool Base::HasStencilComponent(VkFormat format)
 }
 
 
-void Base::TransitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout,
-  VkImageLayout newLayout)
-{
-  VkCommandBuffer commandbuffer = BeginSingleTimeCommands();
-  
-  VkImageMemoryBarrier barrier = { };
-  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  barrier.oldLayout = oldLayout;
-  barrier.newLayout = newLayout;
-  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.image = image;
-  if (newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-    if (HasStencilComponent(format)) {
-      barrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
-    }
-  } else {
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  }
-  barrier.subresourceRange.baseArrayLayer = 0;
-  barrier.subresourceRange.baseMipLevel = 0;
-  barrier.subresourceRange.layerCount = 1;
-  barrier.subresourceRange.levelCount = 1;
-  barrier.srcAccessMask = 0;
-  barrier.dstAccessMask = 0;
-  // too specific! but it matters!
-  if (oldLayout == VK_IMAGE_LAYOUT_PREINITIALIZED && newLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
-    barrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-  } else if (oldLayout == VK_IMAGE_LAYOUT_PREINITIALIZED && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
-    barrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-  } else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-  } else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
-    barrier.srcAccessMask = 0;
-    barrier.dstAccessMask = (VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT);
-  } else {
-    BASE_ASSERT(false && "Failed to modify image barrier access masks.");
-  }
-  // place the image barrier in the pipeline.
-  vkCmdPipelineBarrier(commandbuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-    VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr,
-    1, &barrier);
-  
-  EndSingleTimeCommands(commandbuffer);
-}
-
-
 void Base::CreateImageView(VkImage image, VkFormat format, 
   VkImageAspectFlags aspectFlags, VkImageView &imageView)
 {
+  PBR_TRACE_FUNCTION();
   VkImageViewCreateInfo imageViewCreateInfo = {};
   imageViewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
   imageViewCreateInfo.image = image;
@@ -1856,6 +2295,7 @@ void Base::CreateImageView(VkImage image, VkFormat format,
 
 void Base::CreateTextureSampler()
 {
+  PBR_TRACE_FUNCTION();
   VkSamplerCreateInfo samplerCreateInfo = { };
   samplerCreateInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
   samplerCreateInfo.magFilter = VK_FILTER_LINEAR;
@@ -1881,19 +2321,32 @@ void Base::CreateTextureSampler()
 
 void Base::CreateTextureImageView()
 {
+  PBR_TRACE_FUNCTION();
   CreateImageView(texture.image, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_ASPECT_COLOR_BIT, texture.imageView);
 }
 
 
 void Base::CreateDefaultDepthResources()
 {
+  PBR_TRACE_FUNCTION();
   VkFormat depthFormat = FindDepthFormat();
   CreateImage(mSwapchainExtent.width, mSwapchainExtent.height, 
     depthFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mDepth.image, mDepth.memory);
   CreateImageView(mDepth.image, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT, mDepth.imageView);
-  TransitionImageLayout(mDepth.image, depthFormat, VK_IMAGE_LAYOUT_UNDEFINED, 
-    VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+
+  VkImageSubresourceRange subresourceRange = { };
+  subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+  if (HasStencilComponent(depthFormat)) {
+    subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+  }
+  subresourceRange.baseMipLevel = 0;
+  subresourceRange.levelCount = 1;
+  subresourceRange.baseArrayLayer = 0;
+  subresourceRange.layerCount = 1;
+  mUploader.TransitionImage(mDepth.image, subresourceRange, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | 
+    VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT);
 }
 
 
@@ -1923,30 +2376,52 @@ VkFormat Base::FindSupportedFormat(const std::vector<VkFormat> &candidates, VkIm
 
 void Base::Initialize()
 {
+  PBR_TRACE_FUNCTION();
+  // Does nothing if main() already started the loads. Everything up until 
+  // CreateGraphicsPipeline() runs while the workers parse and compile.
+  Assets::Start();
+  if (global::instance == VK_NULL_HANDLE) {
+    global::instance = global::CreateInstance(mHeadless.enabled);
+  }
   SetDebugCallback();
-  CreateSurface();
+  if (!mHeadless.enabled) {
+    CreateSurface();
+  }
   FindPhyiscalDevice();
   CreateLogicalDevice();
-  CreateSwapChain();
-  CreateImageViews();
+  if (mHeadless.enabled) {
+    CreateOffscreenTargets();
+  } else {
+    CreateSwapChain();
+    CreateImageViews();
+  }
   CreateRenderPasses();
   CreateDescriptorSetLayouts();
-  CreateGraphicsPipeline();
   CreateCommandPool();
   CreateDefaultDepthResources();
   CreateFramebuffers();
+  CreateUniformBuffers();
+  CreateDescriptorPools();
+  CreateSemaphores();
+  CreateQueryPools();
+  SetupCamera();
+
+  // Each of these blocks only on the asset it consumes.
+  CreateGraphicsPipeline();
   CreateTextureImages();
   CreateTextureImageView();
   CreateTextureSampler();
   CreateCubemaps();
+  CreateDescriptorSets();
+  Assets::ReleaseTextures();
   CreateVertexBuffers();
   CreateIndexBuffers();
-  CreateUniformBuffers();
-  CreateDescriptorPools();
-  CreateDescriptorSets();
   CreateCommandBuffers();
-  CreateSemaphores();
-  SetupCamera();
+
+  // All uploads and layout transitions go out in one batch. Frames are submitted to the
+  // graphics queue after it, so nothing needs to wait on it here.
+  mUploader.Flush();
+  mAllocator.PrintStats();
 
   material.roughness = 0.5f;
   material.metallic = 0.5f;
@@ -1961,6 +2436,7 @@ void Base::Initialize()
 
 void Base::SetupCamera()
 {
+  PBR_TRACE_FUNCTION();
   // NOTE(): Gimbal lock if vec3(0.0, x.x, 0.0f))
   mCamera.SetPosition(glm::vec3(2.0f, 2.0f, 2.0f));
   mCamera.SetFov(45.0f);
@@ -1973,28 +2449,50 @@ void Base::SetupCamera()
 
 void Base::Draw()
 {
-  // Creating VkStageFlags all the time is bit of a waste of time, but we use this 
-  // for have the GPU syncing it's queues.
+  PBR_TRACE_FUNCTION();
+  if (mHeadless.enabled) {
+    DrawHeadless();
+    return;
+  }
+  // Wait until the GPU is done with the frame that last used these resources. With N
+  // frames in flight, that is the frame submitted N frames ago, so the CPU gets to 
+  // record this one while the GPU is still chewing on the previous ones.
+  Frame &frame = mFrames[mFrameIndex];
+  {
+    PBR_TRACE_SCOPE("WaitForFrameFence");
+    vkWaitForFences(mLogicalDevice, 1, &frame.fence, VK_TRUE, 
+      (std::numeric_limits<uint64_t>::max)());
+  }
+  // Hand staging memory of finished uploads back.
+  mUploader.Collect();
+  CollectGpuResults(mFrameIndex);
+
   uint32_t imageIndex;
   vkAcquireNextImageKHR(mLogicalDevice, mSwapchain, (std::numeric_limits<uint64_t>::max)(),
-    mSemaphores.presentation, VK_NULL_HANDLE, &imageIndex);
+    frame.imageAvailable, VK_NULL_HANDLE, &imageIndex);
+  vkResetFences(mLogicalDevice, 1, &frame.fence);
+
+  UpdateUniformBuffers(mFrameIndex);
+  RecordCommandBuffer(frame.commandBuffer, imageIndex, mFrameIndex);
+
   VkSubmitInfo submitInfo = { };
   submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-  VkSemaphore wait_semaphores[] = { mSemaphores.presentation };
+  VkSemaphore wait_semaphores[] = { frame.imageAvailable };
 
   VkPipelineStageFlags wait_stages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
   submitInfo.waitSemaphoreCount = 1;
   submitInfo.pWaitSemaphores = wait_semaphores;
   submitInfo.pWaitDstStageMask = wait_stages;
   submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &mCommandBuffers[imageIndex];
+  submitInfo.pCommandBuffers = &frame.commandBuffer;
   
-  VkSemaphore signal_semaphores[] = { mSemaphores.rendering };
+  VkSemaphore signal_semaphores[] = { frame.renderFinished };
   submitInfo.signalSemaphoreCount = 1;
   submitInfo.pSignalSemaphores = signal_semaphores;
-  VkResult result = vkQueueSubmit(mQueues.rendering, 1, &submitInfo, VK_NULL_HANDLE); 
+  VkResult result = vkQueueSubmit(mQueues.rendering, 1, &submitInfo, frame.fence); 
   BASE_ASSERT(result == VK_SUCCESS && "Failed to submit commandbuffer to rendering queue.");
+  frame.number = mFrameNumber++;
 
   VkPresentInfoKHR presentInfo = { };
   presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -2006,12 +2504,51 @@ void Base::Draw()
   presentInfo.pSwapchains = swapchains;
   presentInfo.pImageIndices = &imageIndex;
   presentInfo.pResults = nullptr;
-  vkQueuePresentKHR(mQueues.presentation, &presentInfo);
+  {
+    PBR_TRACE_SCOPE("QueuePresent");
+    vkQueuePresentKHR(mQueues.presentation, &presentInfo);
+  }
+
+  mFrameIndex = (mFrameIndex + 1) % mFramesInFlight;
+}
+
+
+void Base::DrawHeadless()
+{
+  PBR_TRACE_FUNCTION();
+  // Same as Draw(), minus the acquire and present. Each frame in flight owns its 
+  // offscreen target, so the frame index doubles as the image index.
+  Frame &frame = mFrames[mFrameIndex];
+  {
+    PBR_TRACE_SCOPE("WaitForFrameFence");
+    vkWaitForFences(mLogicalDevice, 1, &frame.fence, VK_TRUE, 
+      (std::numeric_limits<uint64_t>::max)());
+  }
+  mUploader.Collect();
+  CollectGpuResults(mFrameIndex);
+  // The fence covers the copy as well, so what this frame read back last time is ready.
+  SaveReadback(mFrameIndex);
+  vkResetFences(mLogicalDevice, 1, &frame.fence);
+
+  UpdateUniformBuffers(mFrameIndex);
+  RecordCommandBuffer(frame.commandBuffer, mFrameIndex, mFrameIndex);
+
+  VkSubmitInfo submitInfo = { };
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &frame.commandBuffer;
+  VkResult result = vkQueueSubmit(mQueues.rendering, 1, &submitInfo, frame.fence); 
+  BASE_ASSERT(result == VK_SUCCESS && "Failed to submit commandbuffer to rendering queue.");
+  frame.number = mFrameNumber++;
+  mHeadless.readbacks[mFrameIndex].frameNumber = frame.number;
+
+  mFrameIndex = (mFrameIndex + 1) % mFramesInFlight;
 }
 
 
 void Base::RecreateSwapchain()
 {
+  auto start = std::chrono::high_resolution_clock::now();
   vkDeviceWaitIdle(mLogicalDevice);
 
   for (size_t i = 0; i < mSwapchainImageViews.size(); ++i) {
@@ -2019,74 +2556,89 @@ void Base::RecreateSwapchain()
     vkDestroyFramebuffer(mLogicalDevice, mSwapchainFramebuffers[i], nullptr);
   }
 
-  vkFreeCommandBuffers(mLogicalDevice, mCommandPool,
-    static_cast<uint32_t>(mCommandBuffers.size()), mCommandBuffers.data());
-
-  vkDestroyPipeline(mLogicalDevice, mPipelines.pbr, nullptr);
-  vkDestroyPipeline(mLogicalDevice, mPipelines.skybox, nullptr);
-  vkDestroyRenderPass(mLogicalDevice, mDefaultRenderPass, nullptr);
-  vkDestroyPipelineLayout(mLogicalDevice, mPipelineLayout, nullptr);
-  vkFreeMemory(mLogicalDevice, mDepth.memory, nullptr);
   vkDestroyImage(mLogicalDevice, mDepth.image, nullptr);
+  mAllocator.Free(mDepth.memory);
   vkDestroyImageView(mLogicalDevice, mDepth.imageView, nullptr);
 
+  VkFormat oldFormat = mSwapchainFormat;
   CreateSwapChain();
   CreateImageViews();
-  CreateRenderPasses();
-  CreateGraphicsPipeline();
+
+  // Viewport and scissor are dynamic, so the render pass and pipelines only go stale 
+  // if the surface hands us a different format. Pretty much never happens on a resize.
+  if (mSwapchainFormat != oldFormat) {
+    vkDestroyPipeline(mLogicalDevice, mPipelines.pbr, nullptr);
+    vkDestroyPipeline(mLogicalDevice, mPipelines.pbrDepthEqual, nullptr);
+    vkDestroyPipeline(mLogicalDevice, mPipelines.depth, nullptr);
+    vkDestroyPipeline(mLogicalDevice, mPipelines.skybox, nullptr);
+    vkDestroyRenderPass(mLogicalDevice, mDefaultRenderPass, nullptr);
+    vkDestroyPipelineLayout(mLogicalDevice, mPipelineLayout, nullptr);
+    CreateRenderPasses();
+    CreateGraphicsPipeline();
+  }
+
+  // Commandbuffers are recorded per frame, nothing to rebuild there.
   CreateDefaultDepthResources();
+  mUploader.Flush();
   CreateFramebuffers();
-  CreateCommandBuffers();
+  mCamera.SetAspect(((float )mSwapchainExtent.width / (float )mSwapchainExtent.height));
+
+  auto end = std::chrono::high_resolution_clock::now();
+  std::printf("Swapchain recreated (%ux%u) in %.3f ms\n", mSwapchainExtent.width, 
+    mSwapchainExtent.height, std::chrono::duration<double, std::milli>(end - start).count());
+}
+
+
+// transpose(inverse(model)) with the translation dropped. pbr::Mat4 and glm::mat4
+// share the OpenGL memory layout, so the model goes across as is.
+static glm::mat4 ComputeNormalMatrix(const glm::mat4 &model)
+{
+  Mat4 m;
+  std::memcpy(m.GetData(), &model[0][0], sizeof(glm::mat4));
+  Mat4 normal = m.Inverse().Transpose();
+  glm::mat4 result;
+  std::memcpy(&result[0][0], normal.GetData(), sizeof(glm::mat4));
+  return glm::mat4(glm::mat3(result));
 }
 
 
-void Base::UpdateUniformBuffers()
+void Base::UpdateUniformBuffers(uint32_t slice)
 {
-  static auto startTime = std::chrono::high_resolution_clock::now();
-  auto currentTime = std::chrono::high_resolution_clock::now();
-  float time = std::chrono::duration_cast<std::chrono::milliseconds>(
-    currentTime - startTime).count() / 1000.0f;
+  PBR_TRACE_FUNCTION();
+  // Simulation time, not the wall clock, so benchmark runs render the same frames.
+  float time = static_cast<float>(mTime);
+
+  // Host coherent and persistently mapped, the writes are visible at submit.
+  uint8_t *data = mUniformRing.mapped + slice * mUniformRing.sliceSize;
 
   ubo.Projection = mCamera.GetProjection();
   // flip projection, vulkan handles everything differently than OpenGL
   ubo.Projection[1][1] *= -1;
   ubo.View = mCamera.GetView();
   ubo.Model = glm::rotate(glm::mat4(), time * glm::radians(45.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+  // Once per frame here, rather than for every vertex in test.vert.
+  ubo.Normal = ComputeNormalMatrix(ubo.Model);
   ubo.CamPosition = mCamera.GetPosition();
-  void *data;
-  vkMapMemory(mLogicalDevice, mUbo.stagingMemory, 0, sizeof(ubo), 0, &data);
-    memcpy(data, &ubo, sizeof(ubo));
-  vkUnmapMemory(mLogicalDevice, mUbo.stagingMemory);
-
-  CopyBuffer(mUbo.stagingBuffer, mUbo.buffer, sizeof(ubo));
+  memcpy(data + mUniformRing.uboOffset, &ubo, sizeof(ubo));
 
   // update pbr settings.
-
-  vkMapMemory(mLogicalDevice, mMaterial.stagingMemory, 0, sizeof(material), 0, &data);
-    memcpy(data, &material, sizeof(material));
-  vkUnmapMemory(mLogicalDevice, mMaterial.stagingMemory);
-  CopyBuffer(mMaterial.stagingBuffer, mMaterial.buffer, sizeof(material));
+  memcpy(data + mUniformRing.materialOffset, &material, sizeof(material));
 
   // update lighting.
   pointLight.Position = glm::vec4(std::sin(time) * 10.0f, 3.0f, 3.0f, 0.0);
   pointLight.Color = glm::vec3(1.0f, 1.0f, 1.0f);
   pointLight.Radius = 100.0f;
-  vkMapMemory(mLogicalDevice, mPointLight.stagingMemory, 0, sizeof(pointLight), 0, &data);
-    memcpy(data, &pointLight, sizeof(pointLight));
-  vkUnmapMemory(mLogicalDevice, mPointLight.stagingMemory);
-  CopyBuffer(mPointLight.stagingBuffer, mPointLight.buffer, sizeof(pointLight));
+  memcpy(data + mUniformRing.lightOffset, &pointLight, sizeof(pointLight));
 
-  // skybox updating.
-  ubo.Model = glm::scale(glm::mat4(glm::mat3(mCamera.GetView())), glm::vec3(500.0));
-  vkMapMemory(mLogicalDevice, mSkyboxUBO.stagingMemory, 0, sizeof(ubo), 0, &data);
-  memcpy(data, &ubo, sizeof(ubo));
-  vkUnmapMemory(mLogicalDevice, mSkyboxUBO.stagingMemory);
-  CopyBuffer(mSkyboxUBO.stagingBuffer, mSkyboxUBO.buffer, sizeof(ubo));
+  // skybox updating. Translation is dropped, the sky sits at infinity.
+  ubo.Model = glm::inverse(ubo.Projection * glm::mat4(glm::mat3(ubo.View)));
+  memcpy(data + mUniformRing.skyboxOffset, &ubo, sizeof(ubo));
 }
 
 
 void Base::MoveCamera()
 {
+  PBR_TRACE_FUNCTION();
   if (global::keyCodes[GLFW_KEY_W]) {
     mCamera.Move(Camera::FORWARD, mDt);
   }
@@ -2141,6 +2693,12 @@ void Base::AdjustMaterialValues()
     pointLight.enable = 0;
   }
 
+  if (global::keyCodes[GLFW_KEY_Z]) {
+    mDepthPrepass = true;
+  } else if (global::keyCodes[GLFW_KEY_X]) {
+    mDepthPrepass = false;
+  }
+
 
 
   if (material.metallic < 0.1f) {
@@ -2166,28 +2724,406 @@ void Base::AdjustMaterialValues()
 }
 
 
-void Base::Run()
+// Summary of a run's frame times, in milliseconds.
+struct FrameTimeStats {
+  double p50;
+  double p95;
+  double p99;
+  double mean;
+};
+
+
+static std::vector<double> GetGpuTimes(const std::vector<GpuProfiler::Result> &results,
+  GpuProfiler::Scope scope)
 {
-  while (!glfwWindowShouldClose(mWindow)) {
-    double t = glfwGetTime();
-    mDt = t - mLastTime;
-    mLastTime = t;
-    glfwPollEvents();
+  std::vector<double> times;
+  times.reserve(results.size());
+  for (const GpuProfiler::Result &result : results) {
+    times.push_back(result.time[scope]);
+  }
+  return times;
+}
+
+
+// Averaged over the frames that were timed past the warm up, untimed frames have no
+// statistics either.
+static GpuProfiler::Statistics GetMeanStatistics(const std::vector<GpuProfiler::Result> &results,
+  GpuProfiler::Scope scope)
+{
+  GpuProfiler::Statistics mean = { };
+  uint64_t count = 0;
+  for (size_t i = GetWarmupFrames(results.size()); i < results.size(); ++i) {
+    const GpuProfiler::Result &result = results[i];
+    if (result.time[scope] < 0.0) continue;
+    mean.clippingInvocations += result.statistics[scope].clippingInvocations;
+    mean.clippingPrimitives += result.statistics[scope].clippingPrimitives;
+    mean.fragmentShaderInvocations += result.statistics[scope].fragmentShaderInvocations;
+    ++count;
+  }
+  if (count > 0) {
+    mean.clippingInvocations /= count;
+    mean.clippingPrimitives /= count;
+    mean.fragmentShaderInvocations /= count;
+  }
+  return mean;
+}
+
+
+// Warm up frames are only left out of runs long enough to have frames left after them.
+static size_t GetWarmupFrames(size_t frameCount)
+{
+  return (frameCount > Base::kWarmupFrames) ? Base::kWarmupFrames : 0;
+}
+
+
+// Times are indexed by frame number. Warm up frames, and frames that could not be timed,
+// which are negative, are left out. Returns false if none are left.
+static bool ComputeFrameTimeStats(const std::vector<double> &times, FrameTimeStats &stats)
+{
+  std::vector<double> sorted;
+  sorted.reserve(times.size());
+  for (size_t i = GetWarmupFrames(times.size()); i < times.size(); ++i) {
+    if (times[i] >= 0.0) sorted.push_back(times[i]);
+  }
+  if (sorted.empty()) return false;
+  std::sort(sorted.begin(), sorted.end());
+  auto percentile = [&sorted] (double p) -> double {
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+  };
+  stats.p50 = percentile(0.50);
+  stats.p95 = percentile(0.95);
+  stats.p99 = percentile(0.99);
+  double sum = 0.0;
+  for (double time : sorted) {
+    sum += time;
+  }
+  stats.mean = sum / sorted.size();
+  return true;
+}
+
+
+void Base::PrintFrameTimes()
+{
+  FrameTimeStats stats;
+  if (!ComputeFrameTimeStats(mFrameTimes, stats)) return;
+  std::printf("Frame times over %u frames, %u warm up, %u in flight: p50 %.3f ms, p95 %.3f ms, "
+    "p99 %.3f ms\n", (uint32_t )mFrameTimes.size(), (uint32_t )GetWarmupFrames(mFrameTimes.size()),
+    mFramesInFlight, stats.p50, stats.p95, stats.p99);
+  for (uint32_t scope = 0; scope < GpuProfiler::gsCount; ++scope) {
+    GpuProfiler::Scope gs = static_cast<GpuProfiler::Scope>(scope);
+    if (!ComputeFrameTimeStats(GetGpuTimes(mGpuResults, gs), stats)) continue;
+    std::printf("GPU %s times: p50 %.3f ms, p95 %.3f ms, p99 %.3f ms\n", 
+      GpuProfiler::GetScopeName(gs), stats.p50, stats.p95, stats.p99);
+  }
+  if (mProfiler.HasStatistics() && !mGpuResults.empty()) {
+    for (uint32_t scope = GpuProfiler::gsFrame + 1; scope < GpuProfiler::gsCount; ++scope) {
+      GpuProfiler::Scope gs = static_cast<GpuProfiler::Scope>(scope);
+      GpuProfiler::Statistics mean = GetMeanStatistics(mGpuResults, gs);
+      std::printf("GPU %s per frame: %llu fragment invocations, %llu clipping primitives out of %llu\n",
+        GpuProfiler::GetScopeName(gs), (unsigned long long )mean.fragmentShaderInvocations,
+        (unsigned long long )mean.clippingPrimitives, (unsigned long long )mean.clippingInvocations);
+    }
+  }
+}
+
+
+void Base::RecordFrameTime(int64_t frameNumber, double ms)
+{
+  // Draw() skips the frame while the swapchain is out of date.
+  if (mFrameNumber == frameNumber) return;
+  if (mFrameTimes.size() <= static_cast<size_t>(frameNumber)) {
+    mFrameTimes.resize(static_cast<size_t>(frameNumber) + 1, -1.0);
+  }
+  mFrameTimes[frameNumber] = ms;
+}
+
+
+void Base::StepSimulation()
+{
+  PBR_TRACE_FUNCTION();
+  if (mBenchmark.enabled) {
+    // The wall clock only goes into mFrameTimes, the scene steps by a fixed amount.
+    mDt = kBenchmarkTimestep;
+    mTime = mFrameNumber * kBenchmarkTimestep;
+    CameraScript::Key key = mBenchmark.script.Sample(mTime);
+    mCamera.SetPosition(key.position);
+    mCamera.SetLookAt(key.target);
+    material.roughness = key.roughness;
+    material.metallic = key.metallic;
+    material.gloss = key.gloss;
+    pointLight.enable = key.light;
+  } else {
+    mTime += mDt;
     MoveCamera();
     AdjustMaterialValues();
-//    std::string str(std::to_string(m_dt) + " delta ms");
-//    glfwSetWindowTitle(m_window, str.c_str());
-    mCamera.Update(mDt);
-    UpdateUniformBuffers();
-    Draw();
-    
-    glfwSwapBuffers(mWindow); 
   }
+  mCamera.Update(mDt);
+
+  if (mRecording.enabled) {
+    CameraScript::Key key;
+    key.time = mTime;
+    key.position = mCamera.GetPosition();
+    key.target = mCamera.GetLookAt();
+    key.roughness = material.roughness;
+    key.metallic = material.metallic;
+    key.gloss = material.gloss;
+    key.light = pointLight.enable;
+    mRecording.script.AddKey(key);
+  }
+}
+
+
+bool Base::IsBenchmarkDone()
+{
+  return mBenchmark.enabled && mFrameNumber >= static_cast<int64_t>(mBenchmark.frameCount);
+}
+
+
+static void WriteJsonStats(std::FILE *file, const char *name, const std::vector<double> &times)
+{
+  FrameTimeStats stats;
+  if (ComputeFrameTimeStats(times, stats)) {
+    std::fprintf(file, "  \"%s\": { \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"mean\": %.4f },\n",
+      name, stats.p50, stats.p95, stats.p99, stats.mean);
+  } else {
+    std::fprintf(file, "  \"%s\": null,\n", name);
+  }
+}
+
+
+// Appends ", \"name\": time" to an open json object, null if the time is negative.
+static void WriteJsonTime(std::FILE *file, const char *name, double time)
+{
+  if (time >= 0.0) {
+    std::fprintf(file, ", \"%s\": %.4f", name, time);
+  } else {
+    std::fprintf(file, ", \"%s\": null", name);
+  }
+}
+
+
+// gpu_<pass>_ms.
+static std::string GetGpuTimeKey(GpuProfiler::Scope scope)
+{
+  return std::string("gpu_") + GpuProfiler::GetScopeName(scope) + "_ms";
+}
+
+
+void Base::WriteBenchmarkResults()
+{
+  std::FILE *file = stdout;
+  if (!mBenchmark.jsonPath.empty()) {
+    file = std::fopen(mBenchmark.jsonPath.c_str(), "w");
+    if (!file) {
+      std::printf("Failed to write benchmark results %s\n", mBenchmark.jsonPath.c_str());
+      return;
+    }
+  }
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
+  std::fprintf(file, "{\n");
+  std::fprintf(file, "  \"device\": \"%s\",\n", properties.deviceName);
+  std::fprintf(file, "  \"driver_version\": %u,\n", properties.driverVersion);
+  std::fprintf(file, "  \"headless\": %s,\n", mHeadless.enabled ? "true" : "false");
+  std::fprintf(file, "  \"width\": %u,\n", mSwapchainExtent.width);
+  std::fprintf(file, "  \"height\": %u,\n", mSwapchainExtent.height);
+  std::fprintf(file, "  \"frames_in_flight\": %u,\n", mFramesInFlight);
+  std::fprintf(file, "  \"timestep_ms\": %.4f,\n", kBenchmarkTimestep * 1000.0);
+  std::fprintf(file, "  \"depth_prepass\": %s,\n", mDepthPrepass ? "true" : "false");
+  std::fprintf(file, "  \"frames\": %u,\n", (uint32_t )mFrameTimes.size());
+  std::fprintf(file, "  \"warmup_frames\": %u,\n", (uint32_t )GetWarmupFrames(mFrameTimes.size()));
+  WriteJsonStats(file, "cpu_ms", mFrameTimes);
+  WriteJsonStats(file, "gpu_ms", GetGpuTimes(mGpuResults, GpuProfiler::gsFrame));
+  for (uint32_t scope = GpuProfiler::gsFrame + 1; scope < GpuProfiler::gsCount; ++scope) {
+    GpuProfiler::Scope gs = static_cast<GpuProfiler::Scope>(scope);
+    WriteJsonStats(file, GetGpuTimeKey(gs).c_str(), GetGpuTimes(mGpuResults, gs));
+  }
+  if (mProfiler.HasStatistics()) {
+    std::fprintf(file, "  \"pipeline_statistics\": {\n");
+    for (uint32_t scope = GpuProfiler::gsFrame + 1; scope < GpuProfiler::gsCount; ++scope) {
+      GpuProfiler::Scope gs = static_cast<GpuProfiler::Scope>(scope);
+      GpuProfiler::Statistics mean = GetMeanStatistics(mGpuResults, gs);
+      std::fprintf(file, "    \"%s\": { \"fragment_shader_invocations\": %llu, "
+        "\"clipping_invocations\": %llu, \"clipping_primitives\": %llu }%s\n",
+        GpuProfiler::GetScopeName(gs), (unsigned long long )mean.fragmentShaderInvocations,
+        (unsigned long long )mean.clippingInvocations, (unsigned long long )mean.clippingPrimitives,
+        (scope + 1 < GpuProfiler::gsCount) ? "," : "");
+    }
+    std::fprintf(file, "  },\n");
+  } else {
+    std::fprintf(file, "  \"pipeline_statistics\": null,\n");
+  }
+  std::fprintf(file, "  \"per_frame\": [\n");
+  for (size_t i = 0; i < mFrameTimes.size(); ++i) {
+    GpuProfiler::Result gpu = (i < mGpuResults.size()) ? mGpuResults[i] : MakeUntimedResult();
+    std::fprintf(file, "    { \"frame\": %u", (uint32_t )i);
+    WriteJsonTime(file, "cpu_ms", mFrameTimes[i]);
+    WriteJsonTime(file, "gpu_ms", gpu.time[GpuProfiler::gsFrame]);
+    for (uint32_t scope = GpuProfiler::gsFrame + 1; scope < GpuProfiler::gsCount; ++scope) {
+      GpuProfiler::Scope gs = static_cast<GpuProfiler::Scope>(scope);
+      WriteJsonTime(file, GetGpuTimeKey(gs).c_str(), gpu.time[gs]);
+    }
+    std::fprintf(file, " }%s\n", (i + 1 < mFrameTimes.size()) ? "," : "");
+  }
+  std::fprintf(file, "  ]\n}\n");
+  if (file != stdout) {
+    std::fclose(file);
+    std::printf("Benchmark results written to %s\n", mBenchmark.jsonPath.c_str());
+  }
+}
+
+
+void Base::FinishRun()
+{
+  PBR_TRACE_FUNCTION();
   vkDeviceWaitIdle(mLogicalDevice);
+  for (uint32_t i = 0; i < mFramesInFlight; ++i) {
+    CollectGpuResults(i);
+  }
+  PrintFrameTimes();
+  if (mBenchmark.enabled) {
+    WriteBenchmarkResults();
+  }
+  if (mRecording.enabled) {
+    mRecording.script.Save(mRecording.scriptPath.c_str());
+  }
+}
+
+
+void Base::Run()
+{
+  if (mHeadless.enabled && !mHeadless.outputDir.empty()) {
+    // Fails harmlessly if the directory is already there.
+#if defined(_WIN32)
+    _mkdir(mHeadless.outputDir.c_str());
+#else
+    mkdir(mHeadless.outputDir.c_str(), 0755);
+#endif
+  }
+  if (mBenchmark.enabled && mBenchmark.sweepFramesInFlight) {
+    RunFramesInFlightSweep();
+  } else {
+    RunPass();
+  }
   glfwTerminate();
 }
 
 
+void Base::RunPass()
+{
+  mFrameTimes.clear();
+  mGpuResults.clear();
+  if (mHeadless.enabled) {
+    RunHeadless();
+  } else {
+    mLastTime = glfwGetTime();
+    while (!glfwWindowShouldClose(mWindow) && !IsBenchmarkDone()) {
+      double t = glfwGetTime();
+      mDt = t - mLastTime;
+      mLastTime = t;
+      PBR_TRACE_SCOPE("Frame");
+      glfwPollEvents();
+//      std::string str(std::to_string(m_dt) + " delta ms");
+//      glfwSetWindowTitle(m_window, str.c_str());
+      int64_t frameNumber = mFrameNumber;
+      StepSimulation();
+      Draw();
+      RecordFrameTime(frameNumber, (glfwGetTime() - t) * 1000.0);
+      
+      glfwSwapBuffers(mWindow); 
+    }
+  }
+  FinishRun();
+  if (mHeadless.enabled) {
+    // Write out the frames still sitting in the ring, oldest first.
+    for (uint32_t i = 0; i < mFramesInFlight; ++i) {
+      SaveReadback((mFrameIndex + i) % mFramesInFlight);
+    }
+  }
+}
+
+
+void Base::RunHeadless()
+{
+  uint32_t frameCount = mBenchmark.enabled ? mBenchmark.frameCount : mHeadless.frameCount;
+  auto last = std::chrono::high_resolution_clock::now();
+  for (uint32_t i = 0; i < frameCount; ++i) {
+    auto now = std::chrono::high_resolution_clock::now();
+    mDt = std::chrono::duration<double>(now - last).count();
+    last = now;
+    PBR_TRACE_SCOPE("Frame");
+    int64_t frameNumber = mFrameNumber;
+    StepSimulation();
+    DrawHeadless();
+    RecordFrameTime(frameNumber, std::chrono::duration<double, std::milli>(
+      std::chrono::high_resolution_clock::now() - now).count());
+  }
+}
+
+
+// results.json becomes results_fif2.json, for 2 frames in flight.
+static std::string GetSweepJsonPath(const std::string &jsonPath, uint32_t framesInFlight)
+{
+  std::string suffix = "_fif" + std::to_string(framesInFlight);
+  size_t dot = jsonPath.find_last_of('.');
+  size_t slash = jsonPath.find_last_of("/\\");
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    return jsonPath + suffix;
+  }
+  return jsonPath.substr(0, dot) + suffix + jsonPath.substr(dot);
+}
+
+
+void Base::RunFramesInFlightSweep()
+{
+  struct Row {
+    uint32_t        framesInFlight;
+    bool            cpuTimed;
+    bool            gpuTimed;
+    FrameTimeStats  cpu;
+    FrameTimeStats  gpu;
+  };
+  std::vector<Row> rows;
+  std::string jsonPath = mBenchmark.jsonPath;
+  for (uint32_t count = 1; count <= kMaxFramesInFlight; ++count) {
+    if (!mHeadless.enabled && glfwWindowShouldClose(mWindow)) break;
+    // FinishRun() left the GPU idle, every fence signaled and every slot collected, so the
+    // slots can be handed out again from the start under the new count.
+    mFramesInFlight = count;
+    mFrameIndex = 0;
+    mFrameNumber = 0;
+    if (!jsonPath.empty()) {
+      mBenchmark.jsonPath = GetSweepJsonPath(jsonPath, count);
+    }
+    RunPass();
+    Row row;
+    row.framesInFlight = count;
+    row.cpuTimed = ComputeFrameTimeStats(mFrameTimes, row.cpu);
+    row.gpuTimed = ComputeFrameTimeStats(GetGpuTimes(mGpuResults, GpuProfiler::gsFrame), row.gpu);
+    rows.push_back(row);
+  }
+  mBenchmark.jsonPath = jsonPath;
+
+  std::printf("Frames in flight sweep, %u frames each, %u warm up, times in ms:\n",
+    mBenchmark.frameCount, (uint32_t )GetWarmupFrames(mBenchmark.frameCount));
+  std::printf("  in flight    CPU p50      p95      p99    GPU p50      p95      p99\n");
+  for (const Row &row : rows) {
+    std::printf("  %9u", row.framesInFlight);
+    if (row.cpuTimed) {
+      std::printf(" %10.3f %8.3f %8.3f", row.cpu.p50, row.cpu.p95, row.cpu.p99);
+    } else {
+      std::printf(" %10s %8s %8s", "-", "-", "-");
+    }
+    if (row.gpuTimed) {
+      std::printf(" %10.3f %8.3f %8.3f\n", row.gpu.p50, row.gpu.p95, row.gpu.p99);
+    } else {
+      std::printf(" %10s %8s %8s\n", "-", "-", "-");
+    }
+  }
+}
+
+
 void Base::Cleanup()
 {
 }
@@ -8,7 +8,12 @@
 #include <stdint.h>
 #include "platform.hpp"
 #include "camera.hpp"
+#include "camera_script.hpp"
+#include "device_allocator.hpp"
+#include "gpu_profiler.hpp"
+#include "staging_uploader.hpp"
 #include <vulkan/vulkan.h>
+#include <string>
 #include <vector>
 
 
@@ -41,6 +46,7 @@ class Shader;
 class Base {
 protected:
   struct Cubemap;
+  struct DrawSlice;
 public:
   Base();
   virtual ~Base();
@@ -65,6 +71,53 @@ public:
 
   void SetupWindow(uint32_t width, uint32_t height);
   void CloseWindow();
+
+  /// Run without a window, surface or swapchain, for render farm nodes and automated
+  /// perf tests. Frames are rendered into offscreen color targets of the given size and
+  /// copied back through a readback buffer per frame in flight. If outputDir is not empty,
+  /// every frame is written there as frame_NNNN.png. Run() renders frameCount frames and
+  /// returns. Call instead of SetupWindow(), before Initialize(). Any device that can draw
+  /// is accepted, including software implementations such as lavapipe.
+  void SetupHeadless(uint32_t width, uint32_t height, uint32_t frameCount, 
+    const std::string &outputDir);
+
+  /// Step of the benchmark mode, in seconds.
+  static const double kBenchmarkTimestep;
+
+  /// Frames left out of the frame time statistics while caches and clocks settle,
+  /// if the run is long enough to have any frames left after them.
+  static const uint32_t kWarmupFrames;
+
+  /// Replay a camera and material timeline with a fixed timestep for frameCount frames, 
+  /// instead of following the keyboard and the wall clock, so every run renders the same
+  /// frames. The timeline is read from scriptPath, or is a built-in orbit if it is empty.
+  /// Per-frame CPU and GPU times and their p50/p95/p99 are written to jsonPath as JSON,
+  /// or to stdout if it is empty. In headless mode, frameCount replaces the headless
+  /// frame count. Must be called before Initialize().
+  void SetupBenchmark(uint32_t frameCount, const std::string &scriptPath, 
+    const std::string &jsonPath);
+
+  /// Record the camera and material of every frame of an interactive run, and write 
+  /// them to scriptPath as a camera script when Run() returns.
+  void SetupRecording(const std::string &scriptPath);
+
+  /// Most frames the CPU may record ahead of the GPU.
+  static const uint32_t kMaxFramesInFlight = 3;
+
+  /// Set how many frames may be in flight, clamped to [1, kMaxFramesInFlight]. 
+  /// Must be called before Initialize(). Defaults to 2.
+  void SetFramesInFlight(uint32_t count);
+
+  /// Run the benchmark once for every frames in flight count from 1 to kMaxFramesInFlight,
+  /// and print their frame time percentiles side by side. Per frame resources are made for
+  /// kMaxFramesInFlight frames up front. With a jsonPath, each count writes its results
+  /// next to it, results.json becoming results_fif1.json and so on. Needs SetupBenchmark(),
+  /// must be called before Initialize().
+  void SetupFramesInFlightSweep();
+
+  /// Lay down depth with a position only pass before the PBR pass, which then only shades
+  /// the fragments that end up visible. Can be flipped at any time, Z/X do it interactively.
+  void SetDepthPrepass(bool enable) { mDepthPrepass = enable; }
   
 protected:
   /// QueueFamily indices, stores the index to the 
@@ -76,6 +129,8 @@ protected:
   struct QueueFamilyIndices {
     int graphicsFamily = -1;
     int presentFamily = -1;
+    /// Transfer only family, -1 if the device has none. Optional.
+    int transferFamily = -1;
     bool IsComplete();
   };
 
@@ -162,6 +217,15 @@ protected:
   /// much quicker. This is rather convenient.
   void CreateGraphicsPipeline();
 
+  /// Create the pipeline cache handed to vkCreateGraphicsPipelines(). It is seeded from the 
+  /// cache file of the previous run, but only if that file was written by the same device 
+  /// and driver version, otherwise the driver would either reject the data, or worse. 
+  /// Called right after the logical device is created.
+  void CreatePipelineCache();
+
+  /// Write the pipeline cache back to disk, so the next run skips the driver's compile.
+  void SavePipelineCache();
+
   /// Create the renderpasses needed for our framebuffers. These render passes define attachments,
   /// not the actual images, it just tells the framebuffer what and how to handle its images.
   void CreateRenderPasses();
@@ -175,12 +239,34 @@ protected:
   /// This is required to create the commands for our renderer API.
   void CreateCommandPool();
   
-  /// Create the commandbuffers, it will mainly be static, but ehh.
-  /// Since Vulkan requires you to record your commands before submitting them to the Graphics Queue,
-  /// you have full control to use multiple threads to build up your commandbuffer. Subpasses and 
-  /// secondary commandbuffers where designed for this very reason.
+  /// Create the commandbuffers, one per frame in flight. They are re-recorded every frame
+  /// with RecordCommandBuffer(), against whichever swapchain image was acquired.
+  /// Also creates the secondary commandbuffers the draw list is recorded into, each with
+  /// its own pool, mMaxDrawSlices of them per frame in flight.
   void CreateCommandBuffers();
 
+  /// Make sure there are secondaries for sliceCount slices in every frame in flight.
+  void ReserveDrawSlices(uint32_t sliceCount);
+
+  /// Record the frame into the commandbuffer, drawing into the given swapchain image and
+  /// reading uniforms from the given frame's slice of the uniform ring. The draws are
+  /// recorded on the thread pool into secondary commandbuffers, which the primary executes.
+  void RecordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t frame);
+
+  /// Fill mDrawList with what the frame draws, in pass order.
+  void BuildDrawList();
+
+  /// Cut every pass of the draw list into mDrawSlices, sized to spread over the thread pool.
+  /// Only passes of hundreds of draws get more than one slice. This scene draws one mesh,
+  /// so each pass is a single slice and the passes are what get recorded in parallel, 3
+  /// secondaries at most. The speedup only shows on scenes with many draws per pass.
+  void BuildDrawSlices();
+
+  /// Record a slice of the draw list into a secondary commandbuffer that continues the
+  /// default renderpass. Runs on pool workers, it touches nothing but the commandbuffer.
+  void RecordDrawSlice(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t frame,
+    const DrawSlice &slice);
+
   /// Create the semaphores needed for notifying the rendering API when 
   /// an image is available to present, as well as for when an image is done
   /// being drawn onto. There are also VkFences if you would like to go that route,
@@ -190,12 +276,63 @@ protected:
   /// Fences : Set on GPU, wait on CPU. Status visible to CPU
   /// Semaphores : Set on GPU, wait on GPU (inter queue) Status not visible to CPU.
   /// Events : Set anywhere, wait on GPU (intra queue) 
+  /// Creates the semaphores and fence of every frame in flight, see Frame.
   void CreateSemaphores(); 
   
   /// Draw onto the swapchain image.
   virtual void Draw();
 
-  /// Recreate the swaphcain when resizing the window.
+  /// Headless counterpart of Draw(). Renders into the frame's offscreen target, and 
+  /// saves whatever the frame's readback buffer held from its previous use.
+  void DrawHeadless();
+
+  /// Render the frames of one run and report it, in a window or headless.
+  void RunPass();
+
+  /// Headless counterpart of the window loop in RunPass().
+  void RunHeadless();
+
+  /// One RunPass() per frames in flight count, see SetupFramesInFlightSweep().
+  void RunFramesInFlightSweep();
+
+  /// Frames that per frame resources are made for, mFramesInFlight unless sweeping.
+  uint32_t GetFrameSlotCount() const;
+
+  /// Advance the simulation clock, and move the camera and material, from the keyboard
+  /// or from the benchmark script. Called once per frame before Draw().
+  void StepSimulation();
+
+  /// True once the benchmark has rendered all of its frames.
+  bool IsBenchmarkDone();
+
+  /// Write the benchmark results, see SetupBenchmark().
+  void WriteBenchmarkResults();
+
+  /// Wait for the GPU to go idle, collect the last GPU times and report the run.
+  void FinishRun();
+
+  /// Set up mProfiler, with pipeline statistics if the device supports them.
+  void CreateQueryPools();
+
+  /// Read back the GPU times and statistics of the frame last submitted in the slot.
+  /// The slot's fence must have been waited on.
+  void CollectGpuResults(uint32_t frame);
+
+  /// Create the offscreen color targets, their views and readback buffers, one per frame
+  /// in flight. They stand in for the swapchain images, so the renderpass, framebuffers
+  /// and commandbuffers need no special casing.
+  void CreateOffscreenTargets();
+
+  /// Copy the frame's offscreen target into its readback buffer. Recorded after the renderpass.
+  void RecordReadback(VkCommandBuffer commandBuffer, uint32_t frame);
+
+  /// Write the frame's readback buffer out, if it holds a frame that was not written yet.
+  /// The frame's fence must have been waited on.
+  void SaveReadback(uint32_t frame);
+
+  /// Recreate the swaphcain when resizing the window. Pipelines use dynamic viewport
+  /// and scissor state, so only the swapchain, its views, the depth buffer, framebuffers 
+  /// and commandbuffers are rebuilt, unless the swapchain format changed.
   void RecreateSwapchain();
 
   /// Create the Descriptor layouts, which are used to tell the graphics pipeline
@@ -213,11 +350,11 @@ protected:
 
   /// Create the test vertex buffer.
   void CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
-    VkBuffer &buffer, VkDeviceMemory &bufferMemory);
+    VkBuffer &buffer, DeviceAllocation &bufferMemory);
 
   /// Create our uniform buffers.
   void CreateUniformBuffers();
-  void UpdateUniformBuffers();
+  void UpdateUniformBuffers(uint32_t slice);
   void CreateDescriptorPools();
   void CreateDescriptorSets();
   void CreateTextureImages();
@@ -225,24 +362,22 @@ protected:
   void SetupCamera();
   void MoveCamera();
 
-  /// For staging buffer purposes, this will transfer the contents of the staging buffer to
-  /// more high performance memory to the vertexbuffer on the gpu.
-  void CopyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
+  /// Print the p50/p95/p99 frame times of the run.
+  void PrintFrameTimes();
+
+  /// Store the CPU time of one frame under the number it was submitted as, the same
+  /// number its GPU results go under. Nothing if the frame was skipped, never submitted.
+  void RecordFrameTime(int64_t frameNumber, double ms);
 
   static void OnWindowResized(global::Window window, int width, int height);
   void CreateImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, 
-    VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage &image, VkDeviceMemory &imageMemory);
+    VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage &image, DeviceAllocation &imageMemory);
 
   ///
   VkSurfaceFormatKHR ChooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR> &availableFormats);
   VkPresentModeKHR ChooseSwapPresentMode(const std::vector<VkPresentModeKHR> &availablePresentModes);
   VkExtent2D ChooseSwapExtent(const VkSurfaceCapabilitiesKHR &capabilities);
   uint32_t FindMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
-  VkCommandBuffer BeginSingleTimeCommands();
-  void EndSingleTimeCommands(VkCommandBuffer commandbuffer);
-  void TransitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, 
-    VkImageLayout newLayout);
-  void CopyImage(VkImage srcImage, VkImage dstImage, uint32_t width, uint32_t height);
   void CreateImageView(VkImage image, VkFormat format, VkImageAspectFlags aspetFlags, VkImageView &imageView);
   void CreateCubemaps();
   void CreateTextureImageView();
@@ -260,37 +395,70 @@ protected:
   struct {
     VkQueue presentation;
     VkQueue rendering;
+    /// Same as rendering if there is no transfer only queue family.
+    VkQueue transfer;
   } mQueues;
 
-  /// Device semaphores.
-  struct {
-    VkSemaphore presentation;
-    VkSemaphore rendering;
-  } mSemaphores;
+  /// Everything a single frame in flight owns. The CPU waits on the fence before it
+  /// touches any of it again, which is the only place the CPU ever waits on the GPU.
+  struct Frame {
+    VkFence         fence;
+    VkSemaphore     imageAvailable;
+    VkSemaphore     renderFinished;
+    VkCommandBuffer commandBuffer;
+    /// Number of the frame last submitted with these resources, -1 if none.
+    int64_t         number;
+  };
+
+  /// One draw in one of the profiled passes. Indexed draws read the mesh, with an
+  /// indexCount of 0 it draws vertexCount vertices the vertex shader makes up itself.
+  struct DrawCall {
+    GpuProfiler::Scope  pass;
+    VkPipeline          pipeline;
+    VkDescriptorSet     descriptorSet;
+    /// VK_NULL_HANDLE for draws without vertex input.
+    VkBuffer            vertexBuffer;
+    uint32_t            firstIndex;
+    uint32_t            indexCount;
+    uint32_t            vertexCount;
+  };
+
+  /// Run of the draw list recorded into one secondary commandbuffer. Slices never cross
+  /// passes. The first and last slice of a pass write its profiler scope.
+  struct DrawSlice {
+    uint32_t            first;
+    uint32_t            count;
+    bool                beginsPass;
+    bool                endsPass;
+  };
+
+  /// Pools are externally synchronized, so every slice of every frame in flight gets a
+  /// pool of its own, instead of every worker thread. Whichever worker picks up a slice
+  /// owns its pool for the frame, and resets it as a whole.
+  struct SliceRecorder {
+    VkCommandPool       pool;
+    VkCommandBuffer     commandBuffer;
+  };
 
   /// Simple test mesh.
   /// This can be an object on it's own.
   struct {
     VkBuffer vertexBuffer;
     VkBuffer indicesBuffer;
-    VkDeviceMemory vertexMemory;
-    VkDeviceMemory indicesMemory;
+    DeviceAllocation vertexMemory;
+    DeviceAllocation indicesMemory;
+    /// Positions only, tightly packed, for the depth prepass.
+    VkBuffer positionBuffer;
+    DeviceAllocation positionMemory;
   } mesh;
 
-  struct {
-    VkBuffer vertexBuffer;
-    VkBuffer indicesBuffer;
-    VkDeviceMemory vertexMemory;
-    VkDeviceMemory indicesMemory;
-  } skyboxMesh;
-
   /// Simple Texture image.
   /// This can be an object on its own.
   struct {
     VkImage image;
     VkImageView imageView;
     VkSampler sampler;
-    VkDeviceMemory memory;
+    DeviceAllocation memory;
   } texture;
 
   /// Enviroment and skybox cubemaps.
@@ -298,39 +466,65 @@ protected:
   struct Cubemap {
     VkImage image;
     VkImageView view;
-    VkDeviceMemory memory;
+    DeviceAllocation memory;
     VkSampler sampler;
   } mEnvMap, mSkybox, mIrradianceMap;
 
-  /// Ubo info.
+  /// Uniform ring. One host coherent buffer, mapped for the lifetime of the device, holding 
+  /// a slice per frame in flight. Each slice holds the ubo, skybox ubo, material and point 
+  /// light, at the offsets below, and the slices are selected with dynamic offsets when
+  /// binding descriptor sets. The CPU writes straight into the slice of the frame it is
+  /// about to record, no staging, no copies, no queue waits.
   struct {
     VkBuffer              buffer;
-    VkBuffer              stagingBuffer;
-    VkDeviceMemory        memory;
-    VkDeviceMemory        stagingMemory;
-  } mUbo;
-
-  struct {
-    VkBuffer buffer;
-    VkDeviceMemory memory;
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingMemory;
-  } mPointLight;
+    DeviceAllocation      memory;
+    uint8_t              *mapped;
+    VkDeviceSize          sliceSize;
+    uint32_t              sliceCount;
+    VkDeviceSize          uboOffset;
+    VkDeviceSize          skyboxOffset;
+    VkDeviceSize          materialOffset;
+    VkDeviceSize          lightOffset;
+  } mUniformRing;
+
+  std::vector<Frame>            mFrames;
+  std::vector<DrawCall>         mDrawList;
+  std::vector<DrawSlice>        mDrawSlices;
+  /// mMaxDrawSlices per frame in flight, slice major.
+  std::vector<SliceRecorder>    mSliceRecorders;
+  /// Secondaries of the frame being recorded, in slice order.
+  std::vector<VkCommandBuffer>  mSliceCommandBuffers;
+  uint32_t                      mMaxDrawSlices;
+  bool                          mDepthPrepass;
+  uint32_t                      mFramesInFlight;
+  uint32_t                      mFrameIndex;
+  /// Frames submitted so far. Indexes mFrameTimes and mGpuResults.
+  int64_t                       mFrameNumber;
+  /// CPU time of each frame of the current run, StepSimulation() through submit and
+  /// present, in milliseconds.
+  std::vector<double>           mFrameTimes;
+  /// GPU times and pipeline statistics per frame, untimed frames have negative times.
+  std::vector<GpuProfiler::Result> mGpuResults;
+  GpuProfiler                   mProfiler;
 
   struct {
-    VkBuffer buffer;
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingMemory;
-    VkDeviceMemory memory;
-  } mMaterial;
+    bool                        enabled;
+    uint32_t                    frameCount;
+    std::string                 jsonPath;
+    CameraScript                script;
+    bool                        sweepFramesInFlight;
+  } mBenchmark;
 
   struct {
-    VkBuffer buffer;
-    VkDeviceMemory memory;
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingMemory;
-  } mSkyboxUBO;
+    bool                        enabled;
+    std::string                 scriptPath;
+    CameraScript                script;
+  } mRecording;
   
+  /// Every buffer and image is bound to memory from here.
+  DeviceAllocator               mAllocator;
+  /// Every staging copy and initial layout transition goes through here.
+  StagingUploader               mUploader;
   VkPhysicalDevice              mPhysicalDevice;
   VkDevice                      mLogicalDevice;
   VkSurfaceKHR                  mSurface; // TODO(): This needs to be global.
@@ -338,23 +532,46 @@ protected:
   std::vector<VkImage>          mSwapchainImages;
   std::vector<VkImageView>      mSwapchainImageViews;
   std::vector<VkFramebuffer>    mSwapchainFramebuffers;
-  std::vector<VkCommandBuffer>  mCommandBuffers;
   
   struct {
     VkImage image;
-    VkDeviceMemory memory;
+    DeviceAllocation memory;
     VkImageView imageView; 
   } mDepth;
 
   struct {
     VkPipeline skybox;
     VkPipeline pbr;
+    /// PBR with an EQUAL depth test and no depth writes, for after the depth prepass.
+    VkPipeline pbrDepthEqual;
+    /// Depth only, reads mesh.positionBuffer.
+    VkPipeline depth;
   } mPipelines;
 
+  /// Readback buffer of a frame in flight. Rows are tightly packed RGBA8.
+  struct Readback {
+    VkBuffer          buffer;
+    DeviceAllocation  memory;
+    /// Number of the frame copied in, -1 if there is nothing left to write.
+    int64_t           frameNumber;
+  };
+
+  /// Headless mode. The offscreen targets live in mSwapchainImages and mSwapchainImageViews,
+  /// their memory lives here.
+  struct {
+    bool                          enabled;
+    uint32_t                      frameCount;
+    std::string                   outputDir;
+    std::vector<DeviceAllocation> colorMemory;
+    std::vector<Readback>         readbacks;
+  } mHeadless;
+
   VkFormat                      mSwapchainFormat;
   VkExtent2D                    mSwapchainExtent;
   VkCommandPool                 mCommandPool;
   VkPipelineLayout              mPipelineLayout;
+  VkPipelineCache               mPipelineCache;
+  bool                          mPipelineCacheWarm;
   VkDescriptorSetLayout         mDescriptorSetLayout;
   VkDescriptorPool              mDescriptorPool;
   VkDescriptorSet               mDescriptorSet;
@@ -367,6 +584,8 @@ protected:
   Camera                        mCamera;
   double                        mLastTime;
   double                        mDt;
+  /// Simulation time in seconds, drives the model rotation and the light.
+  double                        mTime;
 };
 } // pbr
 #endif // __RENDERER_BASE_HPP
\ No newline at end of file
@@ -0,0 +1,899 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "benchmark.hpp"
+#include "bvh.hpp"
+#include "wide_bvh.hpp"
+#include "environment_map.hpp"
+#include "path_tracer.hpp"
+#include "model.hpp"
+#include "geometry.hpp"
+#include "thread_pool.hpp"
+#include <matrix.hpp>
+#include <ray.hpp>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <gli/load.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+
+namespace pbr {
+
+
+typedef std::chrono::high_resolution_clock BenchClock;
+
+
+static double ElapsedMs(BenchClock::time_point start)
+{
+  return std::chrono::duration<double, std::milli>(BenchClock::now() - start).count();
+}
+
+
+// Median of the collected timings, less sensitive to the first cold run than the mean.
+static double Median(std::vector<double> timings)
+{
+  std::sort(timings.begin(), timings.end());
+  return timings[timings.size() / 2];
+}
+
+
+bool Benchmark::Run(const char *name, const char *filepath)
+{
+  if (std::strcmp(name, "obj") == 0) {
+    ObjParsers(filepath ? filepath : PBR_STUDY_DIR"/dragon.obj");
+    return true;
+  }
+  if (std::strcmp(name, "inverse") == 0) {
+    MatrixInverse();
+    return true;
+  }
+  if (std::strcmp(name, "simd") == 0) {
+    return SimdMath();
+  }
+  if (std::strcmp(name, "ray") == 0) {
+    return RayKernels(filepath ? filepath : PBR_STUDY_DIR"/dragon.obj");
+  }
+  if (std::strcmp(name, "bvh") == 0) {
+    return BvhBuild(filepath ? filepath : PBR_STUDY_DIR"/dragon.obj");
+  }
+  if (std::strcmp(name, "wide") == 0) {
+    if (filepath) {
+      return WideTraversal(filepath);
+    }
+    bool ok = WideTraversal(PBR_STUDY_DIR"/dragon.obj");
+    return WideTraversal(PBR_STUDY_DIR"/buddha.obj") && ok;
+  }
+  if (std::strcmp(name, "envmap") == 0) {
+    return EnvironmentSampling(filepath ? filepath : PBR_STUDY_DIR"/maps/subway_skybox.ktx");
+  }
+  std::printf("Unknown benchmark %s. Available: obj, inverse, simd, ray, bvh, wide, envmap\n", name);
+  return false;
+}
+
+
+void Benchmark::ObjParsers(const char *filepath, uint32_t iterations)
+{
+  std::printf("OBJ parsers on %s, %u iterations, %u worker threads.\n", filepath, 
+    iterations, ThreadPool::Global().GetThreadCount());
+  ObjData parallel;
+  ObjData tinyObj;
+  std::vector<double> parallelTimings;
+  std::vector<double> tinyObjTimings;
+  for (uint32_t i = 0; i < iterations; ++i) {
+    parallel = ObjData();
+    BenchClock::time_point start = BenchClock::now();
+    if (!Model::ParseObj(filepath, Model::opParallel, parallel)) {
+      std::printf("Parallel parser failed on %s\n", filepath);
+      return;
+    }
+    parallelTimings.push_back(ElapsedMs(start));
+
+    tinyObj = ObjData();
+    start = BenchClock::now();
+    if (!Model::ParseObj(filepath, Model::opTinyObj, tinyObj)) {
+      std::printf("tinyobj failed on %s\n", filepath);
+      return;
+    }
+    tinyObjTimings.push_back(ElapsedMs(start));
+  }
+
+  bool sameCounts = parallel.vertices.size() == tinyObj.vertices.size() &&
+    parallel.normals.size() == tinyObj.normals.size() &&
+    parallel.texcoords.size() == tinyObj.texcoords.size() &&
+    parallel.indices.size() == tinyObj.indices.size();
+  bool sameIndices = sameCounts && std::memcmp(parallel.indices.data(), tinyObj.indices.data(), 
+    parallel.indices.size() * sizeof(ObjIndex)) == 0;
+  float maxError = 0.0f;
+  if (sameCounts) {
+    for (size_t i = 0; i < parallel.vertices.size(); ++i) {
+      maxError = (std::max)(maxError, std::abs(parallel.vertices[i] - tinyObj.vertices[i]));
+    }
+    for (size_t i = 0; i < parallel.normals.size(); ++i) {
+      maxError = (std::max)(maxError, std::abs(parallel.normals[i] - tinyObj.normals[i]));
+    }
+  }
+
+  double parallelMs = Median(parallelTimings);
+  double tinyObjMs = Median(tinyObjTimings);
+  std::printf("  %zu positions, %zu normals, %zu texcoords, %zu triangles\n",
+    tinyObj.vertices.size() / 3, tinyObj.normals.size() / 3, tinyObj.texcoords.size() / 2,
+    tinyObj.indices.size() / 3);
+  std::printf("  tinyobj::LoadObj  %10.2f ms\n", tinyObjMs);
+  std::printf("  parallel parser   %10.2f ms  (%.2fx)\n", parallelMs, tinyObjMs / parallelMs);
+  std::printf("  results %s, max attribute difference %g\n", 
+    sameIndices ? "match" : "DIFFER", maxError);
+}
+
+
+static const size_t kMathMatrices = 4096;
+static const uint32_t kMathPasses = 256;
+
+
+// Times kMathPasses sweeps over the inputs, keeps the last sweep's results for comparison.
+template<typename _Matrix, typename _Invert>
+static double TimeInverse(const std::vector<_Matrix> &inputs, std::vector<_Matrix> &outputs,
+  _Invert invert)
+{
+  outputs.resize(inputs.size());
+  BenchClock::time_point start = BenchClock::now();
+  for (uint32_t pass = 0; pass < kMathPasses; ++pass) {
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      outputs[i] = invert(inputs[i]);
+    }
+  }
+  return ElapsedMs(start);
+}
+
+
+// Times kMathPasses sweeps of kernel(i) over every i < kMathMatrices.
+template<typename _Kernel>
+static double TimePasses(_Kernel kernel)
+{
+  BenchClock::time_point start = BenchClock::now();
+  for (uint32_t pass = 0; pass < kMathPasses; ++pass) {
+    for (size_t i = 0; i < kMathMatrices; ++i) {
+      kernel(i);
+    }
+  }
+  return ElapsedMs(start);
+}
+
+
+// Largest difference between the two, relative to the glm element.
+static float MaxInverseError(const std::vector<Mat4> &ours, const std::vector<glm::mat4> &theirs)
+{
+  float maxError = 0.0f;
+  for (size_t i = 0; i < ours.size(); ++i) {
+    const float *a = ours[i].GetData();
+    const float *b = &theirs[i][0][0];
+    for (uint32_t j = 0; j < 16; ++j) {
+      maxError = (std::max)(maxError, std::abs(a[j] - b[j]) / (1.0f + std::abs(b[j])));
+    }
+  }
+  return maxError;
+}
+
+
+void Benchmark::MatrixInverse(uint32_t iterations)
+{
+  std::printf("Matrix inverse on %zu matrices, %u passes, %u iterations.\n", kMathMatrices,
+    kMathPasses, iterations);
+  // Model matrices like the renderer builds, and the same with a projection on top.
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> dist(-10.0f, 10.0f);
+  std::vector<glm::mat4> glmAffine(kMathMatrices);
+  std::vector<glm::mat4> glmGeneral(kMathMatrices);
+  std::vector<Mat4> affine(kMathMatrices);
+  std::vector<Mat4> general(kMathMatrices);
+  glm::mat4 projection = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 0.1f, 1000.0f);
+  for (size_t i = 0; i < kMathMatrices; ++i) {
+    glm::vec3 axis = glm::normalize(glm::vec3(dist(rng), dist(rng), dist(rng)) + glm::vec3(0.0f, 0.0f, 20.0f));
+    glm::mat4 model = glm::translate(glm::mat4(), glm::vec3(dist(rng), dist(rng), dist(rng)));
+    model = glm::rotate(model, dist(rng), axis);
+    model = glm::scale(model, glm::vec3(1.0f + std::abs(dist(rng))));
+    glmAffine[i] = model;
+    glmGeneral[i] = projection * model;
+    // Same memory layout, see ComputeNormalMatrix in base.cpp.
+    std::memcpy(affine[i].GetData(), &glmAffine[i][0][0], sizeof(glm::mat4));
+    std::memcpy(general[i].GetData(), &glmGeneral[i][0][0], sizeof(glm::mat4));
+  }
+
+  std::vector<double> glmGeneralTimings;
+  std::vector<double> generalTimings;
+  std::vector<double> glmAffineTimings;
+  std::vector<double> affineTimings;
+  std::vector<glm::mat4> glmGeneralOut;
+  std::vector<glm::mat4> glmAffineOut;
+  std::vector<Mat4> generalOut;
+  std::vector<Mat4> affineOut;
+  for (uint32_t i = 0; i < iterations; ++i) {
+    glmGeneralTimings.push_back(TimeInverse(glmGeneral, glmGeneralOut,
+      [] (const glm::mat4 &m) { return glm::inverse(m); }));
+    generalTimings.push_back(TimeInverse(general, generalOut,
+      [] (const Mat4 &m) { return m.Inverse(); }));
+    glmAffineTimings.push_back(TimeInverse(glmAffine, glmAffineOut,
+      [] (const glm::mat4 &m) { return glm::inverse(m); }));
+    affineTimings.push_back(TimeInverse(affine, affineOut,
+      [] (const Mat4 &m) { return m.Inverse(); }));
+  }
+
+  double count = static_cast<double>(kMathMatrices) * kMathPasses;
+  double glmGeneralNs = Median(glmGeneralTimings) * 1000000.0 / count;
+  double generalNs = Median(generalTimings) * 1000000.0 / count;
+  double glmAffineNs = Median(glmAffineTimings) * 1000000.0 / count;
+  double affineNs = Median(affineTimings) * 1000000.0 / count;
+  std::printf("  glm::inverse, projective  %8.2f ns\n", glmGeneralNs);
+  std::printf("  Mat4::Inverse, projective %8.2f ns  (%.2fx)  max difference %g\n", generalNs,
+    glmGeneralNs / generalNs, MaxInverseError(generalOut, glmGeneralOut));
+  std::printf("  glm::inverse, affine      %8.2f ns\n", glmAffineNs);
+  std::printf("  Mat4::Inverse, affine     %8.2f ns  (%.2fx)  max difference %g\n", affineNs,
+    glmAffineNs / affineNs, MaxInverseError(affineOut, glmAffineOut));
+}
+
+
+// Largest difference relative to the double precision scalar result.
+template<typename _Type>
+static float MaxRelativeError(const _Type *ours, const double *reference, uint32_t count)
+{
+  float maxError = 0.0f;
+  for (uint32_t i = 0; i < count; ++i) {
+    float error = static_cast<float>(std::abs(ours[i] - reference[i]) / (1.0 + std::abs(reference[i])));
+    maxError = (std::max)(maxError, error);
+  }
+  return maxError;
+}
+
+
+template<typename _Simd, typename _Scalar, typename _Glm>
+static void CompareMath(const char *name, uint32_t iterations, _Simd simd, _Scalar scalar, _Glm glm)
+{
+  std::vector<double> simdTimings;
+  std::vector<double> scalarTimings;
+  std::vector<double> glmTimings;
+  for (uint32_t i = 0; i < iterations; ++i) {
+    simdTimings.push_back(TimePasses(simd));
+    scalarTimings.push_back(TimePasses(scalar));
+    glmTimings.push_back(TimePasses(glm));
+  }
+  double count = static_cast<double>(kMathMatrices) * kMathPasses;
+  double simdNs = Median(simdTimings) * 1000000.0 / count;
+  double scalarNs = Median(scalarTimings) * 1000000.0 / count;
+  double glmNs = Median(glmTimings) * 1000000.0 / count;
+  std::printf("  %-14s %7.2f ns   double %7.2f ns (%.2fx)   glm %7.2f ns (%.2fx)\n", name, simdNs,
+    scalarNs, scalarNs / simdNs, glmNs, glmNs / simdNs);
+}
+
+
+bool Benchmark::SimdMath(uint32_t iterations)
+{
+  std::printf("Vec4/Mat4 float on %zu matrices, %u passes, %u iterations. SSE %d, AVX %d, FMA %d.\n",
+    kMathMatrices, kMathPasses, iterations, PBR_SIMD_SSE, PBR_SIMD_AVX, PBR_SIMD_FMA);
+  typedef Matrix4<double> DMat4;
+  typedef Vector4<double> DVec4;
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+  std::vector<Mat4> a(kMathMatrices);
+  std::vector<Mat4> b(kMathMatrices);
+  std::vector<Vec4> v(kMathMatrices);
+  std::vector<DMat4> da(kMathMatrices);
+  std::vector<DMat4> db(kMathMatrices);
+  std::vector<DVec4> dv(kMathMatrices);
+  // glm keeps columns where Mat4 keeps rows, so the same memory is the transpose.
+  std::vector<glm::mat4> ga(kMathMatrices);
+  std::vector<glm::mat4> gb(kMathMatrices);
+  std::vector<glm::vec4> gv(kMathMatrices);
+  for (size_t i = 0; i < kMathMatrices; ++i) {
+    for (uint32_t row = 0; row < 4; ++row) {
+      for (uint32_t col = 0; col < 4; ++col) {
+        a[i][row][col] = dist(rng);
+        b[i][row][col] = dist(rng);
+        da[i][row][col] = a[i][row][col];
+        db[i][row][col] = b[i][row][col];
+        ga[i][row][col] = a[i][row][col];
+        gb[i][row][col] = b[i][row][col];
+      }
+    }
+    v[i] = Vec4(dist(rng), dist(rng), dist(rng), dist(rng));
+    dv[i] = DVec4(v[i].x, v[i].y, v[i].z, v[i].w);
+    gv[i] = glm::vec4(v[i].x, v[i].y, v[i].z, v[i].w);
+  }
+
+  std::vector<Mat4> mats(kMathMatrices);
+  std::vector<DMat4> dmats(kMathMatrices);
+  std::vector<glm::mat4> gmats(kMathMatrices);
+  std::vector<Vec4> vecs(kMathMatrices);
+  std::vector<DVec4> dvecs(kMathMatrices);
+  std::vector<glm::vec4> gvecs(kMathMatrices);
+  std::vector<float> scalars(kMathMatrices);
+  std::vector<double> dscalars(kMathMatrices);
+  std::vector<float> gscalars(kMathMatrices);
+  float maxError = 0.0f;
+
+  // Each kernel runs once more after the timings, then checks against double precision.
+  auto checkMats = [&] () {
+    for (size_t i = 0; i < kMathMatrices; ++i) {
+      for (uint32_t row = 0; row < 4; ++row) {
+        maxError = (std::max)(maxError, MaxRelativeError(mats[i][row], dmats[i][row], 4));
+      }
+    }
+  };
+  auto checkVecs = [&] () {
+    for (size_t i = 0; i < kMathMatrices; ++i) {
+      float ours[4] = { vecs[i].x, vecs[i].y, vecs[i].z, vecs[i].w };
+      double reference[4] = { dvecs[i].x, dvecs[i].y, dvecs[i].z, dvecs[i].w };
+      maxError = (std::max)(maxError, MaxRelativeError(ours, reference, 4));
+    }
+  };
+
+  CompareMath("Mat4 * Mat4", iterations,
+    [&] (size_t i) { mats[i] = a[i] * b[i]; },
+    [&] (size_t i) { dmats[i] = da[i] * db[i]; },
+    [&] (size_t i) { gmats[i] = gb[i] * ga[i]; });
+  checkMats();
+  CompareMath("Mat4 * Vec4", iterations,
+    [&] (size_t i) { vecs[i] = a[i] * v[i]; },
+    [&] (size_t i) { dvecs[i] = da[i] * dv[i]; },
+    [&] (size_t i) { gvecs[i] = gv[i] * ga[i]; });
+  checkVecs();
+  CompareMath("Vec4 * Mat4", iterations,
+    [&] (size_t i) { vecs[i] = v[i] * a[i]; },
+    [&] (size_t i) { dvecs[i] = dv[i] * da[i]; },
+    [&] (size_t i) { gvecs[i] = ga[i] * gv[i]; });
+  checkVecs();
+  CompareMath("MulAdd", iterations,
+    [&] (size_t i) { vecs[i] = MulAdd(v[i], vecs[i], v[i]); },
+    [&] (size_t i) { dvecs[i] = MulAdd(dv[i], dvecs[i], dv[i]); },
+    [&] (size_t i) { gvecs[i] = glm::fma(gv[i], gvecs[i], gv[i]); });
+  // Iterated in place, so compare one step from the same start.
+  for (size_t i = 0; i < kMathMatrices; ++i) {
+    dvecs[i] = DVec4(vecs[i].x, vecs[i].y, vecs[i].z, vecs[i].w);
+    vecs[i] = MulAdd(v[i], vecs[i], v[i]);
+    dvecs[i] = MulAdd(dv[i], dvecs[i], dv[i]);
+  }
+  checkVecs();
+  CompareMath("Transpose", iterations,
+    [&] (size_t i) { mats[i] = a[i].Transpose(); },
+    [&] (size_t i) { dmats[i] = da[i].Transpose(); },
+    [&] (size_t i) { gmats[i] = glm::transpose(ga[i]); });
+  checkMats();
+  CompareMath("Determinant", iterations,
+    [&] (size_t i) { scalars[i] = a[i].Determinant(); },
+    [&] (size_t i) { dscalars[i] = da[i].Determinant(); },
+    [&] (size_t i) { gscalars[i] = glm::determinant(ga[i]); });
+  maxError = (std::max)(maxError, MaxRelativeError(scalars.data(), dscalars.data(), kMathMatrices));
+
+  bool match = maxError < 1e-4f;
+  std::printf("  results %s the double precision scalar templates, max difference %g\n",
+    match ? "match" : "DIFFER from", maxError);
+  return match;
+}
+
+
+// Three corners per triangle, as the ray kernels take them.
+static std::vector<Vec3> GetTriangles(const GeometryData &geometry)
+{
+  std::vector<Vec3> corners(geometry.indices.size());
+  for (size_t i = 0; i < geometry.indices.size(); ++i) {
+    const glm::vec3 &p = geometry.vertices[geometry.indices[i]].position;
+    corners[i] = Vec3(p.x, p.y, p.z);
+  }
+  return corners;
+}
+
+
+// Closest hit of every ray over every triangle, infinity if it missed them all.
+static void TraceScalar(const std::vector<Rayf> &rays, const std::vector<Vec3> &corners,
+  std::vector<float> &closest)
+{
+  closest.resize(rays.size());
+  for (size_t r = 0; r < rays.size(); ++r) {
+    Rayf ray = rays[r];
+    TriangleHit<float> hit;
+    for (size_t i = 0; i < corners.size(); i += 3) {
+      IntersectTriangle(ray, corners[i], corners[i + 1], corners[i + 2], hit);
+    }
+    closest[r] = ray.tMax;
+  }
+}
+
+
+// Same as TraceScalar, _Width rays at a time. rays must be a multiple of _Width.
+template<int _Width>
+static void TracePackets(const std::vector<Rayf> &rays, const std::vector<Vec3> &corners,
+  std::vector<float> &closest)
+{
+  closest.resize(rays.size());
+  for (size_t first = 0; first < rays.size(); first += _Width) {
+    RayPacket<_Width> packet;
+    PacketHit<_Width> hit;
+    for (int lane = 0; lane < _Width; ++lane) {
+      packet.Set(lane, rays[first + lane]);
+    }
+    for (size_t i = 0; i < corners.size(); i += 3) {
+      IntersectTriangle(packet, corners[i], corners[i + 1], corners[i + 2], hit);
+    }
+    for (int lane = 0; lane < _Width; ++lane) {
+      closest[first + lane] = packet.tMax[lane];
+    }
+  }
+}
+
+
+// Bit per ray and box that hit, ray major.
+static void BoxesScalar(const std::vector<Rayf> &rays, const std::vector<Vec3> &boxes,
+  std::vector<uint8_t> &hits)
+{
+  size_t boxCount = boxes.size() / 2;
+  hits.resize(rays.size() * boxCount);
+  for (size_t r = 0; r < rays.size(); ++r) {
+    for (size_t i = 0; i < boxCount; ++i) {
+      float tNear;
+      hits[r * boxCount + i] = IntersectBox(rays[r], boxes[i * 2], boxes[i * 2 + 1], tNear) ? 1 : 0;
+    }
+  }
+}
+
+
+template<int _Width>
+static void BoxesPackets(const std::vector<Rayf> &rays, const std::vector<Vec3> &boxes,
+  std::vector<uint8_t> &hits)
+{
+  size_t boxCount = boxes.size() / 2;
+  hits.resize(rays.size() * boxCount);
+  for (size_t first = 0; first < rays.size(); first += _Width) {
+    RayPacket<_Width> packet;
+    for (int lane = 0; lane < _Width; ++lane) {
+      packet.Set(lane, rays[first + lane]);
+    }
+    for (size_t i = 0; i < boxCount; ++i) {
+      alignas(32) float tNear[_Width];
+      int mask = IntersectBox(packet, boxes[i * 2], boxes[i * 2 + 1], tNear);
+      for (int lane = 0; lane < _Width; ++lane) {
+        hits[(first + lane) * boxCount + i] = (mask >> lane) & 1;
+      }
+    }
+  }
+}
+
+
+// Rays whose closest hits disagree, either hitting or not, or at different distances.
+static size_t CountMismatches(const std::vector<float> &a, const std::vector<float> &b)
+{
+  size_t mismatches = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    bool same = (a[i] == b[i]) || std::abs(a[i] - b[i]) <= 1e-5f * (1.0f + std::abs(b[i]));
+    if (!same) ++mismatches;
+  }
+  return mismatches;
+}
+
+
+static size_t CountMisses(const std::vector<float> &closest)
+{
+  size_t misses = 0;
+  for (float t : closest) {
+    if (t == std::numeric_limits<float>::infinity()) ++misses;
+  }
+  return misses;
+}
+
+
+// Rays from a point inside a closed mesh, at each of its corners and edge midpoints,
+// which is where rounding would let a ray slip between two triangles, plus random ones.
+static std::vector<Rayf> MakeWatertightRays(const std::vector<Vec3> &corners, const Vec3 &origin,
+  std::mt19937 &rng, uint32_t randomCount)
+{
+  std::vector<Rayf> rays;
+  for (size_t i = 0; i < corners.size(); i += 3) {
+    for (uint32_t j = 0; j < 3; ++j) {
+      const Vec3 &a = corners[i + j];
+      const Vec3 &b = corners[i + (j + 1) % 3];
+      Vec3 midpoint((a.x + b.x) * 0.5f, (a.y + b.y) * 0.5f, (a.z + b.z) * 0.5f);
+      rays.push_back(Rayf(origin, a - origin));
+      rays.push_back(Rayf(origin, midpoint - origin));
+    }
+  }
+  std::normal_distribution<float> normal;
+  for (uint32_t i = 0; i < randomCount; ++i) {
+    rays.push_back(Rayf(origin, Vec3(normal(rng), normal(rng), normal(rng))));
+  }
+  // Pad to a whole number of 8 wide packets.
+  while (rays.size() % 8) {
+    rays.push_back(rays.back());
+  }
+  return rays;
+}
+
+
+// Rays from all around the model at random points inside its bounds.
+static std::vector<Rayf> MakeModelRays(const std::vector<Vec3> &corners, size_t count,
+  std::mt19937 &rng)
+{
+  Vec3 boundsMin = corners[0];
+  Vec3 boundsMax = corners[0];
+  for (const Vec3 &p : corners) {
+    boundsMin = Vec3((std::min)(boundsMin.x, p.x), (std::min)(boundsMin.y, p.y), (std::min)(boundsMin.z, p.z));
+    boundsMax = Vec3((std::max)(boundsMax.x, p.x), (std::max)(boundsMax.y, p.y), (std::max)(boundsMax.z, p.z));
+  }
+  Vec3 center((boundsMin.x + boundsMax.x) * 0.5f, (boundsMin.y + boundsMax.y) * 0.5f,
+    (boundsMin.z + boundsMax.z) * 0.5f);
+  float radius = Distance(boundsMin, boundsMax);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+  std::normal_distribution<float> normal;
+  std::vector<Rayf> rays(count);
+  for (Rayf &ray : rays) {
+    Vec3 around = Normalize(Vec3(normal(rng), normal(rng), normal(rng)));
+    Vec3 origin(center.x + around.x * radius, center.y + around.y * radius, center.z + around.z * radius);
+    Vec3 target(boundsMin.x + (boundsMax.x - boundsMin.x) * unit(rng),
+      boundsMin.y + (boundsMax.y - boundsMin.y) * unit(rng),
+      boundsMin.z + (boundsMax.z - boundsMin.z) * unit(rng));
+    ray = Rayf(origin, target - origin);
+  }
+  return rays;
+}
+
+
+bool Benchmark::RayKernels(const char *filepath, uint32_t iterations)
+{
+  std::printf("Ray kernels, SSE %d, AVX %d, FMA %d.\n", PBR_SIMD_SSE, PBR_SIMD_AVX, PBR_SIMD_FMA);
+  std::mt19937 rng(1234);
+  bool ok = true;
+
+  // Watertightness, every ray from inside the closed sphere has to hit it.
+  std::vector<Vec3> sphere = GetTriangles(Geometry::CreateSphere(1.0f, 32, 32));
+  const Vec3 origins[] = { Vec3(0.0f, 0.0f, 0.0f), Vec3(0.31f, -0.22f, 0.17f) };
+  for (const Vec3 &origin : origins) {
+    std::vector<Rayf> rays = MakeWatertightRays(sphere, origin, rng, 4096);
+    std::vector<float> scalar;
+    std::vector<float> packet4;
+    std::vector<float> packet8;
+    TraceScalar(rays, sphere, scalar);
+    TracePackets<4>(rays, sphere, packet4);
+    TracePackets<8>(rays, sphere, packet8);
+    size_t leaks = CountMisses(scalar) + CountMisses(packet4) + CountMisses(packet8);
+    size_t mismatches = CountMismatches(packet4, scalar) + CountMismatches(packet8, scalar);
+    std::printf("  sphere, %zu triangles, %zu rays from (%.2f, %.2f, %.2f): %zu leaks, %zu packet mismatches\n",
+      sphere.size() / 3, rays.size(), origin.x, origin.y, origin.z, leaks, mismatches);
+    ok = ok && leaks == 0 && mismatches == 0;
+  }
+
+  // Throughput, rays from around the model at points inside its bounds.
+  GeometryData geometry = Model::LoadModel("bench", filepath);
+  std::vector<Vec3> corners = GetTriangles(geometry);
+  size_t triangleCount = corners.size() / 3;
+  if (triangleCount == 0) {
+    std::printf("No triangles in %s\n", filepath);
+    return false;
+  }
+  // Enough rays for about 50 million triangle tests per run, in whole 8 wide packets.
+  size_t rayCount = (std::max)(size_t(64), size_t(50000000) / triangleCount);
+  rayCount = (rayCount + 7) & ~size_t(7);
+  std::vector<Rayf> rays = MakeModelRays(corners, rayCount, rng);
+
+  std::vector<float> scalar;
+  std::vector<float> packet4;
+  std::vector<float> packet8;
+  std::vector<double> scalarTimings;
+  std::vector<double> packet4Timings;
+  std::vector<double> packet8Timings;
+  for (uint32_t i = 0; i < iterations; ++i) {
+    BenchClock::time_point start = BenchClock::now();
+    TraceScalar(rays, corners, scalar);
+    scalarTimings.push_back(ElapsedMs(start));
+    start = BenchClock::now();
+    TracePackets<4>(rays, corners, packet4);
+    packet4Timings.push_back(ElapsedMs(start));
+    start = BenchClock::now();
+    TracePackets<8>(rays, corners, packet8);
+    packet8Timings.push_back(ElapsedMs(start));
+  }
+  double tests = static_cast<double>(rayCount) * triangleCount;
+  double scalarMs = Median(scalarTimings);
+  double packet4Ms = Median(packet4Timings);
+  double packet8Ms = Median(packet8Timings);
+  size_t mismatches = CountMismatches(packet4, scalar) + CountMismatches(packet8, scalar);
+  std::printf("  %zu triangles, %zu rays, %zu hit, brute force over every triangle:\n",
+    triangleCount, rayCount, rayCount - CountMisses(scalar));
+  std::printf("    ray/triangle scalar    %10.0f rays/s  %8.1f M tests/s\n",
+    rayCount * 1000.0 / scalarMs, tests / (scalarMs * 1000.0));
+  std::printf("    ray/triangle 4 wide    %10.0f rays/s  %8.1f M tests/s  (%.2fx)\n",
+    rayCount * 1000.0 / packet4Ms, tests / (packet4Ms * 1000.0), scalarMs / packet4Ms);
+  std::printf("    ray/triangle 8 wide    %10.0f rays/s  %8.1f M tests/s  (%.2fx)\n",
+    rayCount * 1000.0 / packet8Ms, tests / (packet8Ms * 1000.0), scalarMs / packet8Ms);
+  ok = ok && mismatches == 0;
+
+  // Slab test against the bounds of each triangle.
+  std::vector<Vec3> boxes(triangleCount * 2);
+  for (size_t i = 0; i < triangleCount; ++i) {
+    const Vec3 *p = &corners[i * 3];
+    boxes[i * 2] = Vec3((std::min)((std::min)(p[0].x, p[1].x), p[2].x),
+      (std::min)((std::min)(p[0].y, p[1].y), p[2].y), (std::min)((std::min)(p[0].z, p[1].z), p[2].z));
+    boxes[i * 2 + 1] = Vec3((std::max)((std::max)(p[0].x, p[1].x), p[2].x),
+      (std::max)((std::max)(p[0].y, p[1].y), p[2].y), (std::max)((std::max)(p[0].z, p[1].z), p[2].z));
+  }
+  std::vector<uint8_t> scalarHits;
+  std::vector<uint8_t> packet4Hits;
+  std::vector<uint8_t> packet8Hits;
+  scalarTimings.clear();
+  packet4Timings.clear();
+  packet8Timings.clear();
+  for (uint32_t i = 0; i < iterations; ++i) {
+    BenchClock::time_point start = BenchClock::now();
+    BoxesScalar(rays, boxes, scalarHits);
+    scalarTimings.push_back(ElapsedMs(start));
+    start = BenchClock::now();
+    BoxesPackets<4>(rays, boxes, packet4Hits);
+    packet4Timings.push_back(ElapsedMs(start));
+    start = BenchClock::now();
+    BoxesPackets<8>(rays, boxes, packet8Hits);
+    packet8Timings.push_back(ElapsedMs(start));
+  }
+  scalarMs = Median(scalarTimings);
+  packet4Ms = Median(packet4Timings);
+  packet8Ms = Median(packet8Timings);
+  bool boxesMatch = scalarHits == packet4Hits && scalarHits == packet8Hits;
+  std::printf("    ray/box scalar         %10.0f rays/s  %8.1f M tests/s\n",
+    rayCount * 1000.0 / scalarMs, tests / (scalarMs * 1000.0));
+  std::printf("    ray/box 4 wide         %10.0f rays/s  %8.1f M tests/s  (%.2fx)\n",
+    rayCount * 1000.0 / packet4Ms, tests / (packet4Ms * 1000.0), scalarMs / packet4Ms);
+  std::printf("    ray/box 8 wide         %10.0f rays/s  %8.1f M tests/s  (%.2fx)\n",
+    rayCount * 1000.0 / packet8Ms, tests / (packet8Ms * 1000.0), scalarMs / packet8Ms);
+  std::printf("  packet results %s the scalar kernels, %zu triangle mismatches\n",
+    (mismatches == 0 && boxesMatch) ? "match" : "DIFFER from", mismatches);
+  return ok && boxesMatch;
+}
+
+
+// Builds a BVH over the geometry and prints how long it took and how good it is, then
+// checks its closest hits against brute force over every triangle and times tracing.
+static bool ReportBvh(const char *name, const GeometryData &geometry, uint32_t iterations,
+  std::mt19937 &rng)
+{
+  Bvh bvh;
+  std::vector<double> buildTimings;
+  for (uint32_t i = 0; i < iterations; ++i) {
+    bvh.Build(geometry);
+    buildTimings.push_back(bvh.GetStats().buildMs);
+  }
+  const Bvh::Stats &stats = bvh.GetStats();
+  std::vector<Vec3> corners = GetTriangles(geometry);
+  size_t triangleCount = corners.size() / 3;
+  std::printf("  %s, %zu triangles\n", name, triangleCount);
+  if (triangleCount == 0) {
+    return false;
+  }
+  std::printf("    build %.2f ms, %u nodes, %u leaves, %.2f triangles per leaf, depth %u, SAH cost %.2f\n",
+    Median(buildTimings), stats.nodeCount, stats.leafCount, stats.averageLeafSize, stats.maxDepth,
+    stats.sahCost);
+
+  // Brute force is slow on the scans, about 20 million triangle tests worth of rays.
+  size_t checkCount = (std::max)(size_t(64), size_t(20000000) / triangleCount);
+  std::vector<Rayf> rays = MakeModelRays(corners, checkCount, rng);
+  std::vector<float> reference;
+  TraceScalar(rays, corners, reference);
+  std::vector<float> closest(rays.size());
+  for (size_t r = 0; r < rays.size(); ++r) {
+    Rayf ray = rays[r];
+    TriangleHit<float> hit;
+    uint32_t triangle;
+    bvh.Intersect(ray, hit, triangle);
+    closest[r] = ray.tMax;
+  }
+  size_t mismatches = CountMismatches(closest, reference);
+
+  rays = MakeModelRays(corners, 1 << 20, rng);
+  std::vector<double> traceTimings;
+  size_t hits = 0;
+  for (uint32_t i = 0; i < iterations; ++i) {
+    hits = 0;
+    BenchClock::time_point start = BenchClock::now();
+    for (const Rayf &r : rays) {
+      Rayf ray = r;
+      TriangleHit<float> hit;
+      uint32_t triangle;
+      hits += bvh.Intersect(ray, hit, triangle) ? 1 : 0;
+    }
+    traceTimings.push_back(ElapsedMs(start));
+  }
+  std::printf("    %zu rays, %zu hit, %.2f M rays/s on one thread\n", rays.size(), hits,
+    rays.size() / (Median(traceTimings) * 1000.0));
+  std::printf("    closest hits %s brute force, %zu of %zu rays differ\n",
+    mismatches == 0 ? "match" : "DIFFER from", mismatches, reference.size());
+  return mismatches == 0;
+}
+
+
+bool Benchmark::BvhBuild(const char *filepath, uint32_t iterations)
+{
+  std::printf("SAH BVH build, %u worker threads, %u bins, leaves up to %u triangles.\n",
+    ThreadPool::Global().GetThreadCount(), Bvh::kBinCount, Bvh::kMaxLeafSize);
+  std::mt19937 rng(1234);
+  bool ok = ReportBvh("sphere", Geometry::CreateSphere(1.0f, 32, 32), iterations, rng);
+  ok = ReportBvh(filepath, Model::LoadModel("bench", filepath), iterations, rng) && ok;
+  return ok;
+}
+
+
+// Closest hit of every ray through one of the BVHs, timed.
+template<typename _Bvh>
+static double TraceBvh(const _Bvh &bvh, const std::vector<Rayf> &rays, std::vector<float> &closest)
+{
+  closest.resize(rays.size());
+  BenchClock::time_point start = BenchClock::now();
+  for (size_t r = 0; r < rays.size(); ++r) {
+    Rayf ray = rays[r];
+    TriangleHit<float> hit;
+    uint32_t triangle;
+    bvh.Intersect(ray, hit, triangle);
+    closest[r] = ray.tMax;
+  }
+  return ElapsedMs(start);
+}
+
+
+bool Benchmark::WideTraversal(const char *filepath, uint32_t iterations)
+{
+  std::printf("Wide BVH traversal on %s, SSE %d, AVX %d.\n", filepath, PBR_SIMD_SSE, PBR_SIMD_AVX);
+  GeometryData geometry = Model::LoadModel("bench", filepath);
+  Bvh bvh;
+  bvh.Build(geometry);
+  Bvh4 bvh4;
+  bvh4.Collapse(bvh);
+  Bvh8 bvh8;
+  bvh8.Collapse(bvh);
+  std::vector<Vec3> corners = GetTriangles(geometry);
+  if (corners.empty()) {
+    std::printf("No triangles in %s\n", filepath);
+    return false;
+  }
+  const Bvh4::Stats &stats4 = bvh4.GetStats();
+  const Bvh8::Stats &stats8 = bvh8.GetStats();
+  std::printf("  %zu triangles, binary build %.2f ms\n", corners.size() / 3, bvh.GetStats().buildMs);
+  std::printf("    binary   %8u nodes, %6.2f MB\n", bvh.GetStats().nodeCount,
+    bvh.GetStats().nodeCount * sizeof(BvhNode) / (1024.0 * 1024.0));
+  std::printf("    4 wide   %8u nodes, %6.2f MB, %.2f children per node, collapse %.2f ms\n",
+    stats4.nodeCount, stats4.nodeBytes / (1024.0 * 1024.0), stats4.averageChildren, stats4.collapseMs);
+  std::printf("    8 wide   %8u nodes, %6.2f MB, %.2f children per node, collapse %.2f ms\n",
+    stats8.nodeCount, stats8.nodeBytes / (1024.0 * 1024.0), stats8.averageChildren, stats8.collapseMs);
+
+  std::mt19937 rng(1234);
+  std::vector<Rayf> rays = MakeModelRays(corners, 1 << 20, rng);
+  std::vector<float> binary;
+  std::vector<float> wide4;
+  std::vector<float> wide8;
+  std::vector<double> binaryTimings;
+  std::vector<double> wide4Timings;
+  std::vector<double> wide8Timings;
+  for (uint32_t i = 0; i < iterations; ++i) {
+    binaryTimings.push_back(TraceBvh(bvh, rays, binary));
+    wide4Timings.push_back(TraceBvh(bvh4, rays, wide4));
+    wide8Timings.push_back(TraceBvh(bvh8, rays, wide8));
+  }
+  double binaryMs = Median(binaryTimings);
+  double wide4Ms = Median(wide4Timings);
+  double wide8Ms = Median(wide8Timings);
+  size_t mismatches = CountMismatches(wide4, binary) + CountMismatches(wide8, binary);
+  std::printf("  %zu rays, %zu hit, one thread:\n", rays.size(), rays.size() - CountMisses(binary));
+  std::printf("    binary   %8.2f M rays/s\n", rays.size() / (binaryMs * 1000.0));
+  std::printf("    4 wide   %8.2f M rays/s  (%.2fx)\n", rays.size() / (wide4Ms * 1000.0), binaryMs / wide4Ms);
+  std::printf("    8 wide   %8.2f M rays/s  (%.2fx)\n", rays.size() / (wide8Ms * 1000.0), binaryMs / wide8Ms);
+  std::printf("  closest hits %s binary traversal, %zu mismatches\n",
+    mismatches == 0 ? "match" : "DIFFER from", mismatches);
+  return mismatches == 0;
+}
+
+
+// Mean squared error of the luminance of image against reference.
+static double LuminanceError(const std::vector<float> &image, const std::vector<float> &reference)
+{
+  double error = 0.0;
+  for (size_t i = 0; i < image.size(); i += 3) {
+    double difference =
+      0.2126 * (image[i + 0] - reference[i + 0]) +
+      0.7152 * (image[i + 1] - reference[i + 1]) +
+      0.0722 * (image[i + 2] - reference[i + 2]);
+    error += difference * difference;
+  }
+  return error / (image.size() / 3);
+}
+
+
+// Render samples passes of scene, returning the mean ms per pass.
+static double RenderPasses(PathTracer &tracer, const GeometryData &geometry,
+  const gli::texture_cube &cube, const PathTracer::Scene &scene, uint32_t samples,
+  std::vector<float> &rgb)
+{
+  tracer.SetScene(geometry, cube, scene);
+  BenchClock::time_point start = BenchClock::now();
+  for (uint32_t i = 0; i < samples; ++i) {
+    tracer.RenderPass();
+  }
+  double ms = ElapsedMs(start) / samples;
+  tracer.Resolve(rgb);
+  return ms;
+}
+
+
+bool Benchmark::EnvironmentSampling(const char *filepath, uint32_t samples, uint32_t runs)
+{
+  std::printf("Environment map sampling on %s, %u threads.\n", filepath,
+    ThreadPool::Global().GetThreadCount() + 1);
+  gli::texture_cube cube(gli::load(filepath));
+  if (cube.empty() || cube.format() != gli::FORMAT_RGBA32_SFLOAT_PACK32) {
+    std::printf("Could not load %s as an RGBA32F cubemap\n", filepath);
+    return false;
+  }
+
+  std::vector<double> timings;
+  EnvironmentMap envMap;
+  for (uint32_t i = 0; i < 5; ++i) {
+    BenchClock::time_point start = BenchClock::now();
+    envMap.Load(cube);
+    timings.push_back(ElapsedMs(start));
+  }
+  uint32_t size = envMap.GetSize();
+  std::printf("  6x%ux%u texels, load and build %.2f ms\n", size, size, Median(timings));
+
+  // Sampled densities against Pdf(), and Pdf() integrated over the texels. The samples
+  // stay off the texel edges, rounding can move those into the next texel over.
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  std::uniform_real_distribution<float> inside(0.01f, 0.99f);
+  float worstDensity = 0.0f;
+  for (uint32_t i = 0; i < (1 << 16); ++i) {
+    glm::vec4 xI(uniform(rng), uniform(rng), inside(rng), inside(rng));
+    float pdf;
+    glm::vec3 direction = envMap.Sample(xI, pdf);
+    worstDensity = (std::max)(worstDensity, std::abs(envMap.Pdf(direction) - pdf) / pdf);
+  }
+  double integral = 0.0;
+  for (uint32_t face = 0; face < 6; ++face) {
+    for (uint32_t y = 0; y < size; ++y) {
+      for (uint32_t x = 0; x < size; ++x) {
+        glm::vec3 direction = EnvironmentMap::GetDirection(face, (x + 0.5f) / size, (y + 0.5f) / size);
+        integral += envMap.Pdf(direction) * envMap.GetSolidAngle(x, y);
+      }
+    }
+  }
+  bool consistent = worstDensity < 1e-3f && std::abs(integral - 1.0) < 1e-2;
+  std::printf("  sampled densities within %.2e of Pdf(), which integrates to %.4f\n",
+    worstDensity, integral);
+
+  // Mostly rough, so the BRDF alone spreads its samples wide.
+  GeometryData geometry = Geometry::CreateSphere(1.0f, 128, 96);
+  PathTracer tracer(160, 100);
+  PathTracer::Scene scene;
+  scene.roughness = 0.7f;
+  scene.metallic = 0.2f;
+  std::vector<float> reference;
+  scene.seed = runs + 1;
+  uint32_t referenceSamples = samples * 64;
+  double referenceMs = RenderPasses(tracer, geometry, cube, scene, referenceSamples, reference);
+  std::printf("  reference %u samples per pixel, %.2f ms per pass\n", referenceSamples, referenceMs);
+
+  double errors[2] = { 0.0, 0.0 };
+  double passMs[2] = { 0.0, 0.0 };
+  std::vector<float> image;
+  for (uint32_t mode = 0; mode < 2; ++mode) {
+    scene.sampleEnvironment = mode == 1;
+    for (uint32_t run = 0; run < runs; ++run) {
+      scene.seed = run;
+      passMs[mode] += RenderPasses(tracer, geometry, cube, scene, samples, image) / runs;
+      errors[mode] += LuminanceError(image, reference) / runs;
+    }
+  }
+  std::printf("  %u samples per pixel, mean squared error over %u runs:\n", samples, runs);
+  std::printf("    BRDF only      %10.3e  %7.2f ms per pass\n", errors[0], passMs[0]);
+  std::printf("    MIS with map   %10.3e  %7.2f ms per pass  (%.2fx less error, %.2fx per ms)\n",
+    errors[1], passMs[1], errors[0] / errors[1], (errors[0] * passMs[0]) / (errors[1] * passMs[1]));
+  return consistent;
+}
+} // pbr
@@ -0,0 +1,57 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __BENCHMARK_HPP
+#define __BENCHMARK_HPP
+
+
+#include "platform.hpp"
+#include <stdint.h>
+
+
+namespace pbr {
+
+
+/// Offline benchmarks, run from the command line with --bench <name> [file].
+/// These do not need a window or a vulkan device, they time the cpu side
+/// systems of the renderer and print their results to stdout.
+class Benchmark {
+public:
+  /// Run the benchmark with the given name. Returns false if there is no such benchmark.
+  static bool Run(const char *name, const char *filepath);
+
+  /// Time the parallel OBJ parser against tinyobj::LoadObj on the same file, 
+  /// and check that both produce the same attributes and faces.
+  static void ObjParsers(const char *filepath, uint32_t iterations = 5);
+
+  /// Time Mat4::Inverse against glm::inverse on the same matrices, for both the 
+  /// general path and the affine fast path, and report how far the results drift apart.
+  static void MatrixInverse(uint32_t iterations = 5);
+
+  /// Time the SSE/AVX Vec4 and Mat4 against the scalar templates and glm, and check 
+  /// that they agree with the scalar templates run in double precision. Returns false
+  /// if they don't.
+  static bool SimdMath(uint32_t iterations = 5);
+
+  /// Check that the ray/triangle kernels are watertight on a closed sphere, and that 
+  /// the 4 and 8 wide packet kernels agree with the scalar ones. Then time all of them,
+  /// ray/triangle and ray/box, brute force over the triangles of the OBJ at filepath.
+  static bool RayKernels(const char *filepath, uint32_t iterations = 3);
+
+  /// Build the SAH BVH over the sphere from Geometry::CreateSphere and over the OBJ at
+  /// filepath, reporting build time and tree quality. Then check that closest hits
+  /// through it match brute force, and time tracing through it.
+  static bool BvhBuild(const char *filepath, uint32_t iterations = 5);
+
+  /// Collapse the binary BVH over the OBJ at filepath into 4 and 8 wide ones, and
+  /// time tracing through all three. Returns false if their closest hits disagree.
+  static bool WideTraversal(const char *filepath, uint32_t iterations = 3);
+
+  /// Build the importance sampling distribution of the KTX cubemap at filepath, and
+  /// check that its densities match what gets sampled and integrate to one. Then path
+  /// trace a sphere under the map with and without sampling it, and compare the error
+  /// of both against a long render at the same number of samples per pixel.
+  static bool EnvironmentSampling(const char *filepath, uint32_t samples = 16, uint32_t runs = 4);
+};
+} // pbr
+#endif // __BENCHMARK_HPP
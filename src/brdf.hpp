@@ -0,0 +1,102 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __BRDF_HPP
+#define __BRDF_HPP
+
+
+#include "vertex.hpp"
+#include <algorithm>
+#include <cmath>
+
+
+namespace pbr {
+
+
+// The shading model of shaders/test.frag on the CPU, for the reference path tracer.
+// Keep these in step with the shader, the point of the tracer is to check it.
+
+
+const float kBrdfPi = 3.14159265359f;
+
+
+/// GGX from Trowbridge-Reitz, same as DGGX in test.frag.
+inline float DGGX(float NoH, float roughness)
+{
+  float alpha = (roughness * roughness);
+  float alpha2 = (alpha * alpha);
+  float denom = (NoH * NoH) * (alpha2 - 1.0f) + 1.0f;
+  return alpha2 / (kBrdfPi * (denom * denom));
+}
+
+
+/// Geometric shadowing with Schlick-Smith GGX, with the direct lighting remap of k
+/// that test.frag uses.
+inline float GSchlickmithGGX(float NoL, float NoV, float roughness)
+{
+  float remap = roughness + 1.0f;
+  float k = (remap * remap) / 8.0f;
+  float GL = NoL / (NoL * (1.0f - k) + k);
+  float GV = NoV / (NoV * (1.0f - k) + k);
+  return GL * GV;
+}
+
+
+/// Schlick's Fresnel approximation, with the roughness term of test.frag.
+inline glm::vec3 FSchlick(float cosTheta, const glm::vec3 &F0, float roughness)
+{
+  return F0 + (glm::max(glm::vec3(1.0f - roughness), F0) - F0) * std::pow(1.0f - cosTheta, 5.0f);
+}
+
+
+/// Karis' GGX importance sampling, a half vector around N distributed as D(H) * NoH.
+inline glm::vec3 ImportanceSampleGGX(const glm::vec2 &xI, float roughness, const glm::vec3 &N)
+{
+  float alpha = roughness * roughness;
+  float phi = 2.0f * kBrdfPi * xI.x;
+  float cosTheta = std::sqrt((1.0f - xI.y) / (1.0f + (alpha * alpha - 1.0f) * xI.y));
+  float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
+
+  glm::vec3 H;
+  H.x = sinTheta * std::cos(phi);
+  H.y = sinTheta * std::sin(phi);
+  H.z = cosTheta;
+
+  glm::vec3 upVector = std::abs(N.z) < 0.999f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+  glm::vec3 tangentX = glm::normalize(glm::cross(upVector, N));
+  glm::vec3 tangentY = glm::cross(N, tangentX);
+
+  return tangentX * H.x + tangentY * H.y + N * H.z;
+}
+
+
+/// Density of L = reflect(-V, H) with H from ImportanceSampleGGX(), per solid angle of L.
+inline float PdfGGX(float NoH, float VoH, float roughness)
+{
+  return DGGX(NoH, roughness) * NoH / (4.0f * (std::max)(VoH, 1e-6f));
+}
+
+
+/// The Cook-Torrance BRDF of test.frag's point light term, diffuse and specular, without
+/// the light's radiance. V, N and L are normalized.
+inline glm::vec3 BRDF(const glm::vec3 &V, const glm::vec3 &N, const glm::vec3 &L,
+  const glm::vec3 &baseColor, float metallic, float roughness)
+{
+  glm::vec3 H = glm::normalize(V + L);
+  float dotNL = glm::clamp(glm::dot(N, L), 0.0f, 1.0f);
+  float dotNV = glm::clamp(glm::dot(N, V), 0.0f, 1.0f);
+  float dotNH = glm::clamp(glm::dot(N, H), 0.0f, 1.0f);
+  if (dotNL <= 0.0f) {
+    return glm::vec3(0.0f);
+  }
+  glm::vec3 F0 = glm::mix(glm::vec3(0.04f), baseColor, metallic);
+  float D = DGGX(dotNH, roughness);
+  float G = GSchlickmithGGX(dotNL, dotNV, roughness);
+  glm::vec3 F = FSchlick(dotNV, F0, roughness);
+  // The shader divides by zero at grazing angles, the tracer can't afford to.
+  glm::vec3 specular = D * F * G / (std::max)(4.0f * dotNL * dotNV, 1e-6f);
+  glm::vec3 kD = (glm::vec3(1.0f) - F) * (1.0f - metallic);
+  return kD * baseColor / kBrdfPi + specular;
+}
+} // pbr
+#endif // __BRDF_HPP
@@ -0,0 +1,510 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "bvh.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <limits>
+
+
+namespace pbr {
+
+
+const float Bvh::kTraversalCost = 1.0f;
+const float Bvh::kIntersectionCost = 1.0f;
+
+// Ranges at least this big bin their triangles over the pool, in chunks.
+static const uint32_t kParallelBinThreshold = 1 << 16;
+static const uint32_t kBinChunkSize = 1 << 14;
+// Ranges at least this big build their two halves as separate tasks.
+static const uint32_t kTaskThreshold = 1 << 12;
+
+
+struct BvhBox {
+  void Reset() {
+    for (uint32_t i = 0; i < 3; ++i) {
+      min[i] = std::numeric_limits<float>::infinity();
+      max[i] = -std::numeric_limits<float>::infinity();
+    }
+  }
+
+  void Grow(const float p[3]) {
+    for (uint32_t i = 0; i < 3; ++i) {
+      min[i] = (std::min)(min[i], p[i]);
+      max[i] = (std::max)(max[i], p[i]);
+    }
+  }
+
+  void Grow(const BvhBox &box) {
+    for (uint32_t i = 0; i < 3; ++i) {
+      min[i] = (std::min)(min[i], box.min[i]);
+      max[i] = (std::max)(max[i], box.max[i]);
+    }
+  }
+
+  float Area() const {
+    if (min[0] > max[0]) return 0.0f;
+    float dx = max[0] - min[0];
+    float dy = max[1] - min[1];
+    float dz = max[2] - min[2];
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+  }
+
+  float min[3];
+  float max[3];
+};
+
+
+struct BvhPrimitive {
+  BvhBox    box;
+  float     centroid[3];
+  uint32_t  triangle;
+};
+
+
+struct BvhBin {
+  void Reset() {
+    box.Reset();
+    centroids.Reset();
+    count = 0;
+  }
+
+  void Grow(const BvhBin &bin) {
+    box.Grow(bin.box);
+    centroids.Grow(bin.centroids);
+    count += bin.count;
+  }
+
+  BvhBox    box;
+  BvhBox    centroids;
+  uint32_t  count;
+};
+
+
+struct BvhBuildNode {
+  BvhBox    box;
+  uint32_t  children[2];
+  uint32_t  first;
+  /// Triangles in the leaf, 0 for an inner node.
+  uint32_t  count;
+  uint16_t  axis;
+};
+
+
+// Bins of all three axes, kBinCount per axis.
+struct BvhBins {
+  BvhBin bins[3][Bvh::kBinCount];
+};
+
+
+class BvhBuilder {
+public:
+  explicit BvhBuilder(std::vector<BvhPrimitive> &primitives)
+    : mPrimitives(primitives)
+    , mNodes((std::max)(size_t(1), primitives.size() * 2))
+    , mNodeCount(0)
+    , mMaxDepth(0) { }
+
+  /// Build the subtree over primitives [begin, end), returns its node.
+  uint32_t Build(uint32_t begin, uint32_t end, const BvhBox &box, const BvhBox &centroids,
+    uint32_t depth);
+
+  const std::vector<BvhBuildNode> &GetNodes() const { return mNodes; }
+  uint32_t GetMaxDepth() const { return mMaxDepth.load(); }
+
+private:
+  uint32_t MakeLeaf(uint32_t begin, uint32_t end, const BvhBox &box, uint32_t depth);
+  void BinRange(uint32_t begin, uint32_t end, const BvhBox &centroids, BvhBins &bins) const;
+
+  std::vector<BvhPrimitive>  &mPrimitives;
+  std::vector<BvhBuildNode>  mNodes;
+  std::atomic<uint32_t>      mNodeCount;
+  std::atomic<uint32_t>      mMaxDepth;
+};
+
+
+static uint32_t GetBin(float centroid, float minimum, float scale)
+{
+  uint32_t bin = static_cast<uint32_t>((centroid - minimum) * scale);
+  return (std::min)(bin, Bvh::kBinCount - 1);
+}
+
+
+static float GetBinScale(const BvhBox &centroids, uint32_t axis)
+{
+  float extent = centroids.max[axis] - centroids.min[axis];
+  return extent > 0.0f ? Bvh::kBinCount / extent : 0.0f;
+}
+
+
+void BvhBuilder::BinRange(uint32_t begin, uint32_t end, const BvhBox &centroids, BvhBins &bins) const
+{
+  float scale[3] = { GetBinScale(centroids, 0), GetBinScale(centroids, 1), GetBinScale(centroids, 2) };
+  for (uint32_t axis = 0; axis < 3; ++axis) {
+    for (uint32_t i = 0; i < Bvh::kBinCount; ++i) {
+      bins.bins[axis][i].Reset();
+    }
+  }
+  for (uint32_t i = begin; i < end; ++i) {
+    const BvhPrimitive &primitive = mPrimitives[i];
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+      BvhBin &bin = bins.bins[axis][GetBin(primitive.centroid[axis], centroids.min[axis], scale[axis])];
+      bin.box.Grow(primitive.box);
+      bin.centroids.Grow(primitive.centroid);
+      bin.count++;
+    }
+  }
+}
+
+
+uint32_t BvhBuilder::MakeLeaf(uint32_t begin, uint32_t end, const BvhBox &box, uint32_t depth)
+{
+  assert(end - begin <= 0xffff && "Bvh leaf is too large for its 16 bit count!");
+  uint32_t index = mNodeCount.fetch_add(1);
+  assert(index < mNodes.size() && "Bvh ran out of build nodes!");
+  BvhBuildNode &node = mNodes[index];
+  node.box = box;
+  node.children[0] = node.children[1] = Bvh::kEmptyChild;
+  node.first = begin;
+  node.count = end - begin;
+  node.axis = 0;
+  uint32_t maxDepth = mMaxDepth.load();
+  while (depth > maxDepth && !mMaxDepth.compare_exchange_weak(maxDepth, depth)) { }
+  return index;
+}
+
+
+uint32_t BvhBuilder::Build(uint32_t begin, uint32_t end, const BvhBox &box, const BvhBox &centroids,
+  uint32_t depth)
+{
+  uint32_t count = end - begin;
+  if (count == 1 || depth + 1 >= Bvh::kMaxDepth) {
+    return MakeLeaf(begin, end, box, depth);
+  }
+
+  BvhBins bins;
+  if (count >= kParallelBinThreshold) {
+    uint32_t chunkCount = (count + kBinChunkSize - 1) / kBinChunkSize;
+    std::vector<BvhBins> chunkBins(chunkCount);
+    ThreadPool::Global().ParallelFor(chunkCount, [&] (uint32_t chunk) {
+      uint32_t chunkBegin = begin + chunk * kBinChunkSize;
+      uint32_t chunkEnd = (std::min)(end, chunkBegin + kBinChunkSize);
+      BinRange(chunkBegin, chunkEnd, centroids, chunkBins[chunk]);
+    });
+    bins = chunkBins[0];
+    for (uint32_t chunk = 1; chunk < chunkCount; ++chunk) {
+      for (uint32_t axis = 0; axis < 3; ++axis) {
+        for (uint32_t i = 0; i < Bvh::kBinCount; ++i) {
+          bins.bins[axis][i].Grow(chunkBins[chunk].bins[axis][i]);
+        }
+      }
+    }
+  } else {
+    BinRange(begin, end, centroids, bins);
+  }
+
+  // Sweep every axis from both ends for the cheapest split between two bins.
+  float area = box.Area();
+  float invArea = area > 0.0f ? 1.0f / area : 0.0f;
+  float bestCost = std::numeric_limits<float>::infinity();
+  uint32_t bestAxis = 0;
+  uint32_t bestSplit = 0;
+  for (uint32_t axis = 0; axis < 3; ++axis) {
+    if (!(centroids.max[axis] > centroids.min[axis])) continue;
+    float rightArea[Bvh::kBinCount];
+    uint32_t rightCount[Bvh::kBinCount];
+    BvhBox accumulated;
+    accumulated.Reset();
+    uint32_t accumulatedCount = 0;
+    for (uint32_t i = Bvh::kBinCount - 1; i > 0; --i) {
+      accumulated.Grow(bins.bins[axis][i].box);
+      accumulatedCount += bins.bins[axis][i].count;
+      rightArea[i] = accumulated.Area();
+      rightCount[i] = accumulatedCount;
+    }
+    accumulated.Reset();
+    accumulatedCount = 0;
+    for (uint32_t split = 1; split < Bvh::kBinCount; ++split) {
+      accumulated.Grow(bins.bins[axis][split - 1].box);
+      accumulatedCount += bins.bins[axis][split - 1].count;
+      if (accumulatedCount == 0 || rightCount[split] == 0) continue;
+      float cost = Bvh::kTraversalCost + Bvh::kIntersectionCost * invArea *
+        (accumulated.Area() * accumulatedCount + rightArea[split] * rightCount[split]);
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestAxis = axis;
+        bestSplit = split;
+      }
+    }
+  }
+
+  float leafCost = Bvh::kIntersectionCost * count;
+  if (count <= Bvh::kMaxLeafSize && !(bestCost < leafCost)) {
+    return MakeLeaf(begin, end, box, depth);
+  }
+
+  uint32_t mid;
+  BvhBox childBoxes[2];
+  BvhBox childCentroids[2];
+  if (bestSplit > 0) {
+    float minimum = centroids.min[bestAxis];
+    float scale = GetBinScale(centroids, bestAxis);
+    BvhPrimitive *first = mPrimitives.data() + begin;
+    BvhPrimitive *middle = std::partition(first, mPrimitives.data() + end,
+      [=] (const BvhPrimitive &primitive) {
+        return GetBin(primitive.centroid[bestAxis], minimum, scale) < bestSplit;
+      });
+    mid = begin + static_cast<uint32_t>(middle - first);
+    BvhBin sides[2];
+    sides[0].Reset();
+    sides[1].Reset();
+    for (uint32_t i = 0; i < Bvh::kBinCount; ++i) {
+      sides[i < bestSplit ? 0 : 1].Grow(bins.bins[bestAxis][i]);
+    }
+    for (uint32_t side = 0; side < 2; ++side) {
+      childBoxes[side] = sides[side].box;
+      childCentroids[side] = sides[side].centroids;
+    }
+  } else {
+    // Every centroid in the same spot, too many to be one leaf. Split down the middle.
+    mid = begin + count / 2;
+    for (uint32_t side = 0; side < 2; ++side) {
+      childBoxes[side].Reset();
+      childCentroids[side].Reset();
+      for (uint32_t i = side ? mid : begin; i < (side ? end : mid); ++i) {
+        childBoxes[side].Grow(mPrimitives[i].box);
+        childCentroids[side].Grow(mPrimitives[i].centroid);
+      }
+    }
+  }
+
+  uint32_t index = mNodeCount.fetch_add(1);
+  assert(index < mNodes.size() && "Bvh ran out of build nodes!");
+  uint32_t children[2];
+  if (count >= kTaskThreshold) {
+    ThreadPool &pool = ThreadPool::Global();
+    std::future<uint32_t> left = pool.Submit([&] () {
+      PBR_TRACE_SCOPE("BvhSubtree");
+      return Build(begin, mid, childBoxes[0], childCentroids[0], depth + 1);
+    });
+    children[1] = Build(mid, end, childBoxes[1], childCentroids[1], depth + 1);
+    children[0] = pool.Wait(left);
+  } else {
+    children[0] = Build(begin, mid, childBoxes[0], childCentroids[0], depth + 1);
+    children[1] = Build(mid, end, childBoxes[1], childCentroids[1], depth + 1);
+  }
+
+  BvhBuildNode &node = mNodes[index];
+  node.box = box;
+  node.children[0] = children[0];
+  node.children[1] = children[1];
+  node.first = 0;
+  node.count = 0;
+  node.axis = static_cast<uint16_t>(bestAxis);
+  return index;
+}
+
+
+// Emits the inner node at buildIndex and everything under it, depth first. Adds the
+// unnormalized SAH cost of the subtree to sah.
+static uint32_t FlattenNode(const std::vector<BvhBuildNode> &buildNodes, uint32_t buildIndex,
+  std::vector<BvhNode> &nodes, double &sah, uint32_t &leafCount)
+{
+  const BvhBuildNode &buildNode = buildNodes[buildIndex];
+  uint32_t index = static_cast<uint32_t>(nodes.size());
+  nodes.push_back(BvhNode());
+  sah += Bvh::kTraversalCost * buildNode.box.Area();
+
+  uint32_t child[2];
+  uint16_t count[2];
+  for (uint32_t side = 0; side < 2; ++side) {
+    const BvhBuildNode &childNode = buildNodes[buildNode.children[side]];
+    if (childNode.count > 0) {
+      child[side] = childNode.first;
+      count[side] = static_cast<uint16_t>(childNode.count);
+      sah += Bvh::kIntersectionCost * childNode.count * childNode.box.Area();
+      leafCount++;
+    } else {
+      child[side] = FlattenNode(buildNodes, buildNode.children[side], nodes, sah, leafCount);
+      count[side] = 0;
+    }
+  }
+
+  // push_back above may have moved the array.
+  BvhNode &node = nodes[index];
+  for (uint32_t side = 0; side < 2; ++side) {
+    const BvhBox &box = buildNodes[buildNode.children[side]].box;
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+      node.childMin[side][axis] = box.min[axis];
+      node.childMax[side][axis] = box.max[axis];
+    }
+    node.child[side] = child[side];
+    node.count[side] = count[side];
+  }
+  node.axis = buildNode.axis;
+  node.pad = 0;
+  return index;
+}
+
+
+Bvh::Bvh()
+  : mBoundsMin(0.0f, 0.0f, 0.0f)
+  , mBoundsMax(0.0f, 0.0f, 0.0f)
+{
+  std::memset(&mStats, 0, sizeof(mStats));
+}
+
+
+void Bvh::Build(const GeometryData &geometry)
+{
+  PBR_TRACE_FUNCTION();
+  auto start = std::chrono::high_resolution_clock::now();
+  mNodes.clear();
+  mCorners.clear();
+  mTriangleIds.clear();
+  std::memset(&mStats, 0, sizeof(mStats));
+  uint32_t triangleCount = static_cast<uint32_t>(geometry.indices.size() / 3);
+  if (triangleCount == 0) {
+    return;
+  }
+
+  // Triangle bounds and centroids, and the bounds of both over the whole mesh.
+  std::vector<BvhPrimitive> primitives(triangleCount);
+  uint32_t chunkCount = (triangleCount + kBinChunkSize - 1) / kBinChunkSize;
+  std::vector<BvhBox> chunkBoxes(chunkCount);
+  std::vector<BvhBox> chunkCentroids(chunkCount);
+  ThreadPool::Global().ParallelFor(chunkCount, [&] (uint32_t chunk) {
+    uint32_t chunkBegin = chunk * kBinChunkSize;
+    uint32_t chunkEnd = (std::min)(triangleCount, chunkBegin + kBinChunkSize);
+    chunkBoxes[chunk].Reset();
+    chunkCentroids[chunk].Reset();
+    for (uint32_t i = chunkBegin; i < chunkEnd; ++i) {
+      BvhPrimitive &primitive = primitives[i];
+      primitive.box.Reset();
+      for (uint32_t corner = 0; corner < 3; ++corner) {
+        const glm::vec3 &p = geometry.vertices[geometry.indices[i * 3 + corner]].position;
+        float position[3] = { p.x, p.y, p.z };
+        primitive.box.Grow(position);
+      }
+      for (uint32_t axis = 0; axis < 3; ++axis) {
+        primitive.centroid[axis] = (primitive.box.min[axis] + primitive.box.max[axis]) * 0.5f;
+      }
+      primitive.triangle = i;
+      chunkBoxes[chunk].Grow(primitive.box);
+      chunkCentroids[chunk].Grow(primitive.centroid);
+    }
+  });
+  BvhBox box;
+  BvhBox centroids;
+  box.Reset();
+  centroids.Reset();
+  for (uint32_t chunk = 0; chunk < chunkCount; ++chunk) {
+    box.Grow(chunkBoxes[chunk]);
+    centroids.Grow(chunkCentroids[chunk]);
+  }
+
+  BvhBuilder builder(primitives);
+  uint32_t root = builder.Build(0, triangleCount, box, centroids, 0);
+  const std::vector<BvhBuildNode> &buildNodes = builder.GetNodes();
+
+  double sah = 0.0;
+  uint32_t leafCount = 0;
+  if (buildNodes[root].count > 0) {
+    // The whole mesh is one leaf, hang it off a root with an empty second child.
+    BvhNode node;
+    std::memset(&node, 0, sizeof(node));
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+      node.childMin[0][axis] = box.min[axis];
+      node.childMax[0][axis] = box.max[axis];
+    }
+    node.child[0] = 0;
+    node.count[0] = static_cast<uint16_t>(triangleCount);
+    node.child[1] = kEmptyChild;
+    mNodes.push_back(node);
+    sah = kTraversalCost * box.Area() + kIntersectionCost * triangleCount * box.Area();
+    leafCount = 1;
+  } else {
+    mNodes.reserve(triangleCount);
+    FlattenNode(buildNodes, root, mNodes, sah, leafCount);
+  }
+
+  mCorners.resize(triangleCount * 3);
+  mTriangleIds.resize(triangleCount);
+  ThreadPool::Global().ParallelFor(chunkCount, [&] (uint32_t chunk) {
+    uint32_t chunkBegin = chunk * kBinChunkSize;
+    uint32_t chunkEnd = (std::min)(triangleCount, chunkBegin + kBinChunkSize);
+    for (uint32_t i = chunkBegin; i < chunkEnd; ++i) {
+      uint32_t triangle = primitives[i].triangle;
+      mTriangleIds[i] = triangle;
+      for (uint32_t corner = 0; corner < 3; ++corner) {
+        const glm::vec3 &p = geometry.vertices[geometry.indices[triangle * 3 + corner]].position;
+        mCorners[i * 3 + corner] = Vec3(p.x, p.y, p.z);
+      }
+    }
+  });
+  mBoundsMin = Vec3(box.min[0], box.min[1], box.min[2]);
+  mBoundsMax = Vec3(box.max[0], box.max[1], box.max[2]);
+
+  auto end = std::chrono::high_resolution_clock::now();
+  float rootArea = box.Area();
+  mStats.buildMs = std::chrono::duration<double, std::milli>(end - start).count();
+  mStats.nodeCount = static_cast<uint32_t>(mNodes.size());
+  mStats.leafCount = leafCount;
+  mStats.maxDepth = builder.GetMaxDepth();
+  mStats.averageLeafSize = static_cast<float>(triangleCount) / leafCount;
+  mStats.sahCost = rootArea > 0.0f ? static_cast<float>(sah / rootArea) : 0.0f;
+}
+
+
+bool Bvh::Intersect(Rayf &ray, TriangleHit<float> &hit, uint32_t &triangle) const
+{
+  if (mNodes.empty()) {
+    return false;
+  }
+  uint32_t stack[kMaxDepth];
+  uint32_t stackSize = 0;
+  uint32_t index = 0;
+  bool found = false;
+  for (;;) {
+    const BvhNode &node = mNodes[index];
+    float tNear[2];
+    bool visit[2];
+    for (uint32_t side = 0; side < 2; ++side) {
+      visit[side] = node.child[side] != kEmptyChild && IntersectBox(ray,
+        Vec3(node.childMin[side][0], node.childMin[side][1], node.childMin[side][2]),
+        Vec3(node.childMax[side][0], node.childMax[side][1], node.childMax[side][2]), tNear[side]);
+      // Leaves are tested right away, only inner nodes go on to the walk below.
+      if (visit[side] && node.count[side] > 0) {
+        uint32_t first = node.child[side];
+        for (uint32_t i = first; i < first + node.count[side]; ++i) {
+          if (IntersectTriangle(ray, mCorners[i * 3], mCorners[i * 3 + 1], mCorners[i * 3 + 2], hit)) {
+            triangle = mTriangleIds[i];
+            found = true;
+          }
+        }
+        visit[side] = false;
+      }
+    }
+
+    if (visit[0] && visit[1]) {
+      // Nearer child first, the other waits on the stack.
+      uint32_t nearSide = tNear[1] < tNear[0] ? 1 : 0;
+      stack[stackSize++] = node.child[1 - nearSide];
+      index = node.child[nearSide];
+    } else if (visit[0] || visit[1]) {
+      index = node.child[visit[0] ? 0 : 1];
+    } else if (stackSize > 0) {
+      index = stack[--stackSize];
+    } else {
+      break;
+    }
+  }
+  return found;
+}
+} // pbr
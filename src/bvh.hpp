@@ -0,0 +1,88 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __BVH_HPP
+#define __BVH_HPP
+
+
+#include "platform.hpp"
+#include "geometry.hpp"
+#include <ray.hpp>
+#include <stdint.h>
+#include <vector>
+
+
+namespace pbr {
+
+
+/// Binary BVH node, one cache line. It holds the bounds of both children rather than its
+/// own, so deciding where to go next takes one fetch. Nodes are laid out depth first,
+/// child 0 of a node is always the node right after it. Leaves are not nodes of their
+/// own, a child with a triangle count is a leaf, and its index is its first triangle.
+/// The alignment holds in a std::vector from C++17 on, with aligned operator new.
+struct alignas(64) BvhNode {
+  float     childMin[2][3];
+  float     childMax[2][3];
+  /// Node index, first triangle for a leaf, Bvh::kEmptyChild if there is nothing there.
+  uint32_t  child[2];
+  /// 0 for an inner node.
+  uint16_t  count[2];
+  /// Axis the children were split on.
+  uint16_t  axis;
+  uint16_t  pad;
+};
+
+
+/// Bounding volume hierarchy over the triangles of a GeometryData, built with binned
+/// SAH on the global ThreadPool. Large ranges bin their triangles in parallel, and
+/// both halves of a split below that become their own tasks. Triangles are copied
+/// out in leaf order, so a leaf reads one contiguous run of corners.
+class Bvh {
+public:
+  static const uint32_t kEmptyChild = 0xffffffff;
+  static const uint32_t kBinCount = 16;
+  static const uint32_t kMaxLeafSize = 8;
+  /// Also the traversal stack size. A range this deep becomes a leaf whatever its size.
+  static const uint32_t kMaxDepth = 64;
+
+  /// SAH cost model, relative cost of visiting a node and of testing a triangle.
+  static const float kTraversalCost;
+  static const float kIntersectionCost;
+
+  struct Stats {
+    double    buildMs;
+    uint32_t  nodeCount;
+    uint32_t  leafCount;
+    uint32_t  maxDepth;
+    float     averageLeafSize;
+    /// Expected cost of tracing a random ray that hits the root, under the cost model above.
+    float     sahCost;
+  };
+
+  Bvh();
+
+  void Build(const GeometryData &geometry);
+
+  /// Closest hit along the ray, shrinking ray.tMax to it. triangle is an index into
+  /// the geometry's triangles, as in indices[triangle * 3].
+  bool Intersect(Rayf &ray, TriangleHit<float> &hit, uint32_t &triangle) const;
+
+  const std::vector<BvhNode> &GetNodes() const { return mNodes; }
+  /// Three corners per triangle, in leaf order.
+  const std::vector<Vec3> &GetCorners() const { return mCorners; }
+  /// Geometry triangle of each triangle in leaf order.
+  const std::vector<uint32_t> &GetTriangleIds() const { return mTriangleIds; }
+  const Stats &GetStats() const { return mStats; }
+  const Vec3 &GetBoundsMin() const { return mBoundsMin; }
+  const Vec3 &GetBoundsMax() const { return mBoundsMax; }
+
+private:
+  std::vector<BvhNode>  mNodes;
+  std::vector<Vec3>     mCorners;
+  std::vector<uint32_t> mTriangleIds;
+  Vec3                  mBoundsMin;
+  Vec3                  mBoundsMax;
+  Stats                 mStats;
+};
+} // pbr
+#endif // __BVH_HPP
@@ -13,7 +13,8 @@ namespace pbr {
 
 class Camera {
 public:
-  enum Movement;
+  // Opaque declarations need a fixed underlying type outside of MSVC.
+  enum Movement : uint32_t;
   Camera(glm::vec3 position = glm::vec3(0.0f, 0.0f, 0.0f))
     : mPosition(position)
   { }
@@ -31,6 +32,7 @@ public:
   glm::mat4 GetProjection() { return mProjection; }
   glm::mat4 GetView() { return mView; }
   glm::vec3 GetPosition() { return mPosition; }
+  glm::vec3 GetLookAt() { return mLookat; }
 
 private:
   ///             |+y
@@ -74,7 +76,7 @@ private:
   glm::vec3 mLookat;
 
 public:
-  enum Movement {
+  enum Movement : uint32_t {
     UP,
     DOWN,
     LEFT,
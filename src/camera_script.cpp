@@ -0,0 +1,110 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "camera_script.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+
+namespace pbr {
+
+
+bool CameraScript::Load(const char *filepath)
+{
+  std::ifstream file(filepath);
+  if (!file.is_open()) {
+    std::printf("Failed to open camera script %s\n", filepath);
+    return false;
+  }
+  mKeys.clear();
+  std::string line;
+  uint32_t lineNumber = 0;
+  while (std::getline(file, line)) {
+    ++lineNumber;
+    size_t first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos || line[first] == '#') continue;
+    std::istringstream stream(line);
+    Key key;
+    stream >> key.time
+      >> key.position.x >> key.position.y >> key.position.z
+      >> key.target.x >> key.target.y >> key.target.z
+      >> key.roughness >> key.metallic >> key.gloss >> key.light;
+    if (stream.fail() || (!mKeys.empty() && key.time < mKeys.back().time)) {
+      std::printf("Bad camera script key on line %u of %s\n", lineNumber, filepath);
+      mKeys.clear();
+      return false;
+    }
+    mKeys.push_back(key);
+  }
+  return !mKeys.empty();
+}
+
+
+bool CameraScript::Save(const char *filepath) const
+{
+  std::FILE *file = std::fopen(filepath, "w");
+  if (!file) {
+    std::printf("Failed to write camera script %s\n", filepath);
+    return false;
+  }
+  std::fprintf(file, "# time px py pz tx ty tz roughness metallic gloss light\n");
+  for (const Key &key : mKeys) {
+    std::fprintf(file, "%.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f %d\n", key.time,
+      key.position.x, key.position.y, key.position.z, key.target.x, key.target.y, key.target.z,
+      key.roughness, key.metallic, key.gloss, key.light);
+  }
+  std::fclose(file);
+  return true;
+}
+
+
+CameraScript::Key CameraScript::Sample(double time) const
+{
+  if (time <= mKeys.front().time) return mKeys.front();
+  if (time >= mKeys.back().time) return mKeys.back();
+  // Timelines are short, and replay walks them front to back, a linear search is fine.
+  size_t next = 1;
+  while (mKeys[next].time < time) {
+    ++next;
+  }
+  const Key &a = mKeys[next - 1];
+  const Key &b = mKeys[next];
+  double span = b.time - a.time;
+  float t = span > 0.0 ? static_cast<float>((time - a.time) / span) : 1.0f;
+  Key key;
+  key.time = time;
+  key.position = glm::mix(a.position, b.position, t);
+  key.target = glm::mix(a.target, b.target, t);
+  key.roughness = a.roughness + (b.roughness - a.roughness) * t;
+  key.metallic = a.metallic + (b.metallic - a.metallic) * t;
+  key.gloss = a.gloss + (b.gloss - a.gloss) * t;
+  // Switches don't interpolate.
+  key.light = a.light;
+  return key;
+}
+
+
+CameraScript CameraScript::CreateOrbit(float radius, float height, double duration)
+{
+  const uint32_t steps = 64;
+  CameraScript script;
+  for (uint32_t i = 0; i <= steps; ++i) {
+    float t = static_cast<float>(i) / steps;
+    float angle = t * 2.0f * 3.14159265f;
+    Key key;
+    key.time = duration * t;
+    key.position = glm::vec3(std::cos(angle) * radius, height, std::sin(angle) * radius);
+    key.target = glm::vec3(0.0f, 0.0f, 0.0f);
+    key.roughness = 0.01f + 0.99f * t;
+    key.metallic = 0.1f + 0.9f * t;
+    key.gloss = 0.04f;
+    key.light = (i >= steps / 2) ? 1 : 0;
+    script.AddKey(key);
+  }
+  return script;
+}
+} // pbr
@@ -0,0 +1,56 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __CAMERA_SCRIPT_HPP
+#define __CAMERA_SCRIPT_HPP
+
+
+#include "platform.hpp"
+#include "vertex.hpp"
+#include <stdint.h>
+#include <vector>
+
+
+namespace pbr {
+
+
+/// Camera and material timeline, replayed by the benchmark mode and recorded from
+/// interactive runs. Sampling interpolates linearly between keys and holds the first
+/// and last key outside of the timeline.
+///
+/// Text format, one key per line, '#' starts a comment line:
+/// time px py pz tx ty tz roughness metallic gloss light
+/// where p is the camera position, t the point it looks at, and light is 0 or 1.
+class CameraScript {
+public:
+  struct Key {
+    double    time;
+    glm::vec3 position;
+    glm::vec3 target;
+    float     roughness;
+    float     metallic;
+    float     gloss;
+    int32_t   light;
+  };
+
+  /// Replace the timeline with the keys of the file. Keys must be in time order.
+  bool Load(const char *filepath);
+  bool Save(const char *filepath) const;
+
+  /// Append a key, its time must not be before the last one.
+  void AddKey(const Key &key) { mKeys.push_back(key); }
+  Key Sample(double time) const;
+
+  bool IsEmpty() const { return mKeys.empty(); }
+  size_t GetKeyCount() const { return mKeys.size(); }
+  double GetDuration() const { return mKeys.empty() ? 0.0 : mKeys.back().time; }
+
+  /// Circle the origin once over duration seconds, sweeping roughness and metallic
+  /// from 0 to 1 along the way. Used when no script file is given.
+  static CameraScript CreateOrbit(float radius, float height, double duration);
+
+private:
+  std::vector<Key> mKeys;
+};
+} // pbr
+#endif // __CAMERA_SCRIPT_HPP
@@ -0,0 +1,304 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "device_allocator.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+
+namespace pbr {
+
+
+const VkDeviceSize DeviceAllocator::kDefaultBlockSize;
+const VkDeviceSize DeviceAllocator::kMinNodeSize;
+
+
+static uint32_t GetOrder(VkDeviceSize size)
+{
+  uint32_t order = 0;
+  VkDeviceSize nodeSize = DeviceAllocator::kMinNodeSize;
+  while (nodeSize < size) {
+    nodeSize <<= 1;
+    ++order;
+  }
+  return order;
+}
+
+
+DeviceAllocator::DeviceAllocator()
+  : mDevice(VK_NULL_HANDLE)
+  , mBlockSize(kDefaultBlockSize)
+{
+  std::memset(&mMemoryProperties, 0, sizeof(mMemoryProperties));
+}
+
+
+DeviceAllocator::~DeviceAllocator()
+{
+  Shutdown();
+}
+
+
+void DeviceAllocator::Initialize(VkPhysicalDevice physicalDevice, VkDevice device,
+  VkDeviceSize blockSize)
+{
+  mDevice = device;
+  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &mMemoryProperties);
+  // Needs to be a power of two multiple of the smallest node.
+  mBlockSize = kMinNodeSize << GetOrder(blockSize);
+  mPools.resize(mMemoryProperties.memoryTypeCount * rkCount);
+  for (uint32_t i = 0; i < mPools.size(); ++i) {
+    mPools[i].memoryType = i / rkCount;
+  }
+}
+
+
+void DeviceAllocator::Shutdown()
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  for (Pool &pool : mPools) {
+    for (std::unique_ptr<Block> &block : pool.blocks) {
+      if (!block) continue;
+      if (block->mapped) {
+        vkUnmapMemory(mDevice, block->memory);
+      }
+      vkFreeMemory(mDevice, block->memory, nullptr);
+    }
+    pool.blocks.clear();
+  }
+  mPools.clear();
+}
+
+
+uint32_t DeviceAllocator::GetMaxOrder() const
+{
+  return GetOrder(mBlockSize);
+}
+
+
+uint32_t DeviceAllocator::FindMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties) const
+{
+  for (uint32_t i = 0; i < mMemoryProperties.memoryTypeCount; ++i) {
+    if ((typeBits & (1 << i)) &&
+        (mMemoryProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+      return i;
+    }
+  }
+  return UINT32_MAX;
+}
+
+
+bool DeviceAllocator::CreateBlock(Pool &pool, VkDeviceSize size, bool dedicated, uint32_t &blockIndex)
+{
+  VkMemoryAllocateInfo allocInfo = { };
+  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocInfo.allocationSize = size;
+  allocInfo.memoryTypeIndex = pool.memoryType;
+  std::unique_ptr<Block> block(new Block());
+  VkResult result = vkAllocateMemory(mDevice, &allocInfo, nullptr, &block->memory);
+  if (result != VK_SUCCESS) {
+    return false;
+  }
+  block->size = size;
+  block->mapped = nullptr;
+  block->dedicated = dedicated;
+  block->allocationCount = 0;
+  block->usedBytes = 0;
+  block->nodeBytes = 0;
+  VkMemoryPropertyFlags flags = mMemoryProperties.memoryTypes[pool.memoryType].propertyFlags;
+  if (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    void *data;
+    result = vkMapMemory(mDevice, block->memory, 0, VK_WHOLE_SIZE, 0, &data);
+    assert(result == VK_SUCCESS && "Failed to map device memory block!");
+    block->mapped = static_cast<uint8_t *>(data);
+  }
+  if (!dedicated) {
+    uint32_t maxOrder = GetMaxOrder();
+    block->freeNodes.resize(maxOrder + 1);
+    block->freeNodes[maxOrder].insert(0);
+  }
+
+  // Reuse the slot of a block that was released earlier.
+  for (uint32_t i = 0; i < pool.blocks.size(); ++i) {
+    if (!pool.blocks[i]) {
+      pool.blocks[i] = std::move(block);
+      blockIndex = i;
+      return true;
+    }
+  }
+  pool.blocks.push_back(std::move(block));
+  blockIndex = static_cast<uint32_t>(pool.blocks.size() - 1);
+  return true;
+}
+
+
+bool DeviceAllocator::AllocateFromBlock(Block &block, uint32_t order, VkDeviceSize &offset)
+{
+  // Smallest free node that fits, split down until it is the size we want.
+  uint32_t current = order;
+  while (current < block.freeNodes.size() && block.freeNodes[current].empty()) {
+    ++current;
+  }
+  if (current >= block.freeNodes.size()) {
+    return false;
+  }
+  offset = *block.freeNodes[current].begin();
+  block.freeNodes[current].erase(block.freeNodes[current].begin());
+  while (current > order) {
+    --current;
+    block.freeNodes[current].insert(offset + (kMinNodeSize << current));
+  }
+  return true;
+}
+
+
+bool DeviceAllocator::Allocate(const VkMemoryRequirements &requirements,
+  VkMemoryPropertyFlags properties, ResourceKind kind, DeviceAllocation &allocation)
+{
+  uint32_t memoryType = FindMemoryType(requirements.memoryTypeBits, properties);
+  if (memoryType == UINT32_MAX) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mMutex);
+  uint32_t poolIndex = GetPoolIndex(memoryType, kind);
+  Pool &pool = mPools[poolIndex];
+
+  allocation.pool = poolIndex;
+  allocation.size = requirements.size;
+  VkDeviceSize nodeSize = (std::max)(requirements.size, requirements.alignment);
+  if (nodeSize > mBlockSize) {
+    uint32_t blockIndex;
+    if (!CreateBlock(pool, requirements.size, true, blockIndex)) {
+      return false;
+    }
+    Block &block = *pool.blocks[blockIndex];
+    block.allocationCount = 1;
+    block.usedBytes = requirements.size;
+    block.nodeBytes = requirements.size;
+    allocation.memory = block.memory;
+    allocation.offset = 0;
+    allocation.mapped = block.mapped;
+    allocation.block = blockIndex;
+    allocation.order = 0;
+    return true;
+  }
+
+  uint32_t order = GetOrder(nodeSize);
+  VkDeviceSize offset = 0;
+  uint32_t blockIndex = UINT32_MAX;
+  for (uint32_t i = 0; i < pool.blocks.size(); ++i) {
+    Block *block = pool.blocks[i].get();
+    if (block && !block->dedicated && AllocateFromBlock(*block, order, offset)) {
+      blockIndex = i;
+      break;
+    }
+  }
+  if (blockIndex == UINT32_MAX) {
+    if (!CreateBlock(pool, mBlockSize, false, blockIndex)) {
+      return false;
+    }
+    AllocateFromBlock(*pool.blocks[blockIndex], order, offset);
+  }
+
+  Block &block = *pool.blocks[blockIndex];
+  block.allocationCount++;
+  block.usedBytes += requirements.size;
+  block.nodeBytes += kMinNodeSize << order;
+  allocation.memory = block.memory;
+  allocation.offset = offset;
+  allocation.mapped = block.mapped ? block.mapped + offset : nullptr;
+  allocation.block = blockIndex;
+  allocation.order = order;
+  return true;
+}
+
+
+void DeviceAllocator::Free(DeviceAllocation &allocation)
+{
+  if (allocation.memory == VK_NULL_HANDLE) return;
+  std::lock_guard<std::mutex> lock(mMutex);
+  Pool &pool = mPools[allocation.pool];
+  std::unique_ptr<Block> &block = pool.blocks[allocation.block];
+  assert(block && block->memory == allocation.memory && "Freeing memory from the wrong block!");
+
+  block->allocationCount--;
+  block->usedBytes -= allocation.size;
+  if (block->dedicated) {
+    block->nodeBytes = 0;
+  } else {
+    // Merge with the buddy for as long as it is free too.
+    uint32_t order = allocation.order;
+    VkDeviceSize offset = allocation.offset;
+    block->nodeBytes -= kMinNodeSize << order;
+    uint32_t maxOrder = GetMaxOrder();
+    while (order < maxOrder) {
+      VkDeviceSize buddy = offset ^ (kMinNodeSize << order);
+      auto it = block->freeNodes[order].find(buddy);
+      if (it == block->freeNodes[order].end()) {
+        break;
+      }
+      block->freeNodes[order].erase(it);
+      offset = (std::min)(offset, buddy);
+      ++order;
+    }
+    block->freeNodes[order].insert(offset);
+  }
+
+  // Hand empty blocks back to the driver, but keep one around per pool so that
+  // allocating and freeing in a loop doesn't thrash vkAllocateMemory.
+  if (block->allocationCount == 0) {
+    uint32_t liveBlocks = 0;
+    for (const std::unique_ptr<Block> &other : pool.blocks) {
+      if (other && !other->dedicated) ++liveBlocks;
+    }
+    if (block->dedicated || liveBlocks > 1) {
+      if (block->mapped) {
+        vkUnmapMemory(mDevice, block->memory);
+      }
+      vkFreeMemory(mDevice, block->memory, nullptr);
+      block.reset();
+    }
+  }
+  allocation.memory = VK_NULL_HANDLE;
+  allocation.mapped = nullptr;
+}
+
+
+DeviceAllocator::HeapStats DeviceAllocator::GetHeapStats(uint32_t heap) const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  HeapStats stats = { };
+  for (const Pool &pool : mPools) {
+    if (mMemoryProperties.memoryTypes[pool.memoryType].heapIndex != heap) continue;
+    for (const std::unique_ptr<Block> &block : pool.blocks) {
+      if (!block) continue;
+      stats.blockCount++;
+      stats.allocationCount += block->allocationCount;
+      stats.blockBytes += block->size;
+      stats.usedBytes += block->usedBytes;
+      stats.wastedBytes += block->nodeBytes - block->usedBytes;
+      stats.freeBytes += block->size - block->nodeBytes;
+    }
+  }
+  return stats;
+}
+
+
+void DeviceAllocator::PrintStats() const
+{
+  const double mb = 1.0 / (1024.0 * 1024.0);
+  for (uint32_t heap = 0; heap < mMemoryProperties.memoryHeapCount; ++heap) {
+    HeapStats stats = GetHeapStats(heap);
+    if (stats.blockCount == 0) continue;
+    bool deviceLocal =
+      (mMemoryProperties.memoryHeaps[heap].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0;
+    std::printf("Heap %u (%s): %u blocks, %u allocations, %.2f MB used, %.2f MB wasted, "
+      "%.2f MB free of %.2f MB\n", heap, deviceLocal ? "device local" : "host",
+      stats.blockCount, stats.allocationCount, stats.usedBytes * mb, stats.wastedBytes * mb,
+      stats.freeBytes * mb, stats.blockBytes * mb);
+  }
+}
+} // pbr
@@ -0,0 +1,124 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __DEVICE_ALLOCATOR_HPP
+#define __DEVICE_ALLOCATOR_HPP
+
+
+#include "platform.hpp"
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+
+namespace pbr {
+
+
+/// A piece of device memory handed out by the DeviceAllocator. Bind resources with
+/// memory and offset. If the memory type is host visible, mapped points at offset
+/// inside the block's persistent mapping, so never call vkMapMemory on memory.
+struct DeviceAllocation {
+  VkDeviceMemory  memory;
+  VkDeviceSize    offset;
+  VkDeviceSize    size;
+  uint8_t        *mapped;
+  uint32_t        pool;
+  uint32_t        block;
+  uint32_t        order;
+};
+
+
+/// Pooled device memory allocator. Instead of one vkAllocateMemory per resource, memory is
+/// allocated in large blocks per memory type and sub-allocated with a buddy allocator.
+/// Buddy nodes are aligned to their own size within a block, so rounding a request up to
+/// a power of two, and at least its alignment, is all the alignment handling needed.
+///
+/// bufferImageGranularity is honored by never letting linear resources (buffers and
+/// linear images) share a block with optimal images: each memory type has a pool of
+/// each kind. Requests bigger than a block get a dedicated allocation.
+class DeviceAllocator {
+public:
+  enum ResourceKind {
+    rkLinear,
+    rkOptimal,
+    rkCount
+  };
+
+  /// Bytes in a single heap. Used is what was requested, wasted is the rounding up to
+  /// a buddy node, and free is what is left in the blocks.
+  struct HeapStats {
+    VkDeviceSize  blockBytes;
+    VkDeviceSize  usedBytes;
+    VkDeviceSize  wastedBytes;
+    VkDeviceSize  freeBytes;
+    uint32_t      blockCount;
+    uint32_t      allocationCount;
+  };
+
+  static const VkDeviceSize kDefaultBlockSize = 64ull * 1024ull * 1024ull;
+  static const VkDeviceSize kMinNodeSize = 256;
+
+  DeviceAllocator();
+  ~DeviceAllocator();
+
+  DeviceAllocator(const DeviceAllocator &) = delete;
+  DeviceAllocator &operator=(const DeviceAllocator &) = delete;
+
+  void Initialize(VkPhysicalDevice physicalDevice, VkDevice device,
+    VkDeviceSize blockSize = kDefaultBlockSize);
+
+  /// Free every block. All allocations must be freed, or at least no longer in use.
+  void Shutdown();
+
+  /// Allocate memory for the given requirements. Returns false if no memory type fits,
+  /// or the device is out of memory.
+  bool Allocate(const VkMemoryRequirements &requirements, VkMemoryPropertyFlags properties,
+    ResourceKind kind, DeviceAllocation &allocation);
+
+  void Free(DeviceAllocation &allocation);
+
+  /// Find a memory type in typeBits with all of the properties. Returns UINT32_MAX if none.
+  uint32_t FindMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties) const;
+
+  HeapStats GetHeapStats(uint32_t heap) const;
+  uint32_t GetHeapCount() const { return mMemoryProperties.memoryHeapCount; }
+  void PrintStats() const;
+
+private:
+  /// One vkAllocateMemory. freeNodes[order] holds the offsets of free nodes of size
+  /// kMinNodeSize << order. Dedicated blocks hold exactly one allocation.
+  struct Block {
+    VkDeviceMemory                      memory;
+    VkDeviceSize                        size;
+    uint8_t                            *mapped;
+    bool                                dedicated;
+    uint32_t                            allocationCount;
+    VkDeviceSize                        usedBytes;
+    VkDeviceSize                        nodeBytes;
+    std::vector<std::set<VkDeviceSize>> freeNodes;
+  };
+
+  /// All blocks of one memory type and resource kind.
+  struct Pool {
+    uint32_t                            memoryType;
+    std::vector<std::unique_ptr<Block>> blocks;
+  };
+
+  uint32_t GetPoolIndex(uint32_t memoryType, ResourceKind kind) const {
+    return memoryType * rkCount + kind;
+  }
+  bool CreateBlock(Pool &pool, VkDeviceSize size, bool dedicated, uint32_t &blockIndex);
+  bool AllocateFromBlock(Block &block, uint32_t order, VkDeviceSize &offset);
+  uint32_t GetMaxOrder() const;
+
+  VkDevice                          mDevice;
+  VkPhysicalDeviceMemoryProperties  mMemoryProperties;
+  VkDeviceSize                      mBlockSize;
+  std::vector<Pool>                 mPools;
+  mutable std::mutex                mMutex;
+};
+} // pbr
+#endif // __DEVICE_ALLOCATOR_HPP
@@ -0,0 +1,282 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "environment_map.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+
+namespace pbr {
+
+
+const float EnvironmentMap::kLuminanceFloor = 1e-3f;
+
+
+// Solid angle of the part of a face between (0, 0) and (x, y), in [-1, 1] coordinates.
+static float AreaElement(float x, float y)
+{
+  return std::atan2(x * y, std::sqrt(x * x + y * y + 1.0f));
+}
+
+
+static float Luminance(const glm::vec3 &color)
+{
+  return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+
+EnvironmentMap::EnvironmentMap()
+  : mSize(0)
+{
+}
+
+
+void EnvironmentMap::Load(const gli::texture_cube &cube)
+{
+  assert(cube.format() == gli::FORMAT_RGBA32_SFLOAT_PACK32 && "Environment map has to be RGBA32F!");
+  mSize = static_cast<uint32_t>(cube.extent().x);
+  mTexels.resize(6 * mSize * mSize);
+  for (uint32_t face = 0; face < 6; ++face) {
+    const glm::vec4 *texels = cube[face][0].data<glm::vec4>();
+    for (uint32_t i = 0; i < mSize * mSize; ++i) {
+      mTexels[face * mSize * mSize + i] = glm::vec3(texels[i]);
+    }
+  }
+  BuildDistribution();
+}
+
+
+void EnvironmentMap::BuildDistribution()
+{
+  PBR_TRACE_FUNCTION();
+  uint32_t texelCount = mSize * mSize;
+  mTexelDensity.resize(6 * texelCount);
+  mTexelAlias.resize(6 * texelCount);
+
+  // Luminance times solid angle, a row per job. Every face sees the same solid angles.
+  std::vector<float> solidAngles(texelCount);
+  std::vector<double> rowSums(6 * mSize);
+  ThreadPool &pool = ThreadPool::Global();
+  pool.ParallelFor(mSize, [&] (uint32_t y) {
+    for (uint32_t x = 0; x < mSize; ++x) {
+      solidAngles[y * mSize + x] = GetSolidAngle(x, y);
+    }
+  });
+  pool.ParallelFor(6 * mSize, [&] (uint32_t row) {
+    float *weights = &mTexelDensity[row * mSize];
+    const glm::vec3 *texels = &mTexels[row * mSize];
+    const float *rowSolidAngles = &solidAngles[(row % mSize) * mSize];
+    double sum = 0.0;
+    for (uint32_t x = 0; x < mSize; ++x) {
+      weights[x] = (std::max)(Luminance(texels[x]), 0.0f) * rowSolidAngles[x];
+      sum += weights[x];
+    }
+    rowSums[row] = sum;
+  });
+  double total = 0.0;
+  for (double sum : rowSums) {
+    total += sum;
+  }
+  // An all black map still gets sampled, uniformly over the sphere.
+  float luminanceFloor = total > 0.0 ?
+    static_cast<float>(kLuminanceFloor * total / (4.0 * 3.14159265358979)) : 1.0f;
+
+  // The floor, the face weights, and then an alias table per face.
+  float faceWeights[6];
+  pool.ParallelFor(6, [&] (uint32_t face) {
+    float *weights = &mTexelDensity[face * texelCount];
+    double sum = 0.0;
+    for (uint32_t i = 0; i < texelCount; ++i) {
+      weights[i] += luminanceFloor * solidAngles[i];
+      sum += weights[i];
+    }
+    faceWeights[face] = static_cast<float>(sum);
+    BuildAliasTable(weights, texelCount, &mTexelAlias[face * texelCount]);
+  });
+  BuildAliasTable(faceWeights, 6, mFaceAlias);
+
+  // Texel probabilities turned into densities over the face's [-1, 1]^2 square.
+  float faceTotal = 0.0f;
+  for (float weight : faceWeights) {
+    faceTotal += weight;
+  }
+  float texelArea = 4.0f / texelCount;
+  pool.ParallelFor(6, [&] (uint32_t face) {
+    float *weights = &mTexelDensity[face * texelCount];
+    float scale = 1.0f / (faceTotal * texelArea);
+    for (uint32_t i = 0; i < texelCount; ++i) {
+      weights[i] *= scale;
+    }
+  });
+}
+
+
+void EnvironmentMap::BuildAliasTable(const float *weights, uint32_t count, AliasEntry *table)
+{
+  double sum = 0.0;
+  for (uint32_t i = 0; i < count; ++i) {
+    sum += weights[i];
+  }
+  // Probabilities scaled so the mean is 1, under goes into small, the rest into large.
+  std::vector<uint32_t> small;
+  std::vector<uint32_t> large;
+  float scale = static_cast<float>(count / sum);
+  for (uint32_t i = 0; i < count; ++i) {
+    table[i].probability = weights[i] * scale;
+    table[i].alias = i;
+    if (table[i].probability < 1.0f) {
+      small.push_back(i);
+    } else {
+      large.push_back(i);
+    }
+  }
+  // Each small entry is topped up to 1 by a large one.
+  while (!small.empty() && !large.empty()) {
+    uint32_t under = small.back();
+    small.pop_back();
+    uint32_t over = large.back();
+    table[under].alias = over;
+    table[over].probability = (table[over].probability + table[under].probability) - 1.0f;
+    if (table[over].probability < 1.0f) {
+      large.pop_back();
+      small.push_back(over);
+    }
+  }
+  // Whatever is left is 1 up to rounding.
+  for (uint32_t i : small) {
+    table[i].probability = 1.0f;
+  }
+  for (uint32_t i : large) {
+    table[i].probability = 1.0f;
+  }
+}
+
+
+uint32_t EnvironmentMap::SampleAliasTable(const AliasEntry *table, uint32_t count, float u)
+{
+  float scaled = u * count;
+  uint32_t index = (std::min)(static_cast<uint32_t>(scaled), count - 1);
+  return (scaled - index) < table[index].probability ? index : table[index].alias;
+}
+
+
+float EnvironmentMap::GetSolidAngle(uint32_t x, uint32_t y) const
+{
+  float x0 = 2.0f * x / mSize - 1.0f;
+  float y0 = 2.0f * y / mSize - 1.0f;
+  float x1 = 2.0f * (x + 1) / mSize - 1.0f;
+  float y1 = 2.0f * (y + 1) / mSize - 1.0f;
+  return AreaElement(x0, y0) - AreaElement(x0, y1) - AreaElement(x1, y0) + AreaElement(x1, y1);
+}
+
+
+// The cube map face selection of the GL and Vulkan specs, sc and tc in [-1, 1].
+glm::vec3 EnvironmentMap::GetDirection(uint32_t face, float s, float t)
+{
+  float sc = 2.0f * s - 1.0f;
+  float tc = 2.0f * t - 1.0f;
+  switch (face) {
+    case 0: return glm::vec3(1.0f, -tc, -sc);
+    case 1: return glm::vec3(-1.0f, -tc, sc);
+    case 2: return glm::vec3(sc, 1.0f, tc);
+    case 3: return glm::vec3(sc, -1.0f, -tc);
+    case 4: return glm::vec3(sc, -tc, 1.0f);
+    default: return glm::vec3(-sc, -tc, -1.0f);
+  }
+}
+
+
+bool EnvironmentMap::Project(const glm::vec3 &direction, uint32_t &face, float &s, float &t) const
+{
+  float ax = std::abs(direction.x);
+  float ay = std::abs(direction.y);
+  float az = std::abs(direction.z);
+  float sc, tc, ma;
+  if (ax >= ay && ax >= az) {
+    face = direction.x >= 0.0f ? 0 : 1;
+    sc = direction.x >= 0.0f ? -direction.z : direction.z;
+    tc = -direction.y;
+    ma = ax;
+  } else if (ay >= az) {
+    face = direction.y >= 0.0f ? 2 : 3;
+    sc = direction.x;
+    tc = direction.y >= 0.0f ? direction.z : -direction.z;
+    ma = ay;
+  } else {
+    face = direction.z >= 0.0f ? 4 : 5;
+    sc = direction.z >= 0.0f ? direction.x : -direction.x;
+    tc = -direction.y;
+    ma = az;
+  }
+  if (mSize == 0 || !(ma > 0.0f)) {
+    return false;
+  }
+  s = (sc / ma + 1.0f) * 0.5f;
+  t = (tc / ma + 1.0f) * 0.5f;
+  return true;
+}
+
+
+glm::vec3 EnvironmentMap::Lookup(const glm::vec3 &direction) const
+{
+  uint32_t face;
+  float s, t;
+  if (!Project(direction, face, s, t)) {
+    return glm::vec3(0.0f);
+  }
+
+  // Texel centers sit at half integers.
+  float x = s * mSize - 0.5f;
+  float y = t * mSize - 0.5f;
+  float last = static_cast<float>(mSize - 1);
+  x = (std::min)((std::max)(x, 0.0f), last);
+  y = (std::min)((std::max)(y, 0.0f), last);
+  uint32_t x0 = static_cast<uint32_t>(x);
+  uint32_t y0 = static_cast<uint32_t>(y);
+  uint32_t x1 = (std::min)(x0 + 1, mSize - 1);
+  uint32_t y1 = (std::min)(y0 + 1, mSize - 1);
+  float fx = x - x0;
+  float fy = y - y0;
+  glm::vec3 top = glm::mix(GetTexel(face, x0, y0), GetTexel(face, x1, y0), fx);
+  glm::vec3 bottom = glm::mix(GetTexel(face, x0, y1), GetTexel(face, x1, y1), fx);
+  return glm::mix(top, bottom, fy);
+}
+
+
+glm::vec3 EnvironmentMap::Sample(const glm::vec4 &xI, float &pdf) const
+{
+  if (mSize == 0) {
+    pdf = 0.0f;
+    return glm::vec3(0.0f, 1.0f, 0.0f);
+  }
+  uint32_t texelCount = mSize * mSize;
+  uint32_t face = SampleAliasTable(mFaceAlias, 6, xI.x);
+  uint32_t texel = SampleAliasTable(&mTexelAlias[face * texelCount], texelCount, xI.y);
+  float s = ((texel % mSize) + xI.z) / mSize;
+  float t = ((texel / mSize) + xI.w) / mSize;
+  glm::vec3 direction = GetDirection(face, s, t);
+  float distance2 = glm::dot(direction, direction);
+  pdf = mTexelDensity[face * texelCount + texel] * distance2 * std::sqrt(distance2);
+  return direction / std::sqrt(distance2);
+}
+
+
+float EnvironmentMap::Pdf(const glm::vec3 &direction) const
+{
+  uint32_t face;
+  float s, t;
+  if (!Project(direction, face, s, t)) {
+    return 0.0f;
+  }
+  uint32_t x = (std::min)(static_cast<uint32_t>((std::max)(s, 0.0f) * mSize), mSize - 1);
+  uint32_t y = (std::min)(static_cast<uint32_t>((std::max)(t, 0.0f) * mSize), mSize - 1);
+  float sc = 2.0f * s - 1.0f;
+  float tc = 2.0f * t - 1.0f;
+  float distance2 = 1.0f + sc * sc + tc * tc;
+  return mTexelDensity[(face * mSize + y) * mSize + x] * distance2 * std::sqrt(distance2);
+}
+} // pbr
@@ -0,0 +1,85 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __ENVIRONMENT_MAP_HPP
+#define __ENVIRONMENT_MAP_HPP
+
+
+#include "platform.hpp"
+#include "vertex.hpp"
+#include <stdint.h>
+#include <vector>
+
+#include <gli/texture_cube.hpp>
+
+
+namespace pbr {
+
+
+/// The top level of a cubemap on the CPU, for rays that leave the scene. Faces are in
+/// the +X, -X, +Y, -Y, +Z, -Z order of the KTX file, with the same orientation the GPU
+/// samples them with, so a direction looks up what the skybox and test.frag would see.
+///
+/// Load() also builds a distribution to importance sample the map with: texels are
+/// picked in proportion to their luminance times the solid angle they cover, through
+/// one alias table for the faces and one per face, so a sample costs the same however
+/// large the map is. A floor on the luminance keeps black texels pickable, bilinear
+/// filtering bleeds their neighbours into them.
+class EnvironmentMap {
+public:
+  /// Floor on texel luminance in the distribution, relative to the mean over the sphere.
+  static const float kLuminanceFloor;
+
+  EnvironmentMap();
+
+  /// Copy level 0 of the cubemap and build the sampling distribution, spread over the
+  /// global ThreadPool. It has to be RGBA32F, which is what Base uploads it as.
+  void Load(const gli::texture_cube &cube);
+
+  /// Bilinear lookup, clamped at the face edges. direction does not need to be normalized.
+  glm::vec3 Lookup(const glm::vec3 &direction) const;
+
+  /// Normalized direction picked from the distribution, xI being four uniform numbers
+  /// in [0, 1): face, texel, and where in the texel. pdf is per solid angle.
+  glm::vec3 Sample(const glm::vec4 &xI, float &pdf) const;
+
+  /// Density per solid angle Sample() picks direction with, for MIS weights.
+  float Pdf(const glm::vec3 &direction) const;
+
+  /// Direction through the point (s, t) in [0, 1]^2 of a face.
+  static glm::vec3 GetDirection(uint32_t face, float s, float t);
+
+  /// Solid angle covered by a texel, the same on every face.
+  float GetSolidAngle(uint32_t x, uint32_t y) const;
+
+  const glm::vec3 &GetTexel(uint32_t face, uint32_t x, uint32_t y) const {
+    return mTexels[(face * mSize + y) * mSize + x];
+  }
+  uint32_t GetSize() const { return mSize; }
+
+private:
+  /// Vose's alias method. A uniform index i is kept with probability probability,
+  /// and swapped for alias otherwise.
+  struct AliasEntry {
+    float     probability;
+    uint32_t  alias;
+  };
+
+  void BuildDistribution();
+  /// Face the direction points into, and its (s, t) coordinates on the face.
+  bool Project(const glm::vec3 &direction, uint32_t &face, float &s, float &t) const;
+  static void BuildAliasTable(const float *weights, uint32_t count, AliasEntry *table);
+  static uint32_t SampleAliasTable(const AliasEntry *table, uint32_t count, float u);
+
+  uint32_t                mSize;
+  /// Face major, then rows.
+  std::vector<glm::vec3>  mTexels;
+  AliasEntry              mFaceAlias[6];
+  /// Alias tables over the texels of each face, laid out like mTexels.
+  std::vector<AliasEntry> mTexelAlias;
+  /// Probability of each texel over the whole map, divided by its area on the face, so
+  /// a density per solid angle is this times the cube of the distance to the face.
+  std::vector<float>      mTexelDensity;
+};
+} // pbr
+#endif // __ENVIRONMENT_MAP_HPP
@@ -0,0 +1,182 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "gpu_profiler.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+
+namespace pbr {
+
+
+const VkQueryPipelineStatisticFlags GpuProfiler::kStatisticFlags =
+  VK_QUERY_PIPELINE_STATISTIC_CLIPPING_INVOCATIONS_BIT |
+  VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT |
+  VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+
+
+GpuProfiler::GpuProfiler()
+  : mDevice(VK_NULL_HANDLE)
+  , mTimestampPool(VK_NULL_HANDLE)
+  , mStatisticsPool(VK_NULL_HANDLE)
+  , mPeriod(0.0)
+  , mMask(0)
+{
+}
+
+
+GpuProfiler::~GpuProfiler()
+{
+  Shutdown();
+}
+
+
+void GpuProfiler::Initialize(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t queueFamily,
+  uint32_t frameCount, bool pipelineStatistics)
+{
+  mDevice = device;
+  mRecorded.reset(new std::atomic<uint32_t>[frameCount]);
+  mQueried.reset(new std::atomic<uint32_t>[frameCount]);
+  for (uint32_t i = 0; i < frameCount; ++i) {
+    mRecorded[i] = 0;
+    mQueried[i] = 0;
+  }
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+  uint32_t familyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, nullptr);
+  std::vector<VkQueueFamilyProperties> families(familyCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, families.data());
+  uint32_t validBits = families[queueFamily].timestampValidBits;
+
+  VkQueryPoolCreateInfo poolInfo = { };
+  poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  if (validBits > 0) {
+    mMask = (validBits >= 64) ? ~0ull : ((1ull << validBits) - 1);
+    mPeriod = properties.limits.timestampPeriod / 1000000.0;
+    poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    poolInfo.queryCount = frameCount * gsCount * 2;
+    VkResult result = vkCreateQueryPool(mDevice, &poolInfo, nullptr, &mTimestampPool);
+    assert(result == VK_SUCCESS && "Failed to create the timestamp query pool!");
+  } else {
+    std::printf("Graphics queue can't write timestamps, GPU times are off.\n");
+  }
+
+  if (pipelineStatistics) {
+    poolInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+    poolInfo.queryCount = frameCount * gsCount;
+    poolInfo.pipelineStatistics = kStatisticFlags;
+    VkResult result = vkCreateQueryPool(mDevice, &poolInfo, nullptr, &mStatisticsPool);
+    assert(result == VK_SUCCESS && "Failed to create the pipeline statistics query pool!");
+  } else {
+    std::printf("No pipeline statistics queries on this device.\n");
+  }
+}
+
+
+void GpuProfiler::Shutdown()
+{
+  if (mDevice == VK_NULL_HANDLE) return;
+  vkDestroyQueryPool(mDevice, mTimestampPool, nullptr);
+  vkDestroyQueryPool(mDevice, mStatisticsPool, nullptr);
+  mTimestampPool = VK_NULL_HANDLE;
+  mStatisticsPool = VK_NULL_HANDLE;
+  mDevice = VK_NULL_HANDLE;
+}
+
+
+void GpuProfiler::ResetFrame(uint32_t frame)
+{
+  mRecorded[frame] = 0;
+  mQueried[frame] = 0;
+}
+
+
+void GpuProfiler::BeginFrame(VkCommandBuffer commandBuffer, uint32_t frame)
+{
+  if (HasTimestamps()) {
+    vkCmdResetQueryPool(commandBuffer, mTimestampPool, TimestampQuery(frame, gsFrame), gsCount * 2);
+  }
+  if (HasStatistics()) {
+    vkCmdResetQueryPool(commandBuffer, mStatisticsPool, StatisticsQuery(frame, gsFrame), gsCount);
+  }
+}
+
+
+void GpuProfiler::BeginScope(VkCommandBuffer commandBuffer, uint32_t frame, Scope scope,
+  bool statistics)
+{
+  if (HasTimestamps()) {
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, mTimestampPool,
+      TimestampQuery(frame, scope));
+  }
+  if (HasStatistics() && statistics && scope != gsFrame) {
+    vkCmdBeginQuery(commandBuffer, mStatisticsPool, StatisticsQuery(frame, scope), 0);
+  }
+}
+
+
+void GpuProfiler::EndScope(VkCommandBuffer commandBuffer, uint32_t frame, Scope scope,
+  bool statistics)
+{
+  if (HasStatistics() && statistics && scope != gsFrame) {
+    vkCmdEndQuery(commandBuffer, mStatisticsPool, StatisticsQuery(frame, scope));
+    mQueried[frame].fetch_or(1u << scope);
+  }
+  if (HasTimestamps()) {
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, mTimestampPool,
+      TimestampQuery(frame, scope) + 1);
+  }
+  mRecorded[frame].fetch_or(1u << scope);
+}
+
+
+bool GpuProfiler::Collect(uint32_t frame, Result &result)
+{
+  uint32_t recorded = mRecorded[frame].exchange(0);
+  uint32_t queried = mQueried[frame].exchange(0);
+  if (recorded == 0) return false;
+  std::memset(&result, 0, sizeof(result));
+  for (uint32_t scope = 0; scope < gsCount; ++scope) {
+    result.time[scope] = -1.0;
+    if (!(recorded & (1u << scope))) continue;
+    // No wait bit. The fence has been waited on, so anything but success means the
+    // query just didn't make it, and the scope counts as not timed.
+    if (HasTimestamps()) {
+      uint64_t ticks[2];
+      VkResult status = vkGetQueryPoolResults(mDevice, mTimestampPool,
+        TimestampQuery(frame, static_cast<Scope>(scope)), 2, sizeof(ticks), ticks,
+        sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+      if (status == VK_SUCCESS) {
+        result.time[scope] = ((ticks[1] - ticks[0]) & mMask) * mPeriod;
+      }
+    }
+    if (queried & (1u << scope)) {
+      Statistics statistics;
+      VkResult status = vkGetQueryPoolResults(mDevice, mStatisticsPool,
+        StatisticsQuery(frame, static_cast<Scope>(scope)), 1, sizeof(statistics), &statistics,
+        sizeof(statistics), VK_QUERY_RESULT_64_BIT);
+      if (status == VK_SUCCESS) {
+        result.statistics[scope] = statistics;
+      }
+    }
+  }
+  return true;
+}
+
+
+const char *GpuProfiler::GetScopeName(Scope scope)
+{
+  switch (scope) {
+    case gsFrame: return "frame";
+    case gsDepth: return "depth";
+    case gsSkybox: return "skybox";
+    case gsPbr: return "pbr";
+    default: return "unknown";
+  }
+}
+} // pbr
@@ -0,0 +1,104 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __GPU_PROFILER_HPP
+#define __GPU_PROFILER_HPP
+
+
+#include "platform.hpp"
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+
+namespace pbr {
+
+
+/// Times parts of a frame on the GPU with timestamp queries, and counts what the skybox
+/// and PBR draws cost with pipeline statistics queries. Every frame in flight owns its
+/// own range of queries, and results are read back only after the frame's fence has
+/// been waited on, which is a frame in flight count late. Results are never waited on,
+/// so the queries don't stall the pipeline.
+///
+/// Pipeline statistics queries can't nest, so only the passes get them, not the frame.
+class GpuProfiler {
+public:
+  enum Scope {
+    gsFrame,
+    gsDepth,
+    gsSkybox,
+    gsPbr,
+    gsCount
+  };
+
+  /// In the order vulkan writes them, see kStatisticFlags.
+  struct Statistics {
+    uint64_t clippingInvocations;
+    uint64_t clippingPrimitives;
+    uint64_t fragmentShaderInvocations;
+  };
+
+  /// What one frame measured.
+  struct Result {
+    /// Milliseconds, negative if the scope wasn't timed.
+    double      time[gsCount];
+    /// Zero for scopes that took no statistics, which always includes gsFrame.
+    Statistics  statistics[gsCount];
+  };
+
+  static const VkQueryPipelineStatisticFlags kStatisticFlags;
+
+  GpuProfiler();
+  ~GpuProfiler();
+
+  GpuProfiler(const GpuProfiler &) = delete;
+  GpuProfiler &operator=(const GpuProfiler &) = delete;
+
+  /// queueFamily is the family the frames are submitted to. pipelineStatistics must only
+  /// be true if the pipelineStatisticsQuery feature was enabled on the device.
+  void Initialize(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t queueFamily,
+    uint32_t frameCount, bool pipelineStatistics);
+  void Shutdown();
+
+  /// Forget which scopes the frame recorded. Must be called before any of its scopes are
+  /// recorded, secondaries included, since those may be recorded before BeginFrame().
+  void ResetFrame(uint32_t frame);
+
+  /// Reset the frame's queries. Must be recorded outside of a renderpass, and execute
+  /// before any scope. Leaves what ResetFrame() tracks alone.
+  void BeginFrame(VkCommandBuffer commandBuffer, uint32_t frame);
+
+  /// Scopes other than gsFrame must begin and end in the same subpass, and must not overlap.
+  /// A scope may begin in one secondary commandbuffer and end in a later one, as long as
+  /// statistics is false, a query can't span commandbuffers. Safe to call from several
+  /// threads, recording into different commandbuffers.
+  void BeginScope(VkCommandBuffer commandBuffer, uint32_t frame, Scope scope, bool statistics = true);
+  void EndScope(VkCommandBuffer commandBuffer, uint32_t frame, Scope scope, bool statistics = true);
+
+  /// Read back what the frame recorded the last time around. Its fence must have been waited
+  /// on. Returns false if the frame recorded nothing since the last Collect().
+  bool Collect(uint32_t frame, Result &result);
+
+  bool HasTimestamps() const { return mTimestampPool != VK_NULL_HANDLE; }
+  bool HasStatistics() const { return mStatisticsPool != VK_NULL_HANDLE; }
+
+  static const char *GetScopeName(Scope scope);
+
+private:
+  uint32_t TimestampQuery(uint32_t frame, Scope scope) const { return (frame * gsCount + scope) * 2; }
+  uint32_t StatisticsQuery(uint32_t frame, Scope scope) const { return frame * gsCount + scope; }
+
+  VkDevice                mDevice;
+  VkQueryPool             mTimestampPool;
+  VkQueryPool             mStatisticsPool;
+  /// Milliseconds per tick.
+  double                  mPeriod;
+  uint64_t                mMask;
+  /// Bit per scope recorded into each frame since its last Collect(), and per scope that
+  /// also took statistics.
+  std::unique_ptr<std::atomic<uint32_t>[]> mRecorded;
+  std::unique_ptr<std::atomic<uint32_t>[]> mQueried;
+};
+} // pbr
+#endif // __GPU_PROFILER_HPP
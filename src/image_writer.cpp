@@ -0,0 +1,236 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "image_writer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+
+namespace pbr {
+
+
+// Largest payload of a stored deflate block.
+static const size_t kMaxStoredBlock = 65535;
+
+
+static uint32_t Crc32(const uint8_t *data, size_t size, uint32_t crc = 0)
+{
+  // Function local static, so the table is built once even with concurrent writers.
+  static const std::array<uint32_t, 256> table = [] {
+    std::array<uint32_t, 256> t;
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+      }
+      t[n] = c;
+    }
+    return t;
+  }();
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+
+static uint32_t Adler32(const uint8_t *data, size_t size)
+{
+  uint32_t a = 1;
+  uint32_t b = 0;
+  for (size_t i = 0; i < size; ++i) {
+    a = (a + data[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  return (b << 16) | a;
+}
+
+
+static void PushU32(std::vector<uint8_t> &out, uint32_t value)
+{
+  out.push_back(static_cast<uint8_t>(value >> 24));
+  out.push_back(static_cast<uint8_t>(value >> 16));
+  out.push_back(static_cast<uint8_t>(value >> 8));
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+
+static void WriteChunk(std::FILE *file, const char type[4], const std::vector<uint8_t> &data)
+{
+  std::vector<uint8_t> chunk;
+  chunk.reserve(data.size() + 12);
+  PushU32(chunk, static_cast<uint32_t>(data.size()));
+  chunk.insert(chunk.end(), type, type + 4);
+  chunk.insert(chunk.end(), data.begin(), data.end());
+  // The crc covers the type and the data, not the length.
+  PushU32(chunk, Crc32(chunk.data() + 4, data.size() + 4));
+  std::fwrite(chunk.data(), 1, chunk.size(), file);
+}
+
+
+bool ImageWriter::WritePng(const char *filepath, uint32_t width, uint32_t height,
+  const uint8_t *pixels, size_t rowPitch)
+{
+  // Every scanline starts with its filter type, 0 being none.
+  std::vector<uint8_t> raw;
+  raw.reserve((size_t )height * (1 + (size_t )width * 3));
+  for (uint32_t y = 0; y < height; ++y) {
+    const uint8_t *row = pixels + y * rowPitch;
+    raw.push_back(0);
+    for (uint32_t x = 0; x < width; ++x) {
+      raw.push_back(row[x * 4 + 0]);
+      raw.push_back(row[x * 4 + 1]);
+      raw.push_back(row[x * 4 + 2]);
+    }
+  }
+
+  // zlib stream made of stored blocks.
+  std::vector<uint8_t> idat;
+  idat.reserve(raw.size() + (raw.size() / kMaxStoredBlock + 1) * 5 + 6);
+  idat.push_back(0x78);
+  idat.push_back(0x01);
+  size_t offset = 0;
+  do {
+    size_t length = (std::min)(raw.size() - offset, kMaxStoredBlock);
+    bool last = offset + length == raw.size();
+    idat.push_back(last ? 1 : 0);
+    idat.push_back(static_cast<uint8_t>(length));
+    idat.push_back(static_cast<uint8_t>(length >> 8));
+    idat.push_back(static_cast<uint8_t>(~length));
+    idat.push_back(static_cast<uint8_t>(~length >> 8));
+    idat.insert(idat.end(), raw.begin() + offset, raw.begin() + offset + length);
+    offset += length;
+  } while (offset < raw.size());
+  PushU32(idat, Adler32(raw.data(), raw.size()));
+
+  std::vector<uint8_t> ihdr;
+  PushU32(ihdr, width);
+  PushU32(ihdr, height);
+  ihdr.push_back(8);  // bit depth
+  ihdr.push_back(2);  // truecolor
+  ihdr.push_back(0);  // deflate
+  ihdr.push_back(0);  // adaptive filtering
+  ihdr.push_back(0);  // no interlace
+
+  std::FILE *file = std::fopen(filepath, "wb");
+  if (!file) {
+    std::printf("Failed to write image %s\n", filepath);
+    return false;
+  }
+  static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  std::fwrite(signature, 1, sizeof(signature), file);
+  WriteChunk(file, "IHDR", ihdr);
+  WriteChunk(file, "IDAT", idat);
+  WriteChunk(file, "IEND", std::vector<uint8_t>());
+  bool ok = std::ferror(file) == 0;
+  std::fclose(file);
+  return ok;
+}
+
+
+// OpenEXR is little endian throughout.
+static void PushLE32(std::vector<uint8_t> &out, uint32_t value)
+{
+  out.push_back(static_cast<uint8_t>(value));
+  out.push_back(static_cast<uint8_t>(value >> 8));
+  out.push_back(static_cast<uint8_t>(value >> 16));
+  out.push_back(static_cast<uint8_t>(value >> 24));
+}
+
+
+static void PushFloat(std::vector<uint8_t> &out, float value)
+{
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  PushLE32(out, bits);
+}
+
+
+static void PushAttribute(std::vector<uint8_t> &out, const char *name, const char *type,
+  const std::vector<uint8_t> &value)
+{
+  out.insert(out.end(), name, name + std::strlen(name) + 1);
+  out.insert(out.end(), type, type + std::strlen(type) + 1);
+  PushLE32(out, static_cast<uint32_t>(value.size()));
+  out.insert(out.end(), value.begin(), value.end());
+}
+
+
+bool ImageWriter::WriteExr(const char *filepath, uint32_t width, uint32_t height, const float *rgb)
+{
+  // Channels have to be listed in alphabetical order, and are stored in it.
+  static const char *kChannels[3] = { "B", "G", "R" };
+  static const uint32_t kChannelOffsets[3] = { 2, 1, 0 };
+  std::vector<uint8_t> channels;
+  for (const char *channel : kChannels) {
+    channels.insert(channels.end(), channel, channel + std::strlen(channel) + 1);
+    PushLE32(channels, 2);  // 32 bit float
+    PushLE32(channels, 0);  // pLinear and reserved bytes
+    PushLE32(channels, 1);  // x sampling
+    PushLE32(channels, 1);  // y sampling
+  }
+  channels.push_back(0);
+  std::vector<uint8_t> window;
+  PushLE32(window, 0);
+  PushLE32(window, 0);
+  PushLE32(window, width - 1);
+  PushLE32(window, height - 1);
+  std::vector<uint8_t> aspect;
+  PushFloat(aspect, 1.0f);
+  std::vector<uint8_t> center;
+  PushFloat(center, 0.0f);
+  PushFloat(center, 0.0f);
+
+  // Magic number, then version 2 of a single part scanline file.
+  std::vector<uint8_t> header = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 };
+  PushAttribute(header, "channels", "chlist", channels);
+  PushAttribute(header, "compression", "compression", std::vector<uint8_t>(1, 0));
+  PushAttribute(header, "dataWindow", "box2i", window);
+  PushAttribute(header, "displayWindow", "box2i", window);
+  PushAttribute(header, "lineOrder", "lineOrder", std::vector<uint8_t>(1, 0));
+  PushAttribute(header, "pixelAspectRatio", "float", aspect);
+  PushAttribute(header, "screenWindowCenter", "v2f", center);
+  PushAttribute(header, "screenWindowWidth", "float", aspect);
+  header.push_back(0);
+
+  // Uncompressed, one scanline per block, each block found through the offset table.
+  uint32_t blockSize = width * 3 * sizeof(float);
+  uint64_t blockOffset = header.size() + height * sizeof(uint64_t);
+  std::vector<uint8_t> offsets;
+  for (uint32_t y = 0; y < height; ++y) {
+    uint64_t offset = blockOffset + (uint64_t )y * (8 + blockSize);
+    PushLE32(offsets, static_cast<uint32_t>(offset));
+    PushLE32(offsets, static_cast<uint32_t>(offset >> 32));
+  }
+  std::vector<uint8_t> block;
+  block.reserve(8 + blockSize);
+
+  std::FILE *file = std::fopen(filepath, "wb");
+  if (!file) {
+    std::printf("Failed to write image %s\n", filepath);
+    return false;
+  }
+  std::fwrite(header.data(), 1, header.size(), file);
+  std::fwrite(offsets.data(), 1, offsets.size(), file);
+  for (uint32_t y = 0; y < height; ++y) {
+    block.clear();
+    PushLE32(block, y);
+    PushLE32(block, blockSize);
+    for (uint32_t channel = 0; channel < 3; ++channel) {
+      const float *row = rgb + (size_t )y * width * 3 + kChannelOffsets[channel];
+      for (uint32_t x = 0; x < width; ++x) {
+        PushFloat(block, row[x * 3]);
+      }
+    }
+    std::fwrite(block.data(), 1, block.size(), file);
+  }
+  bool ok = std::ferror(file) == 0;
+  std::fclose(file);
+  return ok;
+}
+} // pbr
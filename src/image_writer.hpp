@@ -0,0 +1,30 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __IMAGE_WRITER_HPP
+#define __IMAGE_WRITER_HPP
+
+
+#include "platform.hpp"
+#include <stdint.h>
+
+
+namespace pbr {
+
+
+/// Writes frames read back from the gpu, and the reference renders, to disk. There is
+/// no zlib in the tree, so the PNG is written with stored (uncompressed) deflate
+/// blocks. Files come out about as big as the raw pixels, but any viewer or image diff
+/// tool reads them.
+class ImageWriter {
+public:
+  /// Write 8 bit RGBA pixels as a PNG. rowPitch is the distance between rows in bytes,
+  /// which may be larger than width * 4. The alpha channel is dropped.
+  static bool WritePng(const char *filepath, uint32_t width, uint32_t height,
+    const uint8_t *pixels, size_t rowPitch);
+
+  /// Write linear float RGB pixels, rows top to bottom, as an uncompressed OpenEXR.
+  static bool WriteExr(const char *filepath, uint32_t width, uint32_t height, const float *rgb);
+};
+} // pbr
+#endif // __IMAGE_WRITER_HPP
@@ -2,11 +2,137 @@
 // Copyright (c) Mario Garcia, MIT License.
 //
 #include "base.hpp"
+#include "benchmark.hpp"
+#include "path_tracer.hpp"
+#include "assets.hpp"
+#include "trace.hpp"
 
 #include <iostream>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
 
 int main(int c, char *argv[]) {
   std::cout << "PBR_VERSION: " << PBR_CURRENT_VERSION << "\n";
+  // --bench <name> [file] runs one of the offline benchmarks and quits. Without a file,
+  // or if the next argument is another option, the benchmark uses its default asset.
+  for (int i = 1; i < c; ++i) {
+    if (std::strcmp(argv[i], "--bench") == 0 && i + 1 < c) {
+      const char *filepath = (i + 2 < c && std::strncmp(argv[i + 2], "--", 2) != 0) ? argv[i + 2] : nullptr;
+      return pbr::Benchmark::Run(argv[i + 1], filepath) ? 0 : 1;
+    }
+  }
+  // --frames-in-flight <count>, or sweep to benchmark every count from 1 to 3 in one run.
+  uint32_t framesInFlight = 2;
+  bool sweepFramesInFlight = false;
+  // --headless [frames] [--size <w>x<h>] [--output <dir>] renders offscreen and quits.
+  bool headless = false;
+  uint32_t headlessFrames = 1;
+  uint32_t width = 1440;
+  uint32_t height = 900;
+  std::string outputDir;
+  // --benchmark <frames> [--script <file>] [--json <file>] replays a camera script with
+  // a fixed timestep and reports frame times. --record <file> saves an interactive run
+  // as a camera script.
+  uint32_t benchmarkFrames = 0;
+  std::string scriptPath;
+  std::string jsonPath;
+  std::string recordPath;
+  // --trace <file> writes the CPU scopes of the whole run as chrome trace json.
+  std::string tracePath;
+  // --depth-prepass starts with the depth prepass on.
+  bool depthPrepass = false;
+  // --reference <samples> [--light] path traces the first frame on the CPU instead, into
+  // reference.exr and reference.png, using --size and --output as well.
+  uint32_t referenceSamples = 0;
+  bool referenceLight = false;
+  for (int i = 1; i < c; ++i) {
+    if (std::strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < c) {
+      if (std::strcmp(argv[i + 1], "sweep") == 0) {
+        sweepFramesInFlight = true;
+      } else {
+        framesInFlight = static_cast<uint32_t>(std::atoi(argv[i + 1]));
+      }
+    } else if (std::strcmp(argv[i], "--headless") == 0) {
+      headless = true;
+      if (i + 1 < c && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))) {
+        headlessFrames = static_cast<uint32_t>(std::atoi(argv[i + 1]));
+      }
+    } else if (std::strcmp(argv[i], "--size") == 0 && i + 1 < c) {
+      unsigned w = 0, h = 0;
+      if (std::sscanf(argv[i + 1], "%ux%u", &w, &h) == 2 && w > 0 && h > 0) {
+        width = w;
+        height = h;
+      }
+    } else if (std::strcmp(argv[i], "--output") == 0 && i + 1 < c) {
+      outputDir = argv[i + 1];
+    } else if (std::strcmp(argv[i], "--benchmark") == 0 && i + 1 < c) {
+      benchmarkFrames = static_cast<uint32_t>(std::atoi(argv[i + 1]));
+    } else if (std::strcmp(argv[i], "--script") == 0 && i + 1 < c) {
+      scriptPath = argv[i + 1];
+    } else if (std::strcmp(argv[i], "--json") == 0 && i + 1 < c) {
+      jsonPath = argv[i + 1];
+    } else if (std::strcmp(argv[i], "--record") == 0 && i + 1 < c) {
+      recordPath = argv[i + 1];
+    } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < c) {
+      tracePath = argv[i + 1];
+    } else if (std::strcmp(argv[i], "--depth-prepass") == 0) {
+      depthPrepass = true;
+    } else if (std::strcmp(argv[i], "--reference") == 0 && i + 1 < c) {
+      referenceSamples = static_cast<uint32_t>(std::atoi(argv[i + 1]));
+    } else if (std::strcmp(argv[i], "--light") == 0) {
+      referenceLight = true;
+    }
+  }
+  if (!tracePath.empty()) {
+#if !defined(PBR_TRACE) || !PBR_TRACE
+    std::cout << "Built without PBR_TRACE, the trace will be empty. Configure with "
+      "-DPBR_TRACE=ON to build the scopes in.\n";
+#endif
+    pbr::Trace::Enable();
+    PBR_TRACE_THREAD_NAME("main");
+  }
+  if (referenceSamples > 0) {
+    pbr::Assets::Start();
+    bool written = pbr::PathTracer::RenderReference(referenceSamples, width, height, outputDir,
+      referenceLight);
+    if (!tracePath.empty()) {
+      pbr::Trace::Write(tracePath.c_str());
+    }
+    return written ? 0 : 1;
+  }
+  // Nobody is there to press Enter for these.
+  if (headless || benchmarkFrames > 0) {
+    pbr::Assets::Start();
+    pbr::Base base;
+    if (headless) {
+      base.SetupHeadless(width, height, headlessFrames, outputDir);
+    } else {
+      base.SetupWindow(width, height);
+    }
+    if (benchmarkFrames > 0) {
+      base.SetupBenchmark(benchmarkFrames, scriptPath, jsonPath);
+      if (sweepFramesInFlight) {
+        base.SetupFramesInFlightSweep();
+      }
+    } else if (sweepFramesInFlight) {
+      std::cout << "--frames-in-flight sweep needs --benchmark, rendering with " 
+        << framesInFlight << " in flight.\n";
+    }
+    base.SetFramesInFlight(framesInFlight);
+    base.SetDepthPrepass(depthPrepass);
+    base.Initialize();
+    base.Run();
+    if (!tracePath.empty()) {
+      pbr::Trace::Write(tracePath.c_str());
+    }
+    return 0;
+  }
+  // Start parsing and compiling right away, it overlaps with the prompt 
+  // below and with the vulkan setup in Initialize().
+  pbr::Assets::Start();
   std::cout << R"(
     StupidEngine (TM) PBR Render Sample
     Copyright (c) Mario Garcia, MIT License.
@@ -24,6 +150,7 @@ int main(int c, char *argv[]) {
     Hold G/F = Increase/Decrease gloss value
   
     L/O = Turn on/off lights.
+    Z/X = Turn on/off the depth prepass.
     
     ESC = quit.
 
@@ -32,10 +159,18 @@ int main(int c, char *argv[]) {
   std::cin.ignore();
   std::cout << "Starting up...\n";
   pbr::Base base;
-  base.SetupWindow(1440, 900);
+  base.SetupWindow(width, height);
+  if (!recordPath.empty()) {
+    base.SetupRecording(recordPath);
+  }
+  base.SetFramesInFlight(framesInFlight);
+  base.SetDepthPrepass(depthPrepass);
   base.Initialize();
   std::cout << "Complete!\n";
   base.Run();
+  if (!tracePath.empty()) {
+    pbr::Trace::Write(tracePath.c_str());
+  }
   std::cout << "Exiting.\n";
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,283 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "mesh_cache.hpp"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#if !defined(_WIN32)
+ #include <sys/mman.h>
+ #include <fcntl.h>
+ #include <unistd.h>
+#endif
+
+
+namespace pbr {
+
+
+const char kMeshCacheMagic[8] = { 'P', 'B', 'R', 'M', 'E', 'S', 'H', '\0' };
+const uint64_t kMeshCacheAlignment = 16;
+
+
+static uint64_t AlignUp(uint64_t value, uint64_t alignment)
+{
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+
+// Whether count elements of stride bytes at offset fit in size bytes, without
+// the multiply or add wrapping around on a corrupt header.
+static bool FitsIn(uint64_t offset, uint64_t count, uint64_t stride, uint64_t size)
+{
+  return offset <= size && count <= (size - offset) / stride;
+}
+
+
+MappedFile::MappedFile()
+  : mData(nullptr)
+  , mSize(0)
+#if defined(_WIN32)
+  , mFile(INVALID_HANDLE_VALUE)
+  , mMapping(NULL)
+#endif
+{
+}
+
+
+MappedFile::~MappedFile()
+{
+  Close();
+}
+
+
+MappedFile::MappedFile(MappedFile &&other)
+  : MappedFile()
+{
+  *this = std::move(other);
+}
+
+
+MappedFile &MappedFile::operator=(MappedFile &&other)
+{
+  if (this != &other) {
+    Close();
+    mData = other.mData;
+    mSize = other.mSize;
+    other.mData = nullptr;
+    other.mSize = 0;
+#if defined(_WIN32)
+    mFile = other.mFile;
+    mMapping = other.mMapping;
+    other.mFile = INVALID_HANDLE_VALUE;
+    other.mMapping = NULL;
+#endif
+  }
+  return *this;
+}
+
+
+bool MappedFile::Open(const char *filepath)
+{
+  Close();
+#if defined(_WIN32)
+  mFile = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (mFile == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(mFile, &size) || size.QuadPart == 0) {
+    Close();
+    return false;
+  }
+  mMapping = CreateFileMappingA(mFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mMapping == NULL) {
+    Close();
+    return false;
+  }
+  mData = static_cast<const uint8_t *>(MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+  if (!mData) {
+    Close();
+    return false;
+  }
+  mSize = static_cast<size_t>(size.QuadPart);
+#else
+  int fd = open(filepath, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps its own reference to the file.
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  // We are going to stream through the whole thing once, straight into the staging buffer.
+  madvise(data, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+  mData = static_cast<const uint8_t *>(data);
+  mSize = static_cast<size_t>(st.st_size);
+#endif
+  return true;
+}
+
+
+void MappedFile::Close()
+{
+#if defined(_WIN32)
+  if (mData) {
+    UnmapViewOfFile(mData);
+  }
+  if (mMapping != NULL) {
+    CloseHandle(mMapping);
+  }
+  if (mFile != INVALID_HANDLE_VALUE) {
+    CloseHandle(mFile);
+  }
+  mMapping = NULL;
+  mFile = INVALID_HANDLE_VALUE;
+#else
+  if (mData) {
+    munmap(const_cast<uint8_t *>(mData), mSize);
+  }
+#endif
+  mData = nullptr;
+  mSize = 0;
+}
+
+
+std::string MeshCache::GetCachePath(const char *sourcePath)
+{
+  return std::string(sourcePath) + ".pbrmesh";
+}
+
+
+bool MeshCache::GetSourceStats(const char *sourcePath, uint64_t &size, int64_t &modifiedTime)
+{
+#if defined(_WIN32)
+  struct _stat64 st;
+  if (_stat64(sourcePath, &st) != 0) {
+    return false;
+  }
+#else
+  struct stat st;
+  if (stat(sourcePath, &st) != 0) {
+    return false;
+  }
+#endif
+  size = static_cast<uint64_t>(st.st_size);
+  modifiedTime = static_cast<int64_t>(st.st_mtime);
+  return true;
+}
+
+
+bool MeshCache::Load(const char *sourcePath, MappedFile &file,
+  const Vertex *&vertices, size_t &vertexCount,
+  const uint32_t *&indices, size_t &indexCount)
+{
+  uint64_t sourceSize;
+  int64_t sourceModifiedTime;
+  if (!GetSourceStats(sourcePath, sourceSize, sourceModifiedTime)) {
+    return false;
+  }
+  if (!file.Open(GetCachePath(sourcePath).c_str())) {
+    return false;
+  }
+
+  const uint8_t *data = file.GetData();
+  size_t size = file.GetSize();
+  size_t pathLength = std::strlen(sourcePath);
+  Header header;
+  if (size < sizeof(Header)) {
+    file.Close();
+    return false;
+  }
+  std::memcpy(&header, data, sizeof(Header));
+  bool valid = std::memcmp(header.magic, kMeshCacheMagic, sizeof(kMeshCacheMagic)) == 0 &&
+    header.version == kVersion &&
+    header.vertexStride == sizeof(Vertex) &&
+    header.sourceSize == sourceSize &&
+    header.sourceModifiedTime == sourceModifiedTime &&
+    header.sourcePathLength == pathLength &&
+    sizeof(Header) + pathLength <= size &&
+    std::memcmp(data + sizeof(Header), sourcePath, pathLength) == 0 &&
+    header.vertexOffset % kMeshCacheAlignment == 0 &&
+    header.indexOffset % kMeshCacheAlignment == 0 &&
+    FitsIn(header.vertexOffset, header.vertexCount, sizeof(Vertex), size) &&
+    FitsIn(header.indexOffset, header.indexCount, sizeof(uint32_t), size);
+  if (!valid) {
+    file.Close();
+    return false;
+  }
+
+  // The payload goes to the gpu as is, an index past the vertices must not get that far.
+  const uint32_t *mappedIndices = reinterpret_cast<const uint32_t *>(data + header.indexOffset);
+  for (uint64_t i = 0; i < header.indexCount; ++i) {
+    if (mappedIndices[i] >= header.vertexCount) {
+      std::cout << "Mesh cache " << GetCachePath(sourcePath) << " has an index out of range.\n";
+      file.Close();
+      return false;
+    }
+  }
+
+  vertices = reinterpret_cast<const Vertex *>(data + header.vertexOffset);
+  vertexCount = static_cast<size_t>(header.vertexCount);
+  indices = mappedIndices;
+  indexCount = static_cast<size_t>(header.indexCount);
+  return true;
+}
+
+
+bool MeshCache::Store(const char *sourcePath, const GeometryData &data)
+{
+  Header header = { };
+  std::memcpy(header.magic, kMeshCacheMagic, sizeof(kMeshCacheMagic));
+  header.version = kVersion;
+  header.vertexStride = sizeof(Vertex);
+  if (!GetSourceStats(sourcePath, header.sourceSize, header.sourceModifiedTime)) {
+    return false;
+  }
+  header.sourcePathLength = std::strlen(sourcePath);
+  header.vertexCount = data.vertices.size();
+  header.indexCount = data.indices.size();
+  header.vertexOffset = AlignUp(sizeof(Header) + header.sourcePathLength, kMeshCacheAlignment);
+  header.indexOffset = AlignUp(header.vertexOffset + header.vertexCount * sizeof(Vertex), 
+    kMeshCacheAlignment);
+
+  // Write to a temporary first, so that a crash midway never leaves a torn cache behind.
+  std::string cachePath = GetCachePath(sourcePath);
+  std::string tempPath = cachePath + ".tmp";
+  {
+    std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+      std::cout << "Failed to write mesh cache " << cachePath << "\n";
+      return false;
+    }
+    const char padding[kMeshCacheAlignment] = { };
+    file.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+    file.write(sourcePath, header.sourcePathLength);
+    file.write(padding, header.vertexOffset - (sizeof(Header) + header.sourcePathLength));
+    file.write(reinterpret_cast<const char *>(data.vertices.data()), 
+      header.vertexCount * sizeof(Vertex));
+    file.write(padding, header.indexOffset - (header.vertexOffset + header.vertexCount * sizeof(Vertex)));
+    file.write(reinterpret_cast<const char *>(data.indices.data()),
+      header.indexCount * sizeof(uint32_t));
+    if (!file.good()) {
+      file.close();
+      std::remove(tempPath.c_str());
+      return false;
+    }
+  }
+  std::remove(cachePath.c_str());
+  return std::rename(tempPath.c_str(), cachePath.c_str()) == 0;
+}
+} // pbr
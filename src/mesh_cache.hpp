@@ -0,0 +1,89 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __MESH_CACHE_HPP
+#define __MESH_CACHE_HPP
+
+
+#include "platform.hpp"
+#include "geometry.hpp"
+#include <stdint.h>
+#include <string>
+
+
+namespace pbr {
+
+
+/// Read only memory mapping of a whole file. The mapping stays alive for as long
+/// as this object does, so pointers handed out by GetData() are valid until Close().
+class MappedFile {
+public:
+  MappedFile();
+  ~MappedFile();
+
+  MappedFile(MappedFile &&other);
+  MappedFile &operator=(MappedFile &&other);
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool Open(const char *filepath);
+  void Close();
+
+  bool IsOpen() const { return mData != nullptr; }
+  const uint8_t *GetData() const { return mData; }
+  size_t GetSize() const { return mSize; }
+
+private:
+  const uint8_t *mData;
+  size_t mSize;
+#if defined(_WIN32)
+  HANDLE mFile;
+  HANDLE mMapping;
+#endif
+};
+
+
+/// Binary mesh cache. Parsed models are written next to their source file as 
+/// <source>.pbrmesh, which holds the welded vertex and index payloads exactly as they 
+/// are uploaded to the gpu. A cache file is only used if its header matches the version,
+/// the vertex layout, and the path, size and modification time of the source file, 
+/// otherwise the source is parsed again and the cache rewritten.
+///
+/// Layout:
+/// | MeshCacheHeader | source path | padding | vertices | indices |
+/// Payloads are aligned to 16 bytes from the start of the file.
+class MeshCache {
+public:
+  static const uint32_t kVersion = 1;
+
+  struct Header {
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  vertexStride;
+    uint64_t  sourceSize;
+    int64_t   sourceModifiedTime;
+    uint64_t  sourcePathLength;
+    uint64_t  vertexCount;
+    uint64_t  indexCount;
+    uint64_t  vertexOffset;
+    uint64_t  indexOffset;
+  };
+
+  /// Get the path of the cache file for the given source file.
+  static std::string GetCachePath(const char *sourcePath);
+
+  /// Map the cache file of the source file. Returns false if there is no cache, or if 
+  /// it is stale or corrupt, payloads past the end of the file or indices past the
+  /// vertices. On success the vertex and index pointers point into the mapping.
+  static bool Load(const char *sourcePath, MappedFile &file, 
+    const Vertex *&vertices, size_t &vertexCount, 
+    const uint32_t *&indices, size_t &indexCount);
+
+  /// Write the geometry into the cache file of the source file.
+  static bool Store(const char *sourcePath, const GeometryData &data);
+
+private:
+  static bool GetSourceStats(const char *sourcePath, uint64_t &size, int64_t &modifiedTime);
+};
+} // pbr
+#endif // __MESH_CACHE_HPP
@@ -11,17 +11,335 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
 #include <set>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
 
 
 namespace pbr {
 
 
-GeometryData Model::LoadModel(const char *name, const char *filepath)
+// Hashes the raw bits of a Vertex, so that identical position/normal/uv tuples
+// coming from different OBJ face corners can be welded into one vertex.
+struct VertexHash {
+  size_t operator()(const Vertex &vertex) const {
+    uint32_t bits[8];
+    std::memcpy(bits, &vertex, sizeof(bits));
+    // FNV-1a over the 8 floats of the vertex.
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t i = 0; i < 8; ++i) {
+      hash ^= bits[i];
+      hash *= 1099511628211ull;
+    }
+    return static_cast<size_t>(hash ^ (hash >> 32));
+  }
+};
+
+
+struct VertexEqual {
+  bool operator()(const Vertex &a, const Vertex &b) const {
+    return std::memcmp(&a, &b, sizeof(Vertex)) == 0;
+  }
+};
+
+
+// Powers of ten for the float parser, exact in double up to 1e22.
+static const double kPow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+  1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
+static bool IsSpace(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+
+static const char *SkipSpaces(const char *p, const char *end)
+{
+  while (p < end && IsSpace(*p)) ++p;
+  return p;
+}
+
+
+static const char *SkipLine(const char *p, const char *end)
+{
+  while (p < end && *p != '\n') ++p;
+  return p < end ? p + 1 : end;
+}
+
+
+// Fast float parsing for the plain decimal numbers OBJ exporters write, eg. "-0.0312" or
+// "1.5e-3". Mantissa digits are accumulated in an integer and scaled once, which is 
+// within an ulp of strtof, without strtof's locale handling and per call overhead.
+static const char *ParseFloat(const char *p, const char *end, float &value)
+{
+  p = SkipSpaces(p, end);
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    ++p;
+  }
+  uint64_t mantissa = 0;
+  int32_t exponent = 0;
+  int32_t digits = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+      ++digits;
+    } else {
+      ++exponent;
+    }
+    ++p;
+  }
+  if (p < end && *p == '.') {
+    ++p;
+    while (p < end && *p >= '0' && *p <= '9') {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        ++digits;
+        --exponent;
+      }
+      ++p;
+    }
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    ++p;
+    bool negativeExponent = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+      negativeExponent = *p == '-';
+      ++p;
+    }
+    int32_t e = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+      if (e < 10000) e = e * 10 + (*p - '0');
+      ++p;
+    }
+    exponent += negativeExponent ? -e : e;
+  }
+  double result = static_cast<double>(mantissa);
+  while (exponent > 22) { result *= 1e22; exponent -= 22; }
+  while (exponent < -22) { result /= 1e22; exponent += 22; }
+  result = exponent < 0 ? result / kPow10[-exponent] : result * kPow10[exponent];
+  value = static_cast<float>(negative ? -result : result);
+  return p;
+}
+
+
+static const char *ParseInt(const char *p, const char *end, int32_t &value)
+{
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    ++p;
+  }
+  int32_t result = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    result = result * 10 + (*p - '0');
+    ++p;
+  }
+  value = negative ? -result : result;
+  return p;
+}
+
+
+// Everything a chunk of the file parses into. Absolute (positive) OBJ indices are resolved
+// right away, relative (negative) ones depend on how many attributes the earlier chunks hold,
+// so they get patched up once the chunks are merged.
+struct ObjChunk {
+  struct Fixup {
+    size_t  corner;
+    int32_t attribute;
+    int32_t localIndex;
+  };
+
+  ObjData             data;
+  std::vector<Fixup>  fixups;
+};
+
+
+static void ParseObjChunk(const char *p, const char *end, ObjChunk &chunk)
+{
+  ObjData &data = chunk.data;
+  std::vector<ObjIndex> face;
+  std::vector<uint8_t> faceRelative;
+  while (p < end) {
+    p = SkipSpaces(p, end);
+    if (p >= end) break;
+    if (p[0] == 'v' && p + 1 < end && IsSpace(p[1])) {
+      float x, y, z;
+      p = ParseFloat(p + 1, end, x);
+      p = ParseFloat(p, end, y);
+      p = ParseFloat(p, end, z);
+      data.vertices.push_back(x);
+      data.vertices.push_back(y);
+      data.vertices.push_back(z);
+    } else if (p[0] == 'v' && p + 2 < end && p[1] == 'n' && IsSpace(p[2])) {
+      float x, y, z;
+      p = ParseFloat(p + 2, end, x);
+      p = ParseFloat(p, end, y);
+      p = ParseFloat(p, end, z);
+      data.normals.push_back(x);
+      data.normals.push_back(y);
+      data.normals.push_back(z);
+    } else if (p[0] == 'v' && p + 2 < end && p[1] == 't' && IsSpace(p[2])) {
+      float u, v;
+      p = ParseFloat(p + 2, end, u);
+      p = ParseFloat(p, end, v);
+      data.texcoords.push_back(u);
+      data.texcoords.push_back(v);
+    } else if (p[0] == 'f' && p + 1 < end && IsSpace(p[1])) {
+      // Local attribute counts, relative indices count back from these.
+      int32_t counts[3] = {
+        static_cast<int32_t>(data.vertices.size() / 3),
+        static_cast<int32_t>(data.normals.size() / 3),
+        static_cast<int32_t>(data.texcoords.size() / 2)
+      };
+      face.clear();
+      faceRelative.clear();
+      ++p;
+      for (;;) {
+        p = SkipSpaces(p, end);
+        if (p >= end || !((*p >= '0' && *p <= '9') || *p == '-' || *p == '+')) break;
+        // v, v/vt, v//vn or v/vt/vn. raw is ordered vertex, normal, texcoord.
+        int32_t raw[3] = { 0, 0, 0 };
+        p = ParseInt(p, end, raw[0]);
+        if (p < end && *p == '/') {
+          ++p;
+          if (p < end && *p != '/') {
+            p = ParseInt(p, end, raw[2]);
+          }
+          if (p < end && *p == '/') {
+            ++p;
+            p = ParseInt(p, end, raw[1]);
+          }
+        }
+        ObjIndex index;
+        int32_t *resolved[3] = { &index.vertex, &index.normal, &index.texcoord };
+        uint8_t relative = 0;
+        for (int32_t a = 0; a < 3; ++a) {
+          if (raw[a] > 0) {
+            *resolved[a] = raw[a] - 1;
+          } else if (raw[a] < 0) {
+            // Local to this chunk for now, patched into an absolute index on merge.
+            *resolved[a] = counts[a] + raw[a];
+            relative |= 1 << a;
+          } else {
+            *resolved[a] = -1;
+          }
+        }
+        face.push_back(index);
+        faceRelative.push_back(relative);
+      }
+      // Fan triangulate polygons, the same way tinyobj does.
+      for (size_t k = 2; k < face.size(); ++k) {
+        size_t corners[3] = { 0, k - 1, k };
+        for (size_t c = 0; c < 3; ++c) {
+          const ObjIndex &index = face[corners[c]];
+          uint8_t relative = faceRelative[corners[c]];
+          if (relative) {
+            const int32_t values[3] = { index.vertex, index.normal, index.texcoord };
+            for (int32_t a = 0; a < 3; ++a) {
+              if (relative & (1 << a)) {
+                chunk.fixups.push_back({ data.indices.size(), a, values[a] });
+              }
+            }
+          }
+          data.indices.push_back(index);
+        }
+      }
+    }
+    p = SkipLine(p, end);
+  }
+}
+
+
+static bool ParseObjParallel(const char *filepath, ObjData &obj)
+{
+  MappedFile file;
+  if (!file.Open(filepath)) {
+    std::cout << "Failed to open " << filepath << "\n";
+    return false;
+  }
+  const char *begin = reinterpret_cast<const char *>(file.GetData());
+  const char *end = begin + file.GetSize();
+
+  // Oversplit a bit, so that chunks full of faces and chunks full of 
+  // positions even out between the workers.
+  ThreadPool &pool = ThreadPool::Global();
+  const size_t kMinChunkSize = 256 * 1024;
+  size_t chunkCount = (std::max)(size_t(1), 
+    (std::min)(size_t(pool.GetThreadCount() + 1) * 4, file.GetSize() / kMinChunkSize));
+  std::vector<const char *> splits(chunkCount + 1);
+  splits[0] = begin;
+  for (size_t i = 1; i < chunkCount; ++i) {
+    const char *p = begin + (file.GetSize() * i) / chunkCount;
+    if (p < splits[i - 1]) p = splits[i - 1];
+    splits[i] = SkipLine(p, end);
+  }
+  splits[chunkCount] = end;
+
+  std::vector<ObjChunk> chunks(chunkCount);
+  // Set for chunks with a relative index reaching back past the first attribute.
+  std::vector<uint8_t> chunkOutOfRange(chunkCount, 0);
+  pool.ParallelFor(static_cast<uint32_t>(chunkCount), [&] (uint32_t i) {
+    ParseObjChunk(splits[i], splits[i + 1], chunks[i]);
+  });
+
+  // Prefix sums of the attribute counts, in floats, and of the corners.
+  std::vector<size_t> vertexOffsets(chunkCount + 1, 0);
+  std::vector<size_t> normalOffsets(chunkCount + 1, 0);
+  std::vector<size_t> texcoordOffsets(chunkCount + 1, 0);
+  std::vector<size_t> indexOffsets(chunkCount + 1, 0);
+  for (size_t i = 0; i < chunkCount; ++i) {
+    vertexOffsets[i + 1] = vertexOffsets[i] + chunks[i].data.vertices.size();
+    normalOffsets[i + 1] = normalOffsets[i] + chunks[i].data.normals.size();
+    texcoordOffsets[i + 1] = texcoordOffsets[i] + chunks[i].data.texcoords.size();
+    indexOffsets[i + 1] = indexOffsets[i] + chunks[i].data.indices.size();
+  }
+  obj.vertices.resize(vertexOffsets[chunkCount]);
+  obj.normals.resize(normalOffsets[chunkCount]);
+  obj.texcoords.resize(texcoordOffsets[chunkCount]);
+  obj.indices.resize(indexOffsets[chunkCount]);
+
+  pool.ParallelFor(static_cast<uint32_t>(chunkCount), [&] (uint32_t i) {
+    ObjChunk &chunk = chunks[i];
+    std::copy(chunk.data.vertices.begin(), chunk.data.vertices.end(), obj.vertices.begin() + vertexOffsets[i]);
+    std::copy(chunk.data.normals.begin(), chunk.data.normals.end(), obj.normals.begin() + normalOffsets[i]);
+    std::copy(chunk.data.texcoords.begin(), chunk.data.texcoords.end(), obj.texcoords.begin() + texcoordOffsets[i]);
+    std::copy(chunk.data.indices.begin(), chunk.data.indices.end(), obj.indices.begin() + indexOffsets[i]);
+    const int32_t bases[3] = {
+      static_cast<int32_t>(vertexOffsets[i] / 3),
+      static_cast<int32_t>(normalOffsets[i] / 3),
+      static_cast<int32_t>(texcoordOffsets[i] / 2)
+    };
+    for (const ObjChunk::Fixup &fixup : chunk.fixups) {
+      ObjIndex &index = obj.indices[indexOffsets[i] + fixup.corner];
+      int32_t *resolved[3] = { &index.vertex, &index.normal, &index.texcoord };
+      *resolved[fixup.attribute] = bases[fixup.attribute] + fixup.localIndex;
+      // -1 would read as a missing attribute, so catch these here and not in ParseObj().
+      if (*resolved[fixup.attribute] < 0) chunkOutOfRange[i] = 1;
+    }
+    // Done with this chunk, give the memory back early.
+    chunk = ObjChunk();
+  });
+  if (std::find(chunkOutOfRange.begin(), chunkOutOfRange.end(), 1) != chunkOutOfRange.end()) {
+    std::cout << filepath << " has a relative face index out of range.\n";
+    return false;
+  }
+  return true;
+}
+
+
+static bool ParseObjTinyObj(const char *filepath, ObjData &obj)
 {
-  std::cout << "Loading up " << filepath << ".\nThis might take awhile...\n";
-  GeometryData model;
   tinyobj::attrib_t attrib;
   std::vector<tinyobj::shape_t> shapes;
   std::vector<tinyobj::material_t> materials;
@@ -29,40 +347,227 @@ GeometryData Model::LoadModel(const char *name, const char *filepath)
 
   if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, filepath)) {
     std::cout << err;
-    assert(false && "Failed to load model.");
+    return false;
   }  
-  
+  obj.vertices = std::move(attrib.vertices);
+  obj.normals = std::move(attrib.normals);
+  obj.texcoords = std::move(attrib.texcoords);
+  size_t cornerCount = 0;
+  for (const auto &shape : shapes) {
+    cornerCount += shape.mesh.indices.size();
+  }
+  obj.indices.clear();
+  obj.indices.reserve(cornerCount);
   for (const auto &shape : shapes) {
     for (const auto &index : shape.mesh.indices) {
-      Vertex vertex;
-      if (index.vertex_index > -1) {
-        vertex.position = {
-          attrib.vertices[3 * index.vertex_index + 0],
-          attrib.vertices[3 * index.vertex_index + 1],
-          attrib.vertices[3 * index.vertex_index + 2]
-        };
-      }
-      if (index.normal_index > -1) {
-        vertex.normal = {
-          attrib.normals[3 * index.normal_index + 0],
-          attrib.normals[3 * index.normal_index + 1],
-          attrib.normals[3 * index.normal_index + 2] 
-        };
-      }
-      if (index.texcoord_index > -1) {
-        vertex.uv = {
-          attrib.texcoords[2 * index.texcoord_index + 0],
-          attrib.texcoords[2 * index.texcoord_index + 1]
-        };
+      obj.indices.push_back({ index.vertex_index, index.normal_index, index.texcoord_index });
+    }
+  }
+  return true;
+}
+
+
+// Every face index must name an attribute of the file, or be -1 for a missing one.
+static bool CheckObjIndices(const char *filepath, const ObjData &obj)
+{
+  const int64_t counts[3] = {
+    static_cast<int64_t>(obj.vertices.size() / 3),
+    static_cast<int64_t>(obj.normals.size() / 3),
+    static_cast<int64_t>(obj.texcoords.size() / 2)
+  };
+  static const char *names[3] = { "vertex", "normal", "texcoord" };
+  for (size_t i = 0; i < obj.indices.size(); ++i) {
+    const int32_t values[3] = { obj.indices[i].vertex, obj.indices[i].normal, obj.indices[i].texcoord };
+    for (int32_t a = 0; a < 3; ++a) {
+      if (values[a] < -1 || values[a] >= counts[a]) {
+        std::cout << filepath << ": " << names[a] << " index " << values[a] << " of face corner " 
+          << i << " is out of range, the file has " << counts[a] << ".\n";
+        return false;
       }
+    }
+  }
+  return true;
+}
+
+
+bool Model::ParseObj(const char *filepath, ObjParser parser, ObjData &obj)
+{
+  bool parsed = false;
+  switch (parser) {
+    case opParallel: parsed = ParseObjParallel(filepath, obj); break;
+    case opTinyObj: parsed = ParseObjTinyObj(filepath, obj); break;
+    default: break;
+  }
+  return parsed && CheckObjIndices(filepath, obj);
+}
+
 
-      
+GeometryData Model::WeldVertices(const ObjData &obj)
+{
+  static_assert(sizeof(Vertex) == sizeof(float) * 8, "Vertex must be tightly packed for hashing.");
+  GeometryData model;
+
+  // Scanned meshes share nearly every position between 6 triangles, so the number 
+  // of unique vertices is about the number of OBJ positions. Reserve for that up front,
+  // which spares most of the rehashes. Meshes splitting positions over several normals
+  // or uvs can still grow past it, reserving for every corner would be 6 times the memory.
+  size_t positionCount = obj.vertices.size() / 3;
+  std::unordered_map<Vertex, uint32_t, VertexHash, VertexEqual> uniqueVertices;
+  uniqueVertices.reserve(positionCount);
+  model.vertices.reserve(positionCount);
+  model.indices.reserve(obj.indices.size());
+  
+  for (const auto &index : obj.indices) {
+    // Zero out padding and missing attributes, the hash reads the raw bits.
+    Vertex vertex;
+    std::memset(static_cast<void *>(&vertex), 0, sizeof(Vertex));
+    assert(index.vertex < static_cast<int32_t>(positionCount) 
+      && index.normal < static_cast<int32_t>(obj.normals.size() / 3)
+      && index.texcoord < static_cast<int32_t>(obj.texcoords.size() / 2)
+      && "Face index out of range, ParseObj() rejects these.");
+    if (index.vertex > -1) {
+      vertex.position = {
+        obj.vertices[3 * index.vertex + 0],
+        obj.vertices[3 * index.vertex + 1],
+        obj.vertices[3 * index.vertex + 2]
+      };
+    }
+    if (index.normal > -1) {
+      vertex.normal = {
+        obj.normals[3 * index.normal + 0],
+        obj.normals[3 * index.normal + 1],
+        obj.normals[3 * index.normal + 2] 
+      };
+    }
+    if (index.texcoord > -1) {
+      vertex.uv = {
+        obj.texcoords[2 * index.texcoord + 0],
+        obj.texcoords[2 * index.texcoord + 1]
+      };
+    }
+
+    // -0.0 and 0.0 hash differently, but are the same vertex.
+    float *components = &vertex.position.x;
+    for (uint32_t i = 0; i < 8; ++i) {
+      if (components[i] == 0.0f) components[i] = 0.0f;
+    }
+
+    auto it = uniqueVertices.find(vertex);
+    if (it == uniqueVertices.end()) {
+      uint32_t newIndex = static_cast<uint32_t>(model.vertices.size());
+      uniqueVertices.emplace(vertex, newIndex);
       model.vertices.push_back(vertex);
-      model.indices.push_back((uint32_t )model.indices.size());
+      model.indices.push_back(newIndex);
+    } else {
+      model.indices.push_back(it->second);
     }
   }
+  return model;
+}
 
-  std::cout << "Finished!\n";
+
+GeometryData Model::LoadModel(const char *name, const char *filepath, ObjParser parser)
+{
+  PBR_TRACE_FUNCTION();
+  std::cout << "Loading up " << filepath << ".\nThis might take awhile...\n";
+  auto startTime = std::chrono::high_resolution_clock::now();
+  ObjData obj;
+  if (!ParseObj(filepath, parser, obj)) {
+    std::cout << "Failed to load " << filepath << ".\n";
+    return GeometryData();
+  }
+  auto parseTime = std::chrono::high_resolution_clock::now();
+  GeometryData model = WeldVertices(obj);
+  auto endTime = std::chrono::high_resolution_clock::now();
+
+  double parseMs = std::chrono::duration<double, std::milli>(parseTime - startTime).count();
+  double weldMs = std::chrono::duration<double, std::milli>(endTime - parseTime).count();
+  std::cout << "Finished! " << name << ": " << obj.indices.size() << " vertices welded to " 
+    << model.vertices.size() << " (" << model.indices.size() / 3 << " triangles). Parsed in " 
+    << parseMs << " ms, welded in " << weldMs << " ms.\n";
+  return model;
+}
+
+
+Model::Model()
+  : vertices(nullptr)
+  , vertexCount(0)
+  , indices(nullptr)
+  , indexCount(0)
+{
+}
+
+
+Model::Model(const char *name, GeometryData &&geometry)
+  : name(name)
+  , data(std::move(geometry))
+{
+  BindGeometryData();
+}
+
+
+Model::Model(Model &&model)
+  : Model()
+{
+  *this = std::move(model);
+}
+
+
+Model &Model::operator=(Model &&model)
+{
+  if (this != &model) {
+    // Moving the vectors and the mapping keeps their storage, so the
+    // pointers stay valid.
+    name = std::move(model.name);
+    data = std::move(model.data);
+    cache = std::move(model.cache);
+    vertices = model.vertices;
+    vertexCount = model.vertexCount;
+    indices = model.indices;
+    indexCount = model.indexCount;
+    model.vertices = nullptr;
+    model.vertexCount = 0;
+    model.indices = nullptr;
+    model.indexCount = 0;
+  }
+  return *this;
+}
+
+
+void Model::BindGeometryData()
+{
+  vertices = data.vertices.data();
+  vertexCount = data.vertices.size();
+  indices = data.indices.data();
+  indexCount = data.indices.size();
+}
+
+
+Model Model::Load(const char *name, const char *filepath)
+{
+  PBR_TRACE_FUNCTION();
+  Model model;
+  model.name = name;
+  auto startTime = std::chrono::high_resolution_clock::now();
+  if (MeshCache::Load(filepath, model.cache, model.vertices, model.vertexCount, 
+      model.indices, model.indexCount)) {
+    auto endTime = std::chrono::high_resolution_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+    std::cout << "Mapped " << name << " from " << MeshCache::GetCachePath(filepath) << ": "
+      << model.vertexCount << " vertices, " << model.indexCount / 3 << " triangles in " 
+      << ms << " ms.\n";
+    return model;
+  }
+
+  model.data = LoadModel(name, filepath);
+  model.BindGeometryData();
+  // Nothing worth caching if the OBJ failed to load, try parsing again next startup.
+  if (model.data.indices.empty()) {
+    return model;
+  }
+  if (!MeshCache::Store(filepath, model.data)) {
+    std::cout << "Could not write mesh cache for " << filepath << ", next startup will parse again.\n";
+  }
   return model;
 }
 } // pbr
\ No newline at end of file
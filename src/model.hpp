@@ -8,6 +8,7 @@
 #include "platform.hpp"
 #include "vertex.hpp"
 #include "geometry.hpp"
+#include "mesh_cache.hpp"
 #include <vector>
 #include <string>
 
@@ -25,18 +26,80 @@ class Texture {
 };
 
 
+/// Index of one face corner into the ObjData attribute arrays. 
+/// -1 if the corner does not reference that attribute.
+struct ObjIndex {
+  int32_t vertex;
+  int32_t normal;
+  int32_t texcoord;
+};
+
+
+/// Raw OBJ attributes, laid out the same way as tinyobj::attrib_t (xyz positions, 
+/// xyz normals, uv texcoords), with every face already triangulated into indices.
+struct ObjData {
+  std::vector<float>    vertices;
+  std::vector<float>    normals;
+  std::vector<float>    texcoords;
+  std::vector<ObjIndex> indices;
+};
+
+
 class Model {
 public:
-  static GeometryData LoadModel(const char *name, const char *filepath);
+  /// OBJ parsers available to LoadModel().
+  enum ObjParser {
+    opParallel,
+    opTinyObj
+  };
+
 
+  Model();
+  Model(const char *name, GeometryData &&geometry);
+  Model(Model &&model);
+  Model &operator=(Model &&model);
+  Model(const Model &) = delete;
+  Model &operator=(const Model &) = delete;
+
+  /// Parse an OBJ file into welded, indexed geometry. Empty if the file could not be parsed.
+  static GeometryData LoadModel(const char *name, const char *filepath, ObjParser parser = opParallel);
+
+  /// Parse the attributes and triangulated faces of an OBJ file, without welding.
+  /// opParallel splits the file at line boundaries and parses the chunks on 
+  /// the global ThreadPool, opTinyObj goes through tinyobj::LoadObj. Fails if a face
+  /// index, absolute or relative, is out of range of the attributes in the file.
+  static bool ParseObj(const char *filepath, ObjParser parser, ObjData &obj);
+
+  /// Weld identical position/normal/uv tuples of the parsed OBJ into indexed geometry.
+  static GeometryData WeldVertices(const ObjData &obj);
+
+  /// Load a model through the binary mesh cache. If the cache of this file is up to date,
+  /// the vertex and index payloads are mapped straight from the cache file, no parsing 
+  /// involved. Otherwise the OBJ is parsed with LoadModel() and the cache is rewritten.
+  static Model Load(const char *name, const char *filepath);
+
+  /// Only holds the geometry if the model was not mapped from the cache,
+  /// use the vertex and index accessors below instead.
   GeometryData &GetData() { return data; }
   
   // oh boy wish i could use string view...
   std::string GetName() { return name; }
+
+  const Vertex *GetVertices() const { return vertices; }
+  size_t GetVertexCount() const { return vertexCount; }
+  const uint32_t *GetIndices() const { return indices; }
+  size_t GetIndexCount() const { return indexCount; }
   
 private:
+  void BindGeometryData();
+
   std::string name;
   GeometryData data;  
+  MappedFile cache;
+  const Vertex *vertices;
+  size_t vertexCount;
+  const uint32_t *indices;
+  size_t indexCount;
 };
 } // pbr
 #endif // __MODEL_HPP
\ No newline at end of file
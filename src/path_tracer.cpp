@@ -0,0 +1,452 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "path_tracer.hpp"
+#include "assets.hpp"
+#include "brdf.hpp"
+#include "camera.hpp"
+#include "image_writer.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <mutex>
+
+
+namespace pbr {
+
+
+/// PCG32. Seeded from the pixel and the pass, so a pass comes out the same whichever
+/// thread ends up rendering a tile.
+struct PathTracer::Rng {
+  Rng(uint64_t sequence, uint64_t seed)
+    : state(0)
+    , increment((sequence << 1) | 1) {
+    Next();
+    state += seed;
+    Next();
+  }
+
+  uint32_t Next() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ull + increment;
+    uint32_t shifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+    uint32_t rotation = static_cast<uint32_t>(old >> 59);
+    return (shifted >> rotation) | (shifted << ((32 - rotation) & 31));
+  }
+
+  /// Uniform in [0, 1).
+  float NextFloat() { return (Next() >> 8) * (1.0f / 16777216.0f); }
+
+  uint64_t state;
+  uint64_t increment;
+};
+
+
+/// Tile queues for one pass, one per thread. Each thread pops tiles off the front of
+/// its own, and once that runs dry, off the back of someone else's.
+struct PathTracer::Tiles {
+  struct Queue {
+    std::mutex            mutex;
+    std::deque<uint32_t>  tiles;
+  };
+
+  void Reset(uint32_t tileCount, uint32_t queueCount) {
+    while (queues.size() < queueCount) {
+      queues.emplace_back(new Queue());
+    }
+    queues.resize(queueCount);
+    // Contiguous runs, neighbouring tiles tend to cost about the same.
+    for (uint32_t q = 0; q < queueCount; ++q) {
+      queues[q]->tiles.clear();
+      for (uint32_t tile = tileCount * q / queueCount; tile < tileCount * (q + 1) / queueCount; ++tile) {
+        queues[q]->tiles.push_back(tile);
+      }
+    }
+    steals = 0;
+  }
+
+  bool Pop(uint32_t queue, uint32_t &tile) {
+    {
+      Queue &own = *queues[queue];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tiles.empty()) {
+        tile = own.tiles.front();
+        own.tiles.pop_front();
+        return true;
+      }
+    }
+    for (size_t i = 1; i < queues.size(); ++i) {
+      Queue &victim = *queues[(queue + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tiles.empty()) {
+        tile = victim.tiles.back();
+        victim.tiles.pop_back();
+        steals++;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::atomic<uint32_t>               steals;
+};
+
+
+// Matches Base::SetupCamera(), the material set up in Base::Initialize() and the light
+// in Base::UpdateUniformBuffers() at time 0.
+PathTracer::Scene::Scene()
+  : cameraPosition(2.0f, 2.0f, 2.0f)
+  , cameraTarget(0.0f, 0.0f, 0.0f)
+  , fov(45.0f)
+  , roughness(0.5f)
+  , metallic(0.5f)
+  , baseColor(0.8f, 0.498039f, 0.196078f)
+  , lightEnabled(false)
+  , lightPosition(0.0f, 3.0f, 3.0f)
+  , lightColor(1.0f, 1.0f, 1.0f)
+  , lightRadius(100.0f)
+  , sampleEnvironment(true)
+  , seed(0)
+{
+}
+
+
+PathTracer::PathTracer(uint32_t width, uint32_t height)
+  : mWidth(width)
+  , mHeight(height)
+  , mSampleCount(0)
+  , mRayOffset(0.0f)
+  , mTiles(new Tiles())
+{
+  std::memset(&mStats, 0, sizeof(mStats));
+}
+
+
+PathTracer::~PathTracer()
+{
+}
+
+
+void PathTracer::SetScene(const GeometryData &geometry, const gli::texture_cube &envMap,
+  const Scene &scene)
+{
+  PBR_TRACE_FUNCTION();
+  mScene = scene;
+  mGeometry = geometry;
+  Bvh bvh;
+  bvh.Build(mGeometry);
+  mBvh.Collapse(bvh);
+  mEnvMap.Load(envMap);
+  Vec3 extent = bvh.GetBoundsMax() - bvh.GetBoundsMin();
+  mRayOffset = 1e-5f * std::sqrt(extent.x * extent.x + extent.y * extent.y + extent.z * extent.z);
+
+  // Same camera the raster frames go through. Vulkan's flip of the projection only
+  // turns the image upside down in clip space, the rows below run top to bottom.
+  Camera camera;
+  camera.SetPosition(scene.cameraPosition);
+  camera.SetLookAt(scene.cameraTarget);
+  camera.SetFov(scene.fov);
+  camera.SetNearFar(0.1f, 1000.0f);
+  camera.SetAspect(static_cast<float>(mWidth) / static_cast<float>(mHeight));
+  camera.Update(0.0);
+  mInverseViewProjection = glm::inverse(camera.GetProjection() * camera.GetView());
+
+  mSampleCount = 0;
+  mModelSum.assign(mWidth * mHeight, glm::vec3(0.0f));
+  mSkySum.assign(mWidth * mHeight, glm::vec3(0.0f));
+  mModelSamples.assign(mWidth * mHeight, 0);
+}
+
+
+void PathTracer::RenderPass()
+{
+  PBR_TRACE_FUNCTION();
+  auto start = std::chrono::high_resolution_clock::now();
+  uint32_t tileCount = ((mWidth + kTileSize - 1) / kTileSize) * ((mHeight + kTileSize - 1) / kTileSize);
+  ThreadPool &pool = ThreadPool::Global();
+  uint32_t threadCount = pool.GetThreadCount() + 1;
+  mTiles->Reset(tileCount, threadCount);
+  pool.ParallelFor(threadCount, [this] (uint32_t queue) {
+    uint32_t tile;
+    while (mTiles->Pop(queue, tile)) {
+      RenderTile(tile);
+    }
+  });
+  mSampleCount++;
+  auto end = std::chrono::high_resolution_clock::now();
+  mStats.passMs = std::chrono::duration<double, std::milli>(end - start).count();
+  mStats.tileCount = tileCount;
+  mStats.steals = mTiles->steals.load();
+}
+
+
+void PathTracer::RenderTile(uint32_t tile)
+{
+  uint32_t tilesX = (mWidth + kTileSize - 1) / kTileSize;
+  uint32_t x0 = (tile % tilesX) * kTileSize;
+  uint32_t y0 = (tile / tilesX) * kTileSize;
+  uint32_t x1 = (std::min)(x0 + kTileSize, mWidth);
+  uint32_t y1 = (std::min)(y0 + kTileSize, mHeight);
+  Vec3 origin(mScene.cameraPosition.x, mScene.cameraPosition.y, mScene.cameraPosition.z);
+  for (uint32_t y = y0; y < y1; ++y) {
+    for (uint32_t x = x0; x < x1; ++x) {
+      uint32_t pixel = y * mWidth + x;
+      Rng rng(pixel, (static_cast<uint64_t>(mScene.seed) << 32) | mSampleCount);
+      float ndcX = (x + rng.NextFloat()) / mWidth * 2.0f - 1.0f;
+      float ndcY = 1.0f - (y + rng.NextFloat()) / mHeight * 2.0f;
+      glm::vec4 target = mInverseViewProjection * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+      glm::vec3 direction = glm::vec3(target) / target.w - mScene.cameraPosition;
+      bool hitModel = false;
+      glm::vec3 radiance = TracePath(Rayf(origin, Vec3(direction.x, direction.y, direction.z)),
+        rng, hitModel);
+      // A NaN or infinity would stick to the pixel for good.
+      if (!std::isfinite(radiance.x + radiance.y + radiance.z)) {
+        radiance = glm::vec3(0.0f);
+      }
+      if (hitModel) {
+        mModelSum[pixel] += radiance;
+        mModelSamples[pixel]++;
+      } else {
+        mSkySum[pixel] += radiance;
+      }
+    }
+  }
+}
+
+
+bool PathTracer::Occluded(const glm::vec3 &origin, const glm::vec3 &direction, float tMax) const
+{
+  Rayf ray(Vec3(origin.x, origin.y, origin.z), Vec3(direction.x, direction.y, direction.z),
+    0.0f, tMax);
+  TriangleHit<float> hit;
+  uint32_t triangle;
+  return mBvh.Intersect(ray, hit, triangle);
+}
+
+
+// Cosine weighted direction around N, in the tangent frame ImportanceSampleGGX() uses.
+static glm::vec3 SampleCosine(const glm::vec2 &xI, const glm::vec3 &N)
+{
+  float phi = 2.0f * kBrdfPi * xI.x;
+  float sinTheta = std::sqrt(xI.y);
+  float cosTheta = std::sqrt(1.0f - xI.y);
+  glm::vec3 upVector = std::abs(N.z) < 0.999f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+  glm::vec3 tangentX = glm::normalize(glm::cross(upVector, N));
+  glm::vec3 tangentY = glm::cross(N, tangentX);
+  return tangentX * (sinTheta * std::cos(phi)) + tangentY * (sinTheta * std::sin(phi)) + N * cosTheta;
+}
+
+
+// Veach's power heuristic with a beta of 2.
+static float PowerHeuristic(float pdf, float otherPdf)
+{
+  float pdf2 = pdf * pdf;
+  float otherPdf2 = otherPdf * otherPdf;
+  return pdf2 > 0.0f ? pdf2 / (pdf2 + otherPdf2) : 0.0f;
+}
+
+
+// The GGX lobe gets picked more often the more metallic the surface, its share of the
+// reflected light grows with it. Both lobes' densities go into the weight.
+float PathTracer::BrdfPdf(const glm::vec3 &V, const glm::vec3 &N, const glm::vec3 &L) const
+{
+  float specularChance = 0.5f + 0.5f * mScene.metallic;
+  glm::vec3 H = glm::normalize(V + L);
+  return specularChance * PdfGGX(glm::dot(N, H), glm::dot(V, H), mScene.roughness) +
+    (1.0f - specularChance) * (std::max)(glm::dot(N, L), 0.0f) / kBrdfPi;
+}
+
+
+glm::vec3 PathTracer::TracePath(Rayf ray, Rng &rng, bool &hitModel) const
+{
+  float specularChance = 0.5f + 0.5f * mScene.metallic;
+  glm::vec3 radiance(0.0f);
+  glm::vec3 throughput(1.0f);
+  float brdfPdf = 0.0f;
+  for (uint32_t bounce = 0; ; ++bounce) {
+    TriangleHit<float> hit;
+    uint32_t triangle;
+    glm::vec3 direction(ray.direction.x, ray.direction.y, ray.direction.z);
+    if (!mBvh.Intersect(ray, hit, triangle)) {
+      float weight = 1.0f;
+      if (bounce > 0 && mScene.sampleEnvironment) {
+        weight = PowerHeuristic(brdfPdf, mEnvMap.Pdf(direction));
+      }
+      radiance += throughput * mEnvMap.Lookup(direction) * weight;
+      break;
+    }
+    if (bounce == 0) {
+      hitModel = true;
+    }
+    if (bounce == kMaxBounces) {
+      break;
+    }
+
+    const uint32_t *indices = &mGeometry.indices[triangle * 3];
+    const Vertex &v0 = mGeometry.vertices[indices[0]];
+    const Vertex &v1 = mGeometry.vertices[indices[1]];
+    const Vertex &v2 = mGeometry.vertices[indices[2]];
+    float w = 1.0f - hit.u - hit.v;
+    glm::vec3 position = v0.position * w + v1.position * hit.u + v2.position * hit.v;
+    glm::vec3 V = -glm::normalize(direction);
+    glm::vec3 Ng = glm::cross(v1.position - v0.position, v2.position - v0.position);
+    Ng = glm::normalize(Ng);
+    if (glm::dot(Ng, V) < 0.0f) {
+      Ng = -Ng;
+    }
+    glm::vec3 N = v0.normal * w + v1.normal * hit.u + v2.normal * hit.v;
+    N = glm::dot(N, N) > 1e-12f ? glm::normalize(N) : Ng;
+    if (glm::dot(N, Ng) < 0.0f) {
+      N = -N;
+    }
+    glm::vec3 origin = position + Ng * mRayOffset;
+
+    // The point light, test.frag's falloff included.
+    if (mScene.lightEnabled) {
+      glm::vec3 L = mScene.lightPosition - position;
+      float distance = glm::length(L);
+      L /= distance;
+      float NoL = glm::dot(N, L);
+      if (NoL > 0.0f && glm::dot(Ng, L) > 0.0f &&
+          !Occluded(origin, mScene.lightPosition - origin, 1.0f - 1e-4f)) {
+        float attenuation = mScene.lightRadius / ((distance * distance) + 1.0f);
+        radiance += throughput * BRDF(V, N, L, mScene.baseColor, mScene.metallic, mScene.roughness) *
+          mScene.lightColor * attenuation * NoL;
+      }
+    }
+
+    // The environment map, weighted against the chance of the BRDF finding it.
+    if (mScene.sampleEnvironment) {
+      glm::vec4 xI(rng.NextFloat(), rng.NextFloat(), rng.NextFloat(), rng.NextFloat());
+      float lightPdf;
+      glm::vec3 L = mEnvMap.Sample(xI, lightPdf);
+      float NoL = glm::dot(N, L);
+      if (lightPdf > 0.0f && NoL > 0.0f && glm::dot(Ng, L) > 0.0f &&
+          !Occluded(origin, L, std::numeric_limits<float>::infinity())) {
+        float weight = PowerHeuristic(lightPdf, BrdfPdf(V, N, L));
+        radiance += throughput * BRDF(V, N, L, mScene.baseColor, mScene.metallic, mScene.roughness) *
+          mEnvMap.Lookup(L) * (NoL * weight / lightPdf);
+      }
+    }
+
+    glm::vec2 xI(rng.NextFloat(), rng.NextFloat());
+    glm::vec3 L;
+    if (rng.NextFloat() < specularChance) {
+      glm::vec3 H = ImportanceSampleGGX(xI, mScene.roughness, N);
+      L = 2.0f * glm::dot(V, H) * H - V;
+    } else {
+      L = SampleCosine(xI, N);
+    }
+    float NoL = glm::dot(N, L);
+    if (NoL <= 0.0f || glm::dot(Ng, L) <= 0.0f) {
+      break;
+    }
+    brdfPdf = BrdfPdf(V, N, L);
+    throughput *= BRDF(V, N, L, mScene.baseColor, mScene.metallic, mScene.roughness) * NoL / brdfPdf;
+
+    if (bounce >= 3) {
+      float survive = (std::min)(0.95f, (std::max)(throughput.x, (std::max)(throughput.y, throughput.z)));
+      if (rng.NextFloat() >= survive) {
+        break;
+      }
+      throughput /= survive;
+    }
+    ray = Rayf(Vec3(origin.x, origin.y, origin.z), Vec3(L.x, L.y, L.z));
+  }
+  return radiance;
+}
+
+
+void PathTracer::Resolve(std::vector<float> &rgb) const
+{
+  rgb.resize(mWidth * mHeight * 3);
+  float scale = mSampleCount > 0 ? 1.0f / mSampleCount : 0.0f;
+  for (uint32_t i = 0; i < mWidth * mHeight; ++i) {
+    glm::vec3 color = (mModelSum[i] + mSkySum[i]) * scale;
+    rgb[i * 3 + 0] = color.x;
+    rgb[i * 3 + 1] = color.y;
+    rgb[i * 3 + 2] = color.z;
+  }
+}
+
+
+void PathTracer::ResolveDisplay(std::vector<uint8_t> &rgba) const
+{
+  rgba.resize(mWidth * mHeight * 4);
+  for (uint32_t i = 0; i < mWidth * mHeight; ++i) {
+    glm::vec3 color(0.0f);
+    uint32_t modelSamples = mModelSamples[i];
+    uint32_t skySamples = mSampleCount - modelSamples;
+    if (modelSamples > 0) {
+      glm::vec3 model = mModelSum[i] / static_cast<float>(modelSamples);
+      model = model / (model + glm::vec3(1.0f));
+      model = glm::pow(model, glm::vec3(1.0f / 2.2f));
+      color += model * (static_cast<float>(modelSamples) / mSampleCount);
+    }
+    if (skySamples > 0) {
+      color += mSkySum[i] / static_cast<float>(mSampleCount);
+    }
+    color = glm::clamp(color, 0.0f, 1.0f);
+    rgba[i * 4 + 0] = static_cast<uint8_t>(color.x * 255.0f + 0.5f);
+    rgba[i * 4 + 1] = static_cast<uint8_t>(color.y * 255.0f + 0.5f);
+    rgba[i * 4 + 2] = static_cast<uint8_t>(color.z * 255.0f + 0.5f);
+    rgba[i * 4 + 3] = 255;
+  }
+}
+
+
+bool PathTracer::RenderReference(uint32_t samples, uint32_t width, uint32_t height,
+  const std::string &outputDir, bool lightEnabled)
+{
+  PBR_TRACE_FUNCTION();
+  // The model spins about y with time in Base, it starts out unrotated.
+  const Model &model = Assets::GetModel();
+  if (model.GetIndexCount() == 0) {
+    std::printf("No geometry to trace, the model failed to load.\n");
+    return false;
+  }
+  GeometryData geometry;
+  geometry.vertices.assign(model.GetVertices(), model.GetVertices() + model.GetVertexCount());
+  geometry.indices.assign(model.GetIndices(), model.GetIndices() + model.GetIndexCount());
+  Scene scene;
+  scene.lightEnabled = lightEnabled;
+  PathTracer tracer(width, height);
+  tracer.SetScene(geometry, Assets::GetEnvMap(), scene);
+
+  std::string directory = outputDir.empty() ? std::string(".") : outputDir;
+  std::string exrPath = directory + "/reference.exr";
+  std::string pngPath = directory + "/reference.png";
+  std::printf("Reference render, %ux%u, %u samples per pixel, %u threads.\n", width, height,
+    samples, ThreadPool::Global().GetThreadCount() + 1);
+  std::vector<float> rgb;
+  std::vector<uint8_t> rgba;
+  double totalMs = 0.0;
+  for (uint32_t sample = 1; sample <= samples; ++sample) {
+    tracer.RenderPass();
+    totalMs += tracer.GetStats().passMs;
+    if ((sample & (sample - 1)) != 0 && sample != samples) {
+      continue;
+    }
+    tracer.Resolve(rgb);
+    tracer.ResolveDisplay(rgba);
+    bool written = ImageWriter::WriteExr(exrPath.c_str(), width, height, rgb.data()) &&
+      ImageWriter::WritePng(pngPath.c_str(), width, height, rgba.data(), (size_t )width * 4);
+    if (!written) {
+      return false;
+    }
+    const Stats &stats = tracer.GetStats();
+    std::printf("  %5u samples, %8.1f ms per pass, %u of %u tiles stolen in the last one\n",
+      sample, totalMs / sample, stats.steals, stats.tileCount);
+  }
+  std::printf("  wrote %s and %s\n", exrPath.c_str(), pngPath.c_str());
+  return true;
+}
+} // pbr
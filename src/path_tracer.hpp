@@ -0,0 +1,121 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __PATH_TRACER_HPP
+#define __PATH_TRACER_HPP
+
+
+#include "platform.hpp"
+#include "geometry.hpp"
+#include "environment_map.hpp"
+#include "wide_bvh.hpp"
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+namespace pbr {
+
+
+/// CPU path tracer with the BRDF of test.frag, for ground truth to hold the raster
+/// frames against. Renders the model under the environment map and the point light,
+/// one sample per pixel per pass, accumulating until it is stopped. Tiles of a pass
+/// are spread over the global ThreadPool, each thread drains its own run of tiles
+/// and then steals from the others.
+///
+/// The environment map is sampled directly at every vertex as well as through the
+/// BRDF, and the two are weighted with the power heuristic, so neither a small bright
+/// light in the map nor a sharp highlight is left to chance.
+class PathTracer {
+public:
+  static const uint32_t kTileSize = 16;
+  /// Path vertices after the camera ray. Paths longer than 3 are cut short by russian
+  /// roulette as well.
+  static const uint32_t kMaxBounces = 8;
+
+  /// What Base renders on its first frame.
+  struct Scene {
+    Scene();
+
+    glm::vec3   cameraPosition;
+    glm::vec3   cameraTarget;
+    float       fov;
+    float       roughness;
+    float       metallic;
+    glm::vec3   baseColor;
+    bool        lightEnabled;
+    glm::vec3   lightPosition;
+    glm::vec3   lightColor;
+    float       lightRadius;
+    /// Sample the environment map along with the BRDF. Off, paths only find it by
+    /// bouncing into it.
+    bool        sampleEnvironment;
+    /// Mixed into every pixel's random numbers, renders with different seeds are
+    /// independent.
+    uint32_t    seed;
+  };
+
+  struct Stats {
+    double    passMs;
+    uint32_t  tileCount;
+    /// Tiles that ran on another thread than the one they were handed to.
+    uint32_t  steals;
+  };
+
+  PathTracer(uint32_t width, uint32_t height);
+  ~PathTracer();
+
+  /// geometry is in world space. Drops whatever was accumulated so far.
+  void SetScene(const GeometryData &geometry, const gli::texture_cube &envMap, const Scene &scene);
+
+  /// Add one sample to every pixel.
+  void RenderPass();
+
+  /// Mean radiance so far, linear RGB, rows top to bottom.
+  void Resolve(std::vector<float> &rgb) const;
+
+  /// 8 bit RGBA the way the raster frames come out: test.frag's tone mapping and gamma
+  /// on the model, the sky as is.
+  void ResolveDisplay(std::vector<uint8_t> &rgba) const;
+
+  uint32_t GetSampleCount() const { return mSampleCount; }
+  const Stats &GetStats() const { return mStats; }
+
+  /// Render the assets Base loads with samples samples per pixel, and write
+  /// reference.exr and reference.png to outputDir, again after every doubling of the
+  /// sample count so a long run can be looked at early.
+  static bool RenderReference(uint32_t samples, uint32_t width, uint32_t height,
+    const std::string &outputDir, bool lightEnabled);
+
+private:
+  struct Rng;
+  struct Tiles;
+
+  void RenderTile(uint32_t tile);
+  glm::vec3 TracePath(Rayf ray, Rng &rng, bool &hitModel) const;
+  /// Density of the lobe mix TracePath() samples L from.
+  float BrdfPdf(const glm::vec3 &V, const glm::vec3 &N, const glm::vec3 &L) const;
+  bool Occluded(const glm::vec3 &origin, const glm::vec3 &direction, float tMax) const;
+
+  uint32_t                mWidth;
+  uint32_t                mHeight;
+  uint32_t                mSampleCount;
+  Scene                   mScene;
+  GeometryData            mGeometry;
+  Bvh8                    mBvh;
+  EnvironmentMap          mEnvMap;
+  /// Offset off surfaces for the next ray, scaled to the size of the model.
+  float                   mRayOffset;
+  glm::mat4               mInverseViewProjection;
+  /// Summed radiance of paths whose camera ray hit the model, and of those that
+  /// went straight to the sky, and the count of the former.
+  std::vector<glm::vec3>  mModelSum;
+  std::vector<glm::vec3>  mSkySum;
+  std::vector<uint32_t>   mModelSamples;
+  std::unique_ptr<Tiles>  mTiles;
+  Stats                   mStats;
+};
+} // pbr
+#endif // __PATH_TRACER_HPP
@@ -2,9 +2,13 @@
 // Copyright (c) Mario Garcia, MIT License.
 //
 #include "shader.hpp"
+#include "spirv_cache.hpp"
+#include "trace.hpp"
 #include <glslang/Public/ShaderLang.h>
 #include <SPIRV/GlslangToSpv.h>
 #include <cassert>
+#include <cstring>
+#include <cstdio>
 #include <stdint.h>
 #include <vector>
 #include <string>
@@ -15,7 +19,7 @@
 namespace pbr {
 
 
-bool ShaderModule::GLSlangInitialized = false;
+std::once_flag ShaderModule::GLSlangInitialized;
 const char *std_entryPoint = "main";
 const char *ShaderModule::GetStdEntryPoint()
 {
@@ -25,10 +29,10 @@ const char *ShaderModule::GetStdEntryPoint()
 
 void ShaderModule::CheckGLSlangInitialization()
 {
-  if (!ShaderModule::GLSlangInitialized) {
+  // Shaders are compiled from multiple threads at startup.
+  std::call_once(ShaderModule::GLSlangInitialized, [] () {
     glslang::InitializeProcess();
-    ShaderModule::GLSlangInitialized = true;
-  }
+  });
 }
 
 
@@ -147,40 +151,95 @@ std::string GetSource(const char *filepath)
 
 VkShaderModule ShaderModule::GenerateShaderModule(VkDevice device, ShaderStage stage, const char *filepath)
 {
-  ShaderModule::CheckGLSlangInitialization();
-  VkShaderModule shaderModule;
+  return CreateShaderModule(device, CompileSpirv(stage, filepath));
+}
+
+
+static EShLanguage GetGlslLanguage(ShaderModule::ShaderStage stage)
+{
+  switch (stage) {
+    case ShaderModule::ssVertShader: return EShLangVertex;
+    case ShaderModule::ssFragShader: return EShLangFragment;
+    case ShaderModule::ssTesseShader: return EShLangTessEvaluation;
+    case ShaderModule::ssTesscShader: return EShLangTessControl;
+    case ShaderModule::ssGeomShader: return EShLangGeometry;
+    case ShaderModule::ssCompShader: return EShLangCompute;
+    default: return EShLangVertex;
+  }
+}
+
+
+const int kDefaultGlslVersion = 430;
+const EShMessages kCompileMessages = (EShMessages )(EShMsgVulkanRules | EShMsgSpvRules);
+
+
+// Key of the SPIR-V cache. Covers everything that changes what the compiler spits out:
+// the source, the stage, the resource limits, the compile options and the compiler itself.
+static uint64_t GetSpirvCacheKey(EShLanguage glslLanguage, const std::string &sourceCode)
+{
+  int32_t language = static_cast<int32_t>(glslLanguage);
+  int32_t options[2] = { kDefaultGlslVersion, static_cast<int32_t>(kCompileMessages) };
+  std::string spirvVersion;
+  spv::GetSpirvVersion(spirvVersion);
+  const char *glslVersion = glslang::GetGlslVersionString();
+  const char *esslVersion = glslang::GetEsslVersionString();
+
+  uint64_t key = SpirvCache::Hash(sourceCode.data(), sourceCode.size());
+  key = SpirvCache::Hash(&language, sizeof(language), key);
+  key = SpirvCache::Hash(&DefaultTBuiltInResource, sizeof(TBuiltInResource), key);
+  key = SpirvCache::Hash(options, sizeof(options), key);
+  key = SpirvCache::Hash(spirvVersion.data(), spirvVersion.size(), key);
+  key = SpirvCache::Hash(glslVersion, std::strlen(glslVersion), key);
+  key = SpirvCache::Hash(esslVersion, std::strlen(esslVersion), key);
+  return key;
+}
+
+
+std::vector<uint32_t> ShaderModule::CompileSpirv(ShaderStage stage, const char *filepath)
+{
+  PBR_TRACE_FUNCTION();
   std::string sourceCode = GetSource(filepath);
+  EShLanguage glslLanguage = GetGlslLanguage(stage);
+  uint64_t key = GetSpirvCacheKey(glslLanguage, sourceCode);
+  std::vector<uint32_t> spirv;
+  if (SpirvCache::Load(key, spirv)) {
+    return spirv;
+  }
+
+  ShaderModule::CheckGLSlangInitialization();
   glslang::TProgram *program = new glslang::TProgram();
   TBuiltInResource resources = DefaultTBuiltInResource;
-  EShLanguage glslLanguage;
-  switch (stage) {
-    case ssVertShader: glslLanguage = EShLangVertex; break;
-    case ssFragShader: glslLanguage = EShLangFragment; break;
-    case ssTesseShader: glslLanguage = EShLangTessEvaluation; break;
-    case ssTesscShader: glslLanguage = EShLangTessControl; break;
-    case ssGeomShader: glslLanguage = EShLangGeometry; break;
-    case ssCompShader: glslLanguage = EShLangCompute; break;
-    default: glslLanguage = EShLangVertex; break;
-  }
   glslang::TShader *shader = new glslang::TShader(glslLanguage);
   const char *source = sourceCode.c_str();
   shader->setStrings(&source, 1); 
   shader->setEntryPoint(std_entryPoint);
-  bool success = shader->parse(&resources, 430, false, (EShMessages )(EShMsgVulkanRules | EShMsgSpvRules));
+  bool success = shader->parse(&resources, kDefaultGlslVersion, false, kCompileMessages);
   if (!success) {
     std::printf("%s", shader->getInfoLog());
     assert(success && "Failed to parse shader code!");
   }
   
   program->addShader(shader);
-  success = program->link((EShMessages )(EShMsgVulkanRules | EShMsgSpvRules));
+  success = program->link(kCompileMessages);
   assert(success && "Failed to link shader code!");
   if (!success) {
     std::printf("%s", program->getInfoLog());
   }
 
-  std::vector<uint32_t> spirv;
   glslang::GlslangToSpv(*program->getIntermediate(glslLanguage), spirv);
+
+  delete program;
+  delete shader;
+  if (success) {
+    SpirvCache::Store(key, spirv);
+  }
+  return spirv;
+}
+
+
+VkShaderModule ShaderModule::CreateShaderModule(VkDevice device, const std::vector<uint32_t> &spirv)
+{
+  VkShaderModule shaderModule;
   VkShaderModuleCreateInfo shaderModuleCreateInfo = { };
   shaderModuleCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
   shaderModuleCreateInfo.pCode = spirv.data();
@@ -189,9 +248,6 @@ VkShaderModule ShaderModule::GenerateShaderModule(VkDevice device, ShaderStage s
   shaderModuleCreateInfo.pNext = nullptr;
   VkResult result = vkCreateShaderModule(device, &shaderModuleCreateInfo, nullptr, &shaderModule);
   assert(result == VK_SUCCESS && "Shader module unsuccessfully created!");
-
-  delete program;
-  delete shader;
   return shaderModule;
 }
 } // pbr
\ No newline at end of file
@@ -7,6 +7,9 @@
 
 #include "platform.hpp"
 #include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
 
 
 namespace pbr {
@@ -29,11 +32,21 @@ public:
   /// @param stage
   /// @param filepath Filepath to the shader code, must be glsl!
   static VkShaderModule GenerateShaderModule(VkDevice device, ShaderStage stage, const char *filepath);
+
+  /// Compile glsl source to SPIR-V. Does not need a device, so this is safe to 
+  /// call from worker threads while the device is still being created. Results are 
+  /// kept in the SpirvCache, so glslang only runs when the source or compiler changed.
+  /// @param stage
+  /// @param filepath Filepath to the shader code, must be glsl!
+  static std::vector<uint32_t> CompileSpirv(ShaderStage stage, const char *filepath);
+
+  /// Create a Shader Module from already compiled SPIR-V.
+  static VkShaderModule CreateShaderModule(VkDevice device, const std::vector<uint32_t> &spirv);
   static const char *GetStdEntryPoint();
 
 private:
   static void CheckGLSlangInitialization();
-  static bool GLSlangInitialized;
+  static std::once_flag GLSlangInitialized;
 };
 } // pbr
 #endif // __SHADER_MODULE_HPP
\ No newline at end of file
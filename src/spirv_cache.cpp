@@ -0,0 +1,161 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "spirv_cache.hpp"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+
+#if defined(_WIN32)
+ #include <direct.h>
+#endif
+
+
+namespace pbr {
+
+
+const char kSpirvCacheMagic[8] = { 'P', 'B', 'R', 'S', 'P', 'V', '\0', '\0' };
+const uint32_t kSpirvMagicNumber = 0x07230203;
+const uint64_t kFnvPrime = 1099511628211ull;
+
+
+// Everything compiled or loaded during this run. Shaders are compiled on worker
+// threads at startup, so access goes through the mutex.
+struct SpirvTable {
+  std::mutex                                            mutex;
+  std::unordered_map<uint64_t, std::vector<uint32_t>>   entries;
+};
+
+
+static SpirvTable &GetTable()
+{
+  static SpirvTable table;
+  return table;
+}
+
+
+static std::string GetCacheDirectory()
+{
+  return PBR_STUDY_DIR"/shaders/cache";
+}
+
+
+static void CreateCacheDirectory()
+{
+  // Fails harmlessly if the directory is already there.
+#if defined(_WIN32)
+  _mkdir(GetCacheDirectory().c_str());
+#else
+  mkdir(GetCacheDirectory().c_str(), 0755);
+#endif
+}
+
+
+uint64_t SpirvCache::Hash(const void *data, size_t size, uint64_t seed)
+{
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  uint64_t hash = seed;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= kFnvPrime;
+  }
+  return hash;
+}
+
+
+std::string SpirvCache::GetCachePath(uint64_t key)
+{
+  char name[32];
+  std::snprintf(name, sizeof(name), "/%016llx.spv", static_cast<unsigned long long>(key));
+  return GetCacheDirectory() + name;
+}
+
+
+bool SpirvCache::Load(uint64_t key, std::vector<uint32_t> &spirv)
+{
+  SpirvTable &table = GetTable();
+  {
+    std::lock_guard<std::mutex> lock(table.mutex);
+    auto it = table.entries.find(key);
+    if (it != table.entries.end()) {
+      spirv = it->second;
+      return true;
+    }
+  }
+
+  std::ifstream file(GetCachePath(key), std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    return false;
+  }
+  uint64_t fileSize = static_cast<uint64_t>(file.tellg());
+  file.seekg(0);
+  Header header;
+  if (!file.read(reinterpret_cast<char *>(&header), sizeof(Header))) {
+    return false;
+  }
+  bool valid = std::memcmp(header.magic, kSpirvCacheMagic, sizeof(kSpirvCacheMagic)) == 0 &&
+    header.version == kVersion &&
+    header.key == key &&
+    header.wordCount > 0 &&
+    // The header doesn't get to decide how much we allocate, the file has to back it.
+    fileSize == sizeof(Header) + static_cast<uint64_t>(header.wordCount) * sizeof(uint32_t);
+  if (!valid) {
+    return false;
+  }
+  std::vector<uint32_t> words(header.wordCount);
+  if (!file.read(reinterpret_cast<char *>(words.data()), words.size() * sizeof(uint32_t)) ||
+      words[0] != kSpirvMagicNumber) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(table.mutex);
+  spirv = table.entries.emplace(key, std::move(words)).first->second;
+  return true;
+}
+
+
+bool SpirvCache::Store(uint64_t key, const std::vector<uint32_t> &spirv)
+{
+  if (spirv.empty() || spirv[0] != kSpirvMagicNumber) {
+    return false;
+  }
+  {
+    SpirvTable &table = GetTable();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    table.entries[key] = spirv;
+  }
+
+  Header header = { };
+  std::memcpy(header.magic, kSpirvCacheMagic, sizeof(kSpirvCacheMagic));
+  header.version = kVersion;
+  header.wordCount = static_cast<uint32_t>(spirv.size());
+  header.key = key;
+
+  // Same as the mesh cache, never leave a torn file behind.
+  CreateCacheDirectory();
+  std::string cachePath = GetCachePath(key);
+  std::string tempPath = cachePath + ".tmp";
+  {
+    std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+      std::cout << "Failed to write spirv cache " << cachePath << "\n";
+      return false;
+    }
+    file.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+    file.write(reinterpret_cast<const char *>(spirv.data()), spirv.size() * sizeof(uint32_t));
+    if (!file.good()) {
+      file.close();
+      std::remove(tempPath.c_str());
+      return false;
+    }
+  }
+  std::remove(cachePath.c_str());
+  return std::rename(tempPath.c_str(), cachePath.c_str()) == 0;
+}
+} // pbr
@@ -0,0 +1,50 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __SPIRV_CACHE_HPP
+#define __SPIRV_CACHE_HPP
+
+
+#include "platform.hpp"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+namespace pbr {
+
+
+/// Content addressed cache of compiled SPIR-V. Entries are looked up by a 64 bit key,
+/// which the caller builds with Hash() from everything that affects the compiler output.
+/// Lookups hit an in-process table first, then PBR_STUDY_DIR/shaders/cache/<key>.spv.
+/// A file is only used if its header carries the same version and key, and its payload
+/// is well formed SPIR-V, anything else counts as a miss.
+///
+/// Layout:
+/// | Header | spirv words |
+class SpirvCache {
+public:
+  static const uint32_t kVersion = 1;
+  static const uint64_t kHashSeed = 14695981039346656037ull;
+
+  struct Header {
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  wordCount;
+    uint64_t  key;
+  };
+
+  /// FNV-1a 64 over the bytes, chain calls by passing the previous result as seed.
+  static uint64_t Hash(const void *data, size_t size, uint64_t seed = kHashSeed);
+
+  /// Find the SPIR-V of the key, in memory or on disk. Returns false on a miss.
+  static bool Load(uint64_t key, std::vector<uint32_t> &spirv);
+
+  /// Keep the SPIR-V for the rest of the process and write it to disk.
+  static bool Store(uint64_t key, const std::vector<uint32_t> &spirv);
+
+  /// Get the path of the cache file for the key.
+  static std::string GetCachePath(uint64_t key);
+};
+} // pbr
+#endif // __SPIRV_CACHE_HPP
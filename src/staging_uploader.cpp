@@ -0,0 +1,489 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "staging_uploader.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+
+namespace pbr {
+
+
+const VkDeviceSize StagingUploader::kChunkSize;
+
+// Covers the texel size of every format we upload, the largest being R32G32B32A32.
+static const VkDeviceSize kStagingAlignment = 16;
+
+// Free chunks kept around for the next batch, the rest go back to the allocator.
+static const size_t kMaxFreeChunks = 2;
+
+
+StagingUploader::StagingUploader()
+  : mDevice(VK_NULL_HANDLE)
+  , mAllocator(nullptr)
+  , mGraphicsFamily(0)
+  , mTransferFamily(-1)
+  , mGraphicsQueue(VK_NULL_HANDLE)
+  , mTransferQueue(VK_NULL_HANDLE)
+  , mGraphicsPool(VK_NULL_HANDLE)
+  , mTransferPool(VK_NULL_HANDLE)
+  , mNextTicket(1)
+  , mDstStages(0)
+{
+}
+
+
+StagingUploader::~StagingUploader()
+{
+  Shutdown();
+}
+
+
+void StagingUploader::Initialize(VkDevice device, DeviceAllocator *allocator,
+  uint32_t graphicsFamily, VkQueue graphicsQueue, int32_t transferFamily, VkQueue transferQueue)
+{
+  mDevice = device;
+  mAllocator = allocator;
+  mGraphicsFamily = graphicsFamily;
+  mGraphicsQueue = graphicsQueue;
+  mTransferFamily = transferFamily;
+  mTransferQueue = transferQueue;
+
+  VkCommandPoolCreateInfo poolInfo = { };
+  poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  poolInfo.queueFamilyIndex = graphicsFamily;
+  VkResult result = vkCreateCommandPool(mDevice, &poolInfo, nullptr, &mGraphicsPool);
+  assert(result == VK_SUCCESS && "Failed to create the upload command pool!");
+  if (HasTransferQueue()) {
+    poolInfo.queueFamilyIndex = static_cast<uint32_t>(transferFamily);
+    result = vkCreateCommandPool(mDevice, &poolInfo, nullptr, &mTransferPool);
+    assert(result == VK_SUCCESS && "Failed to create the transfer command pool!");
+    std::printf("Uploading on transfer queue family %d\n", transferFamily);
+  } else {
+    std::printf("No transfer only queue family, uploading on the graphics queue\n");
+  }
+}
+
+
+void StagingUploader::Shutdown()
+{
+  if (mDevice == VK_NULL_HANDLE) return;
+  while (!mInFlight.empty()) {
+    Batch &batch = mInFlight.front();
+    vkWaitForFences(mDevice, 1, &batch.fence, VK_TRUE, (std::numeric_limits<uint64_t>::max)());
+    RecycleBatch(batch);
+    mInFlight.pop_front();
+  }
+  for (Batch &batch : mFreeBatches) {
+    vkDestroyFence(mDevice, batch.fence, nullptr);
+    if (batch.transferDone != VK_NULL_HANDLE) {
+      vkDestroySemaphore(mDevice, batch.transferDone, nullptr);
+    }
+  }
+  mFreeBatches.clear();
+  for (Chunk &chunk : mChunks) {
+    DestroyChunk(chunk);
+  }
+  for (Chunk &chunk : mFreeChunks) {
+    DestroyChunk(chunk);
+  }
+  mChunks.clear();
+  mFreeChunks.clear();
+  ClearPending();
+  // Command buffers go with their pools.
+  vkDestroyCommandPool(mDevice, mGraphicsPool, nullptr);
+  if (mTransferPool != VK_NULL_HANDLE) {
+    vkDestroyCommandPool(mDevice, mTransferPool, nullptr);
+  }
+  mGraphicsPool = VK_NULL_HANDLE;
+  mTransferPool = VK_NULL_HANDLE;
+  mDevice = VK_NULL_HANDLE;
+}
+
+
+void StagingUploader::CreateChunk(VkDeviceSize size, Chunk &chunk)
+{
+  VkBufferCreateInfo bufferInfo = { };
+  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferInfo.size = size;
+  bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  VkResult result = vkCreateBuffer(mDevice, &bufferInfo, nullptr, &chunk.buffer);
+  assert(result == VK_SUCCESS && "Failed to create a staging buffer!");
+
+  VkMemoryRequirements memReqs = { };
+  vkGetBufferMemoryRequirements(mDevice, chunk.buffer, &memReqs);
+  bool allocated = mAllocator->Allocate(memReqs, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, DeviceAllocator::rkLinear, chunk.memory);
+  assert(allocated && "Failed to allocate staging memory!");
+  vkBindBufferMemory(mDevice, chunk.buffer, chunk.memory.memory, chunk.memory.offset);
+  chunk.size = size;
+  chunk.used = 0;
+}
+
+
+void StagingUploader::DestroyChunk(Chunk &chunk)
+{
+  vkDestroyBuffer(mDevice, chunk.buffer, nullptr);
+  mAllocator->Free(chunk.memory);
+}
+
+
+void StagingUploader::AllocateStaging(VkDeviceSize size, VkBuffer &buffer, VkDeviceSize &offset,
+  uint8_t *&mapped)
+{
+  // Oversized uploads get a chunk of their own. It goes in front, so that the
+  // chunk at the back is still the one being filled.
+  if (size > kChunkSize) {
+    Chunk chunk;
+    CreateChunk(size, chunk);
+    chunk.used = size;
+    mChunks.insert(mChunks.begin(), chunk);
+    buffer = chunk.buffer;
+    offset = 0;
+    mapped = chunk.memory.mapped;
+    return;
+  }
+
+  VkDeviceSize aligned = 0;
+  if (!mChunks.empty()) {
+    Chunk &chunk = mChunks.back();
+    aligned = (chunk.used + kStagingAlignment - 1) & ~(kStagingAlignment - 1);
+  }
+  if (mChunks.empty() || mChunks.back().size < kChunkSize || aligned + size > kChunkSize) {
+    Chunk chunk;
+    if (!mFreeChunks.empty()) {
+      chunk = mFreeChunks.back();
+      mFreeChunks.pop_back();
+      chunk.used = 0;
+    } else {
+      CreateChunk(kChunkSize, chunk);
+    }
+    mChunks.push_back(chunk);
+    aligned = 0;
+  }
+  Chunk &chunk = mChunks.back();
+  chunk.used = aligned + size;
+  buffer = chunk.buffer;
+  offset = aligned;
+  mapped = chunk.memory.mapped + aligned;
+}
+
+
+void StagingUploader::UploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void *data,
+  VkDeviceSize size, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess)
+{
+  uint8_t *mapped = StageBuffer(dst, dstOffset, size, dstStage, dstAccess);
+  std::memcpy(mapped, data, (size_t )size);
+}
+
+
+void StagingUploader::UploadBufferStrided(VkBuffer dst, VkDeviceSize dstOffset, const void *data,
+  size_t elementSize, size_t srcStride, size_t count, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess)
+{
+  uint8_t *mapped = StageBuffer(dst, dstOffset, (VkDeviceSize )elementSize * count, dstStage, dstAccess);
+  const uint8_t *src = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < count; ++i) {
+    std::memcpy(mapped + i * elementSize, src + i * srcStride, elementSize);
+  }
+}
+
+
+uint8_t *StagingUploader::StageBuffer(VkBuffer dst, VkDeviceSize dstOffset, VkDeviceSize size,
+  VkPipelineStageFlags dstStage, VkAccessFlags dstAccess)
+{
+  PendingBufferCopy copy;
+  uint8_t *mapped;
+  AllocateStaging(size, copy.src, copy.region.srcOffset, mapped);
+  copy.dst = dst;
+  copy.region.dstOffset = dstOffset;
+  copy.region.size = size;
+  mBufferCopies.push_back(copy);
+
+  VkBufferMemoryBarrier barrier = { };
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.buffer = dst;
+  barrier.offset = dstOffset;
+  barrier.size = size;
+  if (HasTransferQueue()) {
+    // Release on the transfer queue, then acquire on the graphics queue.
+    barrier.srcQueueFamilyIndex = static_cast<uint32_t>(mTransferFamily);
+    barrier.dstQueueFamilyIndex = mGraphicsFamily;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = 0;
+    mBufferReleases.push_back(barrier);
+    barrier.srcAccessMask = 0;
+  } else {
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  }
+  barrier.dstAccessMask = dstAccess;
+  mBufferAcquires.push_back(barrier);
+  mDstStages |= dstStage;
+  return mapped;
+}
+
+
+void StagingUploader::UploadImage(VkImage dst, const VkImageSubresourceRange &range, const void *data,
+  VkDeviceSize size, const VkBufferImageCopy *regions, uint32_t regionCount, VkImageLayout finalLayout,
+  VkPipelineStageFlags dstStage, VkAccessFlags dstAccess)
+{
+  PendingImageCopy copy;
+  VkDeviceSize srcOffset;
+  uint8_t *mapped;
+  AllocateStaging(size, copy.src, srcOffset, mapped);
+  std::memcpy(mapped, data, (size_t )size);
+  copy.dst = dst;
+  copy.firstRegion = static_cast<uint32_t>(mRegions.size());
+  copy.regionCount = regionCount;
+  for (uint32_t i = 0; i < regionCount; ++i) {
+    VkBufferImageCopy region = regions[i];
+    region.bufferOffset += srcOffset;
+    mRegions.push_back(region);
+  }
+  mImageCopies.push_back(copy);
+
+  VkImageMemoryBarrier barrier = { };
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.image = dst;
+  barrier.subresourceRange = range;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  mPreCopyBarriers.push_back(barrier);
+
+  // The layout transition is part of the ownership transfer, so release and acquire
+  // both have to spell it out.
+  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.newLayout = finalLayout;
+  if (HasTransferQueue()) {
+    barrier.srcQueueFamilyIndex = static_cast<uint32_t>(mTransferFamily);
+    barrier.dstQueueFamilyIndex = mGraphicsFamily;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = 0;
+    mImageReleases.push_back(barrier);
+    barrier.srcAccessMask = 0;
+  } else {
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  }
+  barrier.dstAccessMask = dstAccess;
+  mImageAcquires.push_back(barrier);
+  mDstStages |= dstStage;
+}
+
+
+void StagingUploader::TransitionImage(VkImage image, const VkImageSubresourceRange &range,
+  VkImageLayout newLayout, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess)
+{
+  VkImageMemoryBarrier barrier = { };
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.image = image;
+  barrier.subresourceRange = range;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = newLayout;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = dstAccess;
+  mTransitions.push_back(barrier);
+  mDstStages |= dstStage;
+}
+
+
+void StagingUploader::CreateBatch(Batch &batch)
+{
+  VkCommandBufferAllocateInfo allocInfo = { };
+  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandBufferCount = 1;
+  allocInfo.commandPool = mGraphicsPool;
+  VkResult result = vkAllocateCommandBuffers(mDevice, &allocInfo, &batch.graphicsCmd);
+  assert(result == VK_SUCCESS && "Failed to allocate an upload command buffer!");
+
+  batch.transferCmd = VK_NULL_HANDLE;
+  batch.transferDone = VK_NULL_HANDLE;
+  if (HasTransferQueue()) {
+    allocInfo.commandPool = mTransferPool;
+    result = vkAllocateCommandBuffers(mDevice, &allocInfo, &batch.transferCmd);
+    assert(result == VK_SUCCESS && "Failed to allocate a transfer command buffer!");
+
+    VkSemaphoreCreateInfo semaphoreInfo = { };
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    result = vkCreateSemaphore(mDevice, &semaphoreInfo, nullptr, &batch.transferDone);
+    assert(result == VK_SUCCESS && "Failed to create the transfer semaphore!");
+  }
+
+  VkFenceCreateInfo fenceInfo = { };
+  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  result = vkCreateFence(mDevice, &fenceInfo, nullptr, &batch.fence);
+  assert(result == VK_SUCCESS && "Failed to create the upload fence!");
+}
+
+
+void StagingUploader::RecycleBatch(Batch &batch)
+{
+  for (Chunk &chunk : batch.chunks) {
+    if (chunk.size == kChunkSize && mFreeChunks.size() < kMaxFreeChunks) {
+      mFreeChunks.push_back(chunk);
+    } else {
+      DestroyChunk(chunk);
+    }
+  }
+  batch.chunks.clear();
+  vkResetFences(mDevice, 1, &batch.fence);
+  mFreeBatches.push_back(batch);
+}
+
+
+void StagingUploader::RecordCopies(VkCommandBuffer cmd)
+{
+  if (!mPreCopyBarriers.empty()) {
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+      0, 0, nullptr, 0, nullptr,
+      static_cast<uint32_t>(mPreCopyBarriers.size()), mPreCopyBarriers.data());
+  }
+  for (const PendingBufferCopy &copy : mBufferCopies) {
+    vkCmdCopyBuffer(cmd, copy.src, copy.dst, 1, &copy.region);
+  }
+  for (const PendingImageCopy &copy : mImageCopies) {
+    vkCmdCopyBufferToImage(cmd, copy.src, copy.dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      copy.regionCount, &mRegions[copy.firstRegion]);
+  }
+}
+
+
+void StagingUploader::ClearPending()
+{
+  mBufferCopies.clear();
+  mImageCopies.clear();
+  mRegions.clear();
+  mPreCopyBarriers.clear();
+  mBufferReleases.clear();
+  mBufferAcquires.clear();
+  mImageReleases.clear();
+  mImageAcquires.clear();
+  mTransitions.clear();
+  mDstStages = 0;
+}
+
+
+StagingUploader::Ticket StagingUploader::Flush()
+{
+  bool hasCopies = !mBufferCopies.empty() || !mImageCopies.empty();
+  if (!hasCopies && mTransitions.empty()) {
+    return mNextTicket - 1;
+  }
+
+  Batch batch;
+  if (!mFreeBatches.empty()) {
+    batch = mFreeBatches.back();
+    mFreeBatches.pop_back();
+  } else {
+    CreateBatch(batch);
+  }
+  batch.ticket = mNextTicket++;
+  batch.chunks.swap(mChunks);
+
+  VkCommandBufferBeginInfo beginInfo = { };
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  bool useTransfer = HasTransferQueue() && hasCopies;
+  if (useTransfer) {
+    vkBeginCommandBuffer(batch.transferCmd, &beginInfo);
+    RecordCopies(batch.transferCmd);
+    vkCmdPipelineBarrier(batch.transferCmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr,
+      static_cast<uint32_t>(mBufferReleases.size()), mBufferReleases.data(),
+      static_cast<uint32_t>(mImageReleases.size()), mImageReleases.data());
+    vkEndCommandBuffer(batch.transferCmd);
+  }
+
+  vkBeginCommandBuffer(batch.graphicsCmd, &beginInfo);
+  if (hasCopies) {
+    if (!useTransfer) {
+      RecordCopies(batch.graphicsCmd);
+    }
+    // With a transfer queue, the semaphore wait already orders this after the copies.
+    VkPipelineStageFlags srcStage = useTransfer ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT :
+      VK_PIPELINE_STAGE_TRANSFER_BIT;
+    vkCmdPipelineBarrier(batch.graphicsCmd, srcStage, mDstStages, 0, 0, nullptr,
+      static_cast<uint32_t>(mBufferAcquires.size()), mBufferAcquires.data(),
+      static_cast<uint32_t>(mImageAcquires.size()), mImageAcquires.data());
+  }
+  if (!mTransitions.empty()) {
+    vkCmdPipelineBarrier(batch.graphicsCmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, mDstStages,
+      0, 0, nullptr, 0, nullptr,
+      static_cast<uint32_t>(mTransitions.size()), mTransitions.data());
+  }
+  vkEndCommandBuffer(batch.graphicsCmd);
+
+  VkResult result;
+  VkSubmitInfo submitInfo = { };
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  if (useTransfer) {
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &batch.transferCmd;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &batch.transferDone;
+    result = vkQueueSubmit(mTransferQueue, 1, &submitInfo, VK_NULL_HANDLE);
+    assert(result == VK_SUCCESS && "Failed to submit uploads to the transfer queue!");
+  }
+
+  VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+  submitInfo = { };
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &batch.graphicsCmd;
+  if (useTransfer) {
+    submitInfo.waitSemaphoreCount = 1;
+    submitInfo.pWaitSemaphores = &batch.transferDone;
+    submitInfo.pWaitDstStageMask = &waitStage;
+  }
+  result = vkQueueSubmit(mGraphicsQueue, 1, &submitInfo, batch.fence);
+  assert(result == VK_SUCCESS && "Failed to submit uploads to the graphics queue!");
+
+  mInFlight.push_back(batch);
+  ClearPending();
+  return batch.ticket;
+}
+
+
+void StagingUploader::Collect()
+{
+  while (!mInFlight.empty() && vkGetFenceStatus(mDevice, mInFlight.front().fence) == VK_SUCCESS) {
+    RecycleBatch(mInFlight.front());
+    mInFlight.pop_front();
+  }
+}
+
+
+bool StagingUploader::IsComplete(Ticket ticket)
+{
+  if (ticket >= mNextTicket) {
+    return false;
+  }
+  Collect();
+  return mInFlight.empty() || mInFlight.front().ticket > ticket;
+}
+
+
+void StagingUploader::Wait(Ticket ticket)
+{
+  for (Batch &batch : mInFlight) {
+    if (batch.ticket == ticket) {
+      vkWaitForFences(mDevice, 1, &batch.fence, VK_TRUE, (std::numeric_limits<uint64_t>::max)());
+      break;
+    }
+  }
+  Collect();
+}
+} // pbr
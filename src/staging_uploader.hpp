@@ -0,0 +1,162 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __STAGING_UPLOADER_HPP
+#define __STAGING_UPLOADER_HPP
+
+
+#include "platform.hpp"
+#include "device_allocator.hpp"
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+
+namespace pbr {
+
+
+/// Batches staging uploads into as few submissions as possible. Upload calls copy the data
+/// into persistently mapped staging memory right away, so the caller may free its copy as soon
+/// as the call returns. The GPU side copies and layout transitions are only recorded on Flush(),
+/// all barriers of a batch go in a single vkCmdPipelineBarrier, and nothing waits on the queue.
+///
+/// If the device has a transfer only queue family, the copies run there and ownership of the
+/// resources is released to the graphics queue family, which acquires them in a small command
+/// buffer of its own. Otherwise everything is recorded into one graphics command buffer.
+///
+/// Work submitted to the graphics queue after a Flush() is ordered after the upload by the
+/// acquire barriers, so rendering never needs to wait on the CPU. The fence behind each Ticket
+/// is only there to know when staging memory can be recycled, or for the rare caller that must
+/// block. Not thread safe, use it from the thread that submits to the queues.
+class StagingUploader {
+public:
+  /// Identifies one Flush(). Tickets increase, and complete, in order.
+  typedef uint64_t Ticket;
+
+  /// Staging memory is handed out of chunks this size. Bigger uploads get a chunk of their own.
+  static const VkDeviceSize kChunkSize = 32ull * 1024ull * 1024ull;
+
+  StagingUploader();
+  ~StagingUploader();
+
+  StagingUploader(const StagingUploader &) = delete;
+  StagingUploader &operator=(const StagingUploader &) = delete;
+
+  /// transferFamily is -1 if the device has no transfer only queue family.
+  void Initialize(VkDevice device, DeviceAllocator *allocator,
+    uint32_t graphicsFamily, VkQueue graphicsQueue, int32_t transferFamily, VkQueue transferQueue);
+
+  /// Waits on everything still in flight, then frees it all.
+  void Shutdown();
+
+  /// Upload size bytes of data into dst at dstOffset. dstStage and dstAccess describe the
+  /// first use of the buffer on the graphics queue.
+  void UploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void *data, VkDeviceSize size,
+    VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
+
+  /// Gather count elements of elementSize bytes, srcStride bytes apart in data, tightly
+  /// packed into dst at dstOffset. Copies straight into staging memory, such as one
+  /// attribute out of an interleaved vertex array, with no packed copy on the side.
+  void UploadBufferStrided(VkBuffer dst, VkDeviceSize dstOffset, const void *data,
+    size_t elementSize, size_t srcStride, size_t count,
+    VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
+
+  /// Upload size bytes of data into the image. The bufferOffset of each region is relative to
+  /// data. Every subresource in range ends up in finalLayout, whatever it held before is discarded.
+  void UploadImage(VkImage dst, const VkImageSubresourceRange &range, const void *data, VkDeviceSize size,
+    const VkBufferImageCopy *regions, uint32_t regionCount, VkImageLayout finalLayout,
+    VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
+
+  /// Move an image with no data to upload, such as a depth buffer, out of its undefined
+  /// initial layout. Recorded on the graphics queue.
+  void TransitionImage(VkImage image, const VkImageSubresourceRange &range, VkImageLayout newLayout,
+    VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
+
+  /// Submit everything recorded since the last Flush(). Returns the ticket of the last
+  /// submission if there was nothing to do.
+  Ticket Flush();
+
+  bool IsComplete(Ticket ticket);
+
+  /// Block until the submission behind ticket has finished.
+  void Wait(Ticket ticket);
+
+  /// Recycle batches that have finished. Cheap, call it once a frame.
+  void Collect();
+
+  bool HasTransferQueue() const { return mTransferFamily >= 0; }
+
+private:
+  struct Chunk {
+    VkBuffer          buffer;
+    DeviceAllocation  memory;
+    VkDeviceSize      size;
+    VkDeviceSize      used;
+  };
+
+  /// Everything one Flush() submits. Command buffers, fence and semaphore are reused
+  /// once the batch has finished.
+  struct Batch {
+    Ticket              ticket;
+    VkCommandBuffer     transferCmd;
+    VkCommandBuffer     graphicsCmd;
+    VkSemaphore         transferDone;
+    VkFence             fence;
+    std::vector<Chunk>  chunks;
+  };
+
+  struct PendingBufferCopy {
+    VkBuffer      src;
+    VkBuffer      dst;
+    VkBufferCopy  region;
+  };
+
+  struct PendingImageCopy {
+    VkBuffer  src;
+    VkImage   dst;
+    uint32_t  firstRegion;
+    uint32_t  regionCount;
+  };
+
+  /// Find room for size bytes of staging memory in the current chunk.
+  void AllocateStaging(VkDeviceSize size, VkBuffer &buffer, VkDeviceSize &offset, uint8_t *&mapped);
+  /// Record the copy and barriers of a buffer upload, returns the staging memory to fill.
+  uint8_t *StageBuffer(VkBuffer dst, VkDeviceSize dstOffset, VkDeviceSize size,
+    VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
+  void CreateChunk(VkDeviceSize size, Chunk &chunk);
+  void DestroyChunk(Chunk &chunk);
+  void CreateBatch(Batch &batch);
+  void RecycleBatch(Batch &batch);
+  void RecordCopies(VkCommandBuffer cmd);
+  void ClearPending();
+
+  VkDevice                            mDevice;
+  DeviceAllocator                    *mAllocator;
+  uint32_t                            mGraphicsFamily;
+  int32_t                             mTransferFamily;
+  VkQueue                             mGraphicsQueue;
+  VkQueue                             mTransferQueue;
+  VkCommandPool                       mGraphicsPool;
+  VkCommandPool                       mTransferPool;
+  Ticket                              mNextTicket;
+
+  // What the next Flush() records.
+  std::vector<Chunk>                  mChunks;
+  std::vector<PendingBufferCopy>      mBufferCopies;
+  std::vector<PendingImageCopy>       mImageCopies;
+  std::vector<VkBufferImageCopy>      mRegions;
+  std::vector<VkImageMemoryBarrier>   mPreCopyBarriers;
+  std::vector<VkBufferMemoryBarrier>  mBufferReleases;
+  std::vector<VkBufferMemoryBarrier>  mBufferAcquires;
+  std::vector<VkImageMemoryBarrier>   mImageReleases;
+  std::vector<VkImageMemoryBarrier>   mImageAcquires;
+  std::vector<VkImageMemoryBarrier>   mTransitions;
+  VkPipelineStageFlags                mDstStages;
+
+  std::deque<Batch>                   mInFlight;
+  std::vector<Batch>                  mFreeBatches;
+  std::vector<Chunk>                  mFreeChunks;
+};
+} // pbr
+#endif // __STAGING_UPLOADER_HPP
@@ -0,0 +1,132 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+
+
+namespace pbr {
+
+
+ThreadPool::ThreadPool(uint32_t threadCount)
+  : mStopping(false)
+{
+  if (threadCount == 0) {
+    uint32_t hardwareThreads = std::thread::hardware_concurrency();
+    threadCount = (std::max)(hardwareThreads, 2u) - 1;
+  }
+  mWorkers.reserve(threadCount);
+  for (uint32_t i = 0; i < threadCount; ++i) {
+    mWorkers.emplace_back(&ThreadPool::WorkerLoop, this);
+  }
+}
+
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStopping = true;
+  }
+  mCondition.notify_all();
+  for (auto &worker : mWorkers) {
+    worker.join();
+  }
+}
+
+
+ThreadPool &ThreadPool::Global()
+{
+  static ThreadPool pool;
+  return pool;
+}
+
+
+void ThreadPool::Enqueue(std::function<void()> job)
+{
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mJobs.push_back(std::move(job));
+  }
+  mCondition.notify_one();
+}
+
+
+bool ThreadPool::RunPendingJob()
+{
+  std::function<void()> job;
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mJobs.empty()) {
+      return false;
+    }
+    job = std::move(mJobs.front());
+    mJobs.pop_front();
+  }
+  job();
+  return true;
+}
+
+
+void ThreadPool::WorkerLoop()
+{
+  PBR_TRACE_THREAD_NAME("pool worker");
+  for (;;) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      mCondition.wait(lock, [this] () { return mStopping || !mJobs.empty(); });
+      if (mStopping && mJobs.empty()) {
+        return;
+      }
+      job = std::move(mJobs.front());
+      mJobs.pop_front();
+    }
+    job();
+  }
+}
+
+
+void ThreadPool::ParallelFor(uint32_t count, const std::function<void(uint32_t)> &func)
+{
+  if (count == 0) {
+    return;
+  }
+
+  // Helpers may only get to run after everything is done, so the shared 
+  // state can not live on this stack frame.
+  struct State {
+    std::atomic<uint32_t> next;
+    std::atomic<uint32_t> remaining;
+    const std::function<void(uint32_t)> *func;
+  };
+  auto state = std::make_shared<State>();
+  state->next = 0;
+  state->remaining = count;
+  state->func = &func;
+
+  auto run = [state, count] () {
+    for (;;) {
+      uint32_t i = state->next.fetch_add(1);
+      if (i >= count) {
+        break;
+      }
+      (*state->func)(i);
+      state->remaining.fetch_sub(1);
+    }
+  };
+
+  uint32_t helpers = (std::min)(count - 1, GetThreadCount());
+  for (uint32_t i = 0; i < helpers; ++i) {
+    Enqueue(run);
+  }
+  run();
+  while (state->remaining.load() > 0) {
+    if (!RunPendingJob()) {
+      std::this_thread::yield();
+    }
+  }
+}
+} // pbr
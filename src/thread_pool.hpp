@@ -0,0 +1,82 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __THREAD_POOL_HPP
+#define __THREAD_POOL_HPP
+
+
+#include "platform.hpp"
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace pbr {
+
+
+/// Simple fixed size worker pool. Jobs are pulled off one shared queue. 
+/// Threads that are waiting on the pool (ParallelFor(), Wait()) help out with queued jobs
+/// instead of sleeping, so it is fine to use the pool from inside one of its own jobs.
+class ThreadPool {
+public:
+  /// Create the pool with the given number of workers. 0 will use one worker 
+  /// per hardware thread, minus the calling thread.
+  explicit ThreadPool(uint32_t threadCount = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /// The process wide pool.
+  static ThreadPool &Global();
+
+  /// Number of worker threads, not counting threads that call into the pool.
+  uint32_t GetThreadCount() const { return static_cast<uint32_t>(mWorkers.size()); }
+
+  /// Queue up a job, the returned future is ready once the job has run.
+  template<typename _Func>
+  auto Submit(_Func &&func) -> std::future<decltype(func())> {
+    typedef decltype(func()) _Result;
+    auto task = std::make_shared<std::packaged_task<_Result()>>(std::forward<_Func>(func));
+    std::future<_Result> future = task->get_future();
+    Enqueue([task] () { (*task)(); });
+    return future;
+  }
+
+  /// Call func(i) for every i in [0, count), spread over the workers and the calling 
+  /// thread. Returns once every call has finished.
+  void ParallelFor(uint32_t count, const std::function<void(uint32_t)> &func);
+
+  /// Wait on a future from Submit(), running other queued jobs in the meantime.
+  template<typename _Result>
+  _Result Wait(std::future<_Result> &future) {
+    while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      if (!RunPendingJob()) {
+        std::this_thread::yield();
+      }
+    }
+    return future.get();
+  }
+
+  /// Run one queued job on the calling thread, if there is any. 
+  bool RunPendingJob();
+
+private:
+  void Enqueue(std::function<void()> job);
+  void WorkerLoop();
+
+  std::vector<std::thread>          mWorkers;
+  std::deque<std::function<void()>> mJobs;
+  std::mutex                        mMutex;
+  std::condition_variable           mCondition;
+  bool                              mStopping;
+};
+} // pbr
+#endif // __THREAD_POOL_HPP
@@ -0,0 +1,182 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "trace.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+namespace pbr {
+
+
+static const size_t kEventsPerChunk = 4096;
+
+
+struct TraceEvent {
+  const char  *name;
+  uint64_t    start;
+  uint64_t    end;
+};
+
+
+// Only the owning thread writes a chunk. It fills in the event before it bumps count,
+// and links the next chunk in before writing to it, so Write() can follow along with
+// acquire loads and never sees a half written event.
+struct TraceChunk {
+  TraceChunk() : count(0), next(nullptr) { }
+
+  TraceEvent                events[kEventsPerChunk];
+  std::atomic<size_t>       count;
+  std::atomic<TraceChunk *> next;
+};
+
+
+struct TraceThread {
+  uint32_t    id;
+  // Guarded by the registry mutex.
+  std::string name;
+  TraceChunk  *head;
+  // Owning thread only.
+  TraceChunk  *tail;
+};
+
+
+struct TraceRegistry {
+  TraceRegistry()
+    : enabled(false)
+    , epoch(std::chrono::steady_clock::now()) { }
+
+  std::atomic<bool>                         enabled;
+  std::chrono::steady_clock::time_point     epoch;
+  std::mutex                                mutex;
+  std::vector<std::unique_ptr<TraceThread>> threads;
+};
+
+
+static TraceRegistry &GetRegistry()
+{
+  // Never freed, pool workers may still record while statics are torn down.
+  static TraceRegistry *registry = new TraceRegistry();
+  return *registry;
+}
+
+
+static TraceThread &GetThread()
+{
+  thread_local TraceThread *thread = nullptr;
+  if (!thread) {
+    // Once per thread, the only time recording takes the lock.
+    TraceRegistry &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.threads.emplace_back(new TraceThread());
+    thread = registry.threads.back().get();
+    thread->id = static_cast<uint32_t>(registry.threads.size());
+    thread->head = thread->tail = new TraceChunk();
+  }
+  return *thread;
+}
+
+
+static void WriteEscaped(std::FILE *file, const char *str)
+{
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\') std::fputc('\\', file);
+    std::fputc(*str, file);
+  }
+}
+
+
+void Trace::Enable()
+{
+  GetRegistry().enabled.store(true, std::memory_order_relaxed);
+}
+
+
+bool Trace::IsEnabled()
+{
+  return GetRegistry().enabled.load(std::memory_order_relaxed);
+}
+
+
+void Trace::SetThreadName(const char *name)
+{
+  TraceThread &thread = GetThread();
+  std::lock_guard<std::mutex> lock(GetRegistry().mutex);
+  thread.name = name;
+}
+
+
+uint64_t Trace::Now()
+{
+  auto elapsed = std::chrono::steady_clock::now() - GetRegistry().epoch;
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+
+void Trace::Record(const char *name, uint64_t start, uint64_t end)
+{
+  TraceThread &thread = GetThread();
+  TraceChunk *chunk = thread.tail;
+  size_t count = chunk->count.load(std::memory_order_relaxed);
+  if (count == kEventsPerChunk) {
+    TraceChunk *next = new TraceChunk();
+    chunk->next.store(next, std::memory_order_release);
+    thread.tail = chunk = next;
+    count = 0;
+  }
+  TraceEvent &event = chunk->events[count];
+  event.name = name;
+  event.start = start;
+  event.end = end;
+  chunk->count.store(count + 1, std::memory_order_release);
+}
+
+
+bool Trace::Write(const char *filepath)
+{
+  std::FILE *file = std::fopen(filepath, "w");
+  if (!file) {
+    std::printf("Failed to write trace %s\n", filepath);
+    return false;
+  }
+  TraceRegistry &registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  size_t eventCount = 0;
+  std::fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  const char *separator = "";
+  for (const std::unique_ptr<TraceThread> &thread : registry.threads) {
+    if (!thread->name.empty()) {
+      std::fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+        "\"args\":{\"name\":\"", separator, thread->id);
+      WriteEscaped(file, thread->name.c_str());
+      std::fprintf(file, "\"}}");
+      separator = ",\n";
+    }
+    for (TraceChunk *chunk = thread->head; chunk;
+      chunk = chunk->next.load(std::memory_order_acquire)) {
+      size_t count = chunk->count.load(std::memory_order_acquire);
+      for (size_t i = 0; i < count; ++i) {
+        const TraceEvent &event = chunk->events[i];
+        std::fprintf(file, "%s{\"name\":\"", separator);
+        WriteEscaped(file, event.name);
+        // Trace event times are in microseconds.
+        std::fprintf(file, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+          thread->id, event.start / 1000.0, (event.end - event.start) / 1000.0);
+        separator = ",\n";
+      }
+      eventCount += count;
+    }
+  }
+  std::fprintf(file, "\n]}\n");
+  bool ok = std::ferror(file) == 0;
+  std::fclose(file);
+  std::printf("Wrote %u trace events to %s\n", (uint32_t )eventCount, filepath);
+  return ok;
+}
+} // pbr
@@ -0,0 +1,75 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __TRACE_HPP
+#define __TRACE_HPP
+
+
+#include "platform.hpp"
+#include <stdint.h>
+
+
+namespace pbr {
+
+
+/// CPU scope timer that dumps chrome trace-event json, open it in chrome://tracing or
+/// ui.perfetto.dev. Each thread appends to its own buffer, so recording a scope takes no
+/// lock. Recording is off until Enable(), scopes only check a flag until then.
+///
+/// Scope names must outlive the trace, string literals and __FUNCTION__ are fine.
+/// Building without PBR_TRACE compiles every PBR_TRACE_* macro out.
+class Trace {
+public:
+  static void Enable();
+  static bool IsEnabled();
+
+  /// Label the calling thread in the trace. The name is copied.
+  static void SetThreadName(const char *name);
+
+  /// Nanoseconds since the first call into the trace.
+  static uint64_t Now();
+
+  /// Append a finished scope to the calling thread's buffer.
+  static void Record(const char *name, uint64_t start, uint64_t end);
+
+  /// Write everything recorded so far. Threads may keep recording while this runs,
+  /// their newest scopes just won't be in the file.
+  static bool Write(const char *filepath);
+};
+
+
+/// Records the time between its construction and destruction.
+class TraceScope {
+public:
+  explicit TraceScope(const char *name)
+    : mName(Trace::IsEnabled() ? name : nullptr)
+    , mStart(mName ? Trace::Now() : 0) { }
+
+  ~TraceScope() {
+    if (mName) Trace::Record(mName, mStart, Trace::Now());
+  }
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+  const char  *mName;
+  uint64_t    mStart;
+};
+} // pbr
+
+
+#define PBR_TRACE_CONCAT_(a, b) a##b
+#define PBR_TRACE_CONCAT(a, b) PBR_TRACE_CONCAT_(a, b)
+
+#if defined(PBR_TRACE) && PBR_TRACE
+ #define PBR_TRACE_SCOPE(name) pbr::TraceScope PBR_TRACE_CONCAT(traceScope, __LINE__)(name)
+ #define PBR_TRACE_FUNCTION() PBR_TRACE_SCOPE(__FUNCTION__)
+ #define PBR_TRACE_THREAD_NAME(name) pbr::Trace::SetThreadName(name)
+#else
+ #define PBR_TRACE_SCOPE(name)
+ #define PBR_TRACE_FUNCTION()
+ #define PBR_TRACE_THREAD_NAME(name)
+#endif
+
+#endif // __TRACE_HPP
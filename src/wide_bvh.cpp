@@ -0,0 +1,408 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#include "wide_bvh.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+
+namespace pbr {
+
+
+static_assert(sizeof(WideBvhNode<4>) == 64, "4 wide BVH node should be one cache line!");
+static_assert(sizeof(WideBvhNode<8>) == 128, "8 wide BVH node should be two cache lines!");
+
+
+// A child of the wide node being collapsed, an inner node of the binary BVH or a leaf.
+struct WideBvhRef {
+  float     min[3];
+  float     max[3];
+  uint32_t  child;
+  /// Triangles in the leaf, 0 for an inner node.
+  uint32_t  count;
+  float     area;
+};
+
+
+static bool GetChildRef(const BvhNode &node, uint32_t side, WideBvhRef &ref)
+{
+  if (node.child[side] == Bvh::kEmptyChild) {
+    return false;
+  }
+  for (uint32_t axis = 0; axis < 3; ++axis) {
+    ref.min[axis] = node.childMin[side][axis];
+    ref.max[axis] = node.childMax[side][axis];
+  }
+  ref.child = node.child[side];
+  ref.count = node.count[side];
+  float dx = ref.max[0] - ref.min[0];
+  float dy = ref.max[1] - ref.min[1];
+  float dz = ref.max[2] - ref.min[2];
+  ref.area = dx * dy + dy * dz + dz * dx;
+  return true;
+}
+
+
+// Quantize [minimum, maximum] into the node's grid, rounding outwards.
+static void Quantize(float origin, float scale, float minimum, float maximum, uint8_t &qMin, uint8_t &qMax)
+{
+  if (scale == 0.0f) {
+    qMin = qMax = 0;
+    return;
+  }
+  int low = static_cast<int>(std::floor((minimum - origin) / scale));
+  int high = static_cast<int>(std::ceil((maximum - origin) / scale));
+  low = (std::min)((std::max)(low, 0), 255);
+  high = (std::min)((std::max)(high, 0), 255);
+  while (low > 0 && origin + low * scale > minimum) --low;
+  while (high < 255 && origin + high * scale < maximum) ++high;
+  qMin = static_cast<uint8_t>(low);
+  qMax = static_cast<uint8_t>(high);
+}
+
+
+// Scalar version of the child test, the slab test of IntersectBox() on decoded bounds.
+template<int _Width>
+static int IntersectChildren(const WideBvhNode<_Width> &node, const float (&scaled)[3],
+  const float (&offset)[3], float tMin, float tMax, float (&tNear)[_Width])
+{
+  int mask = 0;
+  for (int lane = 0; lane < _Width; ++lane) {
+    float tEnter = tMin;
+    float tExit = tMax;
+    for (int axis = 0; axis < 3; ++axis) {
+      float t0 = node.qMin[axis][lane] * scaled[axis] + offset[axis];
+      float t1 = node.qMax[axis][lane] * scaled[axis] + offset[axis];
+      tEnter = detail::SlabMax(detail::SlabMin(t0, t1), tEnter);
+      tExit = detail::SlabMin(detail::SlabMax(t0, t1), tExit);
+    }
+    tNear[lane] = tEnter;
+    if (tEnter <= tExit) {
+      mask |= 1 << lane;
+    }
+  }
+  return mask;
+}
+
+
+#if PBR_SIMD_SSE
+template<typename _Reg> static _Reg LoadQuantized(const uint8_t *q);
+
+
+// 4 bytes to 4 floats, with SSE2 unpacks only.
+template<>
+inline __m128 LoadQuantized<__m128>(const uint8_t *q)
+{
+  int32_t bytes;
+  std::memcpy(&bytes, q, sizeof(bytes));
+  __m128i zero = _mm_setzero_si128();
+  __m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+}
+
+
+#if PBR_SIMD_AVX
+template<>
+inline __m256 LoadQuantized<__m256>(const uint8_t *q)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i words = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(q)), zero);
+  __m128 low = _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+  __m128 high = _mm_cvtepi32_ps(_mm_unpackhi_epi16(words, zero));
+  return _mm256_insertf128_ps(_mm256_castps128_ps256(low), high, 1);
+}
+#endif
+
+
+// Children [first, first + register width) against the ray, one compare for all of them.
+template<typename _Reg, int _Width>
+static int IntersectChildLanes(const WideBvhNode<_Width> &node, int first, const float (&scaled)[3],
+  const float (&offset)[3], float tMin, float tMax, float *tNear)
+{
+  using namespace simd;
+  _Reg tEnter = Set1<_Reg>(tMin);
+  _Reg tExit = Set1<_Reg>(tMax);
+  for (int axis = 0; axis < 3; ++axis) {
+    _Reg scale = Set1<_Reg>(scaled[axis]);
+    _Reg shift = Set1<_Reg>(offset[axis]);
+    _Reg t0 = MulAdd(LoadQuantized<_Reg>(node.qMin[axis] + first), scale, shift);
+    _Reg t1 = MulAdd(LoadQuantized<_Reg>(node.qMax[axis] + first), scale, shift);
+    tEnter = Max(Min(t0, t1), tEnter);
+    tExit = Min(Max(t0, t1), tExit);
+  }
+  Store(tNear + first, tEnter);
+  return MoveMask(CmpLe(tEnter, tExit));
+}
+
+
+template<>
+inline int IntersectChildren<4>(const WideBvhNode<4> &node, const float (&scaled)[3],
+  const float (&offset)[3], float tMin, float tMax, float (&tNear)[4])
+{
+  return IntersectChildLanes<__m128>(node, 0, scaled, offset, tMin, tMax, tNear);
+}
+
+
+template<>
+inline int IntersectChildren<8>(const WideBvhNode<8> &node, const float (&scaled)[3],
+  const float (&offset)[3], float tMin, float tMax, float (&tNear)[8])
+{
+#if PBR_SIMD_AVX
+  return IntersectChildLanes<__m256>(node, 0, scaled, offset, tMin, tMax, tNear);
+#else
+  return IntersectChildLanes<__m128>(node, 0, scaled, offset, tMin, tMax, tNear) |
+    (IntersectChildLanes<__m128>(node, 4, scaled, offset, tMin, tMax, tNear) << 4);
+#endif
+}
+#endif // PBR_SIMD_SSE
+
+
+template<int _Width>
+WideBvh<_Width>::WideBvh()
+{
+  std::memset(&mStats, 0, sizeof(mStats));
+}
+
+
+template<int _Width>
+void WideBvh<_Width>::Collapse(const Bvh &bvh)
+{
+  PBR_TRACE_FUNCTION();
+  auto start = std::chrono::high_resolution_clock::now();
+  mNodes.clear();
+  std::memset(&mStats, 0, sizeof(mStats));
+  mCorners = bvh.GetCorners();
+  mTriangleIds = bvh.GetTriangleIds();
+  if (bvh.GetNodes().empty()) {
+    return;
+  }
+  assert(mTriangleIds.size() <= kFirstMask && "Too many triangles for a wide BVH leaf!");
+  mNodes.reserve(bvh.GetNodes().size() / (_Width - 1) + 1);
+  CollapseNode(bvh, 0);
+
+  auto end = std::chrono::high_resolution_clock::now();
+  uint32_t children = 0;
+  for (const WideBvhNode<_Width> &node : mNodes) {
+    for (int i = 0; i < _Width; ++i) {
+      if (node.child[i] != kLeafFlag) children++;
+    }
+  }
+  mStats.collapseMs = std::chrono::duration<double, std::milli>(end - start).count();
+  mStats.nodeCount = static_cast<uint32_t>(mNodes.size());
+  mStats.averageChildren = static_cast<float>(children) / mNodes.size();
+  mStats.nodeBytes = mNodes.size() * sizeof(WideBvhNode<_Width>);
+}
+
+
+template<int _Width>
+uint32_t WideBvh<_Width>::CollapseNode(const Bvh &bvh, uint32_t binaryNode)
+{
+  const std::vector<BvhNode> &binaryNodes = bvh.GetNodes();
+  WideBvhRef refs[_Width];
+  uint32_t refCount = 0;
+  for (uint32_t side = 0; side < 2; ++side) {
+    if (GetChildRef(binaryNodes[binaryNode], side, refs[refCount])) refCount++;
+  }
+  // Open up the biggest inner child until the node is full.
+  while (refCount < _Width) {
+    int widest = -1;
+    for (uint32_t i = 0; i < refCount; ++i) {
+      if (refs[i].count == 0 && (widest < 0 || refs[i].area > refs[widest].area)) {
+        widest = static_cast<int>(i);
+      }
+    }
+    if (widest < 0) break;
+    const BvhNode &opened = binaryNodes[refs[widest].child];
+    GetChildRef(opened, 0, refs[widest]);
+    GetChildRef(opened, 1, refs[refCount++]);
+  }
+
+  return WriteNode(bvh, refs, refCount);
+}
+
+
+template<int _Width>
+uint32_t WideBvh<_Width>::SplitLeaf(const Bvh &bvh, uint32_t first, uint32_t count)
+{
+  // As few chunks as fit, each bounded by its own triangles.
+  uint32_t chunks = (std::min)(static_cast<uint32_t>(_Width), (count + kMaxLeafCount - 1) / kMaxLeafCount);
+  WideBvhRef refs[_Width];
+  for (uint32_t i = 0; i < chunks; ++i) {
+    WideBvhRef &ref = refs[i];
+    ref.child = first + count * i / chunks;
+    ref.count = first + count * (i + 1) / chunks - ref.child;
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+      ref.min[axis] = std::numeric_limits<float>::infinity();
+      ref.max[axis] = -std::numeric_limits<float>::infinity();
+    }
+    for (uint32_t corner = ref.child * 3; corner < (ref.child + ref.count) * 3; ++corner) {
+      const Vec3 &p = mCorners[corner];
+      ref.min[0] = (std::min)(ref.min[0], p.x);
+      ref.min[1] = (std::min)(ref.min[1], p.y);
+      ref.min[2] = (std::min)(ref.min[2], p.z);
+      ref.max[0] = (std::max)(ref.max[0], p.x);
+      ref.max[1] = (std::max)(ref.max[1], p.y);
+      ref.max[2] = (std::max)(ref.max[2], p.z);
+    }
+    ref.area = 0.0f;
+  }
+  return WriteNode(bvh, refs, chunks);
+}
+
+
+template<int _Width>
+uint32_t WideBvh<_Width>::WriteNode(const Bvh &bvh, const WideBvhRef *refs, uint32_t refCount)
+{
+  WideBvhNode<_Width> node;
+  std::memset(&node, 0, sizeof(node));
+  for (uint32_t axis = 0; axis < 3; ++axis) {
+    float minimum = refs[0].min[axis];
+    float maximum = refs[0].max[axis];
+    for (uint32_t i = 1; i < refCount; ++i) {
+      minimum = (std::min)(minimum, refs[i].min[axis]);
+      maximum = (std::max)(maximum, refs[i].max[axis]);
+    }
+    float scale = (maximum - minimum) / 255.0f;
+    while (minimum + 255.0f * scale < maximum) {
+      scale = std::nextafter(scale, std::numeric_limits<float>::infinity());
+    }
+    node.origin[axis] = minimum;
+    node.scale[axis] = scale;
+    for (uint32_t i = 0; i < refCount; ++i) {
+      Quantize(minimum, scale, refs[i].min[axis], refs[i].max[axis], node.qMin[axis][i], node.qMax[axis][i]);
+    }
+  }
+  for (uint32_t i = refCount; i < _Width; ++i) {
+    node.child[i] = kLeafFlag;
+  }
+
+  uint32_t index = static_cast<uint32_t>(mNodes.size());
+  mNodes.push_back(node);
+  for (uint32_t i = 0; i < refCount; ++i) {
+    if (refs[i].count == 0) {
+      node.child[i] = CollapseNode(bvh, refs[i].child);
+    } else if (refs[i].count > kMaxLeafCount) {
+      node.child[i] = SplitLeaf(bvh, refs[i].child, refs[i].count);
+    } else {
+      assert(refs[i].count <= kMaxLeafCount && refs[i].child <= kFirstMask &&
+        "Leaf does not fit the child encoding!");
+      node.child[i] = kLeafFlag | (refs[i].count << kCountShift) | refs[i].child;
+    }
+  }
+  // The recursion above may have moved the array.
+  mNodes[index] = node;
+  return index;
+}
+
+
+// Inner child waiting on the traversal stack, skipped if a closer hit turns up first.
+struct WideBvhEntry {
+  uint32_t  node;
+  float     tNear;
+};
+
+
+template<int _Width>
+bool WideBvh<_Width>::Intersect(Rayf &ray, TriangleHit<float> &hit, uint32_t &triangle) const
+{
+  if (mNodes.empty()) {
+    return false;
+  }
+  // The child test works in the node's grid, t = q * scale / d + (origin - o) / d.
+  // A zero direction would make that 0 * inf = NaN even for a ray inside the slab,
+  // so those get a tiny direction instead.
+  float invDirection[3];
+  float origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+  float direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+  for (uint32_t axis = 0; axis < 3; ++axis) {
+    float d = direction[axis];
+    if (std::abs(d) < 1e-20f) {
+      d = std::signbit(d) ? -1e-20f : 1e-20f;
+    }
+    invDirection[axis] = 1.0f / d;
+  }
+
+  WideBvhEntry stack[kStackSize];
+  uint32_t stackSize = 0;
+  uint32_t index = 0;
+  bool found = false;
+  for (;;) {
+    const WideBvhNode<_Width> &node = mNodes[index];
+    float scaled[3];
+    float offset[3];
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+      scaled[axis] = node.scale[axis] * invDirection[axis];
+      offset[axis] = (node.origin[axis] - origin[axis]) * invDirection[axis];
+    }
+    alignas(32) float tNear[_Width];
+    int mask = IntersectChildren(node, scaled, offset, ray.tMin, ray.tMax, tNear);
+
+    // Leaves are tested right away, which may rule out some of the inner children.
+    WideBvhEntry inner[_Width];
+    uint32_t innerCount = 0;
+    for (int i = 0; i < _Width; ++i) {
+      if (!((mask >> i) & 1)) continue;
+      uint32_t child = node.child[i];
+      if (child & kLeafFlag) {
+        uint32_t first = child & kFirstMask;
+        uint32_t last = first + ((child & ~kLeafFlag) >> kCountShift);
+        for (uint32_t t = first; t < last; ++t) {
+          if (IntersectTriangle(ray, mCorners[t * 3], mCorners[t * 3 + 1], mCorners[t * 3 + 2], hit)) {
+            triangle = mTriangleIds[t];
+            found = true;
+          }
+        }
+      } else {
+        inner[innerCount].node = child;
+        inner[innerCount].tNear = tNear[i];
+        innerCount++;
+      }
+    }
+
+    // Nearest inner child next, the rest on the stack farthest first.
+    uint32_t remaining = 0;
+    for (uint32_t i = 0; i < innerCount; ++i) {
+      if (inner[i].tNear > ray.tMax) continue;
+      inner[remaining++] = inner[i];
+    }
+    if (remaining > 0) {
+      for (uint32_t i = 1; i < remaining; ++i) {
+        WideBvhEntry entry = inner[i];
+        uint32_t j = i;
+        for (; j > 0 && inner[j - 1].tNear < entry.tNear; --j) {
+          inner[j] = inner[j - 1];
+        }
+        inner[j] = entry;
+      }
+      for (uint32_t i = 0; i + 1 < remaining; ++i) {
+        stack[stackSize++] = inner[i];
+      }
+      index = inner[remaining - 1].node;
+      continue;
+    }
+    bool popped = false;
+    while (stackSize > 0) {
+      const WideBvhEntry &entry = stack[--stackSize];
+      if (entry.tNear <= ray.tMax) {
+        index = entry.node;
+        popped = true;
+        break;
+      }
+    }
+    if (!popped) {
+      break;
+    }
+  }
+  return found;
+}
+
+
+template class WideBvh<4>;
+template class WideBvh<8>;
+} // pbr
@@ -0,0 +1,90 @@
+//
+// Copyright (c) Mario Garcia, MIT License.
+//
+#ifndef __WIDE_BVH_HPP
+#define __WIDE_BVH_HPP
+
+
+#include "platform.hpp"
+#include "bvh.hpp"
+#include <ray.hpp>
+#include <stdint.h>
+#include <vector>
+
+
+namespace pbr {
+
+
+/// _Width wide BVH node, children in structure of arrays form so one ray is tested
+/// against all of them at once. Child bounds are quantized to 8 bits per axis inside
+/// the node's own bounds, origin + q * scale, rounded outwards so they always contain
+/// the real bounds. 64 bytes 4 wide, 128 bytes 8 wide.
+template<int _Width>
+struct alignas(64) WideBvhNode {
+  float     origin[3];
+  float     scale[3];
+  uint8_t   qMin[3][_Width];
+  uint8_t   qMax[3][_Width];
+  /// Node index, or WideBvh::kLeafFlag | count << WideBvh::kCountShift | first triangle.
+  /// Unused slots are empty leaves with a zero sized box.
+  uint32_t  child[_Width];
+};
+
+
+struct WideBvhRef;
+
+
+/// Collapses a binary Bvh into a _Width wide one. Each wide node takes the children of
+/// the largest (by surface area) inner nodes under it until it has _Width of them.
+/// Triangles stay in the binary BVH's leaf order. Traversal tests a ray against every
+/// child of a node with one SSE compare, one AVX compare 8 wide.
+template<int _Width>
+class WideBvh {
+public:
+  static const uint32_t kLeafFlag = 0x80000000;
+  static const uint32_t kCountShift = 27;
+  static const uint32_t kFirstMask = (1 << kCountShift) - 1;
+  /// Most triangles a leaf child can hold. Bigger binary leaves, which Bvh::Build()
+  /// makes once it runs out of depth, are split over a few levels of wide nodes.
+  static const uint32_t kMaxLeafCount = (kLeafFlag >> kCountShift) - 1;
+  /// Levels splitting a leaf can add, enough for the 16 bit counts of the binary BVH.
+  static const uint32_t kLeafSplitDepth = 8;
+  /// Traversal stack size, each level pushes at most _Width - 1 children.
+  static const uint32_t kStackSize = (Bvh::kMaxDepth + kLeafSplitDepth) * (_Width - 1);
+
+  struct Stats {
+    double    collapseMs;
+    uint32_t  nodeCount;
+    /// Children actually used per node, out of _Width.
+    float     averageChildren;
+    size_t    nodeBytes;
+  };
+
+  WideBvh();
+
+  void Collapse(const Bvh &bvh);
+
+  /// Closest hit along the ray, shrinking ray.tMax to it, same as Bvh::Intersect().
+  bool Intersect(Rayf &ray, TriangleHit<float> &hit, uint32_t &triangle) const;
+
+  const std::vector<WideBvhNode<_Width>> &GetNodes() const { return mNodes; }
+  const Stats &GetStats() const { return mStats; }
+
+private:
+  uint32_t CollapseNode(const Bvh &bvh, uint32_t binaryNode);
+  /// Wide node over triangles [first, first + count) of a leaf too big for one child.
+  uint32_t SplitLeaf(const Bvh &bvh, uint32_t first, uint32_t count);
+  /// Quantize the children into a new node, and collapse the inner ones under it.
+  uint32_t WriteNode(const Bvh &bvh, const WideBvhRef *refs, uint32_t refCount);
+
+  std::vector<WideBvhNode<_Width>>  mNodes;
+  std::vector<Vec3>                 mCorners;
+  std::vector<uint32_t>             mTriangleIds;
+  Stats                             mStats;
+};
+
+
+typedef WideBvh<4> Bvh4;
+typedef WideBvh<8> Bvh8;
+} // pbr
+#endif // __WIDE_BVH_HPP